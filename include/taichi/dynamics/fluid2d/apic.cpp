@@ -8,6 +8,7 @@
 *******************************************************************************/
 
 #include "taichi/dynamics/fluid2d/apic.h"
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -27,16 +28,16 @@ void APICLiquid::initialize_solver(const Config &config) {
 }
 
 void APICLiquid::rasterize() {
-    rasterize_component<Particle::get_affine_velocity<0>>(u, u_count);
-    rasterize_component<Particle::get_affine_velocity<1>>(v, v_count);
+    rasterize_velocity<Particle::get_affine_velocity>();
 }
 
 void APICLiquid::sample_c()
 {
-    for (auto &p : particles) {
+    ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
+        Particle &p = particles[i];
         p.c[0] = apic_blend * sample_c(p.position, u);
         p.c[1] = apic_blend * sample_c(p.position, v);
-    }
+    });
 }
 
 Vector2 APICLiquid::sample_c(Vector2 & pos, Array<real> & val) {
@@ -52,12 +53,20 @@ Vector2 APICLiquid::sample_c(Vector2 & pos, Array<real> & val) {
 
 void APICLiquid::substep(real delta_t) {
     Time::Timer _("substep");
+    // Face weights of the pressure solve, refreshed as in EulerLiquid::substep
+    update_velocity_weights();
+    // Nothing else creates particles, so the first reseed seeds the initial liquid
+    // (with or without a band); later ones only keep the band filled
+    if (narrow_band > 0 || t == 0.0f) {
+        reseed();
+    }
     apply_external_forces(delta_t);
     mark_cells();
     rasterize();
     if (t == 0.0f)
         compute_liquid_levelset();
-    else {
+    else if (narrow_band == 0) {
+        // With a narrow band, the levelset is advected along with the grid velocity
         advect_liquid_levelset(delta_t);
     }
     simple_extrapolate();
@@ -65,6 +74,9 @@ void APICLiquid::substep(real delta_t) {
     simple_extrapolate();
     apply_boundary_condition();
     sample_c();
+    if (narrow_band > 0) {
+        advect_grid(delta_t);
+    }
     advect(delta_t);
     t += delta_t;
 }
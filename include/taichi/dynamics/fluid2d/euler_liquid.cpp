@@ -8,6 +8,7 @@
 *******************************************************************************/
 
 #include <taichi/common/util.h>
+#include <taichi/system/threading.h>
 #include "euler_liquid.h"
 
 TC_NAMESPACE_BEGIN
@@ -41,7 +42,19 @@ void EulerLiquid::initialize_solver(const Config &config)
     maximum_iterations = config.get("maximum_iterations", 300);
     tolerance = config.get("tolerance", 1e-4f);
     theta_threshold = config.get("theta_threshold", 0.1f);
+    num_threads = config.get("num_threads", 1);
     initialize_pressure_solver();
+    std::string pressure_solver_name = config.get("pressure_solver", std::string("mic_cg"));
+    if (pressure_solver_name != "mic_cg") {
+        Config solver_config;
+        solver_config.set("res", Vector2i(width, height)).set("num_threads", num_threads).
+                set("padding", "neumann").set("maximum_iterations", maximum_iterations);
+        pressure_solver = create_instance<PoissonSolver2D>(pressure_solver_name, solver_config);
+    }
+    check_pressure_solver = config.get("check_pressure_solver", false);
+    levelset_redistancing = config.get("levelset_redistancing", std::string("brute_force"));
+    assert_info(levelset_redistancing == "brute_force" || levelset_redistancing == "fast_marching",
+                "levelset_redistancing must be brute_force or fast_marching");
     liquid_levelset.initialize(width, height, Vector2(0.5f, 0.5f));
     t = 0;
 }
@@ -132,7 +145,9 @@ void EulerLiquid::level_set_extrapolate() {
 void EulerLiquid::simple_extrapolate() {
     const int dx[4]{ 1, -1, 0, 0 };
     const int dy[4]{ 0, 0, 1, -1 };
-    for (int i = 1; i < width; i++) {
+    // Only inactive faces are written, and only active ones are read, so columns are independent
+    ThreadedTaskManager::run(width - 1, num_threads, [&](int column) {
+        int i = column + 1;
         for (int j = 0; j < height; j++) {
             if (check_u_activity(i, j)) continue;
             real sum = 0.0f, num = 0.0f;
@@ -148,8 +163,8 @@ void EulerLiquid::simple_extrapolate() {
             else
                 u[i][j] = sum / num;
         }
-    }
-    for (int i = 0; i < width; i++) {
+    });
+    ThreadedTaskManager::run(width, num_threads, [&](int i) {
         for (int j = 1; j < height; j++) {
             if (check_v_activity(i, j)) continue;
             real sum = 0.0f, num = 0.0f;
@@ -166,7 +181,7 @@ void EulerLiquid::simple_extrapolate() {
                 v[i][j] = sum / num;
             }
         }
-    }
+    });
 }
 
 void EulerLiquid::step(real delta_t)
@@ -220,60 +235,76 @@ void EulerLiquid::compute_liquid_levelset()
 
 void EulerLiquid::advect_liquid_levelset(real delta_t) {
     Array<real> old = liquid_levelset;
-    for (auto &ind : liquid_levelset.get_region()) {
-        liquid_levelset[ind] = old.sample(ind.get_pos() - delta_t * sample_velocity(ind.get_pos(), u, v));
-    }
+    ThreadedTaskManager::run(liquid_levelset.get_width(), num_threads, [&](int i) {
+        for (int j = 0; j < liquid_levelset.get_height(); j++) {
+            Vector2 pos = liquid_levelset.get_storage_offset() + Vector2((real)i, (real)j);
+            liquid_levelset[i][j] = old.sample(pos - delta_t * sample_velocity(pos, u, v));
+        }
+    });
     rebuild_levelset(liquid_levelset, levelset_band + 1);
 }
 
 void EulerLiquid::rebuild_levelset(LevelSet2D &levelset, real band) {
+    if (levelset_redistancing == "fast_marching") {
+        levelset.redistance_narrow_band(band);
+        return;
+    }
     // Actually, we use a brute-force initialization here
     Array<real> old = levelset;
-    levelset.reset(band);
-    auto update = [&](const Index2D &a, const Index2D &b) {
+    const int w = levelset.get_width(), h = levelset.get_height();
+    // Free surface points, found on the edges where phi changes sign, bucketed by column
+    std::vector<std::vector<Vector2>> surface(w);
+    auto detect = [&](const Index2D &a, const Index2D &b) {
         real phi_0 = old[a], phi_1 = old[b];
         if (phi_0 * phi_1 > 0) {
             return;
         }
-        // Free surface detected
         real p = std::abs(phi_0 / (phi_1 - phi_0));
         Vector2 pos = lerp(p, Vector2(a.i, a.j), Vector2(b.i, b.j));
-        for (int i = std::max(0, int(floor(a.i - band)));
-             i <= std::min(levelset.get_width() - 1, int(b.i + band)); i++) {
-            for (int j = std::max(0, int(floor(a.j - band)));
-                 j <= std::min(levelset.get_height() - 1, int(b.j + band)); j++) {
-                real l = length(Vector2(i, j) - pos);
-                levelset[i][j] = std::min(levelset[i][j], l);
+        surface[std::min(w - 1, (int)pos.x)].push_back(pos);
+    };
+    for (int i = 0; i < w; i++) {
+        for (int j = 0; j < h; j++) {
+            if (i > 0) {
+                detect(Index2D(i - 1, j), Index2D(i, j));
+            }
+            if (j > 0) {
+                detect(Index2D(i, j - 1), Index2D(i, j));
             }
         }
-    };
-    for (auto &ind : old.get_region()) {
-        if (ind.i > 0) {
-            const Index2D a = ind.neighbour(-1, 0);
-            const Index2D b = ind;
-            update(a, b);
+    }
+    // Each column gathers the surface points within the band, so columns are independent
+    const int reach = (int)std::ceil(band) + 1;
+    ThreadedTaskManager::run(w, num_threads, [&](int i) {
+        real *column = &levelset[i][0];
+        for (int j = 0; j < h; j++) {
+            column[j] = band;
         }
-        if (ind.j > 0) {
-            const Index2D a = ind.neighbour(0, -1);
-            const Index2D b = ind;
-            update(a, b);
+        for (int c = std::max(0, i - reach); c <= std::min(w - 1, i + reach); c++) {
+            for (auto &pos : surface[c]) {
+                for (int j = std::max(0, int(floor(pos.y - band))); j <= std::min(h - 1, int(pos.y + band) + 1); j++) {
+                    column[j] = std::min(column[j], length(Vector2(i, j) - pos));
+                }
+            }
         }
-    }
-    for (auto &ind : levelset.get_region()) {
-        levelset[ind] *= sgn(old[ind]);
-    }
+        for (int j = 0; j < h; j++) {
+            column[j] *= sgn(old[i][j]);
+        }
+    });
 }
 
 
 EulerLiquid::Array<real> EulerLiquid::advect(const Array<real> & arr, real delta_t)
 {
     Array<real> arr_out(arr.get_width(), arr.get_height(), 0, arr.get_storage_offset());
-    for (auto &ind : arr.get_region()) {
-        Vector2 position = ind.get_pos();
-        Vector2 velocity = sample_velocity(position);
-        velocity = sample_velocity(position - delta_t * 0.5f * velocity);
-        arr_out[ind] = arr.sample(position - delta_t * velocity);
-    }
+    ThreadedTaskManager::run(arr.get_width(), num_threads, [&](int i) {
+        for (int j = 0; j < arr.get_height(); j++) {
+            Vector2 position = arr.get_storage_offset() + Vector2((real)i, (real)j);
+            Vector2 velocity = sample_velocity(position);
+            velocity = sample_velocity(position - delta_t * 0.5f * velocity);
+            arr_out[i][j] = arr.sample(position - delta_t * velocity);
+        }
+    });
     return arr_out;
 }
 
@@ -296,6 +327,30 @@ bool EulerLiquid::check_diag_domination()
     return true;
 }
 
+// Without air or cut cells (a closed container) the pressure is only defined up to
+// a constant, so the difference is reported with the means over unknowns removed as well.
+void EulerLiquid::compare_with_naive_pressure(const Array<real> &pressure) {
+    Array<real> reference = solve_pressure_naive();
+    double sum = 0, reference_sum = 0;
+    int count = 0;
+    for (auto &ind : Ad.get_region()) {
+        if (Ad[ind] > 0) {
+            sum += pressure[ind];
+            reference_sum += reference[ind];
+            count++;
+        }
+    }
+    real mean_offset = real((sum - reference_sum) / std::max(count, 1));
+    real diff = 0, diff_without_mean = 0;
+    for (auto &ind : Ad.get_region()) {
+        if (Ad[ind] > 0) {
+            diff = std::max(diff, std::abs(pressure[ind] - reference[ind]));
+            diff_without_mean = std::max(diff_without_mean, std::abs(pressure[ind] - reference[ind] - mean_offset));
+        }
+    }
+    printf("Pressure solver vs. mic_cg: max difference %f (%f without the means), reference max %f\n",
+           diff, diff_without_mean, reference.abs_max());
+}
 
 void EulerLiquid::advect(real delta_t) {
     real total_energy = 0;
@@ -324,16 +379,16 @@ void EulerLiquid::advect(real delta_t) {
 }
 
 void EulerLiquid::apply_external_forces(real delta_t) {
-    for (int i = 1; i < width; i++) {
+    ThreadedTaskManager::run(width, num_threads, [&](int i) {
         for (int j = 0; j < height; j++) {
-            u[i][j] += gravity.x * delta_t;
-        }
-    }
-    for (int i = 0; i < width; i++) {
-        for (int j = 1; j < height; j++) {
-            v[i][j] += gravity.y * delta_t;
+            if (i > 0) {
+                u[i][j] += gravity.x * delta_t;
+            }
+            if (j > 0) {
+                v[i][j] += gravity.y * delta_t;
+            }
         }
-    }
+    });
 }
 
 Vector2 EulerLiquid::position_noise()
@@ -346,12 +401,16 @@ bool EulerLiquid::inside(int x, int y) {
 }
 
 void EulerLiquid::update_velocity_weights() {
-    for (auto &ind : u.get_region()) {
-        u_weight[ind] = LevelSet2D::fraction_outside(boundary_levelset[ind], boundary_levelset[ind.neighbour(Vector2i(0, 1))]);
-    }
-    for (auto &ind : v.get_region()) {
-        v_weight[ind] = LevelSet2D::fraction_outside(boundary_levelset[ind], boundary_levelset[ind.neighbour(Vector2i(1, 0))]);
-    }
+    ThreadedTaskManager::run(width + 1, num_threads, [&](int i) {
+        for (int j = 0; j < height + 1; j++) {
+            if (j < height) {
+                u_weight[i][j] = LevelSet2D::fraction_outside(boundary_levelset[i][j], boundary_levelset[i][j + 1]);
+            }
+            if (i < width) {
+                v_weight[i][j] = LevelSet2D::fraction_outside(boundary_levelset[i][j], boundary_levelset[i + 1][j]);
+            }
+        }
+    });
 }
 
 void EulerLiquid::prepare_for_pressure_solve() {
@@ -359,7 +418,6 @@ void EulerLiquid::prepare_for_pressure_solve() {
     Ay = 0;
     Ad = 0;
     E = 0;
-    particles.clear();
     const real theta_threshold = 0.01f;
     Array<char> boundary_cell(width, height, false);
     for (int i = 0; i < width; i++) {
@@ -440,7 +498,9 @@ void EulerLiquid::prepare_for_pressure_solve() {
     if (!check_diag_domination()) {
         printf("Warning: Non diagonally dominant matrix found!\n");
     }
+}
 
+void EulerLiquid::build_mic_preconditioner() {
     real tao = 0.97f, sigma = 0.25f;
 
     for (auto &ind : cell_types.get_region()) {
@@ -498,6 +558,7 @@ EulerLiquid::Array<real> EulerLiquid::apply_A(const Array<real> &x) {
 
 
 EulerLiquid::Array<real> EulerLiquid::solve_pressure_naive() {
+    build_mic_preconditioner();
     static int total_count = 0;
     int count = 0;
     Array<real> r = get_rhs(), z, s;
@@ -526,11 +587,38 @@ EulerLiquid::Array<real> EulerLiquid::solve_pressure_naive() {
     return pressure;
 }
 
+EulerLiquid::Array<real> EulerLiquid::solve_pressure_with_solver() {
+    // Cells with a degree of freedom are interior; the rest are air (Dirichlet)
+    // or fully covered by the boundary (Neumann). The cut-cell weights live in Ad/Ax/Ay.
+    PoissonSolver2D::BCArray boundary(width, height);
+    for (auto &ind : boundary.get_region()) {
+        if (Ad[ind] > 0) {
+            boundary[ind] = PoissonSolver2D::INTERIOR;
+        } else if (liquid_levelset[ind] >= 0) {
+            boundary[ind] = PoissonSolver2D::DIRICHLET;
+        } else {
+            boundary[ind] = PoissonSolver2D::NEUMANN;
+        }
+    }
+    pressure_solver->set_boundary_condition(boundary);
+    pressure_solver->set_system(Ad, Ax, Ay);
+    pressure = 0;
+    pressure_solver->run(get_rhs(), pressure, tolerance);
+    return pressure;
+}
+
 void EulerLiquid::project(real delta_t) {
     update_volume_controller();
     apply_boundary_condition();
     prepare_for_pressure_solve();
-    p = solve_pressure_naive();
+    if (pressure_solver) {
+        p = solve_pressure_with_solver();
+        if (check_pressure_solver) {
+            compare_with_naive_pressure(p);
+        }
+    } else {
+        p = solve_pressure_naive();
+    }
     if (!(p.is_normal())) {
         printf("Abnormal pressure!!!!!\n");
     }
@@ -539,12 +627,12 @@ void EulerLiquid::project(real delta_t) {
 }
 
 void EulerLiquid::mark_cells() {
-    cell_types = CellType::AIR;
-    for (auto &ind : cell_types.get_region()) {
-        if (liquid_levelset.sample(ind.get_pos()) < 0) {
-            cell_types[ind] = CellType::WATER;
+    ThreadedTaskManager::run(width, num_threads, [&](int i) {
+        for (int j = 0; j < height; j++) {
+            Vector2 pos = cell_types.get_storage_offset() + Vector2((real)i, (real)j);
+            cell_types[i][j] = liquid_levelset.sample(pos) < 0 ? CellType::WATER : CellType::AIR;
         }
-    }
+    });
     /*
     for (auto &particle : particles) {
         int x = (int)particle.position.x, y = (int)particle.position.y;
@@ -564,26 +652,30 @@ void EulerLiquid::substep(real delta_t) {
     simple_extrapolate();
     advect(delta_t);
     advect_liquid_levelset(delta_t);
-    for (auto &ind : liquid_levelset.get_region())
-        liquid_levelset[ind] = std::max(liquid_levelset[ind], -boundary_levelset.sample(ind.get_pos()));
+    ThreadedTaskManager::run(width, num_threads, [&](int i) {
+        for (int j = 0; j < height; j++) {
+            Vector2 pos = liquid_levelset.get_storage_offset() + Vector2((real)i, (real)j);
+            liquid_levelset[i][j] = std::max(liquid_levelset[i][j], -boundary_levelset.sample(pos));
+        }
+    });
     t += delta_t;
 }
 
 void EulerLiquid::apply_pressure(const Array<real> &p) {
-    for (int i = 0; i < width - 1; i++) {
+    ThreadedTaskManager::run(width, num_threads, [&](int i) {
         for (int j = 0; j < height; j++) {
-            real theta = LevelSet2D::fraction_inside(liquid_levelset[i][j], liquid_levelset[i + 1][j]);
-            if (u_weight[i + 1][j] > 0 && theta > 0)
-                u[i + 1][j] += (p[i][j] - p[i + 1][j]) / std::max(theta_threshold, theta);
+            if (i < width - 1) {
+                real theta = LevelSet2D::fraction_inside(liquid_levelset[i][j], liquid_levelset[i + 1][j]);
+                if (u_weight[i + 1][j] > 0 && theta > 0)
+                    u[i + 1][j] += (p[i][j] - p[i + 1][j]) / std::max(theta_threshold, theta);
+            }
+            if (j < height - 1) {
+                real theta = LevelSet2D::fraction_inside(liquid_levelset[i][j], liquid_levelset[i][j + 1]);
+                if (v_weight[i][j + 1] > 0 && theta > 0)
+                    v[i][j + 1] += (p[i][j] - p[i][j + 1]) / std::max(theta_threshold, theta);
+            }
         }
-    }
-    for (int i = 0; i < width; i++) {
-        for (int j = 0; j < height - 1; j++) {
-            real theta = LevelSet2D::fraction_inside(liquid_levelset[i][j], liquid_levelset[i][j + 1]);
-            if (v_weight[i][j + 1] > 0 && theta > 0)
-                v[i][j + 1] += (p[i][j] - p[i][j + 1]) / std::max(theta_threshold, theta);
-        }
-    }
+    });
     for (int i = 0; i < width; i++) {
         for (int j = 0; j < height; j++) {
             if (liquid_levelset[i][j] > 0) {
@@ -602,16 +694,16 @@ void EulerLiquid::apply_pressure(const Array<real> &p) {
 }
 
 void EulerLiquid::apply_boundary_condition() {
-    for (auto &ind : u.get_region()) {
-        if (u_weight[ind] == 0.0f) {
-            u[ind] = 0.0f;
-        }
-    }
-    for (auto &ind : v.get_region()) {
-        if (v_weight[ind] == 0.0f) {
-            v[ind] = 0.0f;
+    ThreadedTaskManager::run(width + 1, num_threads, [&](int i) {
+        for (int j = 0; j < height + 1; j++) {
+            if (j < height && u_weight[i][j] == 0.0f) {
+                u[i][j] = 0.0f;
+            }
+            if (i < width && v_weight[i][j] == 0.0f) {
+                v[i][j] = 0.0f;
+            }
         }
-    }
+    });
 }
 
 real EulerLiquid::get_current_time() {
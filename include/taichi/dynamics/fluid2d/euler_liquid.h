@@ -16,6 +16,7 @@
 #include <taichi/visualization/image_buffer.h>
 #include <taichi/math/stencils.h>
 #include <taichi/math/levelset_2d.h>
+#include <taichi/dynamics/poisson_solver2d.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -49,6 +50,14 @@ protected:
     real tolerance;
     real theta_threshold;
     int maximum_iterations;
+    int num_threads;
+    // Built-in MIC(0)-preconditioned CG is used if this is empty
+    std::shared_ptr<PoissonSolver2D> pressure_solver;
+    // Also run the built-in solver and report how far pressure_solver is from it
+    bool check_pressure_solver;
+    // Redistancing of the liquid levelset: "brute_force" (distance to the crossings within
+    // the band) or "fast_marching"
+    std::string levelset_redistancing;
     LevelSet2D boundary_levelset;
     Array<real> density;
     std::vector<Config> sources;
@@ -82,8 +91,12 @@ protected:
 
     virtual void prepare_for_pressure_solve();
 
+    void build_mic_preconditioner();
+
     virtual Array<real> solve_pressure_naive();
 
+    virtual Array<real> solve_pressure_with_solver();
+
     virtual void project(real delta_t);
 
     virtual void apply_viscosity(real delta_t);
@@ -139,6 +152,8 @@ protected:
 
     virtual bool check_diag_domination();
 
+    virtual void compare_with_naive_pressure(const Array<real> &pressure);
+
     virtual void update_velocity_weights();
 
 public:
@@ -8,7 +8,9 @@
 *******************************************************************************/
 
 #include "flip_liquid.h"
-#include <taichi/nearest_neighbour/point_cloud.h>
+#include <taichi/nearest_neighbour/cell_list.h>
+#include <taichi/system/threading.h>
+#include <algorithm>
 
 TC_NAMESPACE_BEGIN
 
@@ -31,10 +33,18 @@ void FLIPLiquid::initialize_solver(const Config &config)
     advection_order = config.get("advection_order", 2);
     correction_strength = config.get("correction_strength", 0.1f);
     correction_neighbours = config.get("correction_neighbours", 5);
+    narrow_band = config.get("narrow_band", 0.0f);
+    particles_per_cell = config.get("particles_per_cell", 4);
+    if (narrow_band > 0) {
+        // Deeper than the levelset band, the advected levelset can not tell the band apart
+        narrow_band = std::min(narrow_band, config.get_real("levelset_band"));
+    }
     u_backup = Array<real>(width + 1, height, 0.0f, Vector2(0.0f, 0.5f));
     v_backup = Array<real>(width, height + 1, 0.0f, Vector2(0.5f, 0.0f));
     u_count = Array<real>(width + 1, height, 0.0f);
     v_count = Array<real>(width, height + 1, 0.0f);
+    u_grid = Array<real>(width + 1, height, 0.0f, Vector2(0.0f, 0.5f));
+    v_grid = Array<real>(width, height + 1, 0.0f, Vector2(0.5f, 0.0f));
 }
 
 Vector2 FLIPLiquid::sample_velocity(Vector2 position, Vector2 velocity, real lerp) {
@@ -44,8 +54,9 @@ Vector2 FLIPLiquid::sample_velocity(Vector2 position, Vector2 velocity, real ler
 
 void FLIPLiquid::advect(real delta_t) {
     real lerp = powf(FLIP_alpha, delta_t / 0.01f);
-    real max_movement = 0.0f;
-    for (auto &p : particles) {
+    assert_info(1 <= advection_order && advection_order <= 3, "advection_order must be in [1, 2, 3].");
+    ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
+        Particle &p = particles[i];
         if (advection_order == 3) {
             Vector2 velocity_1 = sample_velocity(p.position, p.velocity, lerp);
             Vector2 velocity_2 = sample_velocity((p.position + delta_t * 0.5f * velocity_1),
@@ -61,27 +72,34 @@ void FLIPLiquid::advect(real delta_t) {
             Vector2 velocity_2 = sample_velocity(p.position - delta_t * velocity_1, p.velocity, lerp);
             p.velocity = 0.5f * (velocity_1 + velocity_2);
         }
-        else if (advection_order == 1) {
-            p.velocity = sample_velocity(p.position, p.velocity, lerp);
-        }
         else {
-            error("advection_order must be in [1, 2, 3].")
+            p.velocity = sample_velocity(p.position, p.velocity, lerp);
         }
         p.move(delta_t * p.velocity);
-        max_movement = std::max(max_movement, length(p.velocity * delta_t));
         clamp_particle(p);
-    }
+    });
 }
 
 void FLIPLiquid::apply_external_forces(real delta_t) {
-    for (auto &p : particles) {
-        p.velocity += delta_t * gravity;
+    ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
+        particles[i].velocity += delta_t * gravity;
+    });
+    if (narrow_band > 0) {
+        ThreadedTaskManager::run(width, num_threads, [&](int i) {
+            for (int j = 0; j < height; j++) {
+                if (i > 0) {
+                    u_grid[i][j] += gravity.x * delta_t;
+                }
+                if (j > 0) {
+                    v_grid[i][j] += gravity.y * delta_t;
+                }
+            }
+        });
     }
 }
 
 void FLIPLiquid::rasterize() {
-    rasterize_component<Particle::get_velocity<0>>(u, u_count);
-    rasterize_component<Particle::get_velocity<1>>(v, v_count);
+    rasterize_velocity<Particle::get_velocity>();
 }
 
 void FLIPLiquid::step(real delta_t)
@@ -95,7 +113,44 @@ void FLIPLiquid::backup_velocity_field() {
     v_backup = v;
 }
 
+void FLIPLiquid::compute_liquid_levelset() {
+    Array<real> grid_levelset = liquid_levelset;
+    liquid_levelset.reset(1e7f); // Do not use INF here, otherwise interpolation will get NAN...
+    for (auto &p : particles) {
+        for (auto &ind : liquid_levelset.get_rasterization_region(p.position, 3)) {
+            Vector2 delta_pos = ind.get_pos() - p.position;
+            liquid_levelset[ind] = std::min(liquid_levelset[ind], length(delta_pos) - p.radius);
+        }
+    }
+    ThreadedTaskManager::run(width, num_threads, [&](int i) {
+        for (int j = 0; j < height; j++) {
+            // Below the band the surface comes from the grid. The last cell of the band has
+            // both particles and the grid levelset, so that the two overlap.
+            if (narrow_band > 0 && grid_levelset[i][j] < 1.0f - narrow_band) {
+                liquid_levelset[i][j] = std::min(liquid_levelset[i][j], grid_levelset[i][j]);
+            }
+            Vector2 pos = liquid_levelset.get_storage_offset() + Vector2((real)i, (real)j);
+            if (liquid_levelset[i][j] < 0.5f && boundary_levelset.sample(pos) < 0) {
+                liquid_levelset[i][j] = -0.5f;
+            }
+        }
+    });
+}
+
+void FLIPLiquid::advect_grid(real delta_t) {
+    u_grid = EulerLiquid::advect(u, delta_t);
+    v_grid = EulerLiquid::advect(v, delta_t);
+    advect_liquid_levelset(delta_t);
+}
+
 void FLIPLiquid::substep(real delta_t) {
+    // Face weights of the pressure solve, refreshed as in EulerLiquid::substep
+    update_velocity_weights();
+    // Nothing else creates particles, so the first reseed seeds the initial liquid
+    // (with or without a band); later ones only keep the band filled
+    if (narrow_band > 0 || t == 0) {
+        reseed();
+    }
     apply_external_forces(delta_t);
     mark_cells();
     rasterize();
@@ -105,11 +160,41 @@ void FLIPLiquid::substep(real delta_t) {
     simple_extrapolate();
     project(delta_t);
     simple_extrapolate();
+    if (narrow_band > 0) {
+        advect_grid(delta_t);
+    }
     advect(delta_t);
     t += delta_t;
 }
 
+// Fills liquid cells up to particles_per_cell particles, taking the grid velocity. Initially
+// all liquid cells are seeded. Later only band cells at least a cell deep are, since seeding
+// the surface cells would grow the liquid. Particles below the band are deleted.
 void FLIPLiquid::reseed() {
+    if (narrow_band > 0) {
+        particles.erase(std::remove_if(particles.begin(), particles.end(), [&](const Particle &p) {
+            return liquid_levelset.sample(p.position) < -narrow_band - 0.5f;
+        }), particles.end());
+    }
+    Array<int> count(width, height, 0);
+    for (auto &p : particles) {
+        count[clamp((int)std::floor(p.position.x), 0, width - 1)][clamp((int)std::floor(p.position.y), 0, height - 1)]++;
+    }
+    for (int i = 0; i < width; i++) {
+        for (int j = 0; j < height; j++) {
+            real phi = liquid_levelset[i][j];
+            if (phi >= (t == 0 ? 0.0f : -1.0f) || (narrow_band > 0 && phi < -narrow_band)) {
+                continue;
+            }
+            for (int k = count[i][j]; k < particles_per_cell; k++) {
+                Vector2 pos = Vector2((real)i, (real)j) + Vector2(rand(), rand());
+                if (boundary_levelset.sample(pos) < padding) {
+                    continue;
+                }
+                particles.push_back(Particle(pos, EulerLiquid::sample_velocity(pos, u_grid, v_grid)));
+            }
+        }
+    }
 }
 
 void FLIPLiquid::correct_particle_positions(real delta_t, bool clear_c)
@@ -117,21 +202,24 @@ void FLIPLiquid::correct_particle_positions(real delta_t, bool clear_c)
     if (correction_strength == 0.0f && !clear_c) {
         return;
     }
-    NearestNeighbour2D nn;
     real range = 0.5f;
     std::vector<Vector2> positions;
     for (auto &p : particles) {
         positions.push_back(p.position);
     }
-    nn.initialize(positions);
+    // Cells of size `range` cover the correction radius with the 3x3 neighbourhood
+    CellList<2> neighbours(num_threads);
+    neighbours.initialize(positions, range);
+    const int k = correction_neighbours;
+    std::vector<int> neighbour_index;
+    std::vector<real> neighbour_dist;
+    neighbours.query_k_batch(positions, k, neighbour_index, neighbour_dist);
     std::vector<Vector2> delta_pos(particles.size());
     for (int i = 0; i < (int)particles.size(); i++) {
         delta_pos[i] = Vector2(0);
         auto &p = particles[i];
-        std::vector<int> neighbour_index;
-        std::vector<real> neighbour_dist;
-        nn.query_n(p.position, correction_neighbours, neighbour_index, neighbour_dist);
-        for (auto nei_index : neighbour_index) {
+        for (int n = 0; n < k; n++) {
+            int nei_index = neighbour_index[i * k + n];
             if (nei_index == -1) {
                 break;
             }
@@ -144,43 +232,86 @@ void FLIPLiquid::correct_particle_positions(real delta_t, bool clear_c)
                 delta_pos[nei_index] -= a * dir;
             }
         }
-        if (clear_c && (neighbour_index.size() <= 1 || neighbour_dist[1] > 1.5f)) {
+        if (clear_c && (k <= 1 || neighbour_dist[i * k + 1] > 1.5f)) {
             p.c[0] = p.c[1] = Vector2(0.0f);
         }
     }
-    for (int i = 0; i < (int)particles.size(); i++) {
+    ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
         particles[i].position += delta_pos[i];
         clamp_particle(particles[i]);
-    }
+    });
 }
 
-template<real(*T)(const Fluid::Particle &, const Vector2 &)>
-void FLIPLiquid::rasterize_component(Array<real> & val, Array<real> & count)
-{
-    val = 0;
-    count = 0;
+template <real(*T)(const Fluid::Particle &, const Vector2 &, int)>
+void FLIPLiquid::rasterize_velocity() {
+    u = 0;
+    v = 0;
+    u_count = 0;
+    v_count = 0;
     real inv_kernel_size = 1.0f / kernel_size;
     int extent = (kernel_size + 1) / 2;
-    for (auto &p : particles) {
+    // Particles are counting-sorted into columns. A particle in column c writes to faces in
+    // columns c - extent .. c + extent + 1, so strips of strip_width columns that are two strips
+    // apart never write to the same face: even strips, then odd strips, are rasterized in parallel.
+    const int strip_width = 2 * extent + 2;
+    const int num_particles = (int)particles.size();
+    std::vector<int> column_begin(width + 1, 0), sorted(num_particles), columns(num_particles);
+    for (int i = 0; i < num_particles; i++) {
+        columns[i] = clamp((int)std::floor(particles[i].position.x), 0, width - 1);
+        column_begin[columns[i] + 1]++;
+    }
+    for (int c = 0; c < width; c++) {
+        column_begin[c + 1] += column_begin[c];
+    }
+    std::vector<int> slot(column_begin.begin(), column_begin.end() - 1);
+    for (int i = 0; i < num_particles; i++) {
+        sorted[slot[columns[i]]++] = i;
+    }
+    auto splat = [&](const Particle &p, Array<real> &val, Array<real> &count, int k) {
         for (auto &ind : val.get_rasterization_region(p.position, extent)) {
             Vector2 delta_pos = ind.get_pos() - p.position;
             real weight = kernel(inv_kernel_size * delta_pos);
-            val[ind] += weight * T(p, delta_pos);
+            val[ind] += weight * T(p, delta_pos, k);
             count[ind] += weight;
         }
+    };
+    const int num_strips = (width + strip_width - 1) / strip_width;
+    for (int parity = 0; parity < 2; parity++) {
+        ThreadedTaskManager::run((num_strips + 1 - parity) / 2, num_threads, [&](int s) {
+            int strip = 2 * s + parity;
+            int begin = column_begin[strip * strip_width];
+            int end = column_begin[std::min(width, (strip + 1) * strip_width)];
+            for (int i = begin; i < end; i++) {
+                const Particle &p = particles[sorted[i]];
+                splat(p, u, u_count, 0);
+                splat(p, v, v_count, 1);
+            }
+        });
     }
-    for (auto ind : val.get_region()) {
-        if (count[ind] > 0) {
-            val[ind] /= count[ind];
+    // With a narrow band, liquid faces that particles barely reach are completed by the grid velocity
+    auto normalize = [&](real &val, real count, real grid, const Vector2 &pos) {
+        real grid_weight = 0.0f;
+        if (narrow_band > 0 && count < 1.0f && liquid_levelset.sample(pos) < 0) {
+            grid_weight = 1.0f - count;
         }
-    }
+        if (count + grid_weight > 0) {
+            val = (val + grid_weight * grid) / (count + grid_weight);
+        }
+    };
+    ThreadedTaskManager::run(width + 1, num_threads, [&](int i) {
+        for (int j = 0; j < height + 1; j++) {
+            if (j < height) {
+                normalize(u[i][j], u_count[i][j], u_grid[i][j], u.get_storage_offset() + Vector2((real)i, (real)j));
+            }
+            if (i < width) {
+                normalize(v[i][j], v_count[i][j], v_grid[i][j], v.get_storage_offset() + Vector2((real)i, (real)j));
+            }
+        }
+    });
 }
 
-
-template void FLIPLiquid::rasterize_component<Fluid::Particle::get_velocity<0>>(Array<real> &val, Array<real> &count);
-template void FLIPLiquid::rasterize_component<Fluid::Particle::get_velocity<1>>(Array<real> &val, Array<real> &count);
-template void FLIPLiquid::rasterize_component<Fluid::Particle::get_affine_velocity<0>>(Array<real> &val, Array<real> &count);
-template void FLIPLiquid::rasterize_component<Fluid::Particle::get_affine_velocity<1>>(Array<real> &val, Array<real> &count);
+template void FLIPLiquid::rasterize_velocity<Fluid::Particle::get_velocity>();
+template void FLIPLiquid::rasterize_velocity<Fluid::Particle::get_affine_velocity>();
 
 TC_IMPLEMENTATION(Fluid, FLIPLiquid, "flip_liquid");
 
@@ -24,6 +24,13 @@ protected:
     int advection_order;
     real correction_strength;
     int correction_neighbours;
+    // Particles are only kept within narrow_band cells of the surface (0 keeps them in
+    // the whole liquid). The interior is carried by the grid: u_grid and v_grid are the
+    // semi-Lagrangian advected velocity, completing liquid faces that particles barely reach.
+    real narrow_band;
+    int particles_per_cell;
+    Array<real> u_grid;
+    Array<real> v_grid;
 
     void clamp_particle(Particle &p);
 
@@ -37,11 +44,17 @@ protected:
 
     virtual void rasterize();
 
-    template <real(*T)(const Particle &, const Vector2 &)>
-    void rasterize_component(Array<real> &val, Array<real> &count);
+    // Rasterizes both velocity components in one pass over the particles, where
+    // T(p, delta_pos, k) is the value of component k that p carries to a face at delta_pos
+    template <real(*T)(const Particle &, const Vector2 &, int)>
+    void rasterize_velocity();
 
     virtual void backup_velocity_field();
 
+    virtual void compute_liquid_levelset();
+
+    void advect_grid(real delta_t);
+
     virtual void substep(real delta_t);
 
     void reseed();
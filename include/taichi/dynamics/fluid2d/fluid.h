@@ -37,11 +37,9 @@ public:
             this->position += delta_x;
         }
 
-        template <int k>
-        static real get_velocity(const Particle &p, const Vector2 &delta_pos) { return p.velocity[k]; }
+        static real get_velocity(const Particle &p, const Vector2 &delta_pos, int k) { return p.velocity[k]; }
 
-        template <int k>
-        static real get_affine_velocity(const Particle &p, const Vector2 &delta_pos) {
+        static real get_affine_velocity(const Particle &p, const Vector2 &delta_pos, int k) {
             return p.velocity[k] + dot(p.c[k], delta_pos);
         }
 
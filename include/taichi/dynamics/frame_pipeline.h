@@ -0,0 +1,124 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/meta.h>
+#include <taichi/dynamics/simulation3d.h>
+#include <taichi/visualization/particle_visualization.h>
+#include <taichi/math/array_2d.h>
+
+#include <map>
+#include <mutex>
+#include <exception>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+TC_NAMESPACE_BEGIN
+
+// Overlaps per-frame output with simulation.
+// At every frame boundary, the render particles are snapshotted into one of
+// `num_buffers` slots (double buffering by default). Two background stages
+// consume the slots in order:
+//   - the dump stage writes `particles%05d.bin` into `output_directory`;
+//   - the render stage rasterizes the snapshot with the particle renderer and
+//     then runs the output hooks (e.g. encoders).
+// When all slots are still in flight, `push` blocks (backpressure), so the
+// simulation never runs more than `num_buffers` frames ahead of the writer.
+// With `keep_images`, at most `max_kept_images` rendered images wait for
+// `get_image`; beyond that the render stage waits too, and so does `push`.
+// An exception thrown by a stage (or an output hook) is rethrown to the caller
+// from the next `push`, `get_image` or `flush`; the failed frame is skipped.
+class FramePipeline {
+public:
+    struct Frame {
+        int id;
+        real t;
+        std::vector<RenderParticle> particles;
+        std::shared_ptr<Camera> camera;
+        Array2D<Vector3> image;
+    };
+
+    typedef std::function<void(const Frame &)> OutputHook;
+
+protected:
+    enum Stage {
+        DUMP = 0, RENDER = 1, NUM_STAGES = 2
+    };
+
+    struct Slot {
+        Frame frame;
+        int pending_stages = 0;
+    };
+
+    std::string output_directory;
+    bool dump_particles;
+    bool keep_images;
+    int max_kept_images;
+    int width, height;
+    std::shared_ptr<ParticleRenderer> particle_renderer;
+    std::vector<OutputHook> output_hooks;
+
+    std::vector<Slot> slots;
+    int64 num_pushed = 0;
+    int64 num_processed[NUM_STAGES];
+    std::map<int, Array2D<Vector3>> rendered_images;
+    double stall_time = 0.0;
+    // First exception of a stage not yet rethrown
+    std::exception_ptr stage_exception;
+
+    std::mutex mut;
+    std::condition_variable cv;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+
+    void worker(Stage stage);
+
+    void process(Stage stage, Frame &frame);
+
+    // With mut held
+    void rethrow_stage_exception();
+
+public:
+    FramePipeline() {}
+
+    void initialize(const Config &config);
+
+    void set_particle_renderer(std::shared_ptr<ParticleRenderer> renderer) {
+        particle_renderer = renderer;
+    }
+
+    // Hooks run on the render thread, after the frame is rasterized.
+    void add_output_hook(const OutputHook &hook) {
+        output_hooks.push_back(hook);
+    }
+
+    // Snapshot the current state of `sim` as frame `frame_id`.
+    void push(const Simulation3D &sim, int frame_id, std::shared_ptr<Camera> camera);
+
+    void push(std::vector<RenderParticle> &&particles, real t, int frame_id, std::shared_ptr<Camera> camera);
+
+    // Blocks until frame `frame_id` is rendered, then hands over its image.
+    Array2D<Vector3> get_image(int frame_id);
+
+    // Blocks until every pushed frame went through all stages. With `keep_images`, images beyond
+    // `max_kept_images` have to be taken by get_image from another thread for this to return.
+    void flush();
+
+    // Total time (in seconds) `push` has been blocked waiting for a free slot
+    double get_stall_time() const {
+        return stall_time;
+    }
+
+    ~FramePipeline();
+};
+
+TC_NAMESPACE_END
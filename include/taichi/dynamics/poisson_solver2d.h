@@ -28,6 +28,16 @@ public:
 
     virtual void run(const Array &b, Array &x, float tolerance) {};
     virtual void set_boundary_condition(const BCArray &boundary) {};
+
+    // Replace the constant-coefficient operator implied by the cell types with a
+    // variable-coefficient (e.g. liquid/air cut-cell) 5-point system:
+    //   (A x)[i][j] = Ad[i][j] x[i][j] + Ax[i - 1][j] x[i - 1][j] + Ax[i][j] x[i + 1][j]
+    //               + Ay[i][j - 1] x[i][j - 1] + Ay[i][j] x[i][j + 1]
+    // Cells with Ad == 0 carry no degree of freedom. Call after set_boundary_condition,
+    // whose cell types solvers may still use for preconditioning.
+    virtual void set_system(const Array &Ad, const Array &Ax, const Array &Ay) {
+        error("no impl");
+    };
 };
 
 TC_INTERFACE(PoissonSolver2D);
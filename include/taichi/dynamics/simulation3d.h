@@ -14,6 +14,7 @@
 #include <taichi/visualization/particle_visualization.h>
 #include <vector>
 #include <taichi/math/dynamic_levelset_3d.h>
+#include <taichi/system/telemetry.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -22,6 +23,7 @@ protected:
     real current_t = 0.0f;
     int num_threads;
     DynamicLevelSet3D levelset;
+    Telemetry telemetry;
 public:
     Simulation3D() {}
 
@@ -31,6 +33,7 @@ public:
 
     virtual void initialize(const Config &config) override {
         num_threads = config.get_int("num_threads");
+        telemetry.initialize(config);
     }
 
     virtual void add_particles(const Config &config) {
@@ -52,6 +55,11 @@ public:
 
     virtual void update(const Config &config) {}
 
+    // Writes the volumetric fields of the current frame as <prefix>_<field>.tcv (see CompressedVolume)
+    virtual void write_volumes(const std::string &prefix) const {
+        error("no impl");
+    }
+
     virtual bool test() const override {
         return true;
     };
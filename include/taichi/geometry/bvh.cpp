@@ -0,0 +1,600 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "bvh.h"
+#include <taichi/system/threading.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#ifndef TC_DISABLE_SSE
+#define TC_USE_SSE
+#include <immintrin.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+static const int num_bins = 16;
+// Below this depth, nodes are split in halves by count instead of SAH, which bounds
+// the depth of the tree (and the traversal stack) for degenerate inputs
+static const int max_sah_depth = 48;
+static const int stack_size = 256;
+// Far distances of boxes are scaled up by 1 + 2 gamma(3), so that rounding never
+// misses a box that the (watertight) triangle test would hit [Ize 2013]
+static const float box_far_scale = 1.0000004f;
+
+static real half_area(const Vector3 &lower, const Vector3 &upper) {
+    Vector3 d = glm::max(upper - lower, Vector3(0.0f));
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+static int encode_leaf(int first, int count) {
+    return ~((first << 4) | count);
+}
+
+// Per-ray constants for box and triangle tests
+struct TraversalRay {
+    Vector3 org;
+    // Which of bounds[0] or bounds[1] is hit first, per axis
+    int near_bounds[3];
+    // Shear of the watertight test: kz is the dominant axis of the direction
+    int kx, ky, kz;
+    real sx, sy, sz;
+#ifdef TC_USE_SSE
+    __m128 org4[3], inv_dir4[3];
+#else
+    real inv_dir[3];
+#endif
+
+    TraversalRay(const Ray &ray) {
+        org = ray.orig;
+        for (int i = 0; i < 3; i++) {
+            real d = ray.dir[i];
+            if (std::abs(d) < 1e-20f) {
+                d = d < 0 ? -1e-20f : 1e-20f;
+            }
+            near_bounds[i] = d < 0;
+#ifdef TC_USE_SSE
+            org4[i] = _mm_set1_ps(org[i]);
+            inv_dir4[i] = _mm_set1_ps(1.0f / d);
+#else
+            inv_dir[i] = 1.0f / d;
+#endif
+        }
+        Vector3 abs_dir = glm::abs(ray.dir);
+        kz = abs_dir.x > abs_dir.y ? (abs_dir.x > abs_dir.z ? 0 : 2) : (abs_dir.y > abs_dir.z ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        // Keep the winding of the sheared triangle
+        if (ray.dir[kz] < 0) {
+            std::swap(kx, ky);
+        }
+        sx = ray.dir[kx] / ray.dir[kz];
+        sy = ray.dir[ky] / ray.dir[kz];
+        sz = 1.0f / ray.dir[kz];
+    }
+};
+
+// Mask of the children of node whose boxes overlap (t_min, t_max), and their entry distances
+static int intersect_boxes(const BVH::Node &node, const TraversalRay &r, real t_min, real t_max, float *dists) {
+#ifdef TC_USE_SSE
+    __m128 t0 = _mm_set1_ps(t_min), t1 = _mm_set1_ps(t_max);
+    const __m128 scale = _mm_set1_ps(box_far_scale);
+    for (int d = 0; d < 3; d++) {
+        __m128 t_near = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[r.near_bounds[d]][d]), r.org4[d]), r.inv_dir4[d]);
+        __m128 t_far = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1 - r.near_bounds[d]][d]), r.org4[d]), r.inv_dir4[d]);
+        t0 = _mm_max_ps(t0, t_near);
+        t1 = _mm_min_ps(t1, _mm_mul_ps(t_far, scale));
+    }
+    _mm_storeu_ps(dists, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+    int mask = 0;
+    for (int c = 0; c < 4; c++) {
+        real t0 = t_min, t1 = t_max;
+        for (int d = 0; d < 3; d++) {
+            real t_near = (node.bounds[r.near_bounds[d]][d][c] - r.org[d]) * r.inv_dir[d];
+            real t_far = (node.bounds[1 - r.near_bounds[d]][d][c] - r.org[d]) * r.inv_dir[d];
+            t0 = std::max(t0, t_near);
+            t1 = std::min(t1, t_far * box_far_scale);
+        }
+        dists[c] = t0;
+        mask |= int(t0 <= t1) << c;
+    }
+    return mask;
+#endif
+}
+
+// Watertight ray-triangle intersection [Woop et al. 2013]. u and v are the
+// barycentric coordinates of v[1] and v[2], as Triangle::get_coord.
+static bool intersect_triangle(const Vector3 *v, const TraversalRay &r, real t_min, real t_max,
+                               real &t, real &u, real &v_out) {
+    const Vector3 a = v[0] - r.org, b = v[1] - r.org, c = v[2] - r.org;
+    const real ax = a[r.kx] - r.sx * a[r.kz], ay = a[r.ky] - r.sy * a[r.kz];
+    const real bx = b[r.kx] - r.sx * b[r.kz], by = b[r.ky] - r.sy * b[r.kz];
+    const real cx = c[r.kx] - r.sx * c[r.kz], cy = c[r.ky] - r.sy * c[r.kz];
+    real U = cx * by - cy * bx;
+    real V = ax * cy - ay * cx;
+    real W = bx * ay - by * ax;
+    // Edges through the ray are decided in double precision
+    if (U == 0 || V == 0 || W == 0) {
+        U = real((double)cx * by - (double)cy * bx);
+        V = real((double)ax * cy - (double)ay * cx);
+        W = real((double)bx * ay - (double)by * ax);
+    }
+    if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) {
+        return false;
+    }
+    const real det = U + V + W;
+    if (det == 0) {
+        return false;
+    }
+    const real T = U * (r.sz * a[r.kz]) + V * (r.sz * b[r.kz]) + W * (r.sz * c[r.kz]);
+    const real inv_det = 1.0f / det;
+    t = T * inv_det;
+    if (!(t > t_min && t < t_max)) {
+        return false;
+    }
+    u = V * inv_det;
+    v_out = W * inv_det;
+    return true;
+}
+
+BVH::BVH(int num_threads, int leaf_size) : num_threads(num_threads), leaf_size(leaf_size) {
+    assert_info(1 <= leaf_size && leaf_size <= max_leaf_size, "BVH leaf size should be in [1, 15]");
+}
+
+int BVH::build_binary(std::vector<BinaryNode> &binary_nodes, int begin, int end, int depth,
+                      std::vector<BuildTask> *tasks, int task_size) {
+    // Centroids are kept doubled (lower + upper) throughout
+    Vector3 lower(std::numeric_limits<real>::infinity()), upper(-std::numeric_limits<real>::infinity());
+    Vector3 centroid_lower = lower, centroid_upper = upper;
+    for (int i = begin; i < end; i++) {
+        const PrimitiveReference &ref = references[order[i]];
+        lower = glm::min(lower, ref.lower);
+        upper = glm::max(upper, ref.upper);
+        centroid_lower = glm::min(centroid_lower, ref.lower + ref.upper);
+        centroid_upper = glm::max(centroid_upper, ref.lower + ref.upper);
+    }
+    const int index = (int)binary_nodes.size();
+    const int count = end - begin;
+    binary_nodes.push_back(BinaryNode{lower, upper, -1, -1, begin, count});
+    if (count <= 1) {
+        return index;
+    }
+    if (tasks && count <= task_size) {
+        tasks->push_back(BuildTask{index, begin, end, depth});
+        return index;
+    }
+
+    int mid = begin;
+    const real area = half_area(lower, upper);
+    if (depth < max_sah_depth && area > 0) {
+        real best_cost = std::numeric_limits<real>::infinity();
+        int best_axis = -1, best_bin = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            const real extent = centroid_upper[axis] - centroid_lower[axis];
+            if (extent <= 0) {
+                continue;
+            }
+            const real scale = num_bins * (1 - 1e-6f) / extent;
+            int bin_counts[num_bins] = {0};
+            Vector3 bin_lower[num_bins], bin_upper[num_bins];
+            for (int b = 0; b < num_bins; b++) {
+                bin_lower[b] = Vector3(std::numeric_limits<real>::infinity());
+                bin_upper[b] = Vector3(-std::numeric_limits<real>::infinity());
+            }
+            for (int i = begin; i < end; i++) {
+                const PrimitiveReference &ref = references[order[i]];
+                int b = std::min(num_bins - 1, int(((ref.lower + ref.upper)[axis] - centroid_lower[axis]) * scale));
+                bin_counts[b]++;
+                bin_lower[b] = glm::min(bin_lower[b], ref.lower);
+                bin_upper[b] = glm::max(bin_upper[b], ref.upper);
+            }
+            // right_costs[b]: bins [b, num_bins)
+            real right_costs[num_bins];
+            Vector3 l = bin_lower[num_bins - 1], u = bin_upper[num_bins - 1];
+            int right_count = 0;
+            for (int b = num_bins - 1; b > 0; b--) {
+                l = glm::min(l, bin_lower[b]);
+                u = glm::max(u, bin_upper[b]);
+                right_count += bin_counts[b];
+                right_costs[b] = right_count == 0 ? 0 : half_area(l, u) * right_count;
+            }
+            l = bin_lower[0];
+            u = bin_upper[0];
+            int left_count = 0;
+            for (int b = 1; b < num_bins; b++) {
+                l = glm::min(l, bin_lower[b - 1]);
+                u = glm::max(u, bin_upper[b - 1]);
+                left_count += bin_counts[b - 1];
+                if (left_count == 0 || left_count == count) {
+                    continue;
+                }
+                const real cost = half_area(l, u) * left_count + right_costs[b];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+        if (best_axis != -1) {
+            // Unit costs for traversal and intersection
+            const real split_cost = 1 + best_cost / area;
+            if (count <= leaf_size && split_cost >= count) {
+                return index;
+            }
+            const real scale = num_bins * (1 - 1e-6f) / (centroid_upper[best_axis] - centroid_lower[best_axis]);
+            const real offset = centroid_lower[best_axis];
+            mid = int(std::partition(order.begin() + begin, order.begin() + end, [&](int i) {
+                const PrimitiveReference &ref = references[i];
+                return std::min(num_bins - 1, int(((ref.lower + ref.upper)[best_axis] - offset) * scale)) < best_bin;
+            }) - order.begin());
+        }
+    }
+    if (mid <= begin || mid >= end) {
+        if (count <= leaf_size) {
+            return index;
+        }
+        // No useful SAH split: halves along the widest centroid extent
+        const Vector3 extent = centroid_upper - centroid_lower;
+        const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        mid = (begin + end) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int i, int j) {
+            return references[i].lower[axis] + references[i].upper[axis] <
+                   references[j].lower[axis] + references[j].upper[axis];
+        });
+    }
+    const int left = build_binary(binary_nodes, begin, mid, depth + 1, tasks, task_size);
+    const int right = build_binary(binary_nodes, mid, end, depth + 1, tasks, task_size);
+    binary_nodes[index].left = left;
+    binary_nodes[index].right = right;
+    return index;
+}
+
+int BVH::collapse(const std::vector<BinaryNode> &binary_nodes, int b) {
+    const int index = (int)nodes.size();
+    nodes.push_back(Node());
+    // Open the largest inner node among the children until there are four
+    int children[4], num_children = 0;
+    if (binary_nodes[b].left == -1) {
+        children[num_children++] = b;
+    } else {
+        children[num_children++] = binary_nodes[b].left;
+        children[num_children++] = binary_nodes[b].right;
+        while (num_children < 4) {
+            int best = -1;
+            real best_area = -1;
+            for (int c = 0; c < num_children; c++) {
+                const BinaryNode &child = binary_nodes[children[c]];
+                real area = half_area(child.lower, child.upper);
+                if (child.left != -1 && area > best_area) {
+                    best = c;
+                    best_area = area;
+                }
+            }
+            if (best == -1) {
+                break;
+            }
+            const BinaryNode &opened = binary_nodes[children[best]];
+            children[best] = opened.left;
+            children[num_children++] = opened.right;
+        }
+    }
+    Node node;
+    for (int c = 0; c < 4; c++) {
+        for (int d = 0; d < 3; d++) {
+            node.bounds[0][d][c] = std::numeric_limits<float>::infinity();
+            node.bounds[1][d][c] = -std::numeric_limits<float>::infinity();
+        }
+        node.children[c] = encode_leaf(0, 0);
+    }
+    for (int c = 0; c < num_children; c++) {
+        const BinaryNode &child = binary_nodes[children[c]];
+        for (int d = 0; d < 3; d++) {
+            node.bounds[0][d][c] = child.lower[d];
+            node.bounds[1][d][c] = child.upper[d];
+        }
+        node.children[c] = child.left == -1 ? encode_leaf(child.begin, child.count) : collapse(binary_nodes, children[c]);
+    }
+    nodes[index] = node;
+    return index;
+}
+
+void BVH::build_tree(int n) {
+    // The top of the tree is split sequentially, and subtrees below task_size are built in parallel
+    std::vector<BinaryNode> binary_nodes;
+    std::vector<BuildTask> tasks;
+    const int task_size = std::max(4096, n / (8 * num_threads));
+    build_binary(binary_nodes, 0, n, 0, num_threads > 1 ? &tasks : nullptr, task_size);
+    std::vector<std::vector<BinaryNode>> subtrees(tasks.size());
+    ThreadedTaskManager::run((int)tasks.size(), num_threads, [&](int t) {
+        build_binary(subtrees[t], tasks[t].begin, tasks[t].end, tasks[t].depth, nullptr, 0);
+    });
+    for (int t = 0; t < (int)tasks.size(); t++) {
+        // Subtree roots replace their placeholders, and other nodes are appended
+        const int offset = (int)binary_nodes.size() - 1;
+        for (int j = 0; j < (int)subtrees[t].size(); j++) {
+            BinaryNode node = subtrees[t][j];
+            if (node.left != -1) {
+                node.left += offset;
+                node.right += offset;
+            }
+            if (j == 0) {
+                binary_nodes[tasks[t].node] = node;
+            } else {
+                binary_nodes.push_back(node);
+            }
+        }
+    }
+
+    nodes.clear();
+    collapse(binary_nodes, 0);
+}
+
+void BVH::build(const std::vector<Vector3> &vertices, const std::vector<Vector3i> &indices) {
+    const int n = (int)indices.size();
+    assert_info(n < (1 << 27), "Too many triangles for BVH");
+    references.resize((size_t)n);
+    order.resize((size_t)n);
+    const int num_chunks = std::max(1, std::min(n, num_threads));
+    ThreadedTaskManager::run(num_chunks, num_threads, [&](int t) {
+        for (int i = t * n / num_chunks; i < (t + 1) * n / num_chunks; i++) {
+            const Vector3i &tri = indices[i];
+            references[i].lower = glm::min(vertices[tri[0]], glm::min(vertices[tri[1]], vertices[tri[2]]));
+            references[i].upper = glm::max(vertices[tri[0]], glm::max(vertices[tri[1]], vertices[tri[2]]));
+            order[i] = i;
+        }
+    });
+
+    build_tree(n);
+
+    leaf_triangles.resize((size_t)n);
+    ThreadedTaskManager::run(num_chunks, num_threads, [&](int t) {
+        for (int i = t * n / num_chunks; i < (t + 1) * n / num_chunks; i++) {
+            LeafTriangle &leaf_triangle = leaf_triangles[i];
+            for (int k = 0; k < 3; k++) {
+                leaf_triangle.v[k] = vertices[indices[order[i]][k]];
+            }
+            leaf_triangle.id = order[i];
+        }
+    });
+    references = std::vector<PrimitiveReference>();
+    order = std::vector<int>();
+}
+
+void BVH::refit(const std::vector<Vector3> &vertices, const std::vector<Vector3i> &indices) {
+    assert_info(indices.size() == leaf_triangles.size(), "BVH refit needs the triangles of the build");
+    const int n = (int)leaf_triangles.size();
+    const int num_chunks = std::max(1, std::min(n, num_threads));
+    ThreadedTaskManager::run(num_chunks, num_threads, [&](int t) {
+        for (int i = t * n / num_chunks; i < (t + 1) * n / num_chunks; i++) {
+            LeafTriangle &leaf_triangle = leaf_triangles[i];
+            for (int k = 0; k < 3; k++) {
+                leaf_triangle.v[k] = vertices[indices[leaf_triangle.id][k]];
+            }
+        }
+    });
+    // collapse() places children after their parents, so a backward sweep visits them first
+    for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+        Node &node = nodes[i];
+        for (int c = 0; c < 4; c++) {
+            Vector3 lower(std::numeric_limits<real>::infinity()), upper(-std::numeric_limits<real>::infinity());
+            const int child = node.children[c];
+            if (child >= 0) {
+                for (int d = 0; d < 3; d++) {
+                    for (int cc = 0; cc < 4; cc++) {
+                        lower[d] = std::min(lower[d], nodes[child].bounds[0][d][cc]);
+                        upper[d] = std::max(upper[d], nodes[child].bounds[1][d][cc]);
+                    }
+                }
+            } else {
+                const int first = (~child) >> 4, count = (~child) & 15;
+                for (int j = first; j < first + count; j++) {
+                    for (int k = 0; k < 3; k++) {
+                        lower = glm::min(lower, leaf_triangles[j].v[k]);
+                        upper = glm::max(upper, leaf_triangles[j].v[k]);
+                    }
+                }
+            }
+            for (int d = 0; d < 3; d++) {
+                node.bounds[0][d][c] = lower[d];
+                node.bounds[1][d][c] = upper[d];
+            }
+        }
+    }
+}
+
+void BVH::get_bounds(Vector3 &lower, Vector3 &upper) const {
+    lower = Vector3(std::numeric_limits<real>::infinity());
+    upper = Vector3(-std::numeric_limits<real>::infinity());
+    for (int c = 0; c < 4; c++) {
+        for (int d = 0; d < 3; d++) {
+            lower[d] = std::min(lower[d], nodes[0].bounds[0][d][c]);
+            upper[d] = std::max(upper[d], nodes[0].bounds[1][d][c]);
+        }
+    }
+}
+
+// Closest hit traversal. leaf(first, count, t_max) tests the primitives of a leaf, and
+// shortens t_max to the nearest hit
+template <typename Leaf>
+static void traverse_closest(const std::vector<BVH::Node> &nodes, const TraversalRay &r, real t_min, real &t_max,
+                             const Leaf &leaf) {
+    struct Entry {
+        int child;
+        real dist;
+    } stack[stack_size];
+    int top = 0;
+    stack[top++] = Entry{0, t_min};
+    while (top > 0) {
+        const Entry entry = stack[--top];
+        if (entry.dist >= t_max) {
+            continue;
+        }
+        if (entry.child < 0) {
+            leaf((~entry.child) >> 4, (~entry.child) & 15, t_max);
+            continue;
+        }
+        const BVH::Node &node = nodes[entry.child];
+        float dists[4];
+        int mask = intersect_boxes(node, r, t_min, t_max, dists);
+        // Push the nearest child last, so that it is visited first
+        Entry hits[4];
+        int num_hits = 0;
+        for (int c = 0; c < 4; c++) {
+            if (mask & (1 << c)) {
+                int k = num_hits++;
+                while (k > 0 && hits[k - 1].dist < dists[c]) {
+                    hits[k] = hits[k - 1];
+                    k--;
+                }
+                hits[k] = Entry{node.children[c], dists[c]};
+            }
+        }
+        for (int k = 0; k < num_hits; k++) {
+            stack[top++] = hits[k];
+        }
+    }
+}
+
+// Any hit traversal. leaf(first, count) tells whether a primitive of the leaf is hit
+template <typename Leaf>
+static bool traverse_any(const std::vector<BVH::Node> &nodes, const TraversalRay &r, real t_min, real t_max,
+                         const Leaf &leaf) {
+    int stack[stack_size];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const int child = stack[--top];
+        if (child < 0) {
+            if (leaf((~child) >> 4, (~child) & 15)) {
+                return true;
+            }
+            continue;
+        }
+        const BVH::Node &node = nodes[child];
+        float dists[4];
+        int mask = intersect_boxes(node, r, t_min, t_max, dists);
+        for (int c = 0; c < 4; c++) {
+            if (mask & (1 << c)) {
+                stack[top++] = node.children[c];
+            }
+        }
+    }
+    return false;
+}
+
+void BVH::intersect(Ray &ray, real t_min) const {
+    const TraversalRay r(ray);
+    real t_max = ray.dist, hit_u = 0, hit_v = 0;
+    int hit_id = -1;
+    traverse_closest(nodes, r, t_min, t_max, [&](int first, int count, real &dist) {
+        for (int i = first; i < first + count; i++) {
+            real t, u, v;
+            if (intersect_triangle(leaf_triangles[i].v, r, t_min, dist, t, u, v)) {
+                dist = t;
+                hit_u = u;
+                hit_v = v;
+                hit_id = leaf_triangles[i].id;
+            }
+        }
+    });
+    if (hit_id != -1) {
+        ray.dist = t_max;
+        ray.triangle_id = hit_id;
+        ray.u = hit_u;
+        ray.v = hit_v;
+    }
+}
+
+bool BVH::occluded(const Ray &ray, real t_min) const {
+    const TraversalRay r(ray);
+    return traverse_any(nodes, r, t_min, ray.dist, [&](int first, int count) {
+        for (int i = first; i < first + count; i++) {
+            real t, u, v;
+            if (intersect_triangle(leaf_triangles[i].v, r, t_min, ray.dist, t, u, v)) {
+                return true;
+            }
+        }
+        return false;
+    });
+}
+
+void InstanceBVH::build(const std::vector<BVH> &prototypes, const std::vector<Instance> &instances) {
+    const int n = (int)instances.size();
+    assert_info(n < (1 << 27), "Too many instances for BVH");
+    references.resize((size_t)n);
+    order.resize((size_t)n);
+    for (int i = 0; i < n; i++) {
+        // World space box of the transformed corners of the prototype box
+        Vector3 bounds[2];
+        if (prototypes[instances[i].id].get_num_triangles() > 0) {
+            prototypes[instances[i].id].get_bounds(bounds[0], bounds[1]);
+        } else {
+            bounds[0] = bounds[1] = Vector3(0.0f);
+        }
+        references[i].lower = Vector3(std::numeric_limits<real>::infinity());
+        references[i].upper = Vector3(-std::numeric_limits<real>::infinity());
+        for (int k = 0; k < 8; k++) {
+            const Vector3 corner(bounds[k & 1].x, bounds[(k >> 1) & 1].y, bounds[k >> 2].z);
+            const Vector3 p = multiply_matrix4(instances[i].transform, corner, 1.0f);
+            references[i].lower = glm::min(references[i].lower, p);
+            references[i].upper = glm::max(references[i].upper, p);
+        }
+        order[i] = i;
+    }
+
+    build_tree(n);
+
+    leaf_instances.resize((size_t)n);
+    for (int i = 0; i < n; i++) {
+        const Instance &instance = instances[order[i]];
+        leaf_instances[i].inverse_transform = glm::inverse(instance.transform);
+        leaf_instances[i].bvh = &prototypes[instance.id];
+        leaf_instances[i].id = order[i];
+    }
+    references = std::vector<PrimitiveReference>();
+    order = std::vector<int>();
+}
+
+void InstanceBVH::intersect(Ray &ray, real t_min) const {
+    const TraversalRay r(ray);
+    real t_max = ray.dist;
+    traverse_closest(nodes, r, t_min, t_max, [&](int first, int count, real &dist) {
+        for (int i = first; i < first + count; i++) {
+            Ray local = ray.get_transformed(leaf_instances[i].inverse_transform);
+            local.dist = dist;
+            leaf_instances[i].bvh->intersect(local, t_min);
+            if (local.triangle_id != -1) {
+                dist = local.dist;
+                ray.dist = local.dist;
+                ray.triangle_id = local.triangle_id;
+                ray.instance_id = leaf_instances[i].id;
+                ray.u = local.u;
+                ray.v = local.v;
+            }
+        }
+    });
+}
+
+bool InstanceBVH::occluded(const Ray &ray, real t_min) const {
+    const TraversalRay r(ray);
+    return traverse_any(nodes, r, t_min, ray.dist, [&](int first, int count) {
+        for (int i = first; i < first + count; i++) {
+            if (leaf_instances[i].bvh->occluded(ray.get_transformed(leaf_instances[i].inverse_transform), t_min)) {
+                return true;
+            }
+        }
+        return false;
+    });
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,135 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/math/linalg.h>
+#include <taichi/geometry/primitives.h>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Bounding volume hierarchy over triangles, for ray queries without Embree.
+// The tree is built top-down with binned SAH (subtrees in parallel), and collapsed
+// into a 4-wide tree whose nodes store the boxes of their children as SoA, so that
+// one node is tested against a ray with a few SSE instructions.
+// Triangles are intersected with the watertight test of Woop et al. [2013], so rays
+// do not leak through shared edges and vertices.
+class BVH {
+public:
+    // Children: >= 0 for inner nodes, and ~((first << 4) | count) for leaves.
+    // Empty slots are empty leaves with inverted boxes.
+    struct Node {
+        // bounds[0] is the lower corner and bounds[1] the upper one, per axis and child
+        alignas(16) float bounds[2][3][4];
+        int children[4];
+    };
+
+    static const int max_leaf_size = 15;
+
+protected:
+    struct LeafTriangle {
+        Vector3 v[3];
+        int id;
+    };
+
+    struct PrimitiveReference {
+        Vector3 lower, upper;
+    };
+
+    struct BinaryNode {
+        Vector3 lower, upper;
+        // Leaves have left == -1 and triangles order[begin, begin + count)
+        int left, right;
+        int begin, count;
+    };
+
+    struct BuildTask {
+        int node, begin, end, depth;
+    };
+
+    int num_threads;
+    int leaf_size;
+    std::vector<Node> nodes;
+    std::vector<LeafTriangle> leaf_triangles;
+    // Scratch for build()
+    std::vector<PrimitiveReference> references;
+    std::vector<int> order;
+
+    int build_binary(std::vector<BinaryNode> &binary_nodes, int begin, int end, int depth,
+                     std::vector<BuildTask> *tasks, int task_size);
+
+    int collapse(const std::vector<BinaryNode> &binary_nodes, int b);
+
+    // Builds nodes over references[0 .. n), and leaves their order in `order`
+    void build_tree(int n);
+
+public:
+    BVH(int num_threads = 1, int leaf_size = 4);
+
+    // Triangle i has vertices vertices[indices[i][0..2]], and is reported as triangle_id = i
+    void build(const std::vector<Vector3> &vertices, const std::vector<Vector3i> &indices);
+
+    // Moves the triangles of the last build() to new vertex positions (same indices), and updates
+    // the boxes without changing the tree. Much faster than build(), but the tree gets worse as
+    // triangles move away from where they were built.
+    void refit(const std::vector<Vector3> &vertices, const std::vector<Vector3i> &indices);
+
+    // Closest hit in (t_min, ray.dist). Updates dist, triangle_id, u and v of ray on a hit.
+    void intersect(Ray &ray, real t_min) const;
+
+    // Whether anything is hit in (t_min, ray.dist)
+    bool occluded(const Ray &ray, real t_min) const;
+
+    // Box of everything in the tree. The tree must not be empty.
+    void get_bounds(Vector3 &lower, Vector3 &upper) const;
+
+    int get_num_nodes() const {
+        return (int)nodes.size();
+    }
+
+    int get_num_triangles() const {
+        return (int)leaf_triangles.size();
+    }
+};
+
+// Two-level hierarchy for instancing: a BVH over the world space boxes of instances, whose
+// leaves refer to the BVHs of their geometry in object space. Rays are transformed into
+// object space at the instances, so memory and build time scale with the unique geometry
+// rather than with the number of copies.
+class InstanceBVH : public BVH {
+protected:
+    struct LeafInstance {
+        Matrix4 inverse_transform;
+        const BVH *bvh;
+        int id;
+    };
+
+    std::vector<LeafInstance> leaf_instances;
+
+public:
+    InstanceBVH(int num_threads = 1) : BVH(num_threads, 1) {
+    }
+
+    // Instance i places prototypes[instances[i].id], which must outlive the hierarchy
+    void build(const std::vector<BVH> &prototypes, const std::vector<Instance> &instances);
+
+    // Closest hit in (t_min, ray.dist). On a hit, also sets instance_id to the index of the
+    // instance, and triangle_id is the one in its prototype.
+    void intersect(Ray &ray, real t_min) const;
+
+    bool occluded(const Ray &ray, real t_min) const;
+
+    int get_num_instances() const {
+        return (int)leaf_instances.size();
+    }
+};
+
+TC_NAMESPACE_END
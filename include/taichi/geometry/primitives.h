@@ -21,15 +21,26 @@ public:
     Ray(Vector3 orig, Vector3 dir, real time = 0) : orig(orig),
         dir(dir), dist(DIST_INFINITE), time(time) {
         triangle_id = -1;
+        instance_id = -1;
     }
 
     Vector3 at(real d) const {
         return orig + d * dir;
     }
 
+    // The ray mapped by transform, with the same dist. The direction is not normalized,
+    // so that distances along both rays agree.
+    Ray get_transformed(const Matrix4 &transform) const {
+        Ray ray(multiply_matrix4(transform, orig, 1.0f), multiply_matrix4(transform, dir, 0.0f), time);
+        ray.dist = dist;
+        return ray;
+    }
+
     Vector3 orig, dir;
     real time, dist;
     int triangle_id;
+    // Instance hit (see RayIntersection::add_instance), or -1 for non-instanced triangles
+    int instance_id;
     Vector3 geometry_normal;
     real u, v;
 
@@ -40,12 +51,15 @@ struct Face {
     Face() { }
 
     Face(int v0, int v1, int v2) {
-        vert_ind[0] = v0;
-        vert_ind[1] = v1;
-        vert_ind[2] = v2;
+        vert_ind[0] = normal_ind[0] = uv_ind[0] = v0;
+        vert_ind[1] = normal_ind[1] = uv_ind[1] = v1;
+        vert_ind[2] = normal_ind[2] = uv_ind[2] = v2;
     }
 
+    // Positions, normals and uvs are indexed separately, as in OBJ files
     int vert_ind[3];
+    int normal_ind[3];
+    int uv_ind[3];
     int material;
 };
 
@@ -175,7 +189,8 @@ public:
     Vector3 upper_boundary;
 };
 
-class Instance {
+// A placement of shared geometry: object space positions of geometry `id` are mapped by `transform`
+struct Instance {
     Matrix4 transform;
     int id;
 };
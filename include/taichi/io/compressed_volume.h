@@ -0,0 +1,125 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/math/linalg.h>
+#include <taichi/math/array_3d.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Sparse scalar volume frames (".tcv"), for density and temperature output.
+// The volume is split into brick_size^3 bricks, and bricks with no value above
+// `threshold` are not stored (they read as zero). Stored bricks are quantized to
+// 8 or 16 bits between their own minimum and maximum, then predicted along z
+// and bit packed per row, which is lossless on the quantized values. File layout:
+//   header | brick payloads | brick table (at header.table_offset)
+// so frames are written in one pass, one brick in memory at a time.
+class CompressedVolume {
+public:
+    static const int brick_size = 8;
+    static const int brick_cells = brick_size * brick_size * brick_size;
+
+    struct Header {
+        char magic[4];
+        int version;
+        int res[3];
+        int bits;
+        int num_bricks;
+        float maximum;
+        int64 table_offset;
+    };
+
+    struct BrickEntry {
+        // Linear index in the brick grid, (bx * brick_res.y + by) * brick_res.z + bz
+        int brick;
+        float minimum, scale;
+        int size;
+        int64 offset;
+    };
+
+    // Writes f(i, j, k) for all voxels of a volume of resolution res.
+    // If given, f is only evaluated in bricks for which is_brick_active(brick coordinate)
+    // holds; the other bricks are not stored (e.g. inactive tiles of a sparse grid).
+    static void write(const std::string &fn, const Vector3i &res, const std::function<real(int, int, int)> &f,
+                      int bits = 8, real threshold = 0.0f,
+                      const std::function<bool(const Vector3i &)> &is_brick_active = nullptr);
+
+    static void write(const std::string &fn, const Array3D<real> &volume, int bits = 8, real threshold = 0.0f);
+
+protected:
+    Vector3i res, brick_res;
+    Header header;
+    // The mapped file (or a copy of it where mmap is unavailable)
+    const unsigned char *data = nullptr;
+    size_t data_size = 0;
+    std::vector<unsigned char> file_copy;
+    // Per brick of the brick grid: index into `entries`, or -1 if empty
+    std::vector<int> brick_to_entry;
+    std::vector<BrickEntry> entries;
+    // Bricks are decoded on first access, so a render only decodes what it touches
+    mutable std::unique_ptr<std::once_flag[]> decoded_flags;
+    mutable std::vector<std::vector<real>> decoded;
+    mutable std::atomic<int> num_decoded_bricks;
+
+    const real *get_brick(int entry) const;
+
+    void close();
+
+public:
+    CompressedVolume() : num_decoded_bricks(0) {}
+
+    CompressedVolume(const std::string &fn) : num_decoded_bricks(0) {
+        open(fn);
+    }
+
+    CompressedVolume(const CompressedVolume &) = delete;
+
+    CompressedVolume &operator=(const CompressedVolume &) = delete;
+
+    ~CompressedVolume() {
+        close();
+    }
+
+    void open(const std::string &fn);
+
+    Vector3i get_res() const {
+        return res;
+    }
+
+    real get_maximum() const {
+        return header.maximum;
+    }
+
+    int get_num_bricks() const {
+        return (int)entries.size();
+    }
+
+    int get_num_decoded_bricks() const {
+        return num_decoded_bricks;
+    }
+
+    real get(int i, int j, int k) const;
+
+    // Trilinear interpolation in voxel units, as Array3D::sample with storage offset 0.5
+    real sample(const Vector3 &pos) const;
+
+    real sample_relative_coord(const Vector3 &pos) const {
+        return sample(pos * Vector3(res));
+    }
+};
+
+TC_NAMESPACE_END
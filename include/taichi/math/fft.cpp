@@ -0,0 +1,218 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "fft.h"
+
+TC_NAMESPACE_BEGIN
+
+static const double fft_pi = 3.14159265358979323846;
+
+// Per-thread scratch buffers, so that transforms can be shared between threads.
+// Slots: 0 - mixed radix input copy, 1 - real transforms, 2 - Bluestein convolution
+static std::vector<FFT1D::Complex> &get_scratch(int slot, int size) {
+    thread_local std::vector<FFT1D::Complex> scratch[3];
+    if ((int)scratch[slot].size() < size) {
+        scratch[slot].resize((size_t)size);
+    }
+    return scratch[slot];
+}
+
+const int FFT1D::max_radix;
+
+void FFT1D::initialize(int n) {
+    assert_info(n >= 1, "FFT size must be positive");
+    this->n = n;
+    factors.clear();
+    int remaining = n;
+    for (int p = 2; p * p <= remaining; p++) {
+        while (remaining % p == 0) {
+            factors.push_back(p);
+            remaining /= p;
+        }
+    }
+    if (remaining > 1) {
+        factors.push_back(remaining);
+    }
+    chirp.clear();
+    kernel.clear();
+    convolution = nullptr;
+    if (!factors.empty() && factors.back() > max_radix) {
+        // Bluestein: jk = (j^2 + k^2 - (k - j)^2) / 2
+        int m = 1;
+        while (m < 2 * n - 1) {
+            m *= 2;
+        }
+        convolution = std::make_shared<FFT1D>(m);
+        chirp.resize((size_t)n);
+        for (int k = 0; k < n; k++) {
+            // k^2 mod 2n keeps the angle accurate for large k
+            int64 k2 = (int64)k * k % (2 * n);
+            chirp[k] = std::polar(1.0, -fft_pi * k2 / n);
+        }
+        kernel.assign((size_t)m, Complex(0));
+        kernel[0] = std::conj(chirp[0]);
+        for (int k = 1; k < n; k++) {
+            kernel[k] = kernel[m - k] = std::conj(chirp[k]);
+        }
+        convolution->forward(&kernel[0]);
+        roots.clear();
+        inverse_roots.clear();
+    } else {
+        roots.resize((size_t)n);
+        inverse_roots.resize((size_t)n);
+        for (int j = 0; j < n; j++) {
+            roots[j] = std::polar(1.0, -2 * fft_pi * j / n);
+            inverse_roots[j] = std::conj(roots[j]);
+        }
+    }
+}
+
+// Decimation in time: the sub-transforms of in[r::p] are written to out[r * m .. r * m + m)
+// and then combined with radix-p butterflies.
+void FFT1D::mixed_radix(const Complex *in, int stride, Complex *out, int len, int factor, bool inverse) const {
+    if (len == 1) {
+        out[0] = in[0];
+        return;
+    }
+    const int p = factors[factor], m = len / p;
+    if (len == 2) {
+        out[0] = in[0] + in[stride];
+        out[1] = in[0] - in[stride];
+        return;
+    }
+    for (int r = 0; r < p; r++) {
+        mixed_radix(in + r * stride, stride * p, out + r * m, m, factor + 1, inverse);
+    }
+    const int step = n / len;
+    const Complex *roots = inverse ? &inverse_roots[0] : &this->roots[0];
+    auto root = [&](int e) -> Complex {
+        return roots[e * step];
+    };
+    if (p == 2) {
+        for (int k = 0; k < m; k++) {
+            Complex a = out[k], b = out[k + m] * roots[k * step];
+            out[k] = a + b;
+            out[k + m] = a - b;
+        }
+    } else {
+        Complex tmp[max_radix];
+        for (int k = 0; k < m; k++) {
+            for (int q = 0; q < p; q++) {
+                Complex sum = out[k];
+                for (int r = 1; r < p; r++) {
+                    sum += out[r * m + k] * root((int)((int64)r * (k + q * m) % len));
+                }
+                tmp[q] = sum;
+            }
+            for (int q = 0; q < p; q++) {
+                out[k + q * m] = tmp[q];
+            }
+        }
+    }
+}
+
+void FFT1D::transform(Complex *data, bool inverse) const {
+    if (convolution) {
+        const int m = convolution->get_size();
+        auto &a = get_scratch(2, m);
+        for (int k = 0; k < n; k++) {
+            a[k] = (inverse ? std::conj(data[k]) : data[k]) * chirp[k];
+        }
+        std::fill(a.begin() + n, a.begin() + m, Complex(0));
+        convolution->forward(&a[0]);
+        for (int k = 0; k < m; k++) {
+            a[k] *= kernel[k];
+        }
+        convolution->inverse(&a[0]);
+        const double inv_m = 1.0 / m;
+        for (int k = 0; k < n; k++) {
+            Complex x = a[k] * chirp[k] * inv_m;
+            data[k] = inverse ? std::conj(x) : x;
+        }
+        return;
+    }
+    auto &in = get_scratch(0, n);
+    std::copy(data, data + n, in.begin());
+    mixed_radix(&in[0], 1, data, n, 0, inverse);
+}
+
+void RealTrigonometricTransform1D::initialize(Type type, int n) {
+    this->type = type;
+    this->n = n;
+    if (type == DCT_II) {
+        fft.initialize(n);
+        phases.resize((size_t)n);
+        for (int k = 0; k < n; k++) {
+            phases[k] = std::polar(1.0, -fft_pi * k / (2 * n));
+        }
+    } else {
+        fft.initialize(2 * n + 2);
+    }
+}
+
+double RealTrigonometricTransform1D::get_eigenvalue(int k) const {
+    if (type == DCT_II) {
+        return 2 - 2 * std::cos(fft_pi * k / n);
+    } else {
+        return 2 - 2 * std::cos(fft_pi * (k + 1) / (n + 1));
+    }
+}
+
+void RealTrigonometricTransform1D::forward(double *data) const {
+    auto &y = get_scratch(1, fft.get_size());
+    if (type == DCT_II) {
+        // v = [x0, x2, x4, ..., x5, x3, x1], X[k] = Re(exp(-i pi k / 2n) V[k])
+        for (int j = 0; 2 * j < n; j++) {
+            y[j] = data[2 * j];
+        }
+        for (int j = 0; 2 * j + 1 < n; j++) {
+            y[n - 1 - j] = data[2 * j + 1];
+        }
+        fft.forward(&y[0]);
+        for (int k = 0; k < n; k++) {
+            data[k] = (y[k] * phases[k]).real();
+        }
+    } else {
+        // Odd extension [0, x, 0, -reverse(x)]: Y[k + 1] = -2i X[k]
+        y[0] = y[n + 1] = 0;
+        for (int j = 0; j < n; j++) {
+            y[j + 1] = data[j];
+            y[2 * n + 1 - j] = -data[j];
+        }
+        fft.forward(&y[0]);
+        for (int k = 0; k < n; k++) {
+            data[k] = -0.5 * y[k + 1].imag();
+        }
+    }
+}
+
+void RealTrigonometricTransform1D::inverse(double *data) const {
+    if (type == DCT_II) {
+        // V[k] = exp(i pi k / 2n) (X[k] - i X[n - k]), with X[n] = 0; v = IDFT(V) / n
+        auto &y = get_scratch(1, fft.get_size());
+        for (int k = 0; k < n; k++) {
+            y[k] = std::conj(phases[k]) * FFT1D::Complex(data[k], k == 0 ? 0.0 : -data[n - k]);
+        }
+        fft.inverse(&y[0]);
+        for (int j = 0; 2 * j < n; j++) {
+            data[2 * j] = y[j].real() / n;
+        }
+        for (int j = 0; 2 * j + 1 < n; j++) {
+            data[2 * j + 1] = y[n - 1 - j].real() / n;
+        }
+    } else {
+        // DST-I is its own inverse, up to a factor of 2 / (n + 1)
+        forward(data);
+        for (int j = 0; j < n; j++) {
+            data[j] *= 2.0 / (n + 1);
+        }
+    }
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,104 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <complex>
+#include <vector>
+#include <memory>
+
+TC_NAMESPACE_BEGIN
+
+// Unnormalized 1D discrete Fourier transform of any size:
+//   forward: X[k] = sum_j x[j] exp(-2 pi i jk / n)
+//   inverse: x[j] = sum_k X[k] exp(+2 pi i jk / n)   (no 1 / n factor)
+// Sizes are factorized and transformed with a recursive mixed-radix FFT.
+// Sizes with a prime factor above max_radix are mapped to a power-of-two
+// convolution with Bluestein's algorithm, so all sizes are O(n log n).
+// The transform object is immutable after initialize() and can be shared by threads.
+class FFT1D {
+public:
+    typedef std::complex<double> Complex;
+    static const int max_radix = 64;
+
+protected:
+    int n = 0;
+    std::vector<int> factors;
+    // roots[j] = exp(-2 pi i j / n), and their conjugates
+    std::vector<Complex> roots, inverse_roots;
+    // Bluestein chirp, the transformed convolution kernel, and the power-of-two transform
+    std::vector<Complex> chirp, kernel;
+    std::shared_ptr<FFT1D> convolution;
+
+    void mixed_radix(const Complex *in, int stride, Complex *out, int len, int factor, bool inverse) const;
+
+    void transform(Complex *data, bool inverse) const;
+
+public:
+    FFT1D() {}
+
+    FFT1D(int n) {
+        initialize(n);
+    }
+
+    void initialize(int n);
+
+    int get_size() const {
+        return n;
+    }
+
+    void forward(Complex *data) const {
+        transform(data, false);
+    }
+
+    void inverse(Complex *data) const {
+        transform(data, true);
+    }
+};
+
+// Real-to-real trigonometric transforms built on FFT1D, which diagonalize the
+// 1D cell-centered Laplacian [-1 2 -1] with different boundary conditions:
+//   DCT_II (Neumann, ghost cells mirror the boundary cells):
+//     X[k] = sum_j x[j] cos(pi k (j + 1/2) / n),           eigenvalue 2 - 2 cos(pi k / n)
+//   DST_I (Dirichlet, ghost cells are zero):
+//     X[k] = sum_j x[j] sin(pi (k + 1) (j + 1) / (n + 1)), eigenvalue 2 - 2 cos(pi (k + 1) / (n + 1))
+// DCT_II uses an n-point FFT of a permutation of x (Makhoul), DST_I an FFT of the
+// odd extension of x. inverse() is the exact inverse of forward().
+class RealTrigonometricTransform1D {
+public:
+    enum Type {
+        DCT_II, DST_I
+    };
+
+protected:
+    Type type;
+    int n = 0;
+    FFT1D fft;
+    // exp(-i pi k / 2n), for DCT_II
+    std::vector<FFT1D::Complex> phases;
+
+public:
+    RealTrigonometricTransform1D() {}
+
+    RealTrigonometricTransform1D(Type type, int n) {
+        initialize(type, n);
+    }
+
+    void initialize(Type type, int n);
+
+    // Eigenvalue of [-1 2 -1] for mode k
+    double get_eigenvalue(int k) const;
+
+    void forward(double *data) const;
+
+    void inverse(double *data) const;
+};
+
+TC_NAMESPACE_END
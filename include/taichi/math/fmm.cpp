@@ -0,0 +1,404 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "fmm.h"
+#include <taichi/system/threading.h>
+#include <algorithm>
+#include <cmath>
+
+TC_NAMESPACE_BEGIN
+
+// Morton codes take 3 bits per level
+static const int fmm_levels = 21;
+
+FastMultipoleSummation::FastMultipoleSummation(int order, real theta, int leaf_size, real softening,
+                                               int num_threads)
+        : order(order), theta(theta), leaf_size(leaf_size), softening(softening), num_threads(num_threads) {
+    // The field is the gradient of the local expansion, which needs degree 1
+    assert_info(1 <= order && order <= 12, "FMM order should be in [1, 12]");
+    assert_info(leaf_size >= 1, "FMM leaf size should be positive");
+    for (int d = 0; d <= order; d++) {
+        for (int x = d; x >= 0; x--) {
+            for (int y = d - x; y >= 0; y--) {
+                multi_indices.push_back(Vector3i(x, y, d - x - y));
+                degrees.push_back(d);
+            }
+        }
+    }
+    num_coefficients = (int)multi_indices.size();
+    for (int i = 0; i < 3; i++) {
+        raised[i].resize((size_t)num_coefficients);
+    }
+    recurrences.resize((size_t)num_coefficients);
+    for (int c = 0; c < num_coefficients; c++) {
+        const Vector3i n = multi_indices[c];
+        for (int i = 0; i < 3; i++) {
+            Vector3i r = n;
+            r[i]++;
+            raised[i][c] = degrees[c] < order ? get_coefficient_index(r) : -1;
+        }
+        if (c == 0) {
+            continue;
+        }
+        Recurrence &rec = recurrences[c];
+        rec.axis = n[0] > 0 ? 0 : (n[1] > 0 ? 1 : 2);
+        Vector3i m = n;
+        m[rec.axis]--;
+        rec.lower = get_coefficient_index(m);
+        Vector3i mm = m;
+        mm[rec.axis]--;
+        rec.lower_lower = m[rec.axis] > 0 ? get_coefficient_index(mm) : -1;
+        for (int j = 0; j < 3; j++) {
+            Vector3i q = m;
+            q[j]--;
+            q[rec.axis]++;
+            rec.cross[j] = m[j] > 0 ? get_coefficient_index(q) : -1;
+            q[j]--;
+            rec.cross2[j] = m[j] > 1 ? get_coefficient_index(q) : -1;
+        }
+    }
+    for (int n = 0; n < num_coefficients; n++) {
+        for (int k = 0; k < num_coefficients; k++) {
+            const Vector3i a = multi_indices[n], b = multi_indices[k];
+            if (a[0] >= b[0] && a[1] >= b[1] && a[2] >= b[2]) {
+                shift_terms.push_back(Term{k, get_coefficient_index(a - b), n});
+            }
+            if (degrees[n] + degrees[k] <= order) {
+                m2l_terms.push_back(Term{k, n, get_coefficient_index(a + b)});
+            }
+        }
+    }
+}
+
+int FastMultipoleSummation::get_coefficient_index(const Vector3i &n) const {
+    // Degrees are contiguous, and within a degree d, n.x decreases, then n.y
+    const int d = n[0] + n[1] + n[2];
+    const int lower = d * (d + 1) * (d + 2) / 6;
+    const int x_offset = (d - n[0]) * (d - n[0] + 1) / 2;
+    return lower + x_offset + (d - n[0] - n[1]);
+}
+
+void FastMultipoleSummation::compute_monomials(const Vector3 &x, double *monomials) const {
+    monomials[0] = 1;
+    for (int c = 1; c < num_coefficients; c++) {
+        const Recurrence &rec = recurrences[c];
+        monomials[c] = monomials[rec.lower] * x[rec.axis] / multi_indices[c][rec.axis];
+    }
+}
+
+void FastMultipoleSummation::compute_derivatives(const Vector3 &x, double *derivatives) const {
+    // From (|x|^2 + softening) d_i phi = -x_i phi, differentiated by m:
+    //   D_{m+e_i} = -(x_i D_m + m_i D_{m-e_i} + sum_j 2 m_j x_j D_{m-e_j+e_i}
+    //                 + m_j (m_j - 1) D_{m-2e_j+e_i}) / (|x|^2 + softening)
+    const double xs[3] = {x[0], x[1], x[2]};
+    const double inv_r2 = 1.0 / (xs[0] * xs[0] + xs[1] * xs[1] + xs[2] * xs[2] + softening);
+    derivatives[0] = std::sqrt(inv_r2);
+    for (int c = 1; c < num_coefficients; c++) {
+        const Recurrence &rec = recurrences[c];
+        const Vector3i m = multi_indices[rec.lower];
+        double sum = xs[rec.axis] * derivatives[rec.lower];
+        if (rec.lower_lower != -1) {
+            sum += m[rec.axis] * derivatives[rec.lower_lower];
+        }
+        for (int j = 0; j < 3; j++) {
+            if (rec.cross[j] != -1) {
+                sum += 2.0 * m[j] * xs[j] * derivatives[rec.cross[j]];
+            }
+            if (rec.cross2[j] != -1) {
+                sum += m[j] * (m[j] - 1.0) * derivatives[rec.cross2[j]];
+            }
+        }
+        derivatives[c] = -sum * inv_r2;
+    }
+}
+
+void FastMultipoleSummation::build(int t, const std::vector<uint64> &codes, int begin, int end) {
+    nodes[t].begin = begin;
+    nodes[t].end = end;
+    nodes[t].num_children = 0;
+    nodes[t].child_begin = 0;
+    // Bodies sharing a finest cell can not be split further
+    if (end - begin <= leaf_size || codes[begin] == codes[end - 1]) {
+        return;
+    }
+    // Split at the highest octree level where the codes in the range differ
+    const uint64 difference = codes[begin] ^ codes[end - 1];
+    int highest_bit = 63;
+    while (!((difference >> highest_bit) & 1)) {
+        highest_bit--;
+    }
+    const int shift = highest_bit / 3 * 3;
+    int boundaries[9];
+    int num_children = 0;
+    boundaries[0] = begin;
+    while (boundaries[num_children] < end) {
+        const uint64 prefix = codes[boundaries[num_children]] >> shift;
+        boundaries[num_children + 1] = (int)(std::upper_bound(codes.begin() + boundaries[num_children],
+                                                              codes.begin() + end, prefix,
+                                                              [shift](uint64 p, uint64 code) {
+                                                                  return p < (code >> shift);
+                                                              }) - codes.begin());
+        num_children++;
+    }
+    const int child_begin = (int)nodes.size();
+    nodes.resize(nodes.size() + num_children);
+    nodes[t].child_begin = child_begin;
+    nodes[t].num_children = num_children;
+    for (int c = 0; c < num_children; c++) {
+        build(child_begin + c, codes, boundaries[c], boundaries[c + 1]);
+    }
+}
+
+void FastMultipoleSummation::summarize(int t) {
+    Node &node = nodes[t];
+    double *multipole = &multipoles[(size_t)t * num_coefficients];
+    std::fill(multipole, multipole + num_coefficients, 0.0);
+    thread_local std::vector<double> monomials;
+    monomials.resize((size_t)num_coefficients);
+    if (node.is_leaf()) {
+        // P2M about the center of mass (the geometric center for massless leaves)
+        double mass = 0;
+        double center[3] = {0, 0, 0}, lower[3] = {1e30, 1e30, 1e30}, upper[3] = {-1e30, -1e30, -1e30};
+        for (int i = node.begin; i < node.end; i++) {
+            mass += sorted_masses[i];
+            for (int d = 0; d < 3; d++) {
+                center[d] += sorted_masses[i] * sorted_positions[i][d];
+                lower[d] = std::min(lower[d], (double)sorted_positions[i][d]);
+                upper[d] = std::max(upper[d], (double)sorted_positions[i][d]);
+            }
+        }
+        for (int d = 0; d < 3; d++) {
+            node.center[d] = (real)(mass > 0 ? center[d] / mass : 0.5 * (lower[d] + upper[d]));
+        }
+        node.mass = (real)mass;
+        real radius2 = 0;
+        for (int i = node.begin; i < node.end; i++) {
+            const Vector3 d = sorted_positions[i] - node.center;
+            radius2 = std::max(radius2, dot(d, d));
+            compute_monomials(d, &monomials[0]);
+            for (int c = 0; c < num_coefficients; c++) {
+                multipole[c] += sorted_masses[i] * monomials[c];
+            }
+        }
+        node.radius = std::sqrt(radius2);
+        return;
+    }
+    // M2M from the children
+    double mass = 0;
+    double center[3] = {0, 0, 0};
+    for (int ch = node.child_begin; ch < node.child_begin + node.num_children; ch++) {
+        mass += nodes[ch].mass;
+        for (int d = 0; d < 3; d++) {
+            center[d] += (double)nodes[ch].mass * nodes[ch].center[d];
+        }
+    }
+    for (int d = 0; d < 3; d++) {
+        node.center[d] = (real)(mass > 0 ? center[d] / mass : nodes[node.child_begin].center[d]);
+    }
+    node.mass = (real)mass;
+    node.radius = 0;
+    for (int ch = node.child_begin; ch < node.child_begin + node.num_children; ch++) {
+        const Vector3 s = nodes[ch].center - node.center;
+        node.radius = std::max(node.radius, length(s) + nodes[ch].radius);
+        compute_monomials(s, &monomials[0]);
+        const double *child_multipole = &multipoles[(size_t)ch * num_coefficients];
+        for (auto &term : shift_terms) {
+            multipole[term.c] += monomials[term.b] * child_multipole[term.a];
+        }
+    }
+}
+
+void FastMultipoleSummation::upward(int t) {
+    for (int ch = nodes[t].child_begin; ch < nodes[t].child_begin + nodes[t].num_children; ch++) {
+        upward(ch);
+    }
+    summarize(t);
+}
+
+void FastMultipoleSummation::interact(int a, int b) {
+    const Node &A = nodes[a], &B = nodes[b];
+    const Vector3 d = A.center - B.center;
+    const real r = A.radius + B.radius;
+    if (a != b && r * r < theta * theta * dot(d, d)) {
+        // M2L
+        thread_local std::vector<double> derivatives;
+        derivatives.resize((size_t)num_coefficients);
+        compute_derivatives(d, &derivatives[0]);
+        double *local = &locals[(size_t)a * num_coefficients];
+        const double *multipole = &multipoles[(size_t)b * num_coefficients];
+        for (auto &term : m2l_terms) {
+            const double m = degrees[term.b] % 2 == 0 ? multipole[term.b] : -multipole[term.b];
+            local[term.a] += m * derivatives[term.c];
+        }
+        return;
+    }
+    if (A.is_leaf() && B.is_leaf()) {
+        // P2P
+        for (int i = A.begin; i < A.end; i++) {
+            const Vector3 p = sorted_positions[i];
+            Vector3 sum(0.0f);
+            for (int j = B.begin; j < B.end; j++) {
+                const Vector3 e = p - sorted_positions[j];
+                const real dist2 = dot(e, e) + softening;
+                if (dist2 > 0) {
+                    sum += e * (sorted_masses[j] / (dist2 * std::sqrt(dist2)));
+                }
+            }
+            sorted_field[i] += sum;
+        }
+        return;
+    }
+    // Split the larger node, or the one that is not a leaf
+    if (B.is_leaf() || (!A.is_leaf() && A.radius >= B.radius)) {
+        for (int ch = A.child_begin; ch < A.child_begin + A.num_children; ch++) {
+            interact(ch, b);
+        }
+    } else {
+        for (int ch = B.child_begin; ch < B.child_begin + B.num_children; ch++) {
+            interact(a, ch);
+        }
+    }
+}
+
+void FastMultipoleSummation::downward(int t) {
+    const Node &node = nodes[t];
+    const double *local = &locals[(size_t)t * num_coefficients];
+    thread_local std::vector<double> monomials;
+    monomials.resize((size_t)num_coefficients);
+    if (node.is_leaf()) {
+        // L2P: the field is minus the gradient of the local expansion
+        for (int i = node.begin; i < node.end; i++) {
+            compute_monomials(sorted_positions[i] - node.center, &monomials[0]);
+            double field[3] = {0, 0, 0};
+            for (int c = 0; c < num_coefficients; c++) {
+                for (int d = 0; d < 3; d++) {
+                    if (raised[d][c] != -1) {
+                        field[d] -= monomials[c] * local[raised[d][c]];
+                    }
+                }
+            }
+            sorted_field[i] += Vector3((real)field[0], (real)field[1], (real)field[2]);
+        }
+        return;
+    }
+    for (int ch = node.child_begin; ch < node.child_begin + node.num_children; ch++) {
+        // L2L
+        compute_monomials(nodes[ch].center - node.center, &monomials[0]);
+        double *child_local = &locals[(size_t)ch * num_coefficients];
+        for (auto &term : shift_terms) {
+            child_local[term.a] += monomials[term.b] * local[term.c];
+        }
+        downward(ch);
+    }
+}
+
+void FastMultipoleSummation::evaluate(const std::vector<Vector3> &positions, const std::vector<real> &masses,
+                                      std::vector<Vector3> &field) {
+    const int n = (int)positions.size();
+    field.assign((size_t)n, Vector3(0.0f));
+    if (n == 0) {
+        return;
+    }
+    Vector3 lower = positions[0], upper = positions[0];
+    for (auto &p : positions) {
+        for (int d = 0; d < 3; d++) {
+            lower[d] = std::min(lower[d], p[d]);
+            upper[d] = std::max(upper[d], p[d]);
+        }
+    }
+    const real scale = (real)((1 << fmm_levels) - 1) / std::max(max_component(upper - lower), 1e-30f);
+    std::vector<std::pair<uint64, int>> keys((size_t)n);
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+        uint64 code = 0;
+        for (int d = 0; d < 3; d++) {
+            uint64 x = (uint64)((positions[i][d] - lower[d]) * scale);
+            x = std::min(x, (uint64)((1 << fmm_levels) - 1));
+            for (int b = 0; b < fmm_levels; b++) {
+                code |= ((x >> b) & 1) << (3 * b + d);
+            }
+        }
+        keys[i] = std::make_pair(code, i);
+    });
+    std::sort(keys.begin(), keys.end());
+    std::vector<uint64> codes((size_t)n);
+    sorted_indices.resize((size_t)n);
+    sorted_positions.resize((size_t)n);
+    sorted_masses.resize((size_t)n);
+    sorted_field.assign((size_t)n, Vector3(0.0f));
+    for (int i = 0; i < n; i++) {
+        codes[i] = keys[i].first;
+        sorted_indices[i] = keys[i].second;
+        sorted_positions[i] = positions[keys[i].second];
+        sorted_masses[i] = masses[keys[i].second];
+    }
+
+    nodes.resize(1);
+    build(0, codes, 0, n);
+    const int num_nodes = (int)nodes.size();
+    multipoles.assign((size_t)num_nodes * num_coefficients, 0.0);
+    locals.assign((size_t)num_nodes * num_coefficients, 0.0);
+
+    // Subtrees of at most task_size bodies are handled by one thread from start to end.
+    // Nodes above them get no interactions of their own, which only costs a few extra M2Ls.
+    const int task_size = num_threads > 1 ? std::max(leaf_size, n / (num_threads * 8)) : n;
+    tasks.clear();
+    is_top.assign((size_t)num_nodes, 0);
+    std::vector<int> stack(1, 0);
+    while (!stack.empty()) {
+        const int t = stack.back();
+        stack.pop_back();
+        if (nodes[t].is_leaf() || nodes[t].end - nodes[t].begin <= task_size) {
+            tasks.push_back(t);
+            continue;
+        }
+        is_top[t] = 1;
+        for (int ch = nodes[t].child_begin; ch < nodes[t].child_begin + nodes[t].num_children; ch++) {
+            stack.push_back(ch);
+        }
+    }
+    const int num_tasks = (int)tasks.size();
+    ThreadedTaskManager::run(num_tasks, num_threads, [&](int i) {
+        upward(tasks[i]);
+    });
+    // Children come after their parents
+    for (int t = num_nodes - 1; t >= 0; t--) {
+        if (is_top[t]) {
+            summarize(t);
+        }
+    }
+    ThreadedTaskManager::run(num_tasks, num_threads, [&](int i) {
+        interact(tasks[i], 0);
+        downward(tasks[i]);
+    });
+    for (int i = 0; i < n; i++) {
+        field[sorted_indices[i]] = sorted_field[i];
+    }
+}
+
+void FastMultipoleSummation::evaluate_direct(const std::vector<Vector3> &positions, const std::vector<real> &masses,
+                                             real softening, std::vector<Vector3> &field, int num_threads) {
+    const int n = (int)positions.size();
+    field.resize((size_t)n);
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+        double sum[3] = {0, 0, 0};
+        for (int j = 0; j < n; j++) {
+            const Vector3 e = positions[i] - positions[j];
+            const double dist2 = dot(e, e) + softening;
+            if (dist2 > 0) {
+                const double s = masses[j] / (dist2 * std::sqrt(dist2));
+                for (int d = 0; d < 3; d++) {
+                    sum[d] += s * e[d];
+                }
+            }
+        }
+        field[i] = Vector3((real)sum[0], (real)sum[1], (real)sum[2]);
+    });
+}
+
+TC_NAMESPACE_END
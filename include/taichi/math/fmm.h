@@ -0,0 +1,117 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/math/linalg.h>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Fast multipole evaluation of the softened inverse-square field
+//     field_i = sum_j m_j (x_i - x_j) / (|x_i - x_j|^2 + softening)^(3/2),
+// which is the sum NBody integrates. Expansions are Cartesian Taylor series of the
+// softened kernel, truncated at total degree `order`, about the centers of mass of
+// the nodes of an octree with at most `leaf_size` bodies per leaf. Nodes interact by
+// dual tree traversal, and are well separated if (r_A + r_B) < theta * |z_A - z_B|,
+// where r is the radius of a node about its center z.
+class FastMultipoleSummation {
+protected:
+    struct Node {
+        Vector3 center;
+        real radius, mass;
+        // Bodies are [begin, end) in sorted order
+        int begin, end;
+        // Children are nodes[child_begin .. child_begin + num_children)
+        int child_begin, num_children;
+
+        bool is_leaf() const {
+            return num_children == 0;
+        }
+    };
+
+    // How to get the coefficient of multi-index n from lower degrees:
+    // n = m + e_axis, where m = lower
+    struct Recurrence {
+        int axis, lower;
+        // For kernel derivatives: m - e_axis, and m - e_j + e_axis, m - 2 e_j + e_axis per j (-1 if absent)
+        int lower_lower;
+        int cross[3], cross2[3];
+    };
+
+    // Coefficients indexed a, b, c with n_c = n_a + n_b
+    struct Term {
+        int a, b, c;
+    };
+
+    int order;
+    real theta;
+    int leaf_size;
+    real softening;
+    int num_threads;
+
+    // Multi-indices up to `order`, by increasing degree
+    int num_coefficients;
+    std::vector<Vector3i> multi_indices;
+    std::vector<int> degrees;
+    std::vector<Recurrence> recurrences;
+    // Index of n + e_i for every coefficient n, or -1 above `order`
+    std::vector<int> raised[3];
+    // Multipole (M2M) and local (L2L) translations: n = k + (n - k)
+    std::vector<Term> shift_terms;
+    // Multipole to local: L_k += (-1)^|n| M_n D_{n + k}
+    std::vector<Term> m2l_terms;
+
+    std::vector<Node> nodes;
+    std::vector<int> sorted_indices;
+    std::vector<Vector3> sorted_positions;
+    std::vector<real> sorted_masses;
+    std::vector<Vector3> sorted_field;
+    std::vector<double> multipoles, locals;
+    // Subtrees processed by one thread each, and whether a node is above them
+    std::vector<int> tasks;
+    std::vector<char> is_top;
+
+    int get_coefficient_index(const Vector3i &n) const;
+
+    // x^n / n! for all multi-indices n
+    void compute_monomials(const Vector3 &x, double *monomials) const;
+
+    // Derivatives of (|x|^2 + softening)^(-1/2) for all multi-indices
+    void compute_derivatives(const Vector3 &x, double *derivatives) const;
+
+    void build(int t, const std::vector<uint64> &codes, int begin, int end);
+
+    void upward(int t);
+
+    void summarize(int t);
+
+    void interact(int a, int b);
+
+    void downward(int t);
+
+public:
+    FastMultipoleSummation(int order = 4, real theta = 0.5f, int leaf_size = 32, real softening = 1e-4f,
+                           int num_threads = 1);
+
+    // field[i] at positions[i], due to all bodies (a body exerts no field on itself)
+    void evaluate(const std::vector<Vector3> &positions, const std::vector<real> &masses,
+                  std::vector<Vector3> &field);
+
+    // The same field by O(N^2) direct summation, for reference
+    static void evaluate_direct(const std::vector<Vector3> &positions, const std::vector<real> &masses,
+                                real softening, std::vector<Vector3> &field, int num_threads = 1);
+
+    int get_num_nodes() const {
+        return (int)nodes.size();
+    }
+};
+
+TC_NAMESPACE_END
@@ -9,6 +9,7 @@
 *******************************************************************************/
 
 #include "levelset_2d.h"
+#include "levelset_redistance.h"
 
 TC_NAMESPACE_BEGIN
 
@@ -71,6 +72,14 @@ real LevelSet2D::get(const Vector2 &pos) const {
 }
 
 
+void LevelSet2D::redistance(int num_threads) {
+    redistance_fast_sweeping(&data[0], Vector3i(width, height, 1), num_threads);
+}
+
+void LevelSet2D::redistance_narrow_band(real band) {
+    redistance_fast_marching(&data[0], Vector3i(width, height, 1), band);
+}
+
 Array2D<real> LevelSet2D::rasterize(int width, int height) {
     for (auto &p : (*this)) {
         if (std::isnan(p)) {
@@ -8,6 +8,7 @@
 *******************************************************************************/
 
 #include "levelset_3d.h"
+#include "levelset_redistance.h"
 
 TC_NAMESPACE_BEGIN
 
@@ -135,6 +136,14 @@ real LevelSet3D::get(const Vector3 &pos) const {
 }
 
 
+void LevelSet3D::redistance(int num_threads) {
+    redistance_fast_sweeping(&data[0], Vector3i(width, height, depth), num_threads);
+}
+
+void LevelSet3D::redistance_narrow_band(real band) {
+    redistance_fast_marching(&data[0], Vector3i(width, height, depth), band);
+}
+
 Array3D<real> LevelSet3D::rasterize(int width, int height, int depth) {
     for (auto &p : (*this)) {
         if (std::isnan(p)) {
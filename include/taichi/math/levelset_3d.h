@@ -57,6 +57,12 @@ public:
 
     real get(const Vector3 &pos) const;
 
+    // Reinitializes phi to the signed distance (in cells) to its zero crossing, by fast sweeping
+    void redistance(int num_threads = 1);
+
+    // Redistancing by fast marching, only out to `band` cells. Farther values are clamped to +-band.
+    void redistance_narrow_band(real band);
+
     static real fraction_outside(real phi_a, real phi_b) {
         return 1.0f - fraction_inside(phi_a, phi_b);
     }
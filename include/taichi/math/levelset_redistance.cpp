@@ -0,0 +1,230 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "levelset_redistance.h"
+#include <taichi/system/threading.h>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Same as LevelSet2D::INF, so that unreached cells look like an empty levelset
+static const real far_distance = 1e7f;
+
+static int get_index(const Vector3i &res, int i, int j, int k) {
+    return (i * res[1] + j) * res[2] + k;
+}
+
+// Distance of cells next to a sign change to the (linearly interpolated) crossing,
+// and far_distance elsewhere. Crossing cells are frozen.
+static void initialize_interface(const real *phi, const Vector3i &res, std::vector<real> &dist,
+                                 std::vector<char> &frozen, int num_threads) {
+    ThreadedTaskManager::run(res[0], num_threads, [&](int i) {
+        for (int j = 0; j < res[1]; j++) {
+            for (int k = 0; k < res[2]; k++) {
+                const int c = get_index(res, i, j, k);
+                const real p = phi[c];
+                real inv_dist2 = 0;
+                for (int d = 0; d < 3; d++) {
+                    real theta = 2.0f;
+                    for (int s = -1; s <= 1; s += 2) {
+                        Vector3i n(i, j, k);
+                        n[d] += s;
+                        if (n[d] < 0 || n[d] >= res[d]) {
+                            continue;
+                        }
+                        const real q = phi[get_index(res, n[0], n[1], n[2])];
+                        if ((p >= 0) != (q >= 0)) {
+                            theta = std::min(theta, p / (p - q));
+                        }
+                    }
+                    if (theta <= 1.0f) {
+                        inv_dist2 += 1.0f / std::max(theta * theta, 1e-12f);
+                    }
+                }
+                frozen[c] = inv_dist2 > 0;
+                dist[c] = frozen[c] ? 1.0f / std::sqrt(inv_dist2) : far_distance;
+            }
+        }
+    });
+}
+
+// Upwind solution of |grad u| = 1, given the smaller neighbour along each axis
+static real solve_eikonal(real a[3]) {
+    if (a[0] > a[1]) {
+        std::swap(a[0], a[1]);
+    }
+    if (a[1] > a[2]) {
+        std::swap(a[1], a[2]);
+    }
+    if (a[0] > a[1]) {
+        std::swap(a[0], a[1]);
+    }
+    real u = a[0] + 1.0f;
+    if (u > a[1]) {
+        u = 0.5f * (a[0] + a[1] + std::sqrt(std::max(0.0f, 2.0f - (a[0] - a[1]) * (a[0] - a[1]))));
+        if (u > a[2]) {
+            real sum = a[0] + a[1] + a[2];
+            real sum2 = a[0] * a[0] + a[1] * a[1] + a[2] * a[2];
+            u = (sum + std::sqrt(std::max(0.0f, sum * sum - 3.0f * (sum2 - 1.0f)))) / 3.0f;
+        }
+    }
+    return u;
+}
+
+static void apply_sign(real *phi, const Vector3i &res, const std::vector<real> &dist, int num_threads) {
+    const int slice = res[1] * res[2];
+    ThreadedTaskManager::run(res[0], num_threads, [&](int i) {
+        for (int c = i * slice; c < (i + 1) * slice; c++) {
+            phi[c] = phi[c] >= 0 ? dist[c] : -dist[c];
+        }
+    });
+}
+
+void redistance_fast_sweeping(real *phi, const Vector3i &res, int num_threads, real tolerance,
+                              int maximum_iterations) {
+    const int size = res[0] * res[1] * res[2];
+    std::vector<real> dist((size_t)size), last;
+    std::vector<char> frozen((size_t)size);
+    initialize_interface(phi, res, dist, frozen, num_threads);
+
+    const int num_slabs = std::max(1, std::min(num_threads, res[0]));
+    std::vector<real> slab_change((size_t)num_slabs);
+    // The 2^dim sweep orderings; singleton axes (z in 2D) are only swept one way
+    std::vector<Vector3i> orderings;
+    for (int o = 0; o < 8; o++) {
+        Vector3i directions(o & 1 ? -1 : 1, o & 2 ? -1 : 1, o & 4 ? -1 : 1);
+        bool redundant = false;
+        for (int d = 0; d < 3; d++) {
+            redundant = redundant || (res[d] == 1 && directions[d] == -1);
+        }
+        if (!redundant) {
+            orderings.push_back(directions);
+        }
+    }
+
+    for (int iteration = 0; iteration < maximum_iterations; iteration++) {
+        last = dist;
+        ThreadedTaskManager::run(num_slabs, num_threads, [&](int slab) {
+            const int begin = slab * res[0] / num_slabs, end = (slab + 1) * res[0] / num_slabs;
+            const int stride = res[1] * res[2];
+            for (auto &directions : orderings) {
+                for (int ii = 0; ii < end - begin; ii++) {
+                    const int i = directions[0] > 0 ? begin + ii : end - 1 - ii;
+                    // Neighbours in other slabs are read from the last iteration, so slabs do not race
+                    const real *lower = i == 0 ? nullptr : (i - 1 >= begin ? &dist[0] : &last[0]);
+                    const real *upper = i == res[0] - 1 ? nullptr : (i + 1 < end ? &dist[0] : &last[0]);
+                    for (int jj = 0; jj < res[1]; jj++) {
+                        const int j = directions[1] > 0 ? jj : res[1] - 1 - jj;
+                        const int row = get_index(res, i, j, 0);
+                        const int k_begin = directions[2] > 0 ? 0 : res[2] - 1, k_step = directions[2];
+                        for (int kk = 0, k = k_begin; kk < res[2]; kk++, k += k_step) {
+                            const int c = row + k;
+                            if (frozen[c]) {
+                                continue;
+                            }
+                            real a[3];
+                            a[0] = std::min(lower ? lower[c - stride] : far_distance,
+                                            upper ? upper[c + stride] : far_distance);
+                            a[1] = std::min(j > 0 ? dist[c - res[2]] : far_distance,
+                                            j < res[1] - 1 ? dist[c + res[2]] : far_distance);
+                            a[2] = std::min(k > 0 ? dist[c - 1] : far_distance,
+                                            k < res[2] - 1 ? dist[c + 1] : far_distance);
+                            // The update is always larger than the smallest neighbour
+                            if (std::min(a[0], std::min(a[1], a[2])) >= dist[c]) {
+                                continue;
+                            }
+                            dist[c] = std::min(dist[c], solve_eikonal(a));
+                        }
+                    }
+                }
+            }
+            real change = 0;
+            for (int c = get_index(res, begin, 0, 0); c < get_index(res, end, 0, 0); c++) {
+                change = std::max(change, last[c] - dist[c]);
+            }
+            slab_change[slab] = change;
+        });
+        if (*std::max_element(slab_change.begin(), slab_change.end()) <= tolerance) {
+            break;
+        }
+    }
+    apply_sign(phi, res, dist, num_threads);
+}
+
+void redistance_fast_marching(real *phi, const Vector3i &res, real band) {
+    const int size = res[0] * res[1] * res[2];
+    std::vector<real> dist((size_t)size);
+    std::vector<char> frozen((size_t)size);
+    initialize_interface(phi, res, dist, frozen, 1);
+
+    enum { FAR = 0, TRIAL = 1, ACCEPTED = 2 };
+    std::vector<char> state((size_t)size, FAR);
+    typedef std::pair<real, int> Entry;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+    for (int c = 0; c < size; c++) {
+        if (frozen[c]) {
+            state[c] = TRIAL;
+            heap.push(Entry(dist[c], c));
+        }
+    }
+    const int strides[3] = {res[1] * res[2], res[2], 1};
+    while (!heap.empty()) {
+        Entry top = heap.top();
+        heap.pop();
+        const int c = top.second;
+        if (state[c] == ACCEPTED || top.first > dist[c]) {
+            continue;
+        }
+        if (top.first > band) {
+            break;
+        }
+        state[c] = ACCEPTED;
+        const Vector3i coord(c / strides[0], c / strides[1] % res[1], c % res[2]);
+        for (int d = 0; d < 3; d++) {
+            for (int s = -1; s <= 1; s += 2) {
+                Vector3i n = coord;
+                n[d] += s;
+                if (n[d] < 0 || n[d] >= res[d]) {
+                    continue;
+                }
+                const int nc = c + s * strides[d];
+                if (state[nc] == ACCEPTED || frozen[nc]) {
+                    continue;
+                }
+                // Only accepted values are upwind
+                real a[3];
+                for (int e = 0; e < 3; e++) {
+                    a[e] = far_distance;
+                    if (n[e] > 0 && state[nc - strides[e]] == ACCEPTED) {
+                        a[e] = dist[nc - strides[e]];
+                    }
+                    if (n[e] < res[e] - 1 && state[nc + strides[e]] == ACCEPTED) {
+                        a[e] = std::min(a[e], dist[nc + strides[e]]);
+                    }
+                }
+                real u = solve_eikonal(a);
+                if (u < dist[nc]) {
+                    dist[nc] = u;
+                    state[nc] = TRIAL;
+                    heap.push(Entry(u, nc));
+                }
+            }
+        }
+    }
+    for (int c = 0; c < size; c++) {
+        dist[c] = state[c] == ACCEPTED ? std::min(dist[c], band) : band;
+    }
+    apply_sign(phi, res, dist, 1);
+}
+
+TC_NAMESPACE_END
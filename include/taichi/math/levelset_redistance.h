@@ -0,0 +1,31 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/math/linalg.h>
+
+TC_NAMESPACE_BEGIN
+
+// Redistancing of levelsets stored densely as (x, y, z) with z contiguous, which is
+// the layout of Array3D, and of Array2D with res.z = 1. Both methods keep the zero
+// crossings of phi: cells next to a crossing get their distance to it by linear
+// interpolation, and the rest are solved from there with the upwind Eikonal update.
+// Distances are in cells.
+
+// Fast sweeping over the whole grid. The grid is split into slabs along x, which are
+// swept in parallel with the values of neighbouring slabs taken from the last iteration.
+void redistance_fast_sweeping(real *phi, const Vector3i &res, int num_threads = 1,
+                              real tolerance = 1e-3f, int maximum_iterations = 64);
+
+// Fast marching out to `band` cells from the surface. Farther cells are set to +-band.
+void redistance_fast_marching(real *phi, const Vector3i &res, real band);
+
+TC_NAMESPACE_END
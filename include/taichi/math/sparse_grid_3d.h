@@ -0,0 +1,201 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include "math_util.h"
+#include "linalg.h"
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// A 3D grid stored as tile_size^3 tiles, allocated only where the grid is active.
+// Inactive tiles (and everything outside the grid) read as zero.
+// Tiles are indexed as (tx * tile_res.y + ty) * tile_res.z + tz, and cells within
+// a tile as (x * tile_size + y) * tile_size + z, so z is contiguous as in Array3D.
+// Storage of deactivated tiles is recycled, so memory follows the peak number of
+// active tiles instead of the size of the box.
+template <typename T>
+class SparseGrid3D {
+public:
+    static const int tile_size = 8;
+    static const int tile_cells = tile_size * tile_size * tile_size;
+
+protected:
+    Vector3i res, tile_res;
+    Vector3 storage_offset;
+    // Per tile: index into `storage`, or -1 if inactive
+    std::vector<int> slots;
+    std::vector<std::vector<T>> storage;
+    std::vector<int> free_slots;
+    std::vector<int> active_tiles;
+
+public:
+    SparseGrid3D() {}
+
+    SparseGrid3D(const Vector3i &res, Vector3 storage_offset = Vector3(0.5f, 0.5f, 0.5f)) {
+        initialize(res, storage_offset);
+    }
+
+    void initialize(const Vector3i &res, Vector3 storage_offset = Vector3(0.5f, 0.5f, 0.5f)) {
+        this->res = res;
+        this->storage_offset = storage_offset;
+        tile_res = Vector3i((res[0] + tile_size - 1) / tile_size, (res[1] + tile_size - 1) / tile_size,
+                            (res[2] + tile_size - 1) / tile_size);
+        slots.assign((size_t)get_num_tiles(), -1);
+        storage.clear();
+        free_slots.clear();
+        active_tiles.clear();
+    }
+
+    Vector3i get_res() const {
+        return res;
+    }
+
+    Vector3i get_tile_res() const {
+        return tile_res;
+    }
+
+    int get_num_tiles() const {
+        return tile_res[0] * tile_res[1] * tile_res[2];
+    }
+
+    int get_tile_id(int tx, int ty, int tz) const {
+        return (tx * tile_res[1] + ty) * tile_res[2] + tz;
+    }
+
+    Vector3i get_tile_coord(int tile) const {
+        return Vector3i(tile / (tile_res[1] * tile_res[2]), tile / tile_res[2] % tile_res[1], tile % tile_res[2]);
+    }
+
+    static int get_cell_id(int x, int y, int z) {
+        return (x * tile_size + y) * tile_size + z;
+    }
+
+    const std::vector<int> &get_active_tiles() const {
+        return active_tiles;
+    }
+
+    bool is_active(int tile) const {
+        return slots[tile] >= 0;
+    }
+
+    T *get_tile(int tile) {
+        return slots[tile] < 0 ? nullptr : &storage[slots[tile]][0];
+    }
+
+    const T *get_tile(int tile) const {
+        return slots[tile] < 0 ? nullptr : &storage[slots[tile]][0];
+    }
+
+    // Data of the face-adjacent tiles, in the order x+, x-, y+, y-, z+, z-; nullptr where inactive or outside
+    void get_neighbour_tiles(int tile, const T *neighbours[6]) const {
+        Vector3i coord = get_tile_coord(tile);
+        for (int d = 0; d < 6; d++) {
+            Vector3i n = coord;
+            n[d / 2] += d % 2 == 0 ? 1 : -1;
+            bool inside = 0 <= n[0] && n[0] < tile_res[0] && 0 <= n[1] && n[1] < tile_res[1] &&
+                          0 <= n[2] && n[2] < tile_res[2];
+            neighbours[d] = inside ? get_tile(get_tile_id(n[0], n[1], n[2])) : nullptr;
+        }
+    }
+
+    // Sum of the six neighbours of cell (x, y, z) of `tile`, given the tile and its neighbour tiles
+    static T get_neighbour_sum(const T *tile, const T *const neighbours[6], int x, int y, int z) {
+        const int sx = tile_size * tile_size, sy = tile_size, c = get_cell_id(x, y, z);
+        const int last = tile_size - 1;
+        T sum(0);
+        sum += x < last ? tile[c + sx] : (neighbours[0] ? neighbours[0][c - last * sx] : T(0));
+        sum += x > 0 ? tile[c - sx] : (neighbours[1] ? neighbours[1][c + last * sx] : T(0));
+        sum += y < last ? tile[c + sy] : (neighbours[2] ? neighbours[2][c - last * sy] : T(0));
+        sum += y > 0 ? tile[c - sy] : (neighbours[3] ? neighbours[3][c + last * sy] : T(0));
+        sum += z < last ? tile[c + 1] : (neighbours[4] ? neighbours[4][c - last] : T(0));
+        sum += z > 0 ? tile[c - 1] : (neighbours[5] ? neighbours[5][c + last] : T(0));
+        return sum;
+    }
+
+    // Activates exactly the tiles with mask[tile] != 0. Newly activated tiles are zero.
+    void set_active_tiles(const std::vector<char> &mask) {
+        assert_info((int)mask.size() == get_num_tiles(), "Tile mask size mismatch");
+        active_tiles.clear();
+        for (int tile = 0; tile < get_num_tiles(); tile++) {
+            if (mask[tile]) {
+                if (slots[tile] < 0) {
+                    if (free_slots.empty()) {
+                        slots[tile] = (int)storage.size();
+                        storage.push_back(std::vector<T>(tile_cells, T(0)));
+                    } else {
+                        slots[tile] = free_slots.back();
+                        free_slots.pop_back();
+                        std::fill(storage[slots[tile]].begin(), storage[slots[tile]].end(), T(0));
+                    }
+                }
+                active_tiles.push_back(tile);
+            } else if (slots[tile] >= 0) {
+                free_slots.push_back(slots[tile]);
+                slots[tile] = -1;
+            }
+        }
+    }
+
+    void reset(T value) {
+        for (int tile : active_tiles) {
+            std::fill(storage[slots[tile]].begin(), storage[slots[tile]].end(), value);
+        }
+    }
+
+    bool inside(int i, int j, int k) const {
+        return 0 <= i && i < res[0] && 0 <= j && j < res[1] && 0 <= k && k < res[2];
+    }
+
+    T get(int i, int j, int k) const {
+        if (!inside(i, j, k)) {
+            return T(0);
+        }
+        int slot = slots[get_tile_id(i / tile_size, j / tile_size, k / tile_size)];
+        if (slot < 0) {
+            return T(0);
+        }
+        return storage[slot][get_cell_id(i % tile_size, j % tile_size, k % tile_size)];
+    }
+
+    // The cell has to be in an active tile
+    T &get_ref(int i, int j, int k) {
+        int slot = slots[get_tile_id(i / tile_size, j / tile_size, k / tile_size)];
+        return storage[slot][get_cell_id(i % tile_size, j % tile_size, k % tile_size)];
+    }
+
+    // Trilinear interpolation, clamped to the grid as in Array3D::sample
+    T sample(const Vector3 &pos) const {
+        real x = clamp(pos.x - storage_offset.x, 0.f, res[0] - 1.f - eps);
+        real y = clamp(pos.y - storage_offset.y, 0.f, res[1] - 1.f - eps);
+        real z = clamp(pos.z - storage_offset.z, 0.f, res[2] - 1.f - eps);
+        int x_i = clamp(int(x), 0, res[0] - 2);
+        int y_i = clamp(int(y), 0, res[1] - 2);
+        int z_i = clamp(int(z), 0, res[2] - 2);
+        real x_r = x - x_i;
+        real y_r = y - y_i;
+        real z_r = z - z_i;
+        return
+                lerp(z_r,
+                     lerp(x_r,
+                          lerp(y_r, get(x_i, y_i, z_i), get(x_i, y_i + 1, z_i)),
+                          lerp(y_r, get(x_i + 1, y_i, z_i), get(x_i + 1, y_i + 1, z_i))),
+                     lerp(x_r,
+                          lerp(y_r, get(x_i, y_i, z_i + 1), get(x_i, y_i + 1, z_i + 1)),
+                          lerp(y_r, get(x_i + 1, y_i, z_i + 1), get(x_i + 1, y_i + 1, z_i + 1)))
+                );
+    }
+
+    int64 get_memory_usage() const {
+        return (int64)slots.size() * sizeof(int) + (int64)storage.size() * tile_cells * sizeof(T);
+    }
+};
+
+TC_NAMESPACE_END
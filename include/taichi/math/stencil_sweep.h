@@ -0,0 +1,75 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/system/threading.h>
+#include <algorithm>
+
+TC_NAMESPACE_BEGIN
+
+// Iteration schedules for stencil sweeps over grids stored as unit-stride rows
+// along z, one row per (x, y). 2D grids use y = 0, i.e. one row per x.
+// Kernels process whole rows (or whole x planes), so that their inner loops are
+// unit-stride and can be vectorized by the compiler; the schedules only decide
+// the order in which rows are visited:
+//   - for_each_row: spatial blocking. Rows are grouped into tiles of
+//     block_x * block_y rows, which are distributed over threads. Within a
+//     tile, the x - 1 .. x + 1 neighbour rows of a tile stay in cache.
+//   - wavefront: temporal tiling along x for multi-stage sweeps (several smoothing
+//     rounds, or several Jacobi steps). Stage s trails stage s - 1 by `lag` planes,
+//     so only about num_stages * lag planes are live at a time, and one pass
+//     over memory performs all stages.
+class StencilSweep {
+public:
+    int num_threads;
+    int block_x, block_y;
+
+    StencilSweep(int num_threads = 1, int block_x = 4, int block_y = 16)
+            : num_threads(num_threads), block_x(block_x), block_y(block_y) {
+    }
+
+    // kernel(x, y) for every row of a res[0] * res[1] * res[2] grid (res[2] is ignored)
+    template <typename RowKernel>
+    void for_each_row(const Vector3i &res, const RowKernel &kernel) const {
+        const int tiles_x = (res[0] + block_x - 1) / block_x;
+        const int tiles_y = (res[1] + block_y - 1) / block_y;
+        ThreadedTaskManager::run(tiles_x * tiles_y, num_threads, [&](int t) {
+            const int x_begin = t / tiles_y * block_x, y_begin = t % tiles_y * block_y;
+            const int x_end = std::min(x_begin + block_x, res[0]), y_end = std::min(y_begin + block_y, res[1]);
+            for (int x = x_begin; x < x_end; x++) {
+                for (int y = y_begin; y < y_end; y++) {
+                    kernel(x, y);
+                }
+            }
+        });
+    }
+
+    // kernel(s, x) for every stage s < num_stages and plane x < num_planes.
+    // At front f, stages are run in increasing order on planes f - s * lag.
+    // Valid schedules:
+    //   - lag = 1, if stage s of plane x only reads stage s - 1 results of planes
+    //     x - 1 .. x + 1 and writes cells that stage s + 1 does not (in-place red-black sweeps);
+    //   - lag = 2, for out-of-place sweeps ping-ponging between two buffers (Jacobi).
+    // Planes are visited serially; the kernel may parallelize within a plane.
+    template <typename PlaneKernel>
+    void wavefront(int num_planes, int num_stages, int lag, const PlaneKernel &kernel) const {
+        for (int f = 0; f < num_planes + (num_stages - 1) * lag; f++) {
+            for (int s = 0; s < num_stages; s++) {
+                int x = f - s * lag;
+                if (0 <= x && x < num_planes) {
+                    kernel(s, x);
+                }
+            }
+        }
+    }
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,310 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/math/math_util.h>
+#include <taichi/system/threading.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+template <int dim>
+struct CellListTraits;
+
+template <>
+struct CellListTraits<2> {
+    typedef Vector2 Vector;
+};
+
+template <>
+struct CellListTraits<3> {
+    typedef Vector3 Vector;
+};
+
+// Uniform grid (cell list) over a static point set, for radius and k-nearest queries.
+// Points are counting-sorted by cell, so the points of a cell are contiguous.
+// Cells are addressed as 3D for both dims (z has a single layer in 2D).
+// Distances returned by queries are squared, as in ANN.
+template <int dim>
+class CellList {
+public:
+    typedef typename CellListTraits<dim>::Vector Vector;
+
+protected:
+    int num_threads;
+    real cell_size = 1.0f, inv_cell_size = 1.0f;
+    Vector lower;
+    Vector3i res;
+    // Points of cell c are sorted_points[cell_begin[c] .. cell_begin[c + 1])
+    std::vector<int> cell_begin;
+    std::vector<int> sorted_indices;
+    std::vector<Vector> sorted_points;
+
+    // Unclamped, so that queries outside the bounding box find the right rings
+    Vector3i get_cell(const Vector &p) const {
+        Vector3i cell(0);
+        for (int d = 0; d < dim; d++) {
+            cell[d] = (int)std::floor((p[d] - lower[d]) * inv_cell_size);
+        }
+        return cell;
+    }
+
+    int get_cell_id(const Vector3i &cell) const {
+        return (cell[0] * res[1] + cell[1]) * res[2] + cell[2];
+    }
+
+    static real get_dist2(const Vector &a, const Vector &b) {
+        real dist2 = 0;
+        for (int d = 0; d < dim; d++) {
+            dist2 += (a[d] - b[d]) * (a[d] - b[d]);
+        }
+        return dist2;
+    }
+
+    // f(sorted slot) for all points in cells with Chebyshev distance exactly `ring` from `center`
+    template <typename F>
+    void for_each_in_ring(const Vector3i &center, int ring, const F &f) const {
+        for (int i = std::max(center[0] - ring, 0); i <= std::min(center[0] + ring, res[0] - 1); i++) {
+            for (int j = std::max(center[1] - ring, 0); j <= std::min(center[1] + ring, res[1] - 1); j++) {
+                bool on_ring = std::max(std::abs(i - center[0]), std::abs(j - center[1])) == ring;
+                auto visit = [&](int k) {
+                    int cell = get_cell_id(Vector3i(i, j, k));
+                    for (int s = cell_begin[cell]; s < cell_begin[cell + 1]; s++) {
+                        f(s);
+                    }
+                };
+                if (dim == 2) {
+                    if (on_ring) {
+                        visit(0);
+                    }
+                } else if (on_ring) {
+                    for (int k = std::max(center[2] - ring, 0); k <= std::min(center[2] + ring, res[2] - 1); k++) {
+                        visit(k);
+                    }
+                } else {
+                    if (0 <= center[2] - ring && center[2] - ring < res[2]) {
+                        visit(center[2] - ring);
+                    }
+                    if (ring > 0 && 0 <= center[2] + ring && center[2] + ring < res[2]) {
+                        visit(center[2] + ring);
+                    }
+                }
+            }
+        }
+    }
+
+public:
+    CellList(int num_threads = 1) : num_threads(num_threads) {}
+
+    // Cell size defaults to about two points per cell of the bounding box
+    void initialize(const std::vector<Vector> &points, real cell_size = 0.0f) {
+        const int n = (int)points.size();
+        Vector upper;
+        if (n > 0) {
+            lower = upper = points[0];
+        } else {
+            lower = upper = Vector(0.0f);
+        }
+        for (auto &p : points) {
+            for (int d = 0; d < dim; d++) {
+                lower[d] = std::min(lower[d], p[d]);
+                upper[d] = std::max(upper[d], p[d]);
+            }
+        }
+        real extent = 0, volume = 1;
+        for (int d = 0; d < dim; d++) {
+            extent = std::max(extent, upper[d] - lower[d]);
+        }
+        for (int d = 0; d < dim; d++) {
+            volume *= std::max(upper[d] - lower[d], extent * 1e-3f);
+        }
+        if (cell_size <= 0) {
+            cell_size = std::pow(volume * 2 / std::max(n, 1), 1.0f / dim);
+        }
+        // Keep the number of cells O(n) for sparse point sets
+        cell_size = std::max(cell_size, std::pow(volume / (4.0f * std::max(n, 1)), 1.0f / dim));
+        if (!(cell_size > 0)) {
+            cell_size = 1.0f;
+        }
+        this->cell_size = cell_size;
+        inv_cell_size = 1.0f / cell_size;
+        res = Vector3i(1);
+        for (int d = 0; d < dim; d++) {
+            res[d] = (int)((upper[d] - lower[d]) * inv_cell_size) + 1;
+        }
+        const int num_cells = res[0] * res[1] * res[2];
+
+        // Counting sort, with per-thread histograms over contiguous chunks of points
+        std::vector<int> cell_ids((size_t)n);
+        const int num_chunks = std::max(1, std::min(num_threads, n / 4096));
+        std::vector<std::vector<int>> offsets((size_t)num_chunks, std::vector<int>((size_t)num_cells, 0));
+        ThreadedTaskManager::run(num_chunks, num_threads, [&](int t) {
+            for (int i = (int)((int64)n * t / num_chunks); i < (int)((int64)n * (t + 1) / num_chunks); i++) {
+                Vector3i cell = get_cell(points[i]);
+                for (int d = 0; d < dim; d++) {
+                    cell[d] = std::min(cell[d], res[d] - 1);
+                }
+                cell_ids[i] = get_cell_id(cell);
+                offsets[t][cell_ids[i]]++;
+            }
+        });
+        cell_begin.resize((size_t)num_cells + 1);
+        int sum = 0;
+        for (int c = 0; c < num_cells; c++) {
+            cell_begin[c] = sum;
+            for (int t = 0; t < num_chunks; t++) {
+                int count = offsets[t][c];
+                offsets[t][c] = sum;
+                sum += count;
+            }
+        }
+        cell_begin[num_cells] = sum;
+        sorted_indices.resize((size_t)n);
+        sorted_points.resize((size_t)n);
+        ThreadedTaskManager::run(num_chunks, num_threads, [&](int t) {
+            for (int i = (int)((int64)n * t / num_chunks); i < (int)((int64)n * (t + 1) / num_chunks); i++) {
+                int slot = offsets[t][cell_ids[i]]++;
+                sorted_indices[slot] = i;
+                sorted_points[slot] = points[i];
+            }
+        });
+    }
+
+    int size() const {
+        return (int)sorted_points.size();
+    }
+
+    real get_cell_size() const {
+        return cell_size;
+    }
+
+    // f(index, dist2) for every point within `radius` of p
+    template <typename F>
+    void for_each_in_radius(const Vector &p, real radius, const F &f) const {
+        Vector3i begin(0), end(0);
+        for (int d = 0; d < dim; d++) {
+            begin[d] = std::max((int)std::floor((p[d] - radius - lower[d]) * inv_cell_size), 0);
+            end[d] = std::min((int)std::floor((p[d] + radius - lower[d]) * inv_cell_size), res[d] - 1);
+        }
+        const real radius2 = radius * radius;
+        for (int i = begin[0]; i <= end[0]; i++) {
+            for (int j = begin[1]; j <= end[1]; j++) {
+                for (int k = begin[2]; k <= end[2]; k++) {
+                    int cell = get_cell_id(Vector3i(i, j, k));
+                    for (int s = cell_begin[cell]; s < cell_begin[cell + 1]; s++) {
+                        real dist2 = get_dist2(p, sorted_points[s]);
+                        if (dist2 <= radius2) {
+                            f(sorted_indices[s], dist2);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void query_radius(const Vector &p, real radius, std::vector<int> &index, std::vector<real> &dist2) const {
+        index.clear();
+        dist2.clear();
+        for_each_in_radius(p, radius, [&](int i, real d2) {
+            index.push_back(i);
+            dist2.push_back(d2);
+        });
+    }
+
+    // The k nearest points by increasing distance, searched in growing rings of cells.
+    // Missing neighbours (k > size()) are padded with index -1 and distance 1e30.
+    // With k <= 0 nothing is written.
+    void query_k(const Vector &p, int k, int *index, real *dist2) const {
+        if (k <= 0) {
+            return;
+        }
+        // Max-heap of the best k so far
+        thread_local std::vector<std::pair<real, int>> heap_buffer;
+        heap_buffer.resize((size_t)k);
+        std::pair<real, int> *heap = &heap_buffer[0];
+        int found = 0;
+        Vector3i center = get_cell(p);
+        int max_ring = 0;
+        for (int d = 0; d < dim; d++) {
+            max_ring = std::max(max_ring, std::max(std::abs(center[d]), std::abs(res[d] - 1 - center[d])));
+        }
+        for (int ring = 0; ring <= max_ring; ring++) {
+            if (found == k && ring > 0) {
+                // Points in this ring are at least (ring - 1) cells away
+                real bound = (ring - 1) * cell_size;
+                if (bound * bound >= heap[0].first) {
+                    break;
+                }
+            }
+            for_each_in_ring(center, ring, [&](int s) {
+                real d2 = get_dist2(p, sorted_points[s]);
+                if (found < k) {
+                    heap[found++] = std::make_pair(d2, sorted_indices[s]);
+                    std::push_heap(heap, heap + found);
+                } else if (d2 < heap[0].first) {
+                    std::pop_heap(heap, heap + k);
+                    heap[k - 1] = std::make_pair(d2, sorted_indices[s]);
+                    std::push_heap(heap, heap + k);
+                }
+            });
+        }
+        std::sort_heap(heap, heap + found);
+        for (int i = 0; i < k; i++) {
+            index[i] = i < found ? heap[i].second : -1;
+            dist2[i] = i < found ? heap[i].first : 1e30f;
+        }
+    }
+
+    void query_k(const Vector &p, int k, std::vector<int> &index, std::vector<real> &dist2) const {
+        index.resize((size_t)std::max(k, 0));
+        dist2.resize((size_t)std::max(k, 0));
+        if (k > 0) {
+            query_k(p, k, &index[0], &dist2[0]);
+        }
+    }
+
+    // k nearest points of every query, flattened: neighbours of query q are [q * k, (q + 1) * k)
+    void query_k_batch(const std::vector<Vector> &queries, int k, std::vector<int> &index,
+                       std::vector<real> &dist2) const {
+        index.resize(queries.size() * std::max(k, 0));
+        dist2.resize(queries.size() * std::max(k, 0));
+        if (k > 0) {
+            ThreadedTaskManager::run((int)queries.size(), num_threads, [&](int q) {
+                query_k(queries[q], k, &index[q * k], &dist2[q * k]);
+            });
+        }
+    }
+
+    // Points within radius of every query, as a CSR list: neighbours of query q are
+    // index[offsets[q] .. offsets[q + 1])
+    void query_radius_batch(const std::vector<Vector> &queries, real radius, std::vector<int> &offsets,
+                            std::vector<int> &index) const {
+        const int n = (int)queries.size();
+        offsets.assign((size_t)n + 1, 0);
+        ThreadedTaskManager::run(n, num_threads, [&](int q) {
+            int count = 0;
+            for_each_in_radius(queries[q], radius, [&](int, real) { count++; });
+            offsets[q + 1] = count;
+        });
+        for (int q = 0; q < n; q++) {
+            offsets[q + 1] += offsets[q];
+        }
+        index.resize((size_t)offsets[n]);
+        ThreadedTaskManager::run(n, num_threads, [&](int q) {
+            int slot = offsets[q];
+            for_each_in_radius(queries[q], radius, [&](int i, real) { index[slot++] = i; });
+        });
+    }
+};
+
+TC_NAMESPACE_END
@@ -10,18 +10,17 @@
 #pragma once
 
 #include <taichi/common/meta.h>
+#include <taichi/nearest_neighbour/cell_list.h>
 
 TC_NAMESPACE_BEGIN
 
-#ifdef TC_USE_ANN
-
-class ANNkd_tree;
-
+// Nearest neighbour queries on a 2D point set, backed by a CellList.
+// Distances are squared.
 class NearestNeighbour2D {
 public:
-    NearestNeighbour2D();
+    NearestNeighbour2D(int num_threads = 1);
 
-    NearestNeighbour2D(const std::vector<Vector2> &data_points);
+    NearestNeighbour2D(const std::vector<Vector2> &data_points, int num_threads = 1);
 
     void clear();
 
@@ -37,36 +36,17 @@ public:
 
     void query_n_index(Vector2 p, int n, std::vector<int> &index) const;
 
-private:
-    std::vector<Vector2> data_points;
-    std::shared_ptr<ANNkd_tree> ann_kdtree;
-};
-
-#else
-
-class NearestNeighbour2D {
-public:
-    NearestNeighbour2D() { error("no impl"); }
-
-    NearestNeighbour2D(const std::vector<Vector2> &data_points) { error("no impl"); }
+    // Indices and distances of all points within radius of p
+    void query_radius(Vector2 p, real radius, std::vector<int> &index, std::vector<float> &dist) const;
 
-    void clear() {}
-
-    void initialize(const std::vector<Vector2> &data_points) {}
-
-    Vector2 query_point(Vector2 p) const { return Vector2(0.0f); }
-
-    int query_index(Vector2 p) const { return -1; }
-
-    void query(Vector2 p, int &index, float &dist) const {}
-
-    void query_n(Vector2 p, int n, std::vector<int> &index, std::vector<float> &dist) const {}
-
-    void query_n_index(Vector2 p, int n, std::vector<int> &index) const {}
+    // query_n for many points in parallel, flattened: neighbours of points[i] are [i * n, (i + 1) * n)
+    void query_n_batch(const std::vector<Vector2> &points, int n, std::vector<int> &index,
+                       std::vector<float> &dist) const;
 
+private:
+    std::vector<Vector2> data_points;
+    CellList<2> cell_list;
 };
 
-#endif
-
 TC_NAMESPACE_END
 
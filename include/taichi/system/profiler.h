@@ -24,18 +24,21 @@ public:
         Node *parent;
         std::string name;
         double total_time;
+        double last_sample;
         int64 num_samples;
 
         Node(const std::string &name, Node *parent) {
             this->name = name;
             this->parent = parent;
             this->total_time = 0.0;
+            this->last_sample = 0.0;
             this->num_samples = 1LL;
         }
 
         void insert_sample(double sample) {
             num_samples += 1;
             total_time += sample;
+            last_sample = sample;
         }
 
         double get_averaged() const {
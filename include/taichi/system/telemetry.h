@@ -0,0 +1,105 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/common/config.h>
+#include <taichi/system/timer.h>
+#include <taichi/system/profiler.h>
+#include <string>
+#include <vector>
+#include <cstdio>
+
+TC_NAMESPACE_BEGIN
+
+struct TelemetryRecord {
+    real t = 0.0f;
+    real dt = 0.0f;
+    int64 active_particles = 0;
+    int64 active_blocks = 0;
+    real max_velocity = 0.0f;
+    // max / mean of per-rank workload; 1 for perfect balance (or no MPI)
+    real mpi_imbalance = 1.0f;
+};
+
+// Structured per-substep telemetry, written as JSON lines:
+// {"timestamp": ..., "substep": ..., "t": ..., "dt": ..., ..., "phases": {"name": seconds, ...}}
+// Phase timings are the latest samples of the children of the current profiler scope,
+// so `write` should be called at the end of the profiled substep.
+// With an empty `telemetry_fn` the sink is disabled and `should_sample` is a single branch.
+class Telemetry {
+protected:
+    FILE *file = nullptr;
+    int interval = 1;
+    int64 substep = 0;
+
+public:
+    Telemetry() {}
+
+    Telemetry(const Telemetry &) = delete;
+
+    Telemetry &operator=(const Telemetry &) = delete;
+
+    void initialize(const Config &config) {
+        close();
+        std::string fn = config.get("telemetry_fn", std::string(""));
+        interval = std::max(1, config.get("telemetry_interval", 1));
+        substep = 0;
+        if (!fn.empty()) {
+            file = fopen(fn.c_str(), "a");
+            assert_info(file != nullptr, "Can not open telemetry file " + fn);
+        }
+    }
+
+    bool enabled() const {
+        return file != nullptr;
+    }
+
+    // Call once per substep. Returns true if this substep should be recorded.
+    bool should_sample() {
+        if (file == nullptr) {
+            return false;
+        }
+        return (substep++) % interval == 0;
+    }
+
+    void write(const TelemetryRecord &record) {
+        if (file == nullptr) {
+            return;
+        }
+        fprintf(file, "{\"timestamp\": %.6f, \"substep\": %lld, \"t\": %.9g, \"dt\": %.9g, "
+                        "\"active_particles\": %lld, \"active_blocks\": %lld, "
+                        "\"max_velocity\": %.9g, \"mpi_imbalance\": %.6g, \"phases\": {",
+                Time::get_time(), substep - 1, record.t, record.dt,
+                record.active_particles, record.active_blocks,
+                record.max_velocity, record.mpi_imbalance);
+        auto node = ProfilerRecords::get_instance().current_node;
+        for (int i = 0; i < (int)node->childs.size(); i++) {
+            fprintf(file, "%s\"%s\": %.6g", i == 0 ? "" : ", ", node->childs[i]->name.c_str(),
+                    node->childs[i]->last_sample);
+        }
+        fprintf(file, "}}\n");
+        // Flush so that dashboards tailing the file see complete lines
+        fflush(file);
+    }
+
+    void close() {
+        if (file != nullptr) {
+            fclose(file);
+            file = nullptr;
+        }
+    }
+
+    ~Telemetry() {
+        close();
+    }
+};
+
+TC_NAMESPACE_END
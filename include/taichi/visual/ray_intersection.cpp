@@ -8,9 +8,24 @@
 *******************************************************************************/
 
 #include "ray_intersection.h"
+#include <taichi/geometry/bvh.h>
+#include <algorithm>
 
 TC_NAMESPACE_BEGIN
 
+// Overloads of rtcIntersect4/8/16, so that packets of any width share one code path
+static void intersect_packet(const void *valid, RTCScene scene, RTCRay4 &packet) {
+    rtcIntersect4(valid, scene, packet);
+}
+
+static void intersect_packet(const void *valid, RTCScene scene, RTCRay8 &packet) {
+    rtcIntersect8(valid, scene, packet);
+}
+
+static void intersect_packet(const void *valid, RTCScene scene, RTCRay16 &packet) {
+    rtcIntersect16(valid, scene, packet);
+}
+
 
 class BruteForceRayIntersection : public RayIntersection {
 public:
@@ -22,8 +37,22 @@ public:
 
     void add_triangle(Triangle &triangle) override;
 
+    void add_mesh(const std::vector<Vector3> &vertices, const std::vector<Vector3i> &indices) override;
+
+    int add_prototype(const std::vector<Vector3> &vertices, const std::vector<Vector3i> &indices) override;
+
+    void add_instance(const Instance &instance) override;
+
 private:
+    // Triangles of vertices[indices[0 .. n)], with ids first_id, first_id + 1, ...
+    static void append_triangles(std::vector<Triangle> &triangles, const std::vector<Vector3> &vertices,
+                                 const std::vector<Vector3i> &indices, int first_id);
+
     std::vector<Triangle> triangles;
+    std::vector<std::vector<Triangle>> prototypes;
+    std::vector<Instance> instances;
+    // Inverses of the instance transforms, from build()
+    std::vector<Matrix4> inverse_transforms;
 
     // Inherited via RayIntersection
     virtual bool occlude(Ray &ray) override;
@@ -31,6 +60,14 @@ private:
 
 class EmbreeRayIntersection : public RayIntersection {
 public:
+    void initialize(const Config &config) override {
+        dynamic = config.get("dynamic", false);
+    }
+
+    ~EmbreeRayIntersection() {
+        clear();
+    }
+
     void clear() override;
 
     void build() override;
@@ -39,42 +76,302 @@ public:
 
     void add_triangle(Triangle &triangle) override;
 
+    void add_mesh(const std::vector<Vector3> &mesh_vertices, const std::vector<Vector3i> &mesh_indices) override;
+
     virtual bool occlude(Ray &ray) override;
 
+    void query_batch(Ray *rays, int n) override;
+
+    bool update_vertices(const std::vector<Vector3> &new_vertices) override;
+
+    int add_prototype(const std::vector<Vector3> &vertices, const std::vector<Vector3i> &indices) override;
+
+    void add_instance(const Instance &instance) override;
+
 private:
-    std::vector<Triangle> triangles;
-    RTCDevice rtc_device;
-    RTCScene rtc_scene;
-    int geom_id;
+    // Shared vertices, and three of them per triangle
+    std::vector<Vector3> vertices;
+    std::vector<Vector3i> indices;
+    std::vector<std::vector<Vector3>> prototype_vertices;
+    std::vector<std::vector<Vector3i>> prototype_indices;
+    std::vector<Instance> instances;
+    RTCDevice rtc_device = nullptr;
+    RTCScene rtc_scene = nullptr;
+    // With instances, rtc_scene holds Embree instances of the scenes in rtc_prototypes (and of
+    // one for the non-instanced triangles), and instance_ids maps their geometry ids to ours
+    std::vector<RTCScene> rtc_prototypes;
+    std::vector<int> instance_ids;
+    RTCAlgorithmFlags algorithm_flags;
+    // With dynamic, the non-instanced triangles are deformable, so that update_vertices can refit them
+    bool dynamic = false;
+    // The scene and geometry of the non-instanced triangles (rtc_mesh_scene is null if there are none),
+    // and the id of its instance in rtc_scene if instanced
+    RTCScene rtc_mesh_scene = nullptr;
+    unsigned mesh_geom_id, mesh_instance_id;
+    // Widest packet (16, 8, 4, or 1 if none) and whether ray streams are supported by the device
+    int packet_size;
+    bool stream_supported;
+
+    template <typename RTCRayK, int K>
+    void query_packets(Ray *rays, int n);
+
+    RTCScene new_mesh_scene(const std::vector<Vector3> &mesh_vertices, const std::vector<Vector3i> &mesh_indices,
+                            bool deformable, unsigned &geom_id);
+
+    // Our instance id of a hit, from the instID reported by Embree
+    int get_instance_id(unsigned inst_id) const {
+        return inst_id < instance_ids.size() ? instance_ids[inst_id] : -1;
+    }
 };
 
+// Native BVH, for builds or CPUs without a working Embree
+class BVHRayIntersection : public RayIntersection {
+public:
+    void initialize(const Config &config) override {
+        num_threads = config.get("num_threads", 1);
+        leaf_size = config.get("leaf_size", 4);
+        bvh = BVH(num_threads, leaf_size);
+    }
+
+    void clear() override {
+        vertices.clear();
+        indices.clear();
+        prototype_vertices.clear();
+        prototype_indices.clear();
+        instances.clear();
+    }
+
+    void build() override {
+        bvh.build(vertices, indices);
+        if (instances.empty()) {
+            return;
+        }
+        // Geometry is only kept in the BVHs, so that each prototype is stored once
+        prototype_bvhs.assign(prototype_vertices.size(), BVH(num_threads, leaf_size));
+        for (int i = 0; i < (int)prototype_bvhs.size(); i++) {
+            prototype_bvhs[i].build(prototype_vertices[i], prototype_indices[i]);
+        }
+        prototype_vertices.clear();
+        prototype_indices.clear();
+        instance_bvh = InstanceBVH(num_threads);
+        instance_bvh.build(prototype_bvhs, instances);
+    }
+
+    void query(Ray &ray) override {
+        ray.dist = Ray::DIST_INFINITE;
+        ray.triangle_id = -1;
+        ray.instance_id = -1;
+        if (bvh.get_num_triangles() > 0) {
+            bvh.intersect(ray, eps * 10);
+        }
+        if (!instances.empty()) {
+            instance_bvh.intersect(ray, eps * 10);
+        }
+    }
+
+    // Rays are traced in the Morton order of their origins, on a grid of up to 32^3 cells with
+    // about one ray per cell, so that consecutive rays start close to each other and visit mostly
+    // the same nodes and leaves while they are in cache. Each ray gets the same result as query().
+    void query_batch(Ray *rays, int n) override {
+        int levels = 0;
+        while (levels < max_sort_levels && (1 << (3 * (levels + 1))) <= n) {
+            levels++;
+        }
+        Vector3 lower(std::numeric_limits<real>::infinity()), upper(-std::numeric_limits<real>::infinity());
+        for (int i = 0; i < n; i++) {
+            lower = glm::min(lower, rays[i].orig);
+            upper = glm::max(upper, rays[i].orig);
+        }
+        // Nothing to sort for small batches, or rays from a single point (e.g. camera rays)
+        if (levels == 0 || lower == upper) {
+            RayIntersection::query_batch(rays, n);
+            return;
+        }
+        const int res = 1 << levels;
+        const Vector3 scale = Vector3((real)res) / glm::max(upper - lower, Vector3(1e-20f));
+        // Counting sort by cell
+        std::vector<int> codes((size_t)n), offsets(((size_t)1 << (3 * levels)) + 1, 0), order((size_t)n);
+        for (int i = 0; i < n; i++) {
+            const Vector3i cell = glm::min(Vector3i((rays[i].orig - lower) * scale), Vector3i(res - 1));
+            codes[i] = spread_bits(cell.x) | (spread_bits(cell.y) << 1) | (spread_bits(cell.z) << 2);
+            offsets[codes[i] + 1]++;
+        }
+        for (int c = 1; c < (int)offsets.size(); c++) {
+            offsets[c] += offsets[c - 1];
+        }
+        for (int i = 0; i < n; i++) {
+            order[offsets[codes[i]]++] = i;
+        }
+        for (int i = 0; i < n; i++) {
+            query(rays[order[i]]);
+        }
+    }
+
+    bool occlude(Ray &ray) override {
+        return (bvh.get_num_triangles() > 0 && bvh.occluded(ray, eps * 10)) ||
+               (!instances.empty() && instance_bvh.occluded(ray, eps * 10));
+    }
+
+    int add_prototype(const std::vector<Vector3> &mesh_vertices, const std::vector<Vector3i> &mesh_indices) override {
+        prototype_vertices.push_back(mesh_vertices);
+        prototype_indices.push_back(mesh_indices);
+        return (int)prototype_vertices.size() - 1;
+    }
+
+    void add_instance(const Instance &instance) override {
+        instances.push_back(instance);
+    }
+
+    void add_triangle(Triangle &triangle) override {
+        int base = (int)vertices.size();
+        for (int k = 0; k < 3; k++) {
+            vertices.push_back(triangle.v[k]);
+        }
+        indices.push_back(Vector3i(base, base + 1, base + 2));
+    }
+
+    void add_mesh(const std::vector<Vector3> &mesh_vertices, const std::vector<Vector3i> &mesh_indices) override {
+        const int base = (int)vertices.size();
+        vertices.insert(vertices.end(), mesh_vertices.begin(), mesh_vertices.end());
+        for (auto &index : mesh_indices) {
+            indices.push_back(index + base);
+        }
+    }
+
+    bool update_vertices(const std::vector<Vector3> &new_vertices) override {
+        if (new_vertices.size() != vertices.size() || bvh.get_num_triangles() != (int)indices.size()) {
+            return false;
+        }
+        vertices = new_vertices;
+        bvh.refit(vertices, indices);
+        return true;
+    }
+
+private:
+    // Finer grids of ray origins do not make batches noticeably more coherent
+    static const int max_sort_levels = 5;
+
+    // Bits 0..4 of x, moved to bits 0, 3, ..., 12
+    static int spread_bits(int x) {
+        int v = 0;
+        for (int b = 0; b < max_sort_levels; b++) {
+            v |= ((x >> b) & 1) << (3 * b);
+        }
+        return v;
+    }
+
+    int num_threads = 1, leaf_size = 4;
+    std::vector<Vector3> vertices;
+    std::vector<Vector3i> indices;
+    std::vector<std::vector<Vector3>> prototype_vertices;
+    std::vector<std::vector<Vector3i>> prototype_indices;
+    std::vector<Instance> instances;
+    BVH bvh;
+    std::vector<BVH> prototype_bvhs;
+    InstanceBVH instance_bvh;
+};
 
 void BruteForceRayIntersection::clear() {
     triangles.clear();
+    prototypes.clear();
+    instances.clear();
 }
 
 void BruteForceRayIntersection::build() {
+    inverse_transforms.clear();
+    for (auto &instance : instances) {
+        inverse_transforms.push_back(glm::inverse(instance.transform));
+    }
 }
 
 void BruteForceRayIntersection::query(Ray &ray) {
+    ray.instance_id = -1;
     for (auto &triangle : triangles) {
         triangle.intersect(ray);
     }
+    // Instances are tested in object space
+    for (int i = 0; i < (int)instances.size(); i++) {
+        Ray local = ray.get_transformed(inverse_transforms[i]);
+        for (auto &triangle : prototypes[instances[i].id]) {
+            triangle.intersect(local);
+        }
+        if (local.triangle_id != -1) {
+            ray.dist = local.dist;
+            ray.triangle_id = local.triangle_id;
+            ray.instance_id = i;
+            ray.u = local.u;
+            ray.v = local.v;
+        }
+    }
 }
 
 void BruteForceRayIntersection::add_triangle(Triangle &triangle) {
     triangles.push_back(triangle);
 }
 
+void BruteForceRayIntersection::append_triangles(std::vector<Triangle> &triangles,
+                                                 const std::vector<Vector3> &vertices,
+                                                 const std::vector<Vector3i> &indices, int first_id) {
+    for (int i = 0; i < (int)indices.size(); i++) {
+        const Vector3i &index = indices[i];
+        triangles.push_back(Triangle(vertices[index[0]], vertices[index[1]], vertices[index[2]], Vector3(0),
+                                     Vector3(0), Vector3(0), Vector2(0), Vector2(0), Vector2(0), first_id + i));
+    }
+}
+
+void BruteForceRayIntersection::add_mesh(const std::vector<Vector3> &vertices, const std::vector<Vector3i> &indices) {
+    append_triangles(triangles, vertices, indices, (int)triangles.size());
+}
+
+int BruteForceRayIntersection::add_prototype(const std::vector<Vector3> &vertices,
+                                             const std::vector<Vector3i> &indices) {
+    prototypes.push_back(std::vector<Triangle>());
+    append_triangles(prototypes.back(), vertices, indices, 0);
+    return (int)prototypes.size() - 1;
+}
+
+void BruteForceRayIntersection::add_instance(const Instance &instance) {
+    instances.push_back(instance);
+}
+
 bool BruteForceRayIntersection::occlude(Ray &ray) {
+    Ray test = ray;
+    test.triangle_id = -1;
+    for (auto &triangle : triangles) {
+        triangle.intersect(test);
+        if (test.triangle_id != -1) {
+            return true;
+        }
+    }
+    for (int i = 0; i < (int)instances.size(); i++) {
+        Ray local = ray.get_transformed(inverse_transforms[i]);
+        for (auto &triangle : prototypes[instances[i].id]) {
+            triangle.intersect(local);
+            if (local.triangle_id != -1) {
+                return true;
+            }
+        }
+    }
     return false;
-
 }
 
 void EmbreeRayIntersection::clear() {
-    triangles.clear();
-    rtcDeleteScene(rtc_scene);
-    rtcDeleteDevice(rtc_device);
+    vertices.clear();
+    indices.clear();
+    prototype_vertices.clear();
+    prototype_indices.clear();
+    instances.clear();
+    instance_ids.clear();
+    // The device is kept for later builds
+    if (rtc_scene) {
+        rtcDeleteScene(rtc_scene);
+    }
+    for (auto prototype : rtc_prototypes) {
+        rtcDeleteScene(prototype);
+    }
+    rtc_prototypes.clear();
+    rtc_scene = nullptr;
+    rtc_mesh_scene = nullptr;
 }
 
 /* error reporting function */
@@ -114,48 +411,140 @@ void error_handler(const RTCError code, const char *str = nullptr) {
     assert(false);
 }
 
-void EmbreeRayIntersection::build() {
-    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
-    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
-    int num_triangles = (int)triangles.size(),
-        num_vertices = num_triangles * 3;
-    RTCGeometryFlags geom_flags = RTC_GEOMETRY_STATIC;
+// One device for all builds of the process, so that its setup is paid once for a sequence of frames
+static RTCDevice get_rtc_device() {
+    static RTCDevice device = [] {
+        RTCDevice device = rtcNewDevice(NULL);
+        error_handler(rtcDeviceGetError(device));
+        rtcDeviceSetErrorFunction(device, error_handler);
+        return device;
+    }();
+    return device;
+}
 
-    rtc_device = rtcNewDevice(NULL);
+struct RTCVertex {
+    float x, y, z, a;
+};
 
-    error_handler(rtcDeviceGetError(rtc_device));
-    rtcDeviceSetErrorFunction(rtc_device, error_handler);
+static void write_rtc_vertices(RTCScene scene, unsigned geom_id, const std::vector<Vector3> &vertices) {
+    RTCVertex *rtc_vertices = (RTCVertex *)rtcMapBuffer(scene, geom_id, RTC_VERTEX_BUFFER);
+    for (int i = 0; i < (int)vertices.size(); i++) {
+        *(Vector4 *)(&rtc_vertices[i]) = Vector4(vertices[i], 0);
+    }
+    rtcUnmapBuffer(scene, geom_id, RTC_VERTEX_BUFFER);
+}
 
-    rtc_scene = rtcDeviceNewScene(rtc_device, RTC_SCENE_STATIC, RTC_INTERSECT1);
-    geom_id = rtcNewTriangleMesh(rtc_scene, geom_flags, num_triangles, num_vertices, 1);
+RTCScene EmbreeRayIntersection::new_mesh_scene(const std::vector<Vector3> &mesh_vertices,
+                                               const std::vector<Vector3i> &mesh_indices, bool deformable,
+                                               unsigned &geom_id) {
+    int num_triangles = (int)mesh_indices.size(),
+        num_vertices = (int)mesh_vertices.size();
+    RTCGeometryFlags geom_flags = deformable ? RTC_GEOMETRY_DEFORMABLE : RTC_GEOMETRY_STATIC;
+
+    RTCScene scene = rtcDeviceNewScene(rtc_device, deformable ? RTC_SCENE_DYNAMIC : RTC_SCENE_STATIC,
+                                       algorithm_flags);
+    geom_id = rtcNewTriangleMesh(scene, geom_flags, num_triangles, num_vertices, 1);
 
-    struct RTCVertex {
-        float x, y, z, a;
-    };
     struct RTCTriangle {
         int v[3];
     };
 
-    RTCVertex *vertices = (RTCVertex *)rtcMapBuffer(rtc_scene, geom_id, RTC_VERTEX_BUFFER);
+    write_rtc_vertices(scene, geom_id, mesh_vertices);
+
+    RTCTriangle *rtc_triangles = (RTCTriangle *)rtcMapBuffer(scene, geom_id, RTC_INDEX_BUFFER);
     for (int i = 0; i < num_triangles; i++) {
         for (int k = 0; k < 3; k++) {
-            *(Vector4 *)(&vertices[i * 3 + k]) = Vector4(triangles[i].v[k], 0);
+            rtc_triangles[i].v[k] = mesh_indices[i][k];
         }
     }
-    rtcUnmapBuffer(rtc_scene, geom_id, RTC_VERTEX_BUFFER);
+    rtcUnmapBuffer(scene, geom_id, RTC_INDEX_BUFFER);
 
-    RTCTriangle *triangles = (RTCTriangle *)rtcMapBuffer(rtc_scene, geom_id, RTC_INDEX_BUFFER);
-    for (int i = 0; i < num_triangles; i++) {
-        for (int k = 0; k < 3; k++) {
-            triangles[i].v[k] = i * 3 + k;
+    rtcCommit(scene);
+    error_handler(rtcDeviceGetError(rtc_device));
+    return scene;
+}
+
+void EmbreeRayIntersection::build() {
+    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+
+    rtc_device = get_rtc_device();
+
+    // Enable the packet and stream queries this build of Embree supports, for query_batch
+    int flags = RTC_INTERSECT1;
+    stream_supported = rtcDeviceGetParameter1i(rtc_device, RTC_CONFIG_INTERSECTN) != 0;
+    if (stream_supported) {
+        flags |= RTC_INTERSECTN;
+    }
+    packet_size = 1;
+    const std::pair<RTCParameter, int> packets[3] = {
+            {RTC_CONFIG_INTERSECT16, 16}, {RTC_CONFIG_INTERSECT8, 8}, {RTC_CONFIG_INTERSECT4, 4}};
+    const RTCAlgorithmFlags packet_flags[3] = {RTC_INTERSECT16, RTC_INTERSECT8, RTC_INTERSECT4};
+    for (int i = 0; i < 3; i++) {
+        if (rtcDeviceGetParameter1i(rtc_device, packets[i].first)) {
+            packet_size = packets[i].second;
+            flags |= packet_flags[i];
+            break;
         }
     }
-    rtcUnmapBuffer(rtc_scene, geom_id, RTC_INDEX_BUFFER);
+    algorithm_flags = (RTCAlgorithmFlags)flags;
+    error_handler(rtcDeviceGetError(rtc_device));
+
+    if (instances.empty()) {
+        rtc_scene = rtc_mesh_scene = new_mesh_scene(vertices, indices, dynamic, mesh_geom_id);
+        return;
+    }
 
+    // One scene per prototype, instanced in rtc_scene. The non-instanced triangles are also
+    // added as an (identity) instance, since Embree only sets instID on hits inside instances.
+    for (int i = 0; i < (int)prototype_vertices.size(); i++) {
+        unsigned geom_id;
+        rtc_prototypes.push_back(new_mesh_scene(prototype_vertices[i], prototype_indices[i], false, geom_id));
+    }
+    // Embree has its own copies now
+    prototype_vertices.clear();
+    prototype_indices.clear();
+    // Dynamic, so that it can be committed again after the non-instanced triangles move
+    rtc_scene = rtcDeviceNewScene(rtc_device, dynamic ? RTC_SCENE_DYNAMIC : RTC_SCENE_STATIC, algorithm_flags);
+    auto add_rtc_instance = [&](RTCScene source, const Matrix4 &transform, int id) {
+        unsigned geom_id = rtcNewInstance2(rtc_scene, source);
+        rtcSetTransform2(rtc_scene, geom_id, RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, &transform[0][0]);
+        instance_ids.resize(std::max(instance_ids.size(), (size_t)geom_id + 1), -1);
+        instance_ids[geom_id] = id;
+        return geom_id;
+    };
+    if (!indices.empty()) {
+        rtc_mesh_scene = new_mesh_scene(vertices, indices, dynamic, mesh_geom_id);
+        rtc_prototypes.push_back(rtc_mesh_scene);
+        mesh_instance_id = add_rtc_instance(rtc_mesh_scene, Matrix4(1.0f), -1);
+    }
+    for (int i = 0; i < (int)instances.size(); i++) {
+        add_rtc_instance(rtc_prototypes[instances[i].id], instances[i].transform, i);
+    }
     rtcCommit(rtc_scene);
     error_handler(rtcDeviceGetError(rtc_device));
 }
 
+bool EmbreeRayIntersection::update_vertices(const std::vector<Vector3> &new_vertices) {
+    if (!dynamic || !rtc_scene || new_vertices.size() != vertices.size()) {
+        return false;
+    }
+    vertices = new_vertices;
+    if (rtc_mesh_scene == nullptr) {
+        return true;
+    }
+    // Deformable geometry is refit by the commit, instead of rebuilt
+    write_rtc_vertices(rtc_mesh_scene, mesh_geom_id, vertices);
+    rtcUpdateBuffer(rtc_mesh_scene, mesh_geom_id, RTC_VERTEX_BUFFER);
+    rtcCommit(rtc_mesh_scene);
+    if (rtc_mesh_scene != rtc_scene) {
+        rtcUpdate(rtc_scene, mesh_instance_id);
+        rtcCommit(rtc_scene);
+    }
+    error_handler(rtcDeviceGetError(rtc_device));
+    return true;
+}
+
 void EmbreeRayIntersection::query(Ray &ray) {
     RTCRay rtc_ray;
     *(Vector3 *)rtc_ray.org = ray.orig;
@@ -166,12 +555,14 @@ void EmbreeRayIntersection::query(Ray &ray) {
     rtc_ray.mask = -1;
     rtc_ray.geomID = RTC_INVALID_GEOMETRY_ID;
     rtc_ray.primID = RTC_INVALID_GEOMETRY_ID;
+    rtc_ray.instID = RTC_INVALID_GEOMETRY_ID;
 
     rtcIntersect(rtc_scene, rtc_ray);
     ray.u = rtc_ray.u;
     ray.v = rtc_ray.v;
     ray.dist = rtc_ray.tfar;
     ray.triangle_id = rtc_ray.primID;
+    ray.instance_id = get_instance_id(rtc_ray.instID);
     return;
     Vector3 normal = Vector3(rtc_ray.Ng[0], rtc_ray.Ng[1], rtc_ray.Ng[2]); // What the hell happened to Ng???
     normal /= max_component(abs(normal));
@@ -179,11 +570,105 @@ void EmbreeRayIntersection::query(Ray &ray) {
 }
 
 void EmbreeRayIntersection::add_triangle(Triangle &triangle) {
-    triangles.push_back(triangle);
+    int base = (int)vertices.size();
+    for (int k = 0; k < 3; k++) {
+        vertices.push_back(triangle.v[k]);
+    }
+    indices.push_back(Vector3i(base, base + 1, base + 2));
+}
+
+int EmbreeRayIntersection::add_prototype(const std::vector<Vector3> &mesh_vertices,
+                                         const std::vector<Vector3i> &mesh_indices) {
+    prototype_vertices.push_back(mesh_vertices);
+    prototype_indices.push_back(mesh_indices);
+    return (int)prototype_vertices.size() - 1;
+}
+
+void EmbreeRayIntersection::add_instance(const Instance &instance) {
+    instances.push_back(instance);
+}
+
+void EmbreeRayIntersection::add_mesh(const std::vector<Vector3> &mesh_vertices,
+                                     const std::vector<Vector3i> &mesh_indices) {
+    const int base = (int)vertices.size();
+    vertices.insert(vertices.end(), mesh_vertices.begin(), mesh_vertices.end());
+    for (auto &index : mesh_indices) {
+        indices.push_back(index + base);
+    }
+}
+
+template <typename RTCRayK, int K>
+void EmbreeRayIntersection::query_packets(Ray *rays, int n) {
+    for (int begin = 0; begin < n; begin += K) {
+        const int m = std::min(K, n - begin);
+        RTCRayK packet;
+        alignas(64) int valid[K];
+        for (int i = 0; i < K; i++) {
+            // Inactive lanes must still hold finite values
+            const Ray &ray = rays[begin + std::min(i, m - 1)];
+            valid[i] = i < m ? -1 : 0;
+            packet.orgx[i] = ray.orig.x;
+            packet.orgy[i] = ray.orig.y;
+            packet.orgz[i] = ray.orig.z;
+            packet.dirx[i] = ray.dir.x;
+            packet.diry[i] = ray.dir.y;
+            packet.dirz[i] = ray.dir.z;
+            packet.tnear[i] = eps * 10;
+            packet.tfar[i] = Ray::DIST_INFINITE;
+            packet.time[i] = 0.0f;
+            packet.mask[i] = -1;
+            packet.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+            packet.primID[i] = RTC_INVALID_GEOMETRY_ID;
+            packet.instID[i] = RTC_INVALID_GEOMETRY_ID;
+        }
+        intersect_packet(valid, rtc_scene, packet);
+        for (int i = 0; i < m; i++) {
+            Ray &ray = rays[begin + i];
+            ray.u = packet.u[i];
+            ray.v = packet.v[i];
+            ray.dist = packet.tfar[i];
+            ray.triangle_id = packet.primID[i];
+            ray.instance_id = get_instance_id(packet.instID[i]);
+        }
+    }
+}
+
+void EmbreeRayIntersection::query_batch(Ray *rays, int n) {
+    if (stream_supported) {
+        std::vector<RTCRay> stream((size_t)n);
+        for (int i = 0; i < n; i++) {
+            RTCRay &rtc_ray = stream[i];
+            *(Vector3 *)rtc_ray.org = rays[i].orig;
+            *(Vector3 *)rtc_ray.dir = rays[i].dir;
+            rtc_ray.tnear = eps * 10;
+            rtc_ray.tfar = Ray::DIST_INFINITE;
+            rtc_ray.time = 0.0f;
+            rtc_ray.mask = -1;
+            rtc_ray.geomID = RTC_INVALID_GEOMETRY_ID;
+            rtc_ray.primID = RTC_INVALID_GEOMETRY_ID;
+            rtc_ray.instID = RTC_INVALID_GEOMETRY_ID;
+        }
+        // Incoherent, since batches usually mix directions (e.g. bounces of many paths)
+        rtcIntersectN(rtc_scene, stream.data(), (size_t)n, sizeof(RTCRay), RTC_RAYN_DEFAULT);
+        for (int i = 0; i < n; i++) {
+            rays[i].u = stream[i].u;
+            rays[i].v = stream[i].v;
+            rays[i].dist = stream[i].tfar;
+            rays[i].triangle_id = stream[i].primID;
+            rays[i].instance_id = get_instance_id(stream[i].instID);
+        }
+    } else if (packet_size == 16) {
+        query_packets<RTCRay16, 16>(rays, n);
+    } else if (packet_size == 8) {
+        query_packets<RTCRay8, 8>(rays, n);
+    } else if (packet_size == 4) {
+        query_packets<RTCRay4, 4>(rays, n);
+    } else {
+        RayIntersection::query_batch(rays, n);
+    }
 }
 
 bool EmbreeRayIntersection::occlude(Ray &ray) {
-    assert(false); //TODO
     RTCRay rtc_ray;
     *(Vector3 *)rtc_ray.org = ray.orig;
     *(Vector3 *)rtc_ray.dir = ray.dir;
@@ -194,17 +679,16 @@ bool EmbreeRayIntersection::occlude(Ray &ray) {
     rtc_ray.geomID = RTC_INVALID_GEOMETRY_ID;
     rtc_ray.primID = RTC_INVALID_GEOMETRY_ID;
 
-    rtcIntersect(rtc_scene, rtc_ray);
-    ray.u = rtc_ray.u;
-    ray.v = rtc_ray.v;
-    ray.dist = rtc_ray.tfar;
-    ray.triangle_id = rtc_ray.primID;
-    return false;
+    // geomID is set to 0 if anything is hit
+    rtcOccluded(rtc_scene, rtc_ray);
+    return rtc_ray.geomID == 0;
 }
 
 TC_IMPLEMENTATION(RayIntersection, BruteForceRayIntersection, "bf");
 
 TC_IMPLEMENTATION(RayIntersection, EmbreeRayIntersection, "embree");
 
+TC_IMPLEMENTATION(RayIntersection, BVHRayIntersection, "bvh");
+
 TC_NAMESPACE_END
 
@@ -24,9 +24,36 @@ public:
 
     virtual void query(Ray &ray) = 0;
 
+    // Whether anything is hit within ray.dist (any hit, not the closest one). ray is not modified.
     virtual bool occlude(Ray &ray) = 0;
 
+    // Same as query() on rays[0 .. n), which backends may trace together
+    virtual void query_batch(Ray *rays, int n) {
+        for (int i = 0; i < n; i++) {
+            query(rays[i]);
+        }
+    }
+
     virtual void add_triangle(Triangle &triangle) = 0;
+
+    // Triangles with positions vertices[indices[i][0..2]], numbered after those added before:
+    // hits on indices[i] report triangle_id = (number of triangles added before) + i.
+    virtual void add_mesh(const std::vector<Vector3> &vertices, const std::vector<Vector3i> &indices) = 0;
+
+    // New positions for the vertices of the non-instanced triangles (those of add_triangle and add_mesh, in
+    // order), with the triangles themselves unchanged. Backends that can update their acceleration
+    // structure in place do so and return true. Otherwise, nothing is changed, and the geometry should
+    // be added again and rebuilt.
+    virtual bool update_vertices(const std::vector<Vector3> &vertices) {
+        return false;
+    }
+
+    // Geometry in object space that is shared by instances. Returns its id (0, 1, ...) for add_instance.
+    virtual int add_prototype(const std::vector<Vector3> &vertices, const std::vector<Vector3i> &indices) = 0;
+
+    // A copy of prototype instance.id, placed by instance.transform. Hits on it have instance_id set
+    // to the number of instances added before, and triangle_id relative to the prototype.
+    virtual void add_instance(const Instance &instance) = 0;
 };
 
 TC_INTERFACE(RayIntersection);
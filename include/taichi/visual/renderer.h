@@ -50,8 +50,8 @@ public:
     Vector3 trace(Ray &ray) {
         int tri_id = sg->query_hit_triangle_id(ray);
         real temp = 0;
-        if (tri_id != -1) {
-            temp = scene->triangles[tri_id].temperature;
+        if (tri_id != -1 && tri_id < scene->num_triangles) {
+            temp = scene->get_triangles()[tri_id].temperature;
         }
         return Vector3(temp);
     }
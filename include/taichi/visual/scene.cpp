@@ -9,6 +9,8 @@
 
 #include <taichi/visual/scene.h>
 #include <taichi/visual/surface_material.h>
+#include <cstdint>
+#include <cstring>
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include <tiny_obj_loader.h>
@@ -37,6 +39,20 @@ void Mesh::load_from_file(const std::string &file_path) {
 
     assert_info(ret, "Loading " + file_path + " failed");
 
+    // Attributes are kept as indexed in the file; missing normals are generated per face,
+    // and missing uvs refer to a shared (0, 0)
+    int vertex_offset = (int)vertices.size(), normal_offset = (int)normals.size(), uv_offset = (int)uvs.size();
+    for (size_t i = 0; i < attrib.vertices.size() / 3; i++) {
+        vertices.push_back(Vector3(attrib.vertices[3 * i + 0], attrib.vertices[3 * i + 1], attrib.vertices[3 * i + 2]));
+    }
+    for (size_t i = 0; i < attrib.normals.size() / 3; i++) {
+        normals.push_back(Vector3(attrib.normals[3 * i + 0], attrib.normals[3 * i + 1], attrib.normals[3 * i + 2]));
+    }
+    for (size_t i = 0; i < attrib.texcoords.size() / 2; i++) {
+        uvs.push_back(Vector2(attrib.texcoords[2 * i + 0], attrib.texcoords[2 * i + 1]));
+    }
+    int default_uv = -1;
+
     // Loop over shapes
     for (size_t s = 0; s < shapes.size(); s++) {
         // Loop over faces(polygon)
@@ -46,49 +62,169 @@ void Mesh::load_from_file(const std::string &file_path) {
 
             // Loop over vertices in the face.
             assert_info(fv == 3, "Only triangles supported...");
-            int i = (int)vertices.size(), j = i + 1, k = i + 2;
-            bool has_normal = false;
+            Face face;
+            face.material = 0;
+            bool has_normal = true;
             for (size_t v = 0; v < fv; v++) {
                 // access to vertex
                 tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-                float vx = attrib.vertices[3 * idx.vertex_index + 0];
-                float vy = attrib.vertices[3 * idx.vertex_index + 1];
-                float vz = attrib.vertices[3 * idx.vertex_index + 2];
-                vertices.push_back(Vector3(vx, vy, vz));
-                if (idx.normal_index != -1) {
-                    float nx = attrib.normals[3 * idx.normal_index + 0];
-                    float ny = attrib.normals[3 * idx.normal_index + 1];
-                    float nz = attrib.normals[3 * idx.normal_index + 2];
-                    has_normal = true;
-                    normals.push_back(Vector3(nx, ny, nz));
-                } else {
-                    // should be consistent
-                    assert(!has_normal);
-                    has_normal = false;
-                }
-                float tx = 0.0f, ty = 0.0f;
+                face.vert_ind[v] = vertex_offset + idx.vertex_index;
+                face.normal_ind[v] = normal_offset + idx.normal_index;
+                has_normal = has_normal && idx.normal_index != -1;
                 if (idx.texcoord_index != -1) {
-                    tx = attrib.texcoords[2 * idx.texcoord_index + 0];
-                    ty = attrib.texcoords[2 * idx.texcoord_index + 1];
+                    face.uv_ind[v] = uv_offset + idx.texcoord_index;
+                } else {
+                    if (default_uv == -1) {
+                        default_uv = (int)uvs.size();
+                        uvs.push_back(Vector2(0.0f));
+                    }
+                    face.uv_ind[v] = default_uv;
                 }
-                uvs.push_back(Vector2(tx, ty));
             }
             if (!has_normal) {
-                Vector3 *a = &vertices[vertices.size()] - 3;
-                Vector3 generated_normal = cross(a[1] - a[0], a[2] - a[0]);
+                const Vector3 *a[3] = {&vertices[face.vert_ind[0]], &vertices[face.vert_ind[1]],
+                                       &vertices[face.vert_ind[2]]};
+                Vector3 generated_normal = cross(*a[1] - *a[0], *a[2] - *a[0]);
                 if (length(generated_normal) > 1e-6f) {
                     generated_normal = normalize(generated_normal);
                 }
                 for (size_t v = 0; v < fv; v++) {
-                    normals.push_back(generated_normal);
+                    face.normal_ind[v] = (int)normals.size();
                 }
+                normals.push_back(generated_normal);
             }
-            untransformed_triangles.push_back(Triangle(vertices[i], vertices[j], vertices[k],
-                normals[i], normals[j], normals[k],
-                uvs[i], uvs[j], uvs[k], i / 3));
+            faces.push_back(face);
             index_offset += fv;
         }
     }
+    mark_geometry_changed();
+}
+
+// Deduplicates values into a buffer: an open addressing hash table of indices into the buffer,
+// with linear probing. Values are compared with ==, so -0 and +0 are the same value.
+template <typename T>
+class SharedIndexTable {
+protected:
+    static const int num_components = sizeof(T) / sizeof(real);
+    std::vector<T> &buffer;
+    std::vector<int> slots;
+    int shift;
+
+    size_t get_slot(const T &value) const {
+        uint64 h = 0;
+        for (int i = 0; i < num_components; i++) {
+            // Adding +0 turns -0 into +0
+            float component = (float)(value[i] + 0.0f);
+            uint32_t bits;
+            std::memcpy(&bits, &component, sizeof(bits));
+            h = (h ^ bits) * 0x9e3779b97f4a7c15ull;
+        }
+        return (size_t)(h >> shift);
+    }
+
+    void resize(int log_size) {
+        shift = 64 - log_size;
+        slots.assign((size_t)1 << log_size, -1);
+        const size_t mask = slots.size() - 1;
+        for (int index = 0; index < (int)buffer.size(); index++) {
+            size_t slot = get_slot(buffer[index]);
+            while (slots[slot] != -1) {
+                slot = (slot + 1) & mask;
+            }
+            slots[slot] = index;
+        }
+    }
+
+public:
+    // buffer has to be empty, and expected_size is a hint
+    SharedIndexTable(std::vector<T> &buffer, size_t expected_size) : buffer(buffer) {
+        int log_size = 4;
+        while (((size_t)1 << log_size) < expected_size * 2) {
+            log_size++;
+        }
+        resize(log_size);
+    }
+
+    // Index of value in buffer, appended if it is not there yet
+    int get_index(const T &value) {
+        if (buffer.size() * 2 >= slots.size()) {
+            resize(64 - shift + 1);
+        }
+        const size_t mask = slots.size() - 1;
+        size_t slot = get_slot(value);
+        while (slots[slot] != -1) {
+            if (buffer[slots[slot]] == value) {
+                return slots[slot];
+            }
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = (int)buffer.size();
+        buffer.push_back(value);
+        return slots[slot];
+    }
+};
+
+void Mesh::set_untransformed_triangles(const std::vector<Triangle> &triangles) {
+    vertices.clear();
+    normals.clear();
+    uvs.clear();
+    faces.clear();
+    // Closed meshes have about half as many vertices as triangles
+    SharedIndexTable<Vector3> vertex_indices(vertices, triangles.size() / 2), normal_indices(normals, 16);
+    SharedIndexTable<Vector2> uv_indices(uvs, triangles.size() / 2);
+    for (auto &t : triangles) {
+        const Vector3 v[3] = {t.v[0], t.v[0] + t.v10, t.v[0] + t.v20};
+        const Vector3 n[3] = {t.n0, t.n0 + t.n10, t.n0 + t.n20};
+        const Vector2 uv[3] = {t.uv0, t.uv0 + t.uv10, t.uv0 + t.uv20};
+        Face face;
+        face.material = 0;
+        for (int k = 0; k < 3; k++) {
+            face.vert_ind[k] = vertex_indices.get_index(v[k]);
+            face.normal_ind[k] = normal_indices.get_index(n[k]);
+            face.uv_ind[k] = uv_indices.get_index(uv[k]);
+        }
+        faces.push_back(face);
+    }
+    mark_geometry_changed();
+}
+
+void Mesh::get_transformed_vertices(std::vector<Vector3> &transformed_vertices,
+                                    std::vector<Vector3> &transformed_normals) const {
+    const Matrix4 normal_transform = glm::transpose(glm::inverse(transform));
+    transformed_vertices.resize(vertices.size());
+    for (int i = 0; i < (int)vertices.size(); i++) {
+        transformed_vertices[i] = multiply_matrix4(transform, vertices[i], 1.0f);
+    }
+    transformed_normals.resize(normals.size());
+    for (int i = 0; i < (int)normals.size(); i++) {
+        transformed_normals[i] = multiply_matrix4(normal_transform, normals[i], 0.0f);
+    }
+}
+
+std::vector<Triangle> Mesh::get_triangles() const {
+    std::vector<Vector3> transformed_vertices, transformed_normals;
+    get_transformed_vertices(transformed_vertices, transformed_normals);
+    std::vector<Triangle> triangles;
+    triangles.reserve(faces.size());
+    for (int i = 0; i < (int)faces.size(); i++) {
+        const Face &f = faces[i];
+        triangles.push_back(Triangle(
+                transformed_vertices[f.vert_ind[0]], transformed_vertices[f.vert_ind[1]],
+                transformed_vertices[f.vert_ind[2]],
+                transformed_normals[f.normal_ind[0]], transformed_normals[f.normal_ind[1]],
+                transformed_normals[f.normal_ind[2]],
+                uvs[f.uv_ind[0]], uvs[f.uv_ind[1]], uvs[f.uv_ind[2]], i));
+    }
+    return triangles;
+}
+
+std::vector<Vector3i> Mesh::get_vertex_indices() const {
+    std::vector<Vector3i> indices;
+    indices.reserve(faces.size());
+    for (auto &f : faces) {
+        indices.push_back(Vector3i(f.vert_ind[0], f.vert_ind[1], f.vert_ind[2]));
+    }
+    return indices;
 }
 
 void Mesh::set_material(std::shared_ptr<SurfaceMaterial> material) {
@@ -103,68 +239,165 @@ void Mesh::set_material(std::shared_ptr<SurfaceMaterial> material) {
     }
 }
 
-IntersectionInfo Scene::get_intersection_info(int triangle_id, Ray &ray) {
+// Fills the fields of inter for a hit on t. n and uv are the shading normals and texture
+// coordinates at the vertices of t, and only read if SHADING or UV is requested.
+static void set_intersection_info(IntersectionInfo &inter, const TriangleFrame &t, const Vector3 *n,
+                                  const Vector2 *uv, int triangle_id, const Ray &ray, int fields) {
+    inter.intersected = true;
+    inter.triangle_id = triangle_id;
+    inter.dist = ray.dist;
+    const Vector3 geometry_normal = normalized(cross(t.v10, t.v20));
+    inter.front = dot(ray.orig - t.v0, geometry_normal) > 0;
+    inter.geometry_normal = inter.front ? geometry_normal : -geometry_normal;
+    real coord_u = ray.u, coord_v = ray.v;
+    const real coord_w = 1 - coord_u - coord_v;
+    if (fields & IntersectionInfo::POSITION) {
+        inter.tri_coord.x = coord_u;
+        inter.tri_coord.y = coord_u;
+        inter.pos = t.v0 + coord_u * t.v10 + coord_v * t.v20;
+    }
+    if (fields & IntersectionInfo::UV) {
+        inter.uv = coord_w * uv[0] + coord_u * uv[1] + coord_v * uv[2];
+    }
+    if (fields & IntersectionInfo::SHADING) {
+        // Verify interpolated normals can lead specular rays to go inside the object.
+        Vector3 normal = normalized(coord_w * n[0] + coord_u * n[1] + coord_v * n[2]);
+        inter.normal = inter.front ? normal : -normal;
+        Vector3 u = normalized(t.v10);
+        real sgn = inter.front ? 1.0f : -1.0f;
+        Vector3 v = normalized(cross(sgn * inter.normal, u)); // Due to shading normal, we have to normalize here...
+        inter.dt_du = Vector2(dot(t.du_dx, u), dot(t.dv_dx, u));
+        inter.dt_dv = Vector2(dot(t.du_dx, v), dot(t.dv_dx, v));
+        // TODO: ...
+        u = normalized(cross(v, inter.normal));
+        inter.to_world = Matrix3(u, v, inter.normal);
+        inter.to_local = glm::transpose(inter.to_world);
+    }
+}
+
+IntersectionInfo Scene::get_intersection_info(int triangle_id, Ray &ray, int fields) {
     IntersectionInfo inter;
     if (triangle_id == -1) {
         return inter;
     }
-    inter.intersected = true;
-    Triangle &t = triangles[triangle_id];
-    real coord_u = ray.u, coord_v = ray.v;
-    inter.tri_coord.x = coord_u;
-    inter.tri_coord.y = coord_u;
-    inter.pos = t.v[0] + coord_u * (t.v[1] - t.v[0]) + coord_v * (t.v[2] - t.v[0]);
-    inter.front = dot(ray.orig - t.v[0], t.normal) > 0;
-    // Verify interpolated normals can lead specular rays to go inside the object.
-    Vector3 normal = t.get_normal(coord_u, coord_v);
-    Vector2 uv = t.get_uv(coord_u, coord_v);
-    inter.uv = uv;
-    inter.geometry_normal = inter.front ? t.normal : -t.normal;
-    inter.normal = inter.front ? normal : -normal;
-    Mesh *mesh = triangle_id_to_mesh[t.id];
-    inter.triangle_id = triangle_id;
-    inter.dist = ray.dist;
-    // inter.material = mesh->material.get();
-    Vector3 u = normalized(t.v[1] - t.v[0]);
-    real sgn = inter.front ? 1.0f : -1.0f;
-    Vector3 v = normalized(cross(sgn * inter.normal, u)); // Due to shading normal, we have to normalize here...
-    inter.dt_du = t.get_duv(u);
-    inter.dt_dv = t.get_duv(v);
-    // TODO: ...
-    u = normalized(cross(v, inter.normal));
-    inter.to_world = Matrix3(u, v, inter.normal);
-    inter.to_local = glm::transpose(inter.to_world);
+    Vector3 n[3];
+    Vector2 uv[3];
+    if (triangle_id >= num_triangles) {
+        // Instanced: the triangle is transformed from the prototype on demand
+        const int instance_id = get_instance_from_triangle_id(triangle_id);
+        const Instance &instance = instances[instance_id];
+        const Mesh &mesh = *prototypes[instance.id];
+        const Face &f = mesh.faces[triangle_id - instance_triangle_start[instance_id]];
+        Vector3 v[3];
+        for (int k = 0; k < 3; k++) {
+            v[k] = multiply_matrix4(instance.transform, mesh.vertices[f.vert_ind[k]], 1.0f);
+            n[k] = multiply_matrix4(instance_normal_transforms[instance_id], mesh.normals[f.normal_ind[k]], 0.0f);
+            uv[k] = mesh.uvs[f.uv_ind[k]];
+        }
+        const TriangleFrame t(v[0], v[1], v[2], uv[0], uv[1], uv[2], -1);
+        set_intersection_info(inter, t, n, uv, triangle_id, ray, fields);
+        inter.material = get_instance_material(instance_id);
+        return inter;
+    }
+    // Shading data is interpolated from the shared vertex attributes, only when asked for
+    if (fields & IntersectionInfo::SHADING) {
+        const Vector3i &ni = normal_indices[triangle_id];
+        for (int k = 0; k < 3; k++) {
+            n[k] = normals[ni[k]];
+        }
+    }
+    if (fields & IntersectionInfo::UV) {
+        const Vector3i &ti = uv_indices[triangle_id];
+        for (int k = 0; k < 3; k++) {
+            uv[k] = uvs[ti[k]];
+        }
+    }
+    set_intersection_info(inter, triangle_frames[triangle_id], n, uv, triangle_id, ray, fields);
+    inter.material = triangle_materials[triangle_id];
     return inter;
 }
 
+std::vector<Triangle> &Scene::get_triangles() {
+    if ((int)triangles.size() != num_triangles) {
+        triangles.clear();
+        triangles.reserve((size_t)num_triangles);
+        for (int i = 0; i < num_triangles; i++) {
+            triangles.push_back(get_triangle(i));
+        }
+    }
+    return triangles;
+}
+
+Triangle Scene::get_triangle(int id) const {
+    const Vector3i &vi = vertex_indices[id], &ni = normal_indices[id], &ti = uv_indices[id];
+    return Triangle(vertices[vi[0]], vertices[vi[1]], vertices[vi[2]], normals[ni[0]], normals[ni[1]], normals[ni[2]],
+                    uvs[ti[0]], uvs[ti[1]], uvs[ti[2]], id);
+}
+
 void Scene::add_mesh(std::shared_ptr<Mesh> mesh) {
     meshes.push_back(*mesh);
 }
 
+void Scene::add_instance(std::shared_ptr<Mesh> mesh, const Matrix4 &transform,
+                         std::shared_ptr<SurfaceMaterial> material) {
+    assert_info(mesh->emission == 0 && !(material && material->is_emissive()),
+                "Instances can not be emissive. Use add_mesh for light sources.");
+    auto it = prototype_ids.find(mesh.get());
+    if (it == prototype_ids.end()) {
+        it = prototype_ids.insert(std::make_pair(mesh.get(), (int)prototypes.size())).first;
+        prototypes.push_back(mesh);
+    }
+    instances.push_back(Instance{transform * mesh->transform, it->second});
+    instance_materials.push_back(material);
+}
+
 void Scene::finalize_geometry() {
     int triangle_count = 0;
-    for (auto &mesh : meshes) {
-        triangle_id_start[&mesh] = triangle_count;
-        auto sub = mesh.get_triangles();
-        for (int i = 0; i < (int)sub.size(); i++) {
-            sub[i].id = triangle_count + i;
+    std::vector<Vector3> mesh_vertices, mesh_normals;
+    for (int mesh_id = 0; mesh_id < (int)meshes.size(); mesh_id++) {
+        Mesh &mesh = meshes[mesh_id];
+        mesh_triangle_start.push_back(triangle_count);
+        // Append the world space buffers of the mesh, with its indices offset
+        mesh.get_transformed_vertices(mesh_vertices, mesh_normals);
+        const Vector3i offsets((int)vertices.size(), (int)normals.size(), (int)uvs.size());
+        vertices.insert(vertices.end(), mesh_vertices.begin(), mesh_vertices.end());
+        normals.insert(normals.end(), mesh_normals.begin(), mesh_normals.end());
+        uvs.insert(uvs.end(), mesh.uvs.begin(), mesh.uvs.end());
+        for (auto &f : mesh.faces) {
+            vertex_indices.push_back(Vector3i(f.vert_ind[0], f.vert_ind[1], f.vert_ind[2]) + offsets[0]);
+            normal_indices.push_back(Vector3i(f.normal_ind[0], f.normal_ind[1], f.normal_ind[2]) + offsets[1]);
+            uv_indices.push_back(Vector3i(f.uv_ind[0], f.uv_ind[1], f.uv_ind[2]) + offsets[2]);
         }
-        triangle_count += (int)sub.size();
-        triangles.insert(triangles.end(), sub.begin(), sub.end());
-        if (mesh.emission > 0) {
-            emissive_triangles.insert(emissive_triangles.end(), sub.begin(), sub.end());
-        }
-        for (auto &tri : sub) {
-            triangle_id_to_mesh[tri.id] = &mesh;
+        for (int i = 0; i < (int)mesh.faces.size(); i++) {
+            const Vector3i &vi = vertex_indices[triangle_count + i], &ti = uv_indices[triangle_count + i];
+            // Light sampling needs whole triangles, but only of the light sources
+            if (mesh.emission > 0) {
+                emissive_triangles.push_back(get_triangle(triangle_count + i));
+            }
+            triangle_frames.push_back(TriangleFrame(vertices[vi[0]], vertices[vi[1]], vertices[vi[2]],
+                                                    uvs[ti[0]], uvs[ti[1]], uvs[ti[2]], mesh_id));
+            triangle_materials.push_back(mesh.material.get());
         }
+        triangle_count += (int)mesh.faces.size();
     }
     num_triangles = triangle_count;
-    printf("Scene loaded. Triangle count: %d\n", triangle_count);
+    instance_normal_transforms.clear();
+    instance_triangle_start.clear();
+    for (auto &instance : instances) {
+        instance_normal_transforms.push_back(glm::transpose(glm::inverse(instance.transform)));
+        instance_triangle_start.push_back(triangle_count);
+        triangle_count += (int)prototypes[instance.id]->faces.size();
+    }
+    num_instanced_triangles = triangle_count - num_triangles;
+    printf("Scene loaded. Triangle count: %d\n", num_triangles);
+    if (!instances.empty()) {
+        printf("Instances: %d of %d meshes, %d instanced triangles\n", (int)instances.size(),
+               (int)prototypes.size(), num_instanced_triangles);
+    }
 };
 
 void Scene::finalize_lighting() {
     if (!emissive_triangles.empty()) {
-        update_emission_cdf();
         update_light_emission_cdf();
     }
     else {
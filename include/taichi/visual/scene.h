@@ -20,6 +20,7 @@
 
 #include <map>
 #include <deque>
+#include <algorithm>
 
 TC_NAMESPACE_BEGIN
 
@@ -37,68 +38,40 @@ public:
     void initialize(const Config &config);
     void set_material(std::shared_ptr<SurfaceMaterial> material);
     void load_from_file(const std::string &file_path);
-    std::vector<Triangle> untransformed_triangles;
-    void set_untransformed_triangles(const std::vector<Triangle> &triangles) {
-        untransformed_triangles = triangles;
-    }
+
+    // Indexed buffers from the vertices of triangles (shared vertices are merged)
+    void set_untransformed_triangles(const std::vector<Triangle> &triangles);
+
     // bounding box
-    BoundingBox get_bounding_box() {
+    BoundingBox get_bounding_box() const {
         BoundingBox bb;
-        bool is_first_triangle = true;
-        for (auto t : untransformed_triangles) {
-            if (is_first_triangle) {
-                bb.lower_boundary = t.v[0];
-                bb.upper_boundary = t.v[0];
-                is_first_triangle = false;
-            }
-            // loop for xyz
-            for (int i = 0; i < 3; ++i)
-                // loop for each vertex
-                for (int j = 0; j < 3; ++j){
-                    bb.lower_boundary[i] = std::min(bb.lower_boundary[i], t.v[j][i]);
-                    bb.upper_boundary[i] = std::max(bb.upper_boundary[i], t.v[j][i]);
-                }
+        bb.lower_boundary = bb.upper_boundary = vertices.empty() ? Vector3(0.0f) : vertices[0];
+        for (auto &v : vertices) {
+            bb.lower_boundary = glm::min(bb.lower_boundary, v);
+            bb.upper_boundary = glm::max(bb.upper_boundary, v);
         }
         return bb;
     }
-    std::vector<Triangle> get_triangles() {
-        std::vector<Triangle> triangles;
-        for (auto t : untransformed_triangles) {
-            triangles.push_back(t.get_transformed(transform));
-        }
-        return triangles;
-        /*
-        vector<Triangle> triangles;
-        for (auto face : faces) {
-            deque<Triangle> sub_divs;
-            sub_divs.push_back(Triangle(
-                vertices[face.vert_ind[0]],
-                vertices[face.vert_ind[1]],
-                vertices[face.vert_ind[2]],
-                0
-                ));
-            if (sub_div_limit > 0) {
-                while (true) {
-                    Triangle t = sub_divs.front();
-                    int i;
-                    if (t.max_edge_length(i) < sub_div_limit)
-                        break;
-                    Vector3 mid = 0.5f * (t.v[i] + t.v[(i + 1) % 3]);
-                    sub_divs.pop_front();
-                    sub_divs.push_back(Triangle(t.v[i], mid, t.v[(i + 2) % 3], 0));
-                    sub_divs.push_back(Triangle(t.v[(i + 2) % 3], mid, t.v[(i + 1) % 3], 0));
-                }
-            }
-            for (auto &t : sub_divs) {
-                push_triangle(
-                    t.v[0],
-                    t.v[1],
-                    t.v[2],
-                    triangle_count,
-                    triangles
-                    );
-            }
-        }*/
+
+    // Vertices and normals in world space
+    void get_transformed_vertices(std::vector<Vector3> &transformed_vertices,
+                                  std::vector<Vector3> &transformed_normals) const;
+
+    // Transformed triangles, with id = index of the face
+    std::vector<Triangle> get_triangles() const;
+
+    // Positions of the faces, as indices into vertices
+    std::vector<Vector3i> get_vertex_indices() const;
+
+    // Count of the changes to vertices, normals, uvs or faces, so that users of the mesh can tell
+    // whether it was changed in place. Code that writes these buffers directly should call
+    // mark_geometry_changed() afterwards.
+    uint64 get_geometry_version() const {
+        return geometry_version;
+    }
+
+    void mark_geometry_changed() {
+        geometry_version++;
     }
 
     bool need_voxelization;
@@ -114,9 +87,22 @@ public:
     real sub_div_limit;
     Vector3 emission_color;
     std::shared_ptr<SurfaceMaterial> material;
+
+private:
+    uint64 geometry_version = 0;
 };
 
 struct IntersectionInfo {
+    // Parts of the record that Scene::get_intersection_info fills on request. intersected, front,
+    // triangle_id, dist, geometry_normal and material are always filled.
+    enum Fields {
+        BASIC = 0,
+        POSITION = 1, // pos, tri_coord
+        SHADING = 2,  // normal, to_local, to_world, dt_du, dt_dv
+        UV = 4,       // uv
+        ALL = 7
+    };
+
     IntersectionInfo() {
         triangle_id = -1;
         intersected = false;
@@ -136,6 +122,26 @@ struct IntersectionInfo {
     int triangle_id;
 };
 
+// What get_intersection_info needs of a triangle, in one cache line
+struct TriangleFrame {
+    Vector3 v0, v10, v20;
+    // Texture coordinates change by (dot(du_dx, d), dot(dv_dx, d)) along d (as Triangle::get_duv)
+    Vector3 du_dx, dv_dx;
+    int mesh_id;
+
+    TriangleFrame() {
+    }
+
+    TriangleFrame(const Vector3 &v0, const Vector3 &v1, const Vector3 &v2, const Vector2 &uv0, const Vector2 &uv1,
+                  const Vector2 &uv2, int mesh_id)
+            : v0(v0), v10(v1 - v0), v20(v2 - v0), mesh_id(mesh_id) {
+        const Vector3 iv10 = 1.0f / dot(v10, v10) * v10, iv20 = 1.0f / dot(v20, v20) * v20;
+        const Vector2 uv10 = uv1 - uv0, uv20 = uv2 - uv0;
+        du_dx = uv10.x * iv10 + uv20.x * iv20;
+        dv_dx = uv10.y * iv10 + uv20.y * iv20;
+    }
+};
+
 class Scene {
 public:
     Scene() {
@@ -161,6 +167,12 @@ public:
 
     void add_mesh(std::shared_ptr<Mesh> mesh);
 
+    // A copy of mesh placed by transform (after its own transform), without copying its geometry.
+    // Adding the same mesh again shares it. A non-null material overrides that of the mesh.
+    // Instances can not be light sources.
+    void add_instance(std::shared_ptr<Mesh> mesh, const Matrix4 &transform,
+                      std::shared_ptr<SurfaceMaterial> material);
+
     void finalize_geometry();
 
     void finalize_lighting();
@@ -184,10 +196,11 @@ public:
         return light_total_emission / light_total_area;
     }
 
+    // Emission of the triangles by temperature, for sample_photon
     void update_emission_cdf() {
         emission_cdf.clear();
         total_emission = 0;
-        for (auto tri : triangles) {
+        for (auto &tri : get_triangles()) {
             real e = tri.area * pow(tri.temperature, 4.0f);
             emission_cdf.push_back(e);
             total_emission += e;
@@ -202,15 +215,35 @@ public:
         }
     }
 
-    std::vector<Triangle> &get_triangles() {
-        return triangles;
+    // All non-instanced triangles, with the temperatures of the photon methods below. They are
+    // built on the first call, since rendering only needs get_triangle and emissive_triangles.
+    std::vector<Triangle> &get_triangles();
+
+    // Non-instanced triangle id, made from the shared buffers
+    Triangle get_triangle(int id) const;
+
+    real get_triangle_area(int id) const {
+        const Vector3i &vi = vertex_indices[id];
+        return 0.5f * length(cross(vertices[vi[1]] - vertices[vi[0]], vertices[vi[2]] - vertices[vi[0]]));
     }
 
-    Triangle get_triangle(int id) const {
-        return triangles[id];
+    // Hit record of ray on triangle_id, with the groups of IntersectionInfo::Fields in fields
+    IntersectionInfo get_intersection_info(int triangle_id, Ray &ray, int fields = IntersectionInfo::ALL);
+
+    // Triangle id of a hit reported by RayIntersection. Instanced triangles are numbered after the
+    // non-instanced ones, from instance_triangle_start[ray.instance_id] on.
+    int get_hit_triangle_id(const Ray &ray) const {
+        if (ray.triangle_id == -1 || ray.instance_id == -1) {
+            return ray.triangle_id;
+        }
+        return instance_triangle_start[ray.instance_id] + ray.triangle_id;
     }
 
-    IntersectionInfo get_intersection_info(int triangle_id, Ray &ray);
+    // Instance of an instanced triangle id (>= num_triangles)
+    int get_instance_from_triangle_id(int triangle_id) const {
+        return int(std::upper_bound(instance_triangle_start.begin(), instance_triangle_start.end(), triangle_id) -
+                   instance_triangle_start.begin()) - 1;
+    }
 
     const Triangle &sample_triangle_light_emission(real r, real &pdf) const {
         int e_tid = light_emission_sampler.sample(r, pdf);
@@ -235,7 +268,7 @@ public:
     }
 
     real get_triangle_pdf(int id) const {
-        return (1 - envmap_sample_prob) * triangles[id].area *
+        return (1 - envmap_sample_prob) * get_triangle_area(id) *
             get_mesh_from_triangle_id(id)->emission / light_total_emission;
     }
 
@@ -243,11 +276,31 @@ public:
         return envmap_sample_prob;
     }
 
+    // Whether rays can pass through surfaces, so that visibility is more than a single ray query
+    bool has_index_matched_interfaces() const {
+        for (auto &mesh : meshes) {
+            if (mesh.material && mesh.material->may_be_index_matched()) {
+                return true;
+            }
+        }
+        for (int i = 0; i < (int)instances.size(); i++) {
+            SurfaceMaterial *material = get_instance_material(i);
+            if (material && material->may_be_index_matched()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     void sample_photon(Photon &p, real r, real delta_t, real weight) {
+        if (emission_cdf.empty()) {
+            update_emission_cdf();
+        }
+        std::vector<Triangle> &triangles = get_triangles();
         int tid = std::min(int(std::lower_bound(emission_cdf.begin(), emission_cdf.end(), r) - emission_cdf.begin()),
             (int)triangles.size() - 1);
         Triangle &t = triangles[tid];
-        Mesh *mesh = triangle_id_to_mesh[tid];
+        const Mesh *mesh = get_mesh_from_triangle_id(tid);
         weight = t.area / total_triangle_area;
         p.dir = random_diffuse(t.normal);
         p.pos = t.sample_point();
@@ -260,8 +313,8 @@ public:
 
     void recieve_photon(int triangle_id, real energy) {
         int tid = triangle_id;
-        Triangle &t = triangles[tid];
-        Mesh *mesh = triangle_id_to_mesh[tid];
+        Triangle &t = get_triangles()[tid];
+        const Mesh *mesh = get_mesh_from_triangle_id(tid);
         if (!mesh->const_temp)
             t.temperature += energy / t.heat_capacity;
     }
@@ -271,10 +324,11 @@ public:
         return 0.0f;
         /*
         real cooef[3]{ 1 - u - v, u, v };
-        Mesh *mesh = triangle_id_to_mesh[triangle_id];
+        const int mesh_id = triangle_frames[triangle_id].mesh_id;
+        const Mesh *mesh = &meshes[mesh_id];
         real temp = 0;
         for (int i = 0; i < 3; i++) {
-            int vertice_index = mesh->faces[triangle_id - triangle_id_start[mesh]].vert_ind[i];
+            int vertice_index = mesh->faces[triangle_id - mesh_triangle_start[mesh_id]].vert_ind[i];
             temp += mesh->temperature[vertice_index] * cooef[i];
         }
         return temp;
@@ -283,17 +337,28 @@ public:
 
     Vector3 get_coord(int triangle_id, real u, real v) const {
         real cooef[3]{ 1 - u - v, u, v };
-        Mesh *mesh = triangle_id_to_mesh.find(triangle_id)->second;
+        const int mesh_id = triangle_frames[triangle_id].mesh_id;
+        const Mesh *mesh = &meshes[mesh_id];
         Vector3 temp(0);
         for (int i = 0; i < 3; i++) {
-            int vertice_index = mesh->faces[triangle_id - triangle_id_start.find(mesh)->second].vert_ind[i];
+            int vertice_index = mesh->faces[triangle_id - mesh_triangle_start[mesh_id]].vert_ind[i];
             temp += mesh->vertices[vertice_index] * cooef[i];
         }
         return temp;
     }
 
-    Mesh *get_mesh_from_triangle_id(int triangle_id) const {
-        return triangle_id_to_mesh.find(triangle_id)->second;
+    const Mesh *get_mesh_from_triangle_id(int triangle_id) const {
+        if (triangle_id >= num_triangles) {
+            return prototypes[instances[get_instance_from_triangle_id(triangle_id)].id].get();
+        }
+        return &meshes[triangle_frames[triangle_id].mesh_id];
+    }
+
+    SurfaceMaterial *get_instance_material(int instance_id) const {
+        if (instance_materials[instance_id]) {
+            return instance_materials[instance_id].get();
+        }
+        return prototypes[instances[instance_id].id]->material.get();
     }
 
     real get_triangle_emission(int triangle_id) const {
@@ -302,6 +367,7 @@ public:
 
     DiscreteSampler light_emission_sampler;
     std::shared_ptr<Camera> camera;
+    // Built by get_triangles()
     std::vector<Triangle> triangles;
     std::vector<Triangle> emissive_triangles;
     std::vector<real> emission_cdf;
@@ -309,9 +375,27 @@ public:
     real light_total_emission;
     real light_total_area;
     std::vector<Mesh> meshes;
-    std::map<int, Mesh *> triangle_id_to_mesh;
-    std::map<Mesh *, int> triangle_id_start;
-    int num_triangles;
+    // World space geometry of all meshes. Triangle i has positions vertices[vertex_indices[i][0..2]],
+    // and normals and uvs indexed by normal_indices[i] and uv_indices[i].
+    std::vector<Vector3> vertices, normals;
+    std::vector<Vector2> uvs;
+    std::vector<Vector3i> vertex_indices, normal_indices, uv_indices;
+    // Per (non-instanced) triangle: shading frame data and mesh, and material
+    std::vector<TriangleFrame> triangle_frames;
+    std::vector<SurfaceMaterial *> triangle_materials;
+    // Id of the first triangle of each mesh
+    std::vector<int> mesh_triangle_start;
+    int num_triangles = 0;
+    // Meshes shared by instances, in object space. Instance transforms include Mesh::transform.
+    std::vector<std::shared_ptr<Mesh>> prototypes;
+    std::map<Mesh *, int> prototype_ids;
+    std::vector<Instance> instances;
+    // Per instance: material override (or null), inverse transpose of the transform for normals,
+    // and id of the first triangle
+    std::vector<std::shared_ptr<SurfaceMaterial>> instance_materials;
+    std::vector<Matrix4> instance_normal_transforms;
+    std::vector<int> instance_triangle_start;
+    int num_instanced_triangles;
     real sub_divide_limit;
     real total_triangle_area;
     int resolution_x, resolution_y;
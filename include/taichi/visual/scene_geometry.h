@@ -20,9 +20,7 @@ public:
     SceneGeometry(std::shared_ptr<Scene> scene, std::shared_ptr<RayIntersection> ray_intersection) {
         this->scene = scene;
         this->ray_intersection = ray_intersection;
-        for (auto &tri : scene->get_triangles()) {
-            ray_intersection->add_triangle(tri);
-        }
+        add_geometry();
         rebuild();
     }
 
@@ -30,24 +28,83 @@ public:
         ray_intersection->build();
     }
 
+    // Switches to the geometry of scene, e.g. the next frame of an animation. If only the vertex
+    // positions of non-instanced meshes changed, the acceleration structure is updated in place
+    // when the backend supports it. Otherwise (or if the triangles, instanced meshes or instances
+    // changed, including meshes modified in place) it is rebuilt.
+    void update(std::shared_ptr<Scene> scene) {
+        const bool same_topology = has_same_topology(*this->scene, *scene);
+        this->scene = scene;
+        if (same_topology && ray_intersection->update_vertices(scene->vertices)) {
+            return;
+        }
+        ray_intersection->clear();
+        add_geometry();
+        rebuild();
+    }
+
     int query_hit_triangle_id(Ray &ray) {
         ray_intersection->query(ray);
-        return ray.triangle_id;
+        return scene->get_hit_triangle_id(ray);
     }
 
-    IntersectionInfo query(Ray &ray) {
-        int tri_id = query_hit_triangle_id(ray);
-        return scene->get_intersection_info(tri_id, ray);
+    // Hit distances and triangles of many rays at once, through packet or stream queries if available.
+    // triangle_id is then the id in scene (as from query_hit_triangle_id), also for instanced hits.
+    void query_batch(Ray *rays, int n) {
+        ray_intersection->query_batch(rays, n);
+        for (int i = 0; i < n; i++) {
+            rays[i].triangle_id = scene->get_hit_triangle_id(rays[i]);
+        }
     }
 
-    IntersectionInfo occlude(Ray &ray) {
+    // Only the IntersectionInfo::Fields in `fields` are filled, besides the basic ones
+    IntersectionInfo query(Ray &ray, int fields = IntersectionInfo::ALL) {
         int tri_id = query_hit_triangle_id(ray);
-        return scene->get_intersection_info(tri_id, ray);
+        return scene->get_intersection_info(tri_id, ray, fields);
+    }
+
+    // Whether the segment [ray.orig, ray.orig + ray.dist * ray.dir] is blocked
+    bool occlude(Ray &ray) {
+        return ray_intersection->occlude(ray);
     }
 
 private:
+    void add_geometry() {
+        ray_intersection->add_mesh(scene->vertices, scene->vertex_indices);
+        prototype_versions.clear();
+        for (auto &prototype : scene->prototypes) {
+            prototype_versions.push_back(prototype->get_geometry_version());
+            ray_intersection->add_prototype(prototype->vertices, prototype->get_vertex_indices());
+        }
+        for (auto &instance : scene->instances) {
+            ray_intersection->add_instance(instance);
+        }
+    }
+
+    // Prototypes are compared by geometry version with what was added last, since a mesh can be
+    // shared by both scenes and have been changed in between
+    bool has_same_topology(const Scene &a, const Scene &b) const {
+        if (a.vertices.size() != b.vertices.size() || a.vertex_indices != b.vertex_indices ||
+            a.prototypes != b.prototypes || a.instances.size() != b.instances.size()) {
+            return false;
+        }
+        for (int i = 0; i < (int)b.prototypes.size(); i++) {
+            if (b.prototypes[i]->get_geometry_version() != prototype_versions[i]) {
+                return false;
+            }
+        }
+        for (int i = 0; i < (int)a.instances.size(); i++) {
+            if (a.instances[i].id != b.instances[i].id || a.instances[i].transform != b.instances[i].transform) {
+                return false;
+            }
+        }
+        return true;
+    }
+
     std::shared_ptr<Scene> scene;
     std::shared_ptr<RayIntersection> ray_intersection;
+    // Geometry versions of the prototypes as added to ray_intersection
+    std::vector<uint64> prototype_versions;
 };
 
 TC_NAMESPACE_END
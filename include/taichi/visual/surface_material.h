@@ -96,6 +96,11 @@ public:
         return false;
     }
 
+    // Whether sampling may produce index-matched events (even if the material is not index-matched)
+    virtual bool may_be_index_matched() const {
+        return is_index_matched();
+    }
+
     virtual real get_importance(const Vector2 &uv) const {
         error("no impl");
         return 0;
@@ -8,5 +8,313 @@
 *******************************************************************************/
 
 #include "voxelizer.h"
+#include <taichi/visual/scene.h>
+#include <taichi/system/threading.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
 TC_NAMESPACE_BEGIN
+
+static const real far_distance = 1e7f;
+
+static const char cache_magic[4] = {'T', 'C', 'S', 'D'};
+static const int cache_version = 1;
+
+struct VoxelizerCacheHeader {
+    char magic[4];
+    int version;
+    int res[3];
+    float offset[3];
+    float delta_x;
+    float band;
+    uint64 mesh_hash;
+};
+
+static int get_index(const Vector3i &res, int i, int j, int k) {
+    return (i * res[1] + j) * res[2] + k;
+}
+
+// Squared distance from p to the triangle abc (closest point by Voronoi regions)
+static real triangle_dist2(const Vector3 &p, const Vector3 &a, const Vector3 &b, const Vector3 &c) {
+    const Vector3 ab = b - a, ac = c - a, ap = p - a;
+    const real d1 = dot(ab, ap), d2 = dot(ac, ap);
+    Vector3 q;
+    if (d1 <= 0 && d2 <= 0) {
+        q = a;
+    } else {
+        const Vector3 bp = p - b;
+        const real d3 = dot(ab, bp), d4 = dot(ac, bp);
+        const Vector3 cp = p - c;
+        const real d5 = dot(ab, cp), d6 = dot(ac, cp);
+        const real vc = d1 * d4 - d3 * d2, vb = d5 * d2 - d1 * d6, va = d3 * d6 - d5 * d4;
+        if (d3 >= 0 && d4 <= d3) {
+            q = b;
+        } else if (d6 >= 0 && d5 <= d6) {
+            q = c;
+        } else if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+            q = a + d1 / (d1 - d3) * ab;
+        } else if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+            q = a + d2 / (d2 - d6) * ac;
+        } else if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+            q = b + (d4 - d3) / ((d4 - d3) + (d5 - d6)) * (c - b);
+        } else {
+            const real denominator = 1.0f / (va + vb + vc);
+            q = a + vb * denominator * ab + vc * denominator * ac;
+        }
+    }
+    const Vector3 d = p - q;
+    return dot(d, d);
+}
+
+// Sign of the area of (0, 0), (x1, y1), (x2, y2), with exact zeros broken consistently,
+// so that a ray through a shared edge or vertex hits exactly one of the triangles
+static int orientation(double x1, double y1, double x2, double y2, double &twice_signed_area) {
+    twice_signed_area = y1 * x2 - x1 * y2;
+    if (twice_signed_area > 0) {
+        return 1;
+    } else if (twice_signed_area < 0) {
+        return -1;
+    } else if (y2 > y1) {
+        return 1;
+    } else if (y2 < y1) {
+        return -1;
+    } else if (x1 > x2) {
+        return 1;
+    } else if (x1 < x2) {
+        return -1;
+    }
+    return 0;
+}
+
+// Whether (x0, y0) is inside the 2D triangle, and its barycentric coordinates if so
+static bool point_in_triangle_2d(double x0, double y0, double x1, double y1, double x2, double y2,
+                                 double x3, double y3, double &a, double &b, double &c) {
+    x1 -= x0, x2 -= x0, x3 -= x0;
+    y1 -= y0, y2 -= y0, y3 -= y0;
+    const int sign_a = orientation(x2, y2, x3, y3, a);
+    if (sign_a == 0) {
+        return false;
+    }
+    const int sign_b = orientation(x3, y3, x1, y1, b);
+    if (sign_b != sign_a) {
+        return false;
+    }
+    const int sign_c = orientation(x1, y1, x2, y2, c);
+    if (sign_c != sign_a) {
+        return false;
+    }
+    const double sum = a + b + c;
+    a /= sum, b /= sum, c /= sum;
+    return true;
+}
+
+static uint64 hash_triangles(const std::vector<Triangle> &triangles) {
+    // FNV-1a over the vertex coordinates
+    uint64 hash = 14695981039346656037ULL;
+    auto feed = [&](const void *data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ ((const unsigned char *)data)[i]) * 1099511628211ULL;
+        }
+    };
+    uint64 n = triangles.size();
+    feed(&n, sizeof(n));
+    for (auto &t : triangles) {
+        for (int v = 0; v < 3; v++) {
+            float coord[3] = {t.v[v].x, t.v[v].y, t.v[v].z};
+            feed(coord, sizeof(coord));
+        }
+    }
+    return hash;
+}
+
+void Voxelizer::voxelize(const std::vector<Triangle> &triangles, real delta_x, Array3D<real> &sdf) const {
+    const Vector3i res(sdf.get_width(), sdf.get_height(), sdf.get_depth());
+    const int size = res[0] * res[1] * res[2];
+    const int n = (int)triangles.size();
+    // Vertices in grid coordinates, where node (i, j, k) is at (i, j, k)
+    std::vector<Vector3> vertices((size_t)n * 3);
+    const Vector3 offset = sdf.get_storage_offset();
+    for (int t = 0; t < n; t++) {
+        for (int v = 0; v < 3; v++) {
+            vertices[t * 3 + v] = triangles[t].v[v] * (1.0f / delta_x) - offset;
+        }
+    }
+    auto get_distance = [&](int t, const Vector3 &p) {
+        return std::sqrt(triangle_dist2(p, vertices[t * 3], vertices[t * 3 + 1], vertices[t * 3 + 2]));
+    };
+    std::vector<real> dist((size_t)size, far_distance);
+    std::vector<int> closest((size_t)size, -1);
+
+    // Slabs along x. Each slab goes through all triangles and only writes its own nodes,
+    // which costs a bounding box test per triangle and slab, but needs no locking.
+    const int num_slabs = std::max(1, std::min(res[0], num_threads));
+    auto slab_begin = [&](int slab) { return slab * res[0] / num_slabs; };
+
+    // Exact distances within the band, from the band-expanded bounding box of every triangle
+    ThreadedTaskManager::run(num_slabs, num_threads, [&](int slab) {
+        const int begin = slab_begin(slab), end = slab_begin(slab + 1);
+        for (int t = 0; t < n; t++) {
+            Vector3 lower = vertices[t * 3], upper = lower;
+            for (int v = 1; v < 3; v++) {
+                lower = glm::min(lower, vertices[t * 3 + v]);
+                upper = glm::max(upper, vertices[t * 3 + v]);
+            }
+            Vector3i i_lower, i_upper;
+            for (int d = 0; d < 3; d++) {
+                i_lower[d] = std::max((int)std::ceil(lower[d] - band), d == 0 ? begin : 0);
+                i_upper[d] = std::min((int)std::floor(upper[d] + band), (d == 0 ? end : res[d]) - 1);
+            }
+            for (int i = i_lower[0]; i <= i_upper[0]; i++) {
+                for (int j = i_lower[1]; j <= i_upper[1]; j++) {
+                    for (int k = i_lower[2]; k <= i_upper[2]; k++) {
+                        const int c = get_index(res, i, j, k);
+                        const real d = get_distance(t, Vector3((real)i, (real)j, (real)k));
+                        if (d < dist[c]) {
+                            dist[c] = d;
+                            closest[c] = t;
+                        }
+                    }
+                }
+            }
+        }
+    });
+
+    // Nodes within the band have found their closest triangle. The rest take the closest
+    // triangle of their upwind neighbours, over all eight sweep orderings, until nothing
+    // changes (which takes two passes with a single slab).
+    std::vector<char> slab_changed((size_t)num_slabs, 1);
+    for (int pass = 0; pass < 2 || *std::max_element(slab_changed.begin(), slab_changed.end()); pass++) {
+        const std::vector<int> last_closest = closest;
+        ThreadedTaskManager::run(num_slabs, num_threads, [&](int slab) {
+            const int begin = slab_begin(slab), end = slab_begin(slab + 1);
+            bool changed = false;
+            for (int o = 0; o < 8; o++) {
+                const Vector3i directions(o & 1 ? -1 : 1, o & 2 ? -1 : 1, o & 4 ? -1 : 1);
+                for (int ii = 0; ii < end - begin; ii++) {
+                    const int i = directions[0] > 0 ? begin + ii : end - 1 - ii;
+                    const int upwind_i = i - directions[0];
+                    for (int jj = 0; jj < res[1]; jj++) {
+                        const int j = directions[1] > 0 ? jj : res[1] - 1 - jj;
+                        for (int kk = 0; kk < res[2]; kk++) {
+                            const int k = directions[2] > 0 ? kk : res[2] - 1 - kk;
+                            const int c = get_index(res, i, j, k);
+                            if (dist[c] <= band) {
+                                continue;
+                            }
+                            const Vector3 p((real)i, (real)j, (real)k);
+                            auto check = [&](int t) {
+                                if (t != -1 && t != closest[c]) {
+                                    real d = get_distance(t, p);
+                                    if (d < dist[c]) {
+                                        dist[c] = d;
+                                        closest[c] = t;
+                                        changed = true;
+                                    }
+                                }
+                            };
+                            // Closest triangles in other slabs are read from the last pass
+                            if (0 <= upwind_i && upwind_i < res[0]) {
+                                const int nc = get_index(res, upwind_i, j, k);
+                                check(begin <= upwind_i && upwind_i < end ? closest[nc] : last_closest[nc]);
+                            }
+                            if (0 <= j - directions[1] && j - directions[1] < res[1]) {
+                                check(closest[get_index(res, i, j - directions[1], k)]);
+                            }
+                            if (0 <= k - directions[2] && k - directions[2] < res[2]) {
+                                check(closest[get_index(res, i, j, k - directions[2])]);
+                            }
+                        }
+                    }
+                }
+            }
+            slab_changed[slab] = changed;
+        });
+    }
+
+    // Sign by parity of the crossings of rays along +x, counted at the first node after each crossing
+    std::vector<int> crossings((size_t)size, 0);
+    ThreadedTaskManager::run(num_slabs, num_threads, [&](int slab) {
+        const int begin = slab * res[1] / num_slabs, end = (slab + 1) * res[1] / num_slabs;
+        for (int t = 0; t < n; t++) {
+            const Vector3 &a = vertices[t * 3], &b = vertices[t * 3 + 1], &c = vertices[t * 3 + 2];
+            const int j_lower = std::max((int)std::ceil(std::min(a.y, std::min(b.y, c.y))), begin);
+            const int j_upper = std::min((int)std::floor(std::max(a.y, std::max(b.y, c.y))), end - 1);
+            const int k_lower = std::max((int)std::ceil(std::min(a.z, std::min(b.z, c.z))), 0);
+            const int k_upper = std::min((int)std::floor(std::max(a.z, std::max(b.z, c.z))), res[2] - 1);
+            for (int j = j_lower; j <= j_upper; j++) {
+                for (int k = k_lower; k <= k_upper; k++) {
+                    double wa, wb, wc;
+                    if (!point_in_triangle_2d(j, k, a.y, a.z, b.y, b.z, c.y, c.z, wa, wb, wc)) {
+                        continue;
+                    }
+                    const int i = (int)std::ceil(wa * a.x + wb * b.x + wc * c.x);
+                    if (i < res[0]) {
+                        crossings[get_index(res, std::max(i, 0), j, k)]++;
+                    }
+                }
+            }
+        }
+    });
+    ThreadedTaskManager::run(res[0] > 0 ? res[1] : 0, num_threads, [&](int j) {
+        for (int k = 0; k < res[2]; k++) {
+            int count = 0;
+            for (int i = 0; i < res[0]; i++) {
+                const int c = get_index(res, i, j, k);
+                count += crossings[c];
+                sdf[i][j][k] = count % 2 == 1 ? -dist[c] : dist[c];
+            }
+        }
+    });
+}
+
+void Voxelizer::voxelize_mesh(Mesh &mesh, real delta_x, bool inside_out, LevelSet3D &levelset,
+                              const std::string &cache_fn) const {
+    const std::vector<Triangle> triangles = mesh.get_triangles();
+    const Vector3i res(levelset.get_width(), levelset.get_height(), levelset.get_depth());
+    const Vector3 offset = levelset.get_storage_offset();
+    Array3D<real> sdf(res, 0.0f, offset);
+
+    VoxelizerCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = cache_version;
+    for (int d = 0; d < 3; d++) {
+        header.res[d] = res[d];
+        header.offset[d] = offset[d];
+    }
+    header.delta_x = delta_x;
+    header.band = band;
+    header.mesh_hash = hash_triangles(triangles);
+
+    bool cached = false;
+    if (!cache_fn.empty()) {
+        FILE *file = fopen(cache_fn.c_str(), "rb");
+        if (file != nullptr) {
+            VoxelizerCacheHeader cache_header;
+            if (fread(&cache_header, sizeof(cache_header), 1, file) == 1 &&
+                std::memcmp(&cache_header, &header, sizeof(header)) == 0) {
+                cached = fread(&sdf[0][0][0], sizeof(real), sdf.get_size(), file) == (size_t)sdf.get_size();
+            }
+            fclose(file);
+        }
+    }
+    if (!cached) {
+        voxelize(triangles, delta_x, sdf);
+        if (!cache_fn.empty()) {
+            FILE *file = fopen(cache_fn.c_str(), "wb");
+            assert_info(file != nullptr, "Can not open " + cache_fn + " for writing");
+            fwrite(&header, sizeof(header), 1, file);
+            fwrite(&sdf[0][0][0], sizeof(real), sdf.get_size(), file);
+            fclose(file);
+        }
+    }
+
+    const real sign = inside_out ? -1.0f : 1.0f;
+    for (auto &ind : levelset.get_region()) {
+        levelset[ind] = std::min(levelset[ind], sign * sdf[ind]);
+    }
+}
+
 TC_NAMESPACE_END
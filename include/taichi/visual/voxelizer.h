@@ -10,14 +10,39 @@
 #pragma once
 
 #include <functional>
+#include <string>
+#include <vector>
 #include <taichi/common/meta.h>
 #include <taichi/math/linalg.h>
+#include <taichi/math/array_3d.h>
+#include <taichi/math/levelset_3d.h>
+#include <taichi/geometry/primitives.h>
 
 TC_NAMESPACE_BEGIN
 
-    class Voxelizer {
-    protected:
-    public:
-    };
+class Mesh;
+
+// Signed distance fields of closed triangle meshes, sampled at the nodes of an Array3D
+// (node (i, j, k) is at ((i, j, k) + storage_offset) * delta_x in world space).
+// Distances are exact within `band` cells of the surface, and propagated outwards
+// by sweeping the closest triangle of neighbouring nodes. The sign is found by ray
+// parity along x, so meshes should be closed but need not be consistently oriented.
+class Voxelizer {
+protected:
+    int num_threads;
+    real band;
+
+public:
+    Voxelizer(int num_threads = 1, real band = 3.0f) : num_threads(num_threads), band(band) {}
+
+    // Signed distance (in cells, negative inside) for all nodes of sdf
+    void voxelize(const std::vector<Triangle> &triangles, real delta_x, Array3D<real> &sdf) const;
+
+    // Union of the (transformed) mesh with levelset, as LevelSet3D::add_sphere.
+    // If cache_fn is not empty, the distance field is read from it when it was written
+    // for the same triangles and grid, and written to it otherwise.
+    void voxelize_mesh(Mesh &mesh, real delta_x, bool inside_out, LevelSet3D &levelset,
+                       const std::string &cache_fn = "") const;
+};
 
 TC_NAMESPACE_END
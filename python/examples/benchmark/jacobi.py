@@ -10,6 +10,7 @@ def analysis_bf():
         #'serial': ['relative_noif', 'relative_noif_inc']#'relative_noif_inc_unroll2', 'relative_noif_inc_unroll4']
         'serial': ['relative_noif_inc_unroll4'],
         'simd': ['sse', 'avx'],
+        'sweep': ['blocked', 'wavefront'],
         #'simd': ['avx', 'sse'],
         #'serial': ['relative_noif_inc_unroll']#, 'relative_noif_inc', 'relative_noif', 'relative', 'naive'],
     }
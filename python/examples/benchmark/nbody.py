@@ -0,0 +1,47 @@
+import taichi as tc
+import matplotlib.pyplot as plt
+
+
+def analysis_order():
+    # FMM accuracy (checked against direct summation by test()) and time per body vs. order
+    n = 100000
+    x, y = [], []
+    for order in range(1, 9):
+        benchmark = tc.system.Benchmark('nbody_fmm', n=n, order=order, theta=0.5, warm_up_iterations=0,
+                                        returns_time=True, tolerance=1.0)
+        assert benchmark.test()
+        t = benchmark.run(3)
+        x.append(order)
+        y.append(t * 1e6)
+        print 'order', order, '%.3f' % (t * 1e6), 'us per body'
+    direct = tc.system.Benchmark('nbody_direct', n=n, warm_up_iterations=0, returns_time=True)
+    t = direct.run(1)
+    print 'direct', '%.3f' % (t * 1e6), 'us per body'
+    plt.plot(x, y, label='fmm')
+    plt.axhline(t * 1e6, color='r', label='direct')
+    plt.xlabel('Order')
+    plt.ylabel('us per Body')
+    plt.legend()
+    plt.show()
+
+
+def analysis_n():
+    x, y_fmm, y_direct = [], [], []
+    for i in range(6):
+        n = 2 ** i * 1000
+        fmm = tc.system.Benchmark('nbody_fmm', n=n, order=4, warm_up_iterations=0, returns_time=True)
+        direct = tc.system.Benchmark('nbody_direct', n=n, warm_up_iterations=0, returns_time=True)
+        x.append(n)
+        y_fmm.append(fmm.run(3) * 1e6)
+        y_direct.append(direct.run(1) * 1e6)
+        print '%6d' % n, 'fmm %.3f direct %.3f' % (y_fmm[-1], y_direct[-1]), 'us per body'
+    plt.loglog(x, y_fmm, basex=2, label='fmm')
+    plt.loglog(x, y_direct, basex=2, label='direct')
+    plt.xlabel('N')
+    plt.ylabel('us per Body')
+    plt.legend()
+    plt.show()
+
+
+if __name__ == '__main__':
+    analysis_order()
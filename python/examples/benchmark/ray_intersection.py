@@ -0,0 +1,70 @@
+import taichi as tc
+import matplotlib.pyplot as plt
+
+backends = ['bvh', 'embree']
+
+
+def analysis_queries(filename=''):
+    # Rays per second of each backend and query type, on the same scene
+    for backend in backends:
+        for query in ['closest', 'occlusion', 'batch']:
+            benchmark = tc.system.Benchmark('ray_intersection', ray_intersection=backend, query=query,
+                                            filename=filename, num_triangles=1000000, warm_up_iterations=1,
+                                            returns_time=True)
+            if query == 'closest':
+                assert benchmark.test()
+            t = benchmark.run(4)
+            print '%8s %10s %.3f Mrays/s' % (backend, query, 1e-6 / t)
+
+
+def analysis_n():
+    x, y_query, y_build = [], {}, {}
+    for backend in backends:
+        y_query[backend], y_build[backend] = [], []
+    for i in range(8):
+        n = 4 ** i * 16
+        x.append(n)
+        for backend in backends:
+            query = tc.system.Benchmark('ray_intersection', ray_intersection=backend, num_triangles=n,
+                                        warm_up_iterations=1, returns_time=True)
+            build = tc.system.Benchmark('ray_intersection_build', ray_intersection=backend, num_triangles=n,
+                                        warm_up_iterations=0, returns_time=True, num_threads=4)
+            y_query[backend].append(query.run(4) * 1e6)
+            y_build[backend].append(build.run(1) * 1e6)
+            print '%8d %8s query %.3f build %.3f' % (n, backend, y_query[backend][-1], y_build[backend][-1]), 'us'
+    for backend in backends:
+        plt.loglog(x, y_query[backend], basex=2, label=backend + ' query (us per ray)')
+        plt.loglog(x, y_build[backend], basex=2, label=backend + ' build (us per triangle)')
+    plt.xlabel('Triangles')
+    plt.legend()
+    plt.show()
+
+
+def analysis_instances():
+    # Copies of the same 4096 triangles: build time should not grow with the number of instances
+    for backend in backends:
+        for n in [1, 16, 256, 4096]:
+            query = tc.system.Benchmark('ray_intersection', ray_intersection=backend, num_triangles=4096,
+                                        num_instances=n, warm_up_iterations=1, returns_time=True)
+            build = tc.system.Benchmark('ray_intersection_build', ray_intersection=backend, num_triangles=4096,
+                                        num_instances=n, warm_up_iterations=0, returns_time=True)
+            assert query.test()
+            print '%8s %6d instances: query %.3f us, build %.3f ms' % (backend, n, query.run(4) * 1e6,
+                                                                       build.run(1) * 4096 * 1e3)
+
+
+def analysis_update():
+    # Refit after small vertex motion (as between frames of a simulation) vs building again
+    for backend in backends:
+        for n in [4096, 65536, 1048576]:
+            update = tc.system.Benchmark('ray_intersection_update', ray_intersection=backend, num_triangles=n,
+                                         warm_up_iterations=1, returns_time=True)
+            build = tc.system.Benchmark('ray_intersection_build', ray_intersection=backend, num_triangles=n,
+                                        warm_up_iterations=0, returns_time=True)
+            assert update.test()
+            print '%8s %8d triangles: update %.3f build %.3f us per triangle' % (backend, n, update.run(4) * 1e6,
+                                                                                build.run(1) * 1e6)
+
+
+if __name__ == '__main__':
+    analysis_queries()
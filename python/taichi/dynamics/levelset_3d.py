@@ -27,9 +27,32 @@ class LevelSet3D:
             inside_out
         )
 
+    # Union with a closed triangle mesh (a taichi.visual.Mesh or an OBJ file name).
+    # Distances are exact within `band` of the surface. With `cache`, the voxelized
+    # mesh is stored in that file and reused while the mesh and grid are unchanged.
+    def add_mesh(self, mesh, inside_out=False, band=None, num_threads=1, cache=''):
+        if isinstance(mesh, str):
+            filename = mesh
+            mesh = tc.core.create_mesh()
+            mesh.initialize(config_from_dict({'filename': filename}))
+        else:
+            mesh = mesh.c
+        if band is None:
+            band = 3 * self.delta_x
+        voxelizer = tc.core.Voxelizer(num_threads, band / self.delta_x)
+        voxelizer.voxelize_mesh(mesh, self.delta_x, inside_out, self.levelset, cache)
+
     def global_increase(self, delta):
         self.levelset.global_increase(delta / self.delta_x)
 
+    # Turns unions of primitives (which are only exact distances near their surfaces)
+    # into a proper signed distance field, e.g. before building a DynamicLevelSet3D
+    def redistance(self, num_threads=1):
+        self.levelset.redistance(num_threads)
+
+    def redistance_narrow_band(self, band):
+        self.levelset.redistance_narrow_band(band / self.delta_x)
+
     # def get(self, x, y=None):
     #     if y is None:
     #         y = x.y
@@ -26,8 +26,17 @@ class MPM3:
                                                   shadow_map_resolution=0.3, alpha=0.7, shadowing=2,
                                                   ambient_light=0.01,
                                                   light_direction=(1, 1, 0))
+        self.pipeline = tc_core.FramePipeline()
+        self.pipeline.initialize(config_from_dict({
+            'output_directory': self.directory,
+            'width': self.video_manager.width,
+            'height': self.video_manager.height,
+            'num_buffers': 2
+        }))
+        self.pipeline.set_particle_renderer(self.particle_renderer.c)
         self.resolution = kwargs['resolution']
         self.frame = 0
+        self.num_output_frames = 0
 
         dummy_levelset = self.create_levelset()
 
@@ -73,26 +82,31 @@ class MPM3:
         self.simulation_total_time += time.time() - T
         print '* Step Time: %.2f [tot: %.2f per frame %.2f]' % (
             time.time() - T, time.time() - self.start_simulation_time, self.simulation_total_time / (self.frame + 1))
-        image_buffer = tc_core.Array2DVector3(self.video_manager.width, self.video_manager.height, Vector(0, 0, 0.0))
-        particles = self.c.get_render_particles()
-        particles.write(self.directory + '/particles%05d.bin' % self.frame)
         res = map(float, self.resolution)
         if not camera:
             camera = Camera('pinhole', origin=(0, res[1] * 0.4, res[2] * 1.4),
                             look_at=(0, -res[1] * 0.5, 0), up=(0, 1, 0), fov=90,
                             width=10, height=10)
-        self.particle_renderer.set_camera(camera)
-        self.particle_renderer.render(image_buffer, particles)
-        img = image_buffer_to_ndarray(image_buffer)
-        img = LDRDisplay(exposure=2.0, adaptive_exposure=False).process(img)
-        show_image('Vis', img)
-        self.video_manager.write_frame(img)
+        # Snapshot this frame. Dumping and rendering run in the background while the next frame simulates.
+        self.pipeline.push(self.c, self.frame, camera.c)
         self.frame += 1
+        self.output_frames(lag=1)
+        print '* Output stall time: %.2f' % self.pipeline.get_stall_time()
+
+    def output_frames(self, lag=0):
+        while self.num_output_frames < self.frame - lag:
+            img = image_buffer_to_ndarray(self.pipeline.get_image(self.num_output_frames))
+            img = LDRDisplay(exposure=2.0, adaptive_exposure=False).process(img)
+            show_image('Vis', img)
+            self.video_manager.write_frame(img)
+            self.num_output_frames += 1
 
     def get_directory(self):
         return self.directory
 
     def make_video(self):
+        self.output_frames()
+        self.pipeline.flush()
         self.video_manager.make_video()
 
     def create_levelset(self):
@@ -7,8 +7,10 @@ from taichi.misc.util import *
 
 class Smoke3:
     def __init__(self, **kwargs):
-        self.c = tc_core.create_simulation3d('smoke')
+        self.c = tc_core.create_simulation3d('sparse_smoke' if kwargs.get('sparse', False) else 'smoke')
         self.c.initialize(P(**kwargs))
+        self.output_volumes = kwargs.get('output_volumes', False)
+        self.frame = 0
         self.directory = taichi.get_output_path(get_unique_task_id())
         try:
             os.mkdir(self.directory)
@@ -21,6 +23,9 @@ class Smoke3:
         T = time.time()
         self.c.step(step_t)
         print 'Time:', time.time() - T
+        if self.output_volumes:
+            self.c.write_volumes(os.path.join(self.directory, '%05d' % self.frame))
+        self.frame += 1
 
     def update(self, generation, initial_velocity, color, temperature):
         cfg = P(
@@ -21,6 +21,14 @@ class LevelSet2D:
     def add_polygon(self, polygon, inside_out):
         self.levelset.add_polygon(make_polygon(polygon, 1.0 / self.delta_x), inside_out)
 
+    def redistance(self, num_threads=1):
+        self.levelset.redistance(num_threads)
+        self.cache_image = None
+
+    def redistance_narrow_band(self, band):
+        self.levelset.redistance_narrow_band(band / self.delta_x)
+        self.cache_image = None
+
     # def get(self, x, y=None):
     #     if y is None:
     #         y = x.y
@@ -45,11 +45,19 @@ class Renderer(object):
             self.renderer_name = args['name']
         else:
             args = kwargs
+        self.args = args
         self.c = tc_core.create_renderer(self.renderer_name)
         if scene is not None:
             self.set_scene(scene)
         self.c.initialize(config_from_dict(args))
 
+    # Starts the next frame of a sequence with the scene of that frame. The ray intersection structure is
+    # kept, and refit instead of rebuilt if only vertices moved (with dynamic_geometry=True for embree).
+    def next_frame(self, scene):
+        self.frame += 1
+        self.set_scene(scene)
+        self.c.initialize(config_from_dict(self.args))
+
     def render(self, stages, cache_interval=-1):
         for i in range(1, stages + 1):
             print 'stage', i
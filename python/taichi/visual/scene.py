@@ -10,6 +10,11 @@ class Scene:
     def add_mesh(self, mesh):
         self.c.add_mesh(mesh.c)
 
+    # Places another copy of mesh, sharing its geometry. `transform` is applied after that of the mesh,
+    # and `material` (if given) replaces the one of the mesh.
+    def add_instance(self, mesh, transform, material=None):
+        self.c.add_instance(mesh.c, transform, material.c if material else None)
+
     def __getattr__(self, key):
         return self.c.__getattribute__(key)
 
@@ -11,6 +11,7 @@
 #include <immintrin.h>
 #include <taichi/system/benchmark.h>
 #include <taichi/system/threading.h>
+#include <taichi/math/stencil_sweep.h>
 
 
 #ifndef TC_DISABLE_SSE
@@ -44,6 +45,9 @@ class JacobiSerial;
 template<typename T>
 class JacobiSIMD;
 
+template<typename T>
+class JacobiSweep;
+
 template<typename T>
 class JacobiBruteForce : public Benchmark {
 private:
@@ -104,6 +108,7 @@ protected:
 
     friend JacobiSerial<T>;
     friend JacobiSIMD<T>;
+    friend JacobiSweep<T>;
 };
 
 REGISTER(JacobiBruteForce, "jacobi_bf")
@@ -743,6 +748,138 @@ void JacobiSIMD<double>::iterate_avx() {
 
 REGISTER(JacobiSIMD, "jacobi_simd")
 
+// Jacobi sweeps through StencilSweep, the engine behind the multigrid smoothers.
+// Each iteration performs `time_steps` Jacobi steps on the whole domain:
+//   - blocked: one spatially blocked, parallel sweep per step;
+//   - wavefront: all steps in a single temporally tiled pass (lag 2, since the
+//     steps ping-pong between two buffers), parallel within each plane.
+template<typename T>
+class JacobiSweep : public Benchmark {
+protected:
+    int n;
+    int ignore;
+    int num_threads;
+    int time_steps;
+    bool wavefront;
+    StencilSweep sweep;
+    std::vector<T> data[2];
+    std::vector<T> zero_row;
+    Config cfg;
+public:
+    void initialize(const Config &config) override {
+        cfg = config;
+        Benchmark::initialize(config);
+        n = config.get_int("n");
+        ignore = config.get_int("ignore_boundary");
+        num_threads = config.get("num_threads", 1);
+        time_steps = config.get("time_steps", 4);
+        std::string method = config.get_string("iteration_method");
+        assert_info((n & (n - 1)) == 0, "n should be a power of 2");
+        if (method == "blocked") {
+            wavefront = false;
+        } else if (method == "wavefront") {
+            wavefront = true;
+        } else {
+            error("Iteration method not found: " + method);
+        }
+        sweep = StencilSweep(num_threads, config.get("block_x", 4), config.get("block_y", 16));
+        workload = (int64)n * n * n * time_steps;
+        data[0].resize(n * n * n);
+        data[1].resize(n * n * n);
+        zero_row.assign(n, T(0));
+    }
+
+    const T &get_entry(int l, int i, int j, int k) const {
+        return data[l][i * n * n + j * n + k];
+    }
+
+    T &get_entry(int l, int i, int j, int k) {
+        return data[l][i * n * n + j * n + k];
+    }
+
+    bool test() const override {
+        Config cfg;
+        cfg.set("n", 128);
+        cfg.set("iteration_method", this->cfg.get_string("iteration_method"));
+        cfg.set("ignore_boundary", ignore);
+        cfg.set("num_threads", num_threads);
+        cfg.set("time_steps", time_steps);
+        JacobiBruteForce<T> bf;
+        JacobiSweep<T> self;
+        bf.initialize(cfg);
+        bf.setup();
+        for (int t = 0; t < time_steps; t++) {
+            bf.iterate();
+        }
+        self.initialize(cfg);
+        self.setup();
+        self.iterate();
+        bool same = true;
+        for (int i = ignore; i < self.n - ignore; i++) {
+            for (int j = ignore; j < self.n - ignore; j++) {
+                for (int k = ignore; k < self.n - ignore; k++) {
+                    T a = self.get_entry(0, i, j, k), b = bf.data[0][i][j][k];
+                    if (std::abs(a - b) / std::max((T)1e-3, std::max(std::abs(a), std::abs(b))) > 1e-3f) {
+                        same = false;
+                    }
+                }
+            }
+        }
+        self.finalize();
+        return same;
+    }
+
+    virtual void setup() override {
+        for (int i = 0; i < n; i++)
+            for (int j = 0; j < n; j++)
+                for (int k = 0; k < n; k++)
+                    get_entry(0, i, j, k) = get_initial_entry<T>(i, j, k);
+    }
+
+    // One Jacobi step on row (i, j); cells outside the domain are zero.
+    void iterate_row(const T *__restrict src, T *__restrict dst, int i, int j) const {
+        const T one_over_six = T(1) / 6;
+        const T *center = src + i * n * n + j * n;
+        const T *minus_i = i > 0 ? center - n * n : &zero_row[0];
+        const T *plus_i = i + 1 < n ? center + n * n : &zero_row[0];
+        const T *minus_j = j > 0 ? center - n : &zero_row[0];
+        const T *plus_j = j + 1 < n ? center + n : &zero_row[0];
+        T *out = dst + i * n * n + j * n;
+        out[0] = (minus_i[0] + plus_i[0] + minus_j[0] + plus_j[0] + center[1]) * one_over_six;
+        for (int k = 1; k < n - 1; k++) {
+            out[k] = (minus_i[k] + plus_i[k] + minus_j[k] + plus_j[k] + center[k - 1] + center[k + 1]) *
+                     one_over_six;
+        }
+        out[n - 1] = (minus_i[n - 1] + plus_i[n - 1] + minus_j[n - 1] + plus_j[n - 1] + center[n - 2]) *
+                     one_over_six;
+    }
+
+    virtual void iterate() override {
+        if (wavefront) {
+            sweep.wavefront(n, time_steps, 2, [&](int t, int i) {
+                const T *src = &data[t % 2][0];
+                T *dst = &data[(t + 1) % 2][0];
+                ThreadedTaskManager::run(n, num_threads, [&](int j) {
+                    iterate_row(src, dst, i, j);
+                });
+            });
+        } else {
+            for (int t = 0; t < time_steps; t++) {
+                const T *src = &data[t % 2][0];
+                T *dst = &data[(t + 1) % 2][0];
+                sweep.for_each_row(Vector3i(n, n, n), [&](int i, int j) {
+                    iterate_row(src, dst, i, j);
+                });
+            }
+        }
+        if (time_steps % 2 == 1) {
+            data[0].swap(data[1]);
+        }
+    }
+};
+
+REGISTER(JacobiSweep, "jacobi_sweep")
+
 TC_NAMESPACE_END
 
 #endif
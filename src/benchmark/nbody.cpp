@@ -0,0 +1,93 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/benchmark.h>
+#include <taichi/math/fmm.h>
+#include <random>
+
+TC_NAMESPACE_BEGIN
+
+// Gravity of n bodies, half of them uniform in the unit cube and half in a cluster,
+// with the softening NBody uses. Workload is per body.
+class NBodyDirectBenchmark : public Benchmark {
+protected:
+    int n;
+    int num_threads;
+    std::vector<Vector3> positions, field;
+    std::vector<real> masses;
+
+public:
+    void initialize(const Config &config) override {
+        Benchmark::initialize(config);
+        n = config.get_int("n");
+        num_threads = config.get("num_threads", 1);
+        workload = n;
+        std::mt19937 rng(0);
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        positions.resize((size_t)n);
+        masses.assign((size_t)n, 1.0f);
+        for (int i = 0; i < n; i++) {
+            positions[i] = Vector3(uniform(rng), uniform(rng), uniform(rng));
+            if (i % 2 == 1) {
+                positions[i] = Vector3(0.3f) + 0.1f * positions[i];
+            }
+        }
+    }
+
+protected:
+    void iterate() override {
+        FastMultipoleSummation::evaluate_direct(positions, masses, 1e-4f, field, num_threads);
+    }
+};
+
+TC_IMPLEMENTATION(Benchmark, NBodyDirectBenchmark, "nbody_direct");
+
+// FMM on the same bodies. test() compares with direct summation on at most 4096 bodies
+// and passes if the RMS relative error is below `tolerance`.
+class NBodyFMMBenchmark : public NBodyDirectBenchmark {
+protected:
+    Config cfg;
+    std::shared_ptr<FastMultipoleSummation> fmm;
+
+public:
+    void initialize(const Config &config) override {
+        NBodyDirectBenchmark::initialize(config);
+        cfg = config;
+        fmm = std::make_shared<FastMultipoleSummation>(config.get("order", 4), config.get("theta", 0.5f),
+                                                       config.get("leaf_size", 32), 1e-4f, num_threads);
+    }
+
+    bool test() const override {
+        Config config = cfg;
+        config.set("n", std::min(n, 4096));
+        NBodyFMMBenchmark self;
+        self.initialize(config);
+        self.iterate();
+        std::vector<Vector3> reference;
+        FastMultipoleSummation::evaluate_direct(self.positions, self.masses, 1e-4f, reference, num_threads);
+        double error2 = 0, norm2 = 0;
+        for (int i = 0; i < self.n; i++) {
+            Vector3 d = self.field[i] - reference[i];
+            error2 += dot(d, d);
+            norm2 += dot(reference[i], reference[i]);
+        }
+        real rms_error = (real)std::sqrt(error2 / norm2);
+        P(rms_error);
+        return rms_error < cfg.get("tolerance", 1e-2f);
+    }
+
+protected:
+    void iterate() override {
+        fmm->evaluate(positions, masses, field);
+    }
+};
+
+TC_IMPLEMENTATION(Benchmark, NBodyFMMBenchmark, "nbody_fmm");
+
+TC_NAMESPACE_END
@@ -0,0 +1,249 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/benchmark.h>
+#include <taichi/visual/ray_intersection.h>
+#include <taichi/visual/scene.h>
+#include <random>
+
+TC_NAMESPACE_BEGIN
+
+// Rays against the triangles of the OBJ file `filename`, or if it is empty, a soup of
+// `num_triangles` random triangles in the unit cube. `ray_intersection` is the backend
+// ("bvh", "embree" or "bf"), and `query` one of "closest", "occlusion" or "batch".
+// Rays start uniformly in the bounding box, in uniform directions; occlusion rays
+// are a quarter of the box diagonal long. Workload is per ray.
+// With `num_instances` > 0, the triangles are shared by that many instances, scaled down and
+// randomly rotated and placed in the unit cube.
+class RayIntersectionBenchmark : public Benchmark {
+protected:
+    Config cfg;
+    std::string query;
+    int num_threads;
+    std::vector<Triangle> triangles;
+    std::vector<Instance> instances;
+    std::vector<Ray> rays, results;
+    std::vector<char> occluded;
+    std::shared_ptr<RayIntersection> ray_intersection;
+
+    std::shared_ptr<RayIntersection> create_ray_intersection(const std::string &name) {
+        Config config;
+        config.set("num_threads", num_threads);
+        config.set("dynamic", cfg.get("dynamic", false));
+        auto instance = create_instance<RayIntersection>(name, config);
+        if (instances.empty()) {
+            for (auto &tri : triangles) {
+                instance->add_triangle(tri);
+            }
+        } else {
+            std::vector<Vector3> vertices;
+            std::vector<Vector3i> indices;
+            for (auto &tri : triangles) {
+                indices.push_back(Vector3i(0, 1, 2) + (int)vertices.size());
+                vertices.insert(vertices.end(), tri.v, tri.v + 3);
+            }
+            instance->add_prototype(vertices, indices);
+            for (auto &inst : instances) {
+                instance->add_instance(inst);
+            }
+        }
+        instance->build();
+        return instance;
+    }
+
+public:
+    void initialize(const Config &config) override {
+        Benchmark::initialize(config);
+        cfg = config;
+        query = config.get("query", std::string("closest"));
+        num_threads = config.get("num_threads", 1);
+        std::mt19937 rng(0);
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        std::string filename = config.get("filename", std::string(""));
+        if (!filename.empty()) {
+            Mesh mesh;
+            mesh.initialize(config);
+            triangles = mesh.get_triangles();
+        } else {
+            int n = config.get_int("num_triangles");
+            real size = 2.0f / std::cbrt((real)n);
+            for (int i = 0; i < n; i++) {
+                Vector3 center(uniform(rng), uniform(rng), uniform(rng)), v[3];
+                for (int k = 0; k < 3; k++) {
+                    v[k] = center + size * (Vector3(uniform(rng), uniform(rng), uniform(rng)) - Vector3(0.5f));
+                }
+                triangles.push_back(Triangle(v[0], v[1], v[2], Vector3(0), Vector3(0), Vector3(0),
+                                             Vector2(0), Vector2(0), Vector2(0), i));
+            }
+        }
+        Vector3 lower(1e30f), upper(-1e30f);
+        for (auto &tri : triangles) {
+            for (int k = 0; k < 3; k++) {
+                lower = glm::min(lower, tri.v[k]);
+                upper = glm::max(upper, tri.v[k]);
+            }
+        }
+        int num_instances = config.get("num_instances", 0);
+        if (num_instances > 0) {
+            const Vector3 center = 0.5f * (lower + upper);
+            const real scale = 1.0f / (std::cbrt((real)num_instances) * length(upper - lower));
+            for (int i = 0; i < num_instances; i++) {
+                Vector3 axis(uniform(rng) - 0.5f, uniform(rng) - 0.5f, uniform(rng) + 0.1f);
+                Matrix4 transform = glm::translate(Matrix4(1.0f), Vector3(uniform(rng), uniform(rng), uniform(rng))) *
+                                    glm::rotate(Matrix4(1.0f), 2 * pi * uniform(rng), normalize(axis)) *
+                                    glm::scale(Matrix4(1.0f), Vector3(scale)) *
+                                    glm::translate(Matrix4(1.0f), -center);
+                instances.push_back(Instance{transform, 0});
+            }
+            const real radius = 0.5f / std::cbrt((real)num_instances);
+            lower = Vector3(-radius);
+            upper = Vector3(1 + radius);
+        }
+        int num_rays = config.get("num_rays", 65536);
+        for (int i = 0; i < num_rays; i++) {
+            Vector3 orig = lower + (upper - lower) * Vector3(uniform(rng), uniform(rng), uniform(rng));
+            real z = 2 * uniform(rng) - 1, phi = 2 * pi * uniform(rng), r = std::sqrt(1 - z * z);
+            Ray ray(orig, Vector3(r * std::cos(phi), r * std::sin(phi), z));
+            ray.dist = 0.25f * length(upper - lower);
+            rays.push_back(ray);
+        }
+        results = rays;
+        occluded.resize(rays.size());
+        workload = num_rays;
+        ray_intersection = create_ray_intersection(config.get("ray_intersection", std::string("bvh")));
+    }
+
+    // Compares with the brute force backend on at most 4096 triangles and 1024 rays
+    bool test() const override {
+        Config config = cfg;
+        config.set("num_rays", std::min((int)rays.size(), 1024));
+        const int max_triangles = config.get("num_instances", 0) > 0 ? 256 : 4096;
+        if (!config.has_key("num_triangles") || config.get_int("num_triangles") > max_triangles) {
+            config.set("num_triangles", max_triangles);
+        }
+        if (config.get("num_instances", 0) > 64) {
+            config.set("num_instances", 64);
+        }
+        config.set("filename", "");
+        RayIntersectionBenchmark self;
+        self.initialize(config);
+        auto reference = self.create_ray_intersection("bf");
+        // The brute force backend does not reset dist and triangle_id itself
+        std::vector<Ray> queries = self.rays;
+        for (auto &ray : queries) {
+            ray.dist = Ray::DIST_INFINITE;
+            ray.triangle_id = -1;
+        }
+        std::vector<Ray> batch = queries;
+        self.ray_intersection->query_batch(&batch[0], (int)batch.size());
+        int mismatches = 0;
+        for (int i = 0; i < (int)self.rays.size(); i++) {
+            Ray &ray = self.rays[i];
+            Ray a = queries[i], b = queries[i];
+            self.ray_intersection->query(a);
+            reference->query(b);
+            if ((a.triangle_id != b.triangle_id || a.instance_id != b.instance_id) &&
+                std::abs(a.dist - b.dist) > 1e-5f * b.dist) {
+                mismatches++;
+            }
+            // Batched and single queries are the same traversal
+            if (a.triangle_id != batch[i].triangle_id || a.instance_id != batch[i].instance_id) {
+                mismatches++;
+            }
+            if (self.ray_intersection->occlude(ray) != (b.dist < ray.dist)) {
+                mismatches++;
+            }
+        }
+        P(mismatches);
+        return mismatches * 1000 <= (int)self.rays.size();
+    }
+
+protected:
+    void iterate() override {
+        if (query == "batch") {
+            results = rays;
+            ray_intersection->query_batch(&results[0], (int)results.size());
+        } else if (query == "occlusion") {
+            for (int i = 0; i < (int)rays.size(); i++) {
+                occluded[i] = ray_intersection->occlude(rays[i]);
+            }
+        } else {
+            for (int i = 0; i < (int)rays.size(); i++) {
+                results[i] = rays[i];
+                ray_intersection->query(results[i]);
+            }
+        }
+    }
+};
+
+TC_IMPLEMENTATION(Benchmark, RayIntersectionBenchmark, "ray_intersection");
+
+// Construction of the acceleration structure for the same scenes. Workload is per triangle.
+class RayIntersectionBuildBenchmark : public RayIntersectionBenchmark {
+public:
+    void initialize(const Config &config) override {
+        Config tmp = config;
+        tmp.set("num_rays", 0);
+        RayIntersectionBenchmark::initialize(tmp);
+        workload = (int64)triangles.size();
+    }
+
+    bool test() const override {
+        return true;
+    }
+
+protected:
+    void iterate() override {
+        create_ray_intersection(cfg.get("ray_intersection", std::string("bvh")))->clear();
+    }
+};
+
+TC_IMPLEMENTATION(Benchmark, RayIntersectionBuildBenchmark, "ray_intersection_build");
+
+// Updates of the same scenes after every vertex moved a little, as between frames of a simulation.
+// Workload is per triangle.
+class RayIntersectionUpdateBenchmark : public RayIntersectionBenchmark {
+protected:
+    std::vector<Vector3> frames[2];
+    int frame;
+
+public:
+    void initialize(const Config &config) override {
+        Config tmp = config;
+        tmp.set("num_rays", 0);
+        tmp.set("num_instances", 0);
+        tmp.set("dynamic", true);
+        RayIntersectionBenchmark::initialize(tmp);
+        workload = (int64)triangles.size();
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+        const real jitter = 1e-2f / std::cbrt((real)std::max(1, (int)triangles.size()));
+        for (auto &tri : triangles) {
+            for (int k = 0; k < 3; k++) {
+                frames[0].push_back(tri.v[k]);
+                frames[1].push_back(tri.v[k] + jitter * Vector3(uniform(rng), uniform(rng), uniform(rng)));
+            }
+        }
+        frame = 0;
+    }
+
+    bool test() const override {
+        return ray_intersection->update_vertices(frames[0]);
+    }
+
+protected:
+    void iterate() override {
+        frame = 1 - frame;
+        ray_intersection->update_vertices(frames[frame]);
+    }
+};
+
+TC_IMPLEMENTATION(Benchmark, RayIntersectionUpdateBenchmark, "ray_intersection_update");
+
+TC_NAMESPACE_END
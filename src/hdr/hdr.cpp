@@ -21,11 +21,13 @@ protected:
     real s;
     int num_threads;
     int max_solver_iterations;
+    std::string poisson_solver_name;
 public:
     void initialize(const Config &config) override {
         pyramid_sigma = config.get("pyramid_sigma", 1.0f);
         num_threads = config.get("num_threads", 1);
         max_solver_iterations = config.get("max_solver_iterations", 100);
+        poisson_solver_name = config.get("poisson_solver", std::string("fft"));
         alpha = config.get_real("alpha");
         beta = config.get_real("beta");
         s = config.get_real("s");
@@ -106,7 +108,7 @@ public:
                 div_y -= G[ind.neighbour(0, -1)].y;
             div_G[ind] = -(div_x + div_y);
         }
-        auto poisson_solver = create_instance<PoissonSolver2D>("mgpcg");
+        auto poisson_solver = create_instance<PoissonSolver2D>(poisson_solver_name);
         Config cfg;
         cfg.set("res", Vector2i(width, height)).set("num_threads", num_threads).set("padding", "neumann").
             set("maximum_iterations", max_solver_iterations);
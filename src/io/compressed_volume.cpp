@@ -0,0 +1,275 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/io/compressed_volume.h>
+#include <cstdio>
+#include <cstring>
+
+#if !defined(_WIN32)
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#endif
+
+TC_NAMESPACE_BEGIN
+
+const int CompressedVolume::brick_size;
+const int CompressedVolume::brick_cells;
+
+static const char volume_magic[4] = {'T', 'C', 'V', 'F'};
+static const int volume_version = 1;
+
+// Smooth fields are well predicted by linear extrapolation along z, and by the
+// neighbouring row at the start of a row
+static int predict(const int *codes, int c) {
+    const int z = c % CompressedVolume::brick_size;
+    if (z >= 2) {
+        return 2 * codes[c - 1] - codes[c - 2];
+    } else if (z == 1) {
+        return codes[c - 1];
+    } else if (c >= CompressedVolume::brick_size) {
+        return codes[c - CompressedVolume::brick_size];
+    }
+    return 0;
+}
+
+// Prediction residuals are zigzag mapped and bit packed per z row: a row of brick_size
+// residuals that fit in b bits is stored as the byte b followed by b bytes.
+static void encode_brick(const int *codes, std::vector<unsigned char> &out) {
+    const int n = CompressedVolume::brick_size;
+    for (int row = 0; row < CompressedVolume::brick_cells; row += n) {
+        unsigned zigzag[n], all = 0;
+        for (int z = 0; z < n; z++) {
+            int residual = codes[row + z] - predict(codes, row + z);
+            zigzag[z] = ((unsigned)residual << 1) ^ (unsigned)(residual >> 31);
+            all |= zigzag[z];
+        }
+        int bits = 0;
+        while (bits < 32 && (all >> bits) != 0) {
+            bits++;
+        }
+        out.push_back((unsigned char)bits);
+        size_t begin = out.size();
+        out.resize(begin + bits * n / 8, 0);
+        for (int z = 0; z < n; z++) {
+            for (int b = 0; b < bits; b++) {
+                int position = z * bits + b;
+                out[begin + position / 8] |= (unsigned char)(((zigzag[z] >> b) & 1) << (position % 8));
+            }
+        }
+    }
+}
+
+static void decode_brick(const unsigned char *in, int *codes) {
+    const int n = CompressedVolume::brick_size;
+    for (int row = 0; row < CompressedVolume::brick_cells; row += n) {
+        const int bits = *in++;
+        for (int z = 0; z < n; z++) {
+            unsigned zigzag = 0;
+            for (int b = 0; b < bits; b++) {
+                int position = z * bits + b;
+                zigzag |= (unsigned)((in[position / 8] >> (position % 8)) & 1) << b;
+            }
+            codes[row + z] = predict(codes, row + z) + ((int)(zigzag >> 1) ^ -(int)(zigzag & 1));
+        }
+        in += bits * n / 8;
+    }
+}
+
+void CompressedVolume::write(const std::string &fn, const Vector3i &res, const std::function<real(int, int, int)> &f,
+                             int bits, real threshold, const std::function<bool(const Vector3i &)> &is_brick_active) {
+    assert_info(bits == 8 || bits == 16, "Compressed volumes are quantized to 8 or 16 bits");
+    FILE *file = fopen(fn.c_str(), "wb");
+    assert_info(file != nullptr, "Can not open " + fn + " for writing");
+    Header header;
+    std::memcpy(header.magic, volume_magic, sizeof(volume_magic));
+    header.version = volume_version;
+    for (int d = 0; d < 3; d++) {
+        header.res[d] = res[d];
+    }
+    header.bits = bits;
+    header.num_bricks = 0;
+    header.maximum = 0;
+    header.table_offset = 0;
+    // Placeholder, rewritten once the brick table is known
+    fwrite(&header, sizeof(header), 1, file);
+    int64 offset = sizeof(header);
+
+    Vector3i brick_res = (res + Vector3i(brick_size - 1)) / brick_size;
+    const int levels = (1 << bits) - 1;
+    std::vector<BrickEntry> entries;
+    std::vector<real> values(brick_cells);
+    std::vector<bool> inside(brick_cells);
+    std::vector<int> codes(brick_cells);
+    std::vector<unsigned char> payload;
+    for (int bx = 0; bx < brick_res[0]; bx++) {
+        for (int by = 0; by < brick_res[1]; by++) {
+            for (int bz = 0; bz < brick_res[2]; bz++) {
+                if (is_brick_active && !is_brick_active(Vector3i(bx, by, bz))) {
+                    continue;
+                }
+                real minimum = std::numeric_limits<real>::infinity(), maximum = -minimum;
+                bool empty = true;
+                for (int c = 0; c < brick_cells; c++) {
+                    int i = bx * brick_size + c / (brick_size * brick_size);
+                    int j = by * brick_size + c / brick_size % brick_size;
+                    int k = bz * brick_size + c % brick_size;
+                    inside[c] = i < res[0] && j < res[1] && k < res[2];
+                    if (!inside[c]) {
+                        continue;
+                    }
+                    values[c] = f(i, j, k);
+                    minimum = std::min(minimum, values[c]);
+                    maximum = std::max(maximum, values[c]);
+                    empty = empty && std::abs(values[c]) <= threshold;
+                }
+                if (empty) {
+                    continue;
+                }
+                header.maximum = std::max(header.maximum, maximum);
+                BrickEntry entry;
+                entry.brick = (bx * brick_res[1] + by) * brick_res[2] + bz;
+                entry.minimum = minimum;
+                entry.scale = (maximum - minimum) / levels;
+                for (int c = 0; c < brick_cells; c++) {
+                    codes[c] = inside[c] && entry.scale > 0 ? (int)std::round((values[c] - minimum) / entry.scale) : 0;
+                }
+                payload.clear();
+                encode_brick(&codes[0], payload);
+                entry.size = (int)payload.size();
+                entry.offset = offset;
+                fwrite(&payload[0], 1, payload.size(), file);
+                offset += payload.size();
+                entries.push_back(entry);
+            }
+        }
+    }
+    header.num_bricks = (int)entries.size();
+    header.table_offset = offset;
+    if (!entries.empty()) {
+        fwrite(&entries[0], sizeof(BrickEntry), entries.size(), file);
+    }
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    fclose(file);
+}
+
+void CompressedVolume::write(const std::string &fn, const Array3D<real> &volume, int bits, real threshold) {
+    write(fn, Vector3i(volume.get_width(), volume.get_height(), volume.get_depth()),
+          [&](int i, int j, int k) { return volume[i][j][k]; }, bits, threshold);
+}
+
+void CompressedVolume::open(const std::string &fn) {
+    close();
+#if !defined(_WIN32)
+    int fd = ::open(fn.c_str(), O_RDONLY);
+    assert_info(fd >= 0, "Can not open " + fn);
+    struct stat st;
+    fstat(fd, &st);
+    data_size = (size_t)st.st_size;
+    assert_info(data_size >= sizeof(Header), "Not a compressed volume: " + fn);
+    void *ptr = mmap(nullptr, data_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    assert_info(ptr != MAP_FAILED, "Can not map " + fn);
+    data = (const unsigned char *)ptr;
+#else
+    FILE *file = fopen(fn.c_str(), "rb");
+    assert_info(file != nullptr, "Can not open " + fn);
+    fseek(file, 0, SEEK_END);
+    data_size = (size_t)ftell(file);
+    fseek(file, 0, SEEK_SET);
+    file_copy.resize(data_size);
+    size_t read = fread(&file_copy[0], 1, data_size, file);
+    fclose(file);
+    assert_info(read == data_size && data_size >= sizeof(Header), "Not a compressed volume: " + fn);
+    data = &file_copy[0];
+#endif
+    std::memcpy(&header, data, sizeof(header));
+    assert_info(std::memcmp(header.magic, volume_magic, sizeof(volume_magic)) == 0 &&
+                header.version == volume_version, "Not a compressed volume: " + fn);
+    assert_info(header.table_offset + (int64)header.num_bricks * (int64)sizeof(BrickEntry) <= (int64)data_size,
+                "Truncated compressed volume: " + fn);
+    res = Vector3i(header.res[0], header.res[1], header.res[2]);
+    brick_res = (res + Vector3i(brick_size - 1)) / brick_size;
+    entries.resize((size_t)header.num_bricks);
+    if (header.num_bricks > 0) {
+        std::memcpy(&entries[0], data + header.table_offset, entries.size() * sizeof(BrickEntry));
+    }
+    brick_to_entry.assign((size_t)(brick_res[0] * brick_res[1] * brick_res[2]), -1);
+    for (int e = 0; e < (int)entries.size(); e++) {
+        assert_info(entries[e].offset + entries[e].size <= header.table_offset, "Corrupted compressed volume: " + fn);
+        brick_to_entry[entries[e].brick] = e;
+    }
+    decoded_flags.reset(new std::once_flag[entries.size()]);
+    decoded.assign(entries.size(), std::vector<real>());
+    num_decoded_bricks = 0;
+}
+
+void CompressedVolume::close() {
+#if !defined(_WIN32)
+    if (data != nullptr) {
+        munmap((void *)data, data_size);
+    }
+#endif
+    data = nullptr;
+    data_size = 0;
+    file_copy.clear();
+}
+
+const real *CompressedVolume::get_brick(int entry) const {
+    std::call_once(decoded_flags[entry], [&]() {
+        const BrickEntry &brick = entries[entry];
+        int codes[brick_cells];
+        decode_brick(data + brick.offset, codes);
+        std::vector<real> &values = decoded[entry];
+        values.resize(brick_cells);
+        for (int c = 0; c < brick_cells; c++) {
+            values[c] = brick.minimum + codes[c] * brick.scale;
+        }
+        num_decoded_bricks++;
+    });
+    return &decoded[entry][0];
+}
+
+real CompressedVolume::get(int i, int j, int k) const {
+    if (i < 0 || j < 0 || k < 0 || i >= res[0] || j >= res[1] || k >= res[2]) {
+        return 0.0f;
+    }
+    int entry = brick_to_entry[((i / brick_size) * brick_res[1] + j / brick_size) * brick_res[2] + k / brick_size];
+    if (entry < 0) {
+        return 0.0f;
+    }
+    return get_brick(entry)[((i % brick_size) * brick_size + j % brick_size) * brick_size + k % brick_size];
+}
+
+real CompressedVolume::sample(const Vector3 &pos) const {
+    real x = clamp(pos.x - 0.5f, 0.f, res[0] - 1.f - eps);
+    real y = clamp(pos.y - 0.5f, 0.f, res[1] - 1.f - eps);
+    real z = clamp(pos.z - 0.5f, 0.f, res[2] - 1.f - eps);
+    int x_i = clamp(int(x), 0, res[0] - 2);
+    int y_i = clamp(int(y), 0, res[1] - 2);
+    int z_i = clamp(int(z), 0, res[2] - 2);
+    real x_r = x - x_i;
+    real y_r = y - y_i;
+    real z_r = z - z_i;
+    return
+            lerp(z_r,
+                 lerp(x_r,
+                      lerp(y_r, get(x_i, y_i, z_i), get(x_i, y_i + 1, z_i)),
+                      lerp(y_r, get(x_i + 1, y_i, z_i), get(x_i + 1, y_i + 1, z_i))),
+                 lerp(x_r,
+                      lerp(y_r, get(x_i, y_i, z_i + 1), get(x_i, y_i + 1, z_i + 1)),
+                      lerp(y_r, get(x_i + 1, y_i, z_i + 1), get(x_i + 1, y_i + 1, z_i + 1)))
+            );
+}
+
+TC_NAMESPACE_END
@@ -12,6 +12,7 @@
 #include <taichi/dynamics/mpm2d/mpm.h>
 #include <taichi/dynamics/mpm2d/mpm_particle.h>
 #include <taichi/dynamics/simulation3d.h>
+#include <taichi/dynamics/frame_pipeline.h>
 #include <taichi/common/asset_manager.h>
 
 PYBIND11_MAKE_OPAQUE(std::vector<taichi::RenderParticle>);
@@ -72,6 +73,7 @@ void export_dynamics(py::module &m) {
             .def("initialize", &Simulation3D::initialize)
             .def("add_particles", &Simulation3D::add_particles)
             .def("update", &Simulation3D::update)
+            .def("write_volumes", &Simulation3D::write_volumes)
             .def("step", &Simulation3D::step)
             .def("get_current_time", &Simulation3D::get_current_time)
             .def("get_render_particles", &Simulation3D::get_render_particles)
@@ -79,6 +81,16 @@ void export_dynamics(py::module &m) {
             .def("get_mpi_world_rank", &Simulation3D::get_mpi_world_rank)
             .def("test", &Simulation3D::test);
 
+    py::class_<FramePipeline, std::shared_ptr<FramePipeline>>(m, "FramePipeline")
+            .def(py::init<>())
+            .def("initialize", &FramePipeline::initialize)
+            .def("set_particle_renderer", &FramePipeline::set_particle_renderer)
+            .def("push", static_cast<void (FramePipeline::*)(const Simulation3D &, int, std::shared_ptr<Camera>)>(
+                    &FramePipeline::push))
+            .def("get_image", &FramePipeline::get_image)
+            .def("flush", &FramePipeline::flush)
+            .def("get_stall_time", &FramePipeline::get_stall_time);
+
     py::class_<MPM>(m, "MPMSimulator")
             .def(py::init<>())
             .def("initialize", &MPM::initialize)
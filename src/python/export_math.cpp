@@ -172,6 +172,8 @@ void export_math(py::module &m) {
             .def("set", static_cast<void (LevelSet2D::*)(int, int, const real &)>(&LevelSet2D::set))
             .def("add_sphere", &LevelSet2D::add_sphere)
             .def("add_polygon", &LevelSet2D::add_polygon)
+            .def("redistance", &LevelSet2D::redistance)
+            .def("redistance_narrow_band", &LevelSet2D::redistance_narrow_band)
             .def("get_gradient", &LevelSet2D::get_gradient)
             .def("rasterize", &LevelSet2D::rasterize)
             .def("sample", static_cast<real(LevelSet2D::*)(real, real) const>(&LevelSet2D::sample))
@@ -194,6 +196,8 @@ void export_math(py::module &m) {
             .def("add_plane", &LevelSet3D::add_plane)
             .def("add_cuboid", &LevelSet3D::add_cuboid)
             .def("global_increase", &LevelSet3D::global_increase)
+            .def("redistance", &LevelSet3D::redistance)
+            .def("redistance_narrow_band", &LevelSet3D::redistance_narrow_band)
             .def("get_gradient", &LevelSet3D::get_gradient)
             .def("rasterize", &LevelSet3D::rasterize)
             .def("sample", static_cast<real(LevelSet3D::*)(real, real, real) const>(&LevelSet3D::sample))
@@ -21,6 +21,7 @@
 
 #include <taichi/geometry/factory.h>
 #include <taichi/math/levelset_3d.h>
+#include <taichi/visual/voxelizer.h>
 
 PYBIND11_MAKE_OPAQUE(std::vector<taichi::RenderParticle>);
 PYBIND11_MAKE_OPAQUE(std::vector<taichi::Triangle>);
@@ -92,10 +93,15 @@ void export_visual(py::module &m) {
             .def("set_material", &Mesh::set_material)
             .def_readwrite("transform", &Mesh::transform);
 
+    py::class_<Voxelizer>(m, "Voxelizer")
+            .def(py::init<int, real>())
+            .def("voxelize_mesh", &Voxelizer::voxelize_mesh);
+
     py::class_<Scene, std::shared_ptr<Scene>>(m, "Scene")
             //.def("initialize", &Scene::initialize)
             .def("finalize", &Scene::finalize)
             .def("add_mesh", &Scene::add_mesh)
+            .def("add_instance", &Scene::add_instance)
             .def("set_atmosphere_material", &Scene::set_atmosphere_material)
             .def("set_environment_map", &Scene::set_environment_map)
             .def("set_camera", &Scene::set_camera);
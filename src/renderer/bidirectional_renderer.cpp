@@ -167,7 +167,7 @@ double BidirectionalRenderer::path_pdf(const Path &path,
         if (i == -1) {
             // Light sample PDF
             int id = path[path_length].triangle_id;
-            p = p * scene->get_triangle_pdf(id) / scene->get_triangle(id).area;
+            p = p * scene->get_triangle_pdf(id) / scene->get_triangle_area(id);
         } else if (i == 0) {
             Vector3 in_dir = normalize(
                     path[path_length - 1].pos - path[path_length].pos);
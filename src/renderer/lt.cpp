@@ -70,11 +70,11 @@ public:
         camera->get_pixel_coordinate(normalized(pos - camera->get_origin()), px, py);
         if (!(px < 0 || px > 1 || py < 0 || py > 1)) {
             Vector3 out_dir = normalized(camera->get_origin() - pos);
-            auto test_ray = Ray(pos, out_dir);
-            sg->query(test_ray);
             Vector3d d0 = pos - camera->get_origin();
             const double dist2 = dot(d0, d0);
-            if (test_ray.dist > sqrt(dist2) - 1e-4f) {
+            auto test_ray = Ray(pos, out_dir);
+            test_ray.dist = real(sqrt(dist2)) - 1e-4f;
+            if (!sg->occlude(test_ray)) {
                 d0 = normalized(d0);
                 const double c = dot(d0, camera->get_dir());
                 real scale = real(abs(dot(d0, normal) / dist2 / (c * c * c)) / camera->get_pixel_scaling());
@@ -104,7 +104,6 @@ public:
             IntersectionInfo info = sg->query(ray);
             if (!info.intersected)
                 break;
-            Triangle &tri = scene->triangles[info.triangle_id];
             BSDF bsdf(scene, info);
             Vector3 in_dir = -ray.dir;
             Vector3 out_dir;
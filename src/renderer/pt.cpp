@@ -36,12 +36,20 @@ public:
 
     void render_stage() override {
         int samples = width * height;
-        auto task = [&](int i) {
-            RandomStateSequence rand(sampler, index + i);
-            auto cont = get_path_contribution(rand);
-            write_path_contribution(cont);
-        };
-        ThreadedTaskManager::run(task, 0, samples, num_threads);
+        if (batch_primary_rays) {
+            const int num_batches = (samples + primary_ray_batch_size - 1) / primary_ray_batch_size;
+            auto task = [&](int b) {
+                render_batch(b * primary_ray_batch_size, std::min((b + 1) * primary_ray_batch_size, samples));
+            };
+            ThreadedTaskManager::run(task, 0, num_batches, num_threads);
+        } else {
+            auto task = [&](int i) {
+                RandomStateSequence rand(sampler, index + i);
+                auto cont = get_path_contribution(rand);
+                write_path_contribution(cont);
+            };
+            ThreadedTaskManager::run(task, 0, samples, num_threads);
+        }
         index += samples;
     }
 
@@ -69,6 +77,8 @@ protected:
         } else {
             tri = *p_triangle;
         }
+        // Without index-matched surfaces or participating media, visibility is a single ray query
+        const bool use_shadow_rays = shadow_rays && stack.size() != 0 && stack.top()->is_vacuum();
         // MIS between bsdf and light sampling.
         int samples = direct_lighting_bsdf + direct_lighting_light;
         for (int i = 0; i < samples; i++) {
@@ -88,6 +98,8 @@ protected:
             real bsdf_p;
             SurfaceEvent event;
             Vector3 dist;
+            // Barycentric coordinates of the sampled point on the light
+            real light_u = 0, light_v = 0;
             if (sample_bsdf) {
                 // Sample BSDF
                 bsdf.sample(in_dir, rand(), rand(), out_dir, f, bsdf_p, event);
@@ -103,7 +115,13 @@ protected:
                     real pdf;
                     out_dir = p_envmap->sample_direction(rand, pdf, _);
                 } else {
-                    Vector3 pos = tri.sample_point(rand(), rand());
+                    light_u = rand();
+                    light_v = rand();
+                    if (light_u + light_v > 1) {
+                        light_u = 1 - light_u;
+                        light_v = 1 - light_v;
+                    }
+                    Vector3 pos = tri.sample_point(light_u, light_v);
                     dist = pos - info.pos;
                     out_dir = normalize(dist);
                 }
@@ -112,7 +130,29 @@ protected:
             }
             Ray ray(info.pos + out_dir * 1e-3f, out_dir);
             IntersectionInfo test_info;
-            Vector3 att = get_attenuation(stack, ray, rand, test_info);
+            Vector3 att;
+            if (!use_shadow_rays) {
+                att = get_attenuation(stack, ray, rand, test_info);
+            } else if (sample_bsdf) {
+                // Anything but a light source blocks the ray. Only lights need the full hit record.
+                test_info = sg->query(ray, IntersectionInfo::BASIC);
+                const bool emissive = test_info.intersected && test_info.material->is_emissive();
+                if (emissive) {
+                    test_info = scene->get_intersection_info(test_info.triangle_id, ray);
+                }
+                att = Vector3(real(!test_info.intersected || emissive));
+            } else if (sample_envmap) {
+                att = Vector3(real(!sg->occlude(ray)));
+            } else {
+                // Only the sampled point has to be visible; it is then the first hit
+                const real light_dist = length(tri.sample_point(light_u, light_v) - ray.orig);
+                ray.dist = light_dist - 1e-3f;
+                att = Vector3(real(!sg->occlude(ray)));
+                ray.dist = light_dist;
+                ray.u = light_u;
+                ray.v = light_v;
+                test_info = scene->get_intersection_info(tri.id, ray);
+            }
             if (max_component(att) == 0.0f) {
                 // Completely blocked.
                 continue;
@@ -124,15 +164,14 @@ protected:
             Vector3 throughput;
             if (test_info.intersected) {
                 // Mesh light
-                const Triangle &light_tri = scene->get_triangle(test_info.triangle_id);
                 BSDF light_bsdf(scene, test_info);
                 if (!light_bsdf.is_emissive() || !test_info.front) {
                     continue;
                 }
                 real c = abs(dot(ray.dir, tri.normal));
                 dist = test_info.pos - info.pos;
-                light_p = dot(dist, dist) / std::max(1e-20f, light_tri.area * c) *
-                          scene->get_triangle_pdf(light_tri.id);
+                light_p = dot(dist, dist) / std::max(1e-20f, scene->get_triangle_area(test_info.triangle_id) * c) *
+                          scene->get_triangle_pdf(test_info.triangle_id);
                 const Vector3 emission = light_bsdf.evaluate(test_info.normal, -out_dir);
                 throughput = f * co * emission * att;
             } else {
@@ -167,18 +206,51 @@ protected:
     Vector3 calculate_volumetric_direct_lighting(const Vector3 &in_dir, const Vector3 &orig,
                                                  StateSequence &rand, VolumeStack &stack);
 
-    PathContribution get_path_contribution(StateSequence &rand) {
-        Vector2 offset(rand(), rand());
+    Ray sample_primary_ray(StateSequence &rand, Vector2 &offset) {
+        offset = Vector2(rand(), rand());
         Vector2 size(1.0f / width, 1.0f / height);
-        Ray ray = camera->sample(offset, size, rand);
-        Vector3 color = trace(ray, rand);
+        return camera->sample(offset, size, rand);
+    }
+
+    PathContribution get_path_contribution(const Vector2 &offset, Vector3 color) {
         if (luminance_clamping > 0 && luminance(color) > luminance_clamping) {
             color = luminance_clamping / luminance(color) * color;
         }
         return PathContribution(offset.x, offset.y, color);
     }
 
-    virtual Vector3 trace(Ray ray, StateSequence &rand);
+    PathContribution get_path_contribution(StateSequence &rand) {
+        Vector2 offset;
+        Ray ray = sample_primary_ray(rand, offset);
+        return get_path_contribution(offset, trace(ray, rand));
+    }
+
+    // Samples [begin, end) of this stage, with their primary rays traced together through
+    // SceneGeometry::query_batch. Each sample keeps its own random sequence, so the result
+    // is the same as tracing them one by one.
+    void render_batch(int begin, int end) {
+        std::vector<RandomStateSequence> rands;
+        std::vector<Vector2> offsets((size_t)(end - begin));
+        std::vector<Ray> rays;
+        rands.reserve((size_t)(end - begin));
+        rays.reserve((size_t)(end - begin));
+        for (int i = begin; i < end; i++) {
+            rands.push_back(RandomStateSequence(sampler, index + i));
+            rays.push_back(sample_primary_ray(rands.back(), offsets[i - begin]));
+        }
+        sg->query_batch(&rays[0], end - begin);
+        for (int i = 0; i < end - begin; i++) {
+            IntersectionInfo info = scene->get_intersection_info(rays[i].triangle_id, rays[i]);
+            write_path_contribution(get_path_contribution(offsets[i], trace(rays[i], rands[i], &info)));
+        }
+    }
+
+    virtual Vector3 trace(Ray ray, StateSequence &rand) {
+        return trace(ray, rand, nullptr);
+    }
+
+    // If given, primary_hit is the intersection of ray, which has been queried already
+    Vector3 trace(Ray ray, StateSequence &rand, const IntersectionInfo *primary_hit);
 
     virtual void write_path_contribution(const PathContribution &cont, real scale = 1.0f) {
         auto x = clamp(cont.x, 0.0f, 1.0f - 1e-7f);
@@ -250,6 +322,12 @@ protected:
     }
 
     bool direct_lighting;
+    // Trace single shadow rays for direct lighting instead of get_attenuation, when the scene allows
+    bool shadow_rays;
+    // Trace the primary rays of render_stage in batches (see render_batch). Renderers that
+    // override trace() have to disable this.
+    bool batch_primary_rays;
+    static const int primary_ray_batch_size = 256;
     int direct_lighting_bsdf;
     int direct_lighting_light;
     ImageAccumulator<Vector3> accumulator;
@@ -271,6 +349,8 @@ void PathTracingRenderer::initialize(const Config &config) {
     this->accumulator = ImageAccumulator<Vector3>(width, height);
     this->russian_roulette = config.get("russian_roulette", true);
     this->envmap_is = config.get("envmap_is", true);
+    this->shadow_rays = config.get("shadow_rays", true) && !scene->has_index_matched_interfaces();
+    this->batch_primary_rays = config.get("batch_primary_rays", true);
     index = 0;
 }
 
@@ -339,15 +419,14 @@ Vector3 PathTracingRenderer::calculate_volumetric_direct_lighting(const Vector3
         Vector3 throughput;
         if (test_info.intersected) {
             // Mesh light
-            const Triangle &light_tri = scene->get_triangle(test_info.triangle_id);
             BSDF light_bsdf(scene, test_info);
             if (!light_bsdf.is_emissive() || !test_info.front) {
                 continue;
             }
             real c = abs(dot(ray.dir, tri.normal));
             dist = test_info.pos - orig;
-            light_p = dot(dist, dist) / std::max(1e-20f, light_tri.area * c) *
-                      scene->get_triangle_pdf(light_tri.id);
+            light_p = dot(dist, dist) / std::max(1e-20f, scene->get_triangle_area(test_info.triangle_id) * c) *
+                      scene->get_triangle_pdf(test_info.triangle_id);
             const Vector3 emission = light_bsdf.evaluate(test_info.normal, -out_dir);
             throughput = f * co * emission * att;
         } else {
@@ -372,7 +451,7 @@ Vector3 PathTracingRenderer::calculate_volumetric_direct_lighting(const Vector3
     return acc;
 }
 
-Vector3 PathTracingRenderer::trace(Ray ray, StateSequence &rand) {
+Vector3 PathTracingRenderer::trace(Ray ray, StateSequence &rand, const IntersectionInfo *primary_hit) {
     Vector3 ret(0);
     Vector3 importance(1);
     VolumeStack stack;
@@ -390,7 +469,7 @@ Vector3 PathTracingRenderer::trace(Ray ray, StateSequence &rand) {
             break;
         }
         const VolumeMaterial &volume = *stack.top();
-        IntersectionInfo info = sg->query(ray);
+        IntersectionInfo info = depth == 1 && primary_hit ? *primary_hit : sg->query(ray);
         real safe_distance = volume.sample_free_distance(rand, ray);
         Vector3 f(1.0f);
         Ray out_ray;
@@ -485,6 +564,10 @@ class PTSDFRenderer final : public PathTracingRenderer {
 public:
     void initialize(const Config &config) override {
         PathTracingRenderer::initialize(config);
+        // Visibility is given by ray marching in get_attenuation
+        shadow_rays = false;
+        // Primary hits come from the SDF as well, in trace()
+        batch_primary_rays = false;
         Config cfg;
         cfg.set("color", Vector3(1, 1, 1));
         material = create_instance<SurfaceMaterial>("diffuse", cfg);
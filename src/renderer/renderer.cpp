@@ -12,11 +12,21 @@
 TC_NAMESPACE_BEGIN
 
 void Renderer::initialize(const Config &config) {
-    this->ray_intersection = create_instance<RayIntersection>(config.get("ray_intersection", "embree"));
-    sg = std::make_shared<SceneGeometry>(scene, ray_intersection);
+    this->num_threads = config.get("num_threads", 1);
+    if (sg) {
+        // Initialized again for another frame: the ray intersection structure is kept and updated
+        sg->update(scene);
+    } else {
+        Config ray_intersection_config;
+        ray_intersection_config.set("num_threads", num_threads);
+        // Geometry that will move between frames, see SceneGeometry::update
+        ray_intersection_config.set("dynamic", config.get("dynamic_geometry", false));
+        this->ray_intersection = create_instance<RayIntersection>(config.get("ray_intersection", "embree"),
+                                                                  ray_intersection_config);
+        sg = std::make_shared<SceneGeometry>(scene, ray_intersection);
+    }
     this->min_path_length = config.get_int("min_path_length");
     this->max_path_length = config.get_int("max_path_length");
-    this->num_threads = config.get("num_threads", 1);
     assert_info(min_path_length <= max_path_length, "min_path_length > max_path_length");
 }
 
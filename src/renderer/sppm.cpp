@@ -58,7 +58,6 @@ void SPPMRenderer::trace_eye_path(StateSequence &rand, Ray &ray, const Vector2i
         if (!info.intersected)
             return;
 
-        Triangle &tri = scene->triangles[info.triangle_id];
         BSDF bsdf(scene, info);
         Vector3 in_dir = -ray.dir;
         if (bsdf.is_emissive()) {
@@ -110,7 +109,6 @@ bool SPPMRenderer::trace_photon(StateSequence &rand, real contribution_scaling)
         IntersectionInfo info = sg->query(ray);
         if (!info.intersected)
             break;
-        Triangle &tri = scene->triangles[info.triangle_id];
         BSDF bsdf(scene, info);
         Vector3 in_dir = -ray.dir;
         Vector3 out_dir;
@@ -0,0 +1,253 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/threading.h>
+#include <taichi/dynamics/poisson_solver2d.h>
+#include <taichi/dynamics/poisson_solver3d.h>
+#include <taichi/math/fft.h>
+
+TC_NAMESPACE_BEGIN
+
+// Direct solver for the constant-coefficient Poisson systems of the multigrid
+// solvers on an all-interior box (diagonal = number of non-Neumann neighbours).
+// The operator is a sum of 1D [-1 2 -1] operators, one per axis, each of which
+// is diagonalized by a transform determined by the padding:
+//   neumann: DCT-II, dirichlet: DST-I, periodic: DFT.
+// Transforming b along every axis, dividing by the summed eigenvalues and
+// transforming back solves the system in O(N log N), without iterations.
+// With neumann and periodic padding the constant mode is the null space; the
+// mean of b is projected out and the solution has zero mean.
+// Data is row-major with the last axis contiguous, matching Array2D and Array3D.
+class SpectralPoissonSolver {
+public:
+    typedef FFT1D::Complex Complex;
+
+protected:
+    std::vector<int> res;
+    bool periodic;
+    int num_threads;
+    int64 size;
+    std::vector<RealTrigonometricTransform1D> transforms;
+    std::vector<FFT1D> ffts;
+    std::vector<std::vector<double>> eigenvalues;
+
+    // f(line, base, stride) for every 1D line along `axis`
+    template <typename T, typename F>
+    void transform_lines(std::vector<T> &data, int axis, const F &f) const {
+        int64 stride = 1;
+        for (int d = axis + 1; d < (int)res.size(); d++) {
+            stride *= res[d];
+        }
+        const int n = res[axis];
+        const int64 num_lines = size / n;
+        ThreadedTaskManager::run((int)num_lines, num_threads, [&](int l) {
+            thread_local std::vector<T> line;
+            line.resize((size_t)n);
+            int64 base = l / stride * stride * n + l % stride;
+            for (int i = 0; i < n; i++) {
+                line[i] = data[base + i * stride];
+            }
+            f(&line[0]);
+            for (int i = 0; i < n; i++) {
+                data[base + i * stride] = line[i];
+            }
+        });
+    }
+
+    template <typename T>
+    void divide_by_eigenvalues(std::vector<T> &data) const {
+        const int dim = (int)res.size();
+        ThreadedTaskManager::run(res[0], num_threads, [&](int i) {
+            const int64 slab = size / res[0];
+            std::vector<int> index(dim, 0);
+            index[0] = i;
+            for (int64 p = 0; p < slab; p++) {
+                double lambda = 0;
+                for (int d = 0; d < dim; d++) {
+                    lambda += eigenvalues[d][index[d]];
+                }
+                T &v = data[i * slab + p];
+                // The null space (constant mode) is dropped
+                v = lambda > 1e-9 ? T(v / lambda) : T(0);
+                for (int d = dim - 1; d > 0; d--) {
+                    if (++index[d] < res[d]) {
+                        break;
+                    }
+                    index[d] = 0;
+                }
+            }
+        });
+    }
+
+public:
+    void initialize(const std::vector<int> &res, const std::string &padding, int num_threads) {
+        assert_info(padding == "neumann" || padding == "dirichlet" || padding == "periodic",
+                    "'padding' has to be 'neumann', 'dirichlet' or 'periodic' instead of " + padding);
+        this->res = res;
+        this->num_threads = num_threads;
+        periodic = padding == "periodic";
+        size = 1;
+        transforms.clear();
+        ffts.clear();
+        eigenvalues.clear();
+        for (int n : res) {
+            assert_info(n >= 1, "Empty resolution");
+            size *= n;
+            std::vector<double> eig((size_t)n);
+            if (periodic) {
+                ffts.push_back(FFT1D(n));
+                for (int k = 0; k < n; k++) {
+                    eig[k] = 2 - 2 * std::cos(2 * 3.14159265358979323846 * k / n);
+                }
+            } else {
+                auto type = padding == "neumann" ? RealTrigonometricTransform1D::DCT_II
+                                                 : RealTrigonometricTransform1D::DST_I;
+                transforms.push_back(RealTrigonometricTransform1D(type, n));
+                for (int k = 0; k < n; k++) {
+                    eig[k] = transforms.back().get_eigenvalue(k);
+                }
+            }
+            eigenvalues.push_back(eig);
+        }
+    }
+
+    void solve(const real *b, real *x) const {
+        const int dim = (int)res.size();
+        if (periodic) {
+            std::vector<Complex> data(b, b + size);
+            for (int d = 0; d < dim; d++) {
+                transform_lines(data, d, [&](Complex *line) { ffts[d].forward(line); });
+            }
+            divide_by_eigenvalues(data);
+            for (int d = 0; d < dim; d++) {
+                transform_lines(data, d, [&](Complex *line) { ffts[d].inverse(line); });
+            }
+            for (int64 i = 0; i < size; i++) {
+                x[i] = (real)(data[i].real() / size);
+            }
+        } else {
+            std::vector<double> data(b, b + size);
+            for (int d = 0; d < dim; d++) {
+                transform_lines(data, d, [&](double *line) { transforms[d].forward(line); });
+            }
+            divide_by_eigenvalues(data);
+            for (int d = 0; d < dim; d++) {
+                transform_lines(data, d, [&](double *line) { transforms[d].inverse(line); });
+            }
+            for (int64 i = 0; i < size; i++) {
+                x[i] = (real)data[i];
+            }
+        }
+    }
+};
+
+// "fft": direct solves on all-interior boxes. Boundary arrays with any
+// non-interior cell, and variable-coefficient systems, are handed to an
+// iterative `fallback` solver (mgpcg by default) created with the same config.
+class FFTPoissonSolver2D : public PoissonSolver2D {
+protected:
+    Config config;
+    Vector2i res;
+    std::string padding;
+    SpectralPoissonSolver spectral;
+    BCArray boundary;
+    std::shared_ptr<PoissonSolver2D> fallback;
+    bool use_fallback = false;
+
+    void enable_fallback() {
+        assert_info(padding != "periodic", "Periodic padding is only supported on all-interior boxes.");
+        if (!fallback) {
+            fallback = create_instance<PoissonSolver2D>(config.get("fallback", std::string("mgpcg")), config);
+        }
+        fallback->set_boundary_condition(boundary);
+        use_fallback = true;
+    }
+
+public:
+    void initialize(const Config &config) override {
+        this->config = config;
+        res = config.get_vec2i("res");
+        padding = config.get_string("padding");
+        spectral.initialize({res[0], res[1]}, padding, config.get("num_threads", 1));
+    }
+
+    void set_boundary_condition(const BCArray &boundary) override {
+        this->boundary = boundary;
+        use_fallback = false;
+        for (auto &ind : boundary.get_region()) {
+            if (boundary[ind] != INTERIOR) {
+                enable_fallback();
+                break;
+            }
+        }
+    }
+
+    void set_system(const Array &Ad, const Array &Ax, const Array &Ay) override {
+        enable_fallback();
+        fallback->set_system(Ad, Ax, Ay);
+    }
+
+    void run(const Array &b, Array &x, real tolerance) override {
+        if (use_fallback) {
+            fallback->run(b, x, tolerance);
+            return;
+        }
+        spectral.solve(&b[0][0], &x[0][0]);
+    }
+};
+
+TC_IMPLEMENTATION(PoissonSolver2D, FFTPoissonSolver2D, "fft");
+
+class FFTPoissonSolver3D : public PoissonSolver3D {
+protected:
+    Config config;
+    Vector3i res;
+    std::string padding;
+    SpectralPoissonSolver spectral;
+    std::shared_ptr<PoissonSolver3D> fallback;
+    bool use_fallback = false;
+
+public:
+    void initialize(const Config &config) override {
+        this->config = config;
+        maximum_iterations = config.get("maximum_iterations", 0);
+        res = config.get_vec3i("res");
+        padding = config.get_string("padding");
+        spectral.initialize({res[0], res[1], res[2]}, padding, config.get("num_threads", 1));
+    }
+
+    void set_boundary_condition(const BCArray &boundary) override {
+        use_fallback = false;
+        for (auto &ind : boundary.get_region()) {
+            if (boundary[ind] != INTERIOR) {
+                use_fallback = true;
+                break;
+            }
+        }
+        if (use_fallback) {
+            assert_info(padding != "periodic", "Periodic padding is only supported on all-interior boxes.");
+            if (!fallback) {
+                fallback = create_instance<PoissonSolver3D>(config.get("fallback", std::string("mgpcg")), config);
+            }
+            fallback->set_boundary_condition(boundary);
+        }
+    }
+
+    void run(const Array &b, Array &x, real tolerance) override {
+        if (use_fallback) {
+            fallback->run(b, x, tolerance);
+            return;
+        }
+        spectral.solve(&b[0][0][0], &x[0][0][0]);
+    }
+};
+
+TC_IMPLEMENTATION(PoissonSolver3D, FFTPoissonSolver3D, "fft");
+
+TC_NAMESPACE_END
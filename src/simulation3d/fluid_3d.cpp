@@ -15,6 +15,10 @@
 #include <taichi/visualization/particle_visualization.h>
 #include <taichi/common/asset_manager.h>
 #include <taichi/system/timer.h>
+#include <taichi/system/profiler.h>
+#include <taichi/system/threading.h>
+#include <taichi/math/stencil_sweep.h>
+#include <taichi/io/compressed_volume.h>
 
 TC_NAMESPACE_BEGIN
 const static Vector3i offsets[]{
@@ -23,65 +27,61 @@ const static Vector3i offsets[]{
         Vector3i(0, 0, 1), Vector3i(0, 0, -1)
 };
 
-void Smoke3D::project() {
-    Array divergence(res[0], res[1], res[2], 0.0f);
-    for (auto &ind : u.get_region()) {
-        if (0 < ind.i)
-            divergence[ind + Vector3i(-1, 0, 0)] += u[ind];
-        if (ind.i < res[0])
-            divergence[ind] -= u[ind];
-    }
-    for (auto &ind : v.get_region()) {
-        if (0 < ind.j)
-            divergence[ind + Vector3i(0, -1, 0)] += v[ind];
-        if (ind.j < res[1])
-            divergence[ind] -= v[ind];
-    }
-    for (auto &ind : w.get_region()) {
-        if (0 < ind.k)
-            divergence[ind + Vector3i(0, 0, -1)] += w[ind];
-        if (ind.k < res[2])
-            divergence[ind] -= w[ind];
+bool Smoke3D::is_neumann(int i, int j, int k) const {
+    if (boundary_condition.inside(i, j, k)) {
+        return boundary_condition[i][j][k] == PoissonSolver3D::NEUMANN;
+    } else {
+        return !open_boundary;
     }
+}
+
+void Smoke3D::project() {
+    StencilSweep sweep(num_threads);
+    sweep.for_each_row(res, [&](int i, int j) {
+        const real *u0 = u[i][j], *u1 = u[i + 1][j], *v0 = v[i][j], *v1 = v[i][j + 1], *w_row = w[i][j];
+        const PoissonSolver3D::CellType *bc = boundary_condition[i][j];
+        real *div = divergence[i][j];
+        for (int k = 0; k < res[2]; k++) {
+            real d = u1[k] - u0[k] + v1[k] - v0[k] + w_row[k + 1] - w_row[k];
+            div[k] = bc[k] == PoissonSolver3D::INTERIOR ? d : 0.0f;
+        }
+    });
     pressure = 0;
     pressure_solver->set_boundary_condition(boundary_condition);
-    for (auto &ind : boundary_condition.get_region()) {
-        if (boundary_condition[ind] != PoissonSolver3D::INTERIOR) {
-            divergence[ind] = 0.0f;
-        }
-    }
     pressure_solver->run(divergence, pressure, pressure_tolerance);
-    auto is_neumann = [&](Index3D const &ind) -> bool {
-        if (boundary_condition.inside(ind)) {
-            return boundary_condition[ind] == PoissonSolver3D::NEUMANN;
-        } else {
-            if (open_boundary) {
-                return false;
-            } else {
-                return true;
-            }
+    // Faces gather the pressure of the cells on both sides, so that they can be updated in parallel
+    sweep.for_each_row(Vector3i(res[0] + 1, res[1], res[2]), [&](int i, int j) {
+        real *face = u[i][j];
+        for (int k = 0; k < res[2]; k++) {
+            if (i < res[0] && !is_neumann(i - 1, j, k))
+                face[k] += pressure[i][j][k];
+            if (i > 0 && !is_neumann(i, j, k))
+                face[k] -= pressure[i - 1][j][k];
         }
-    };
-    for (auto &ind : pressure.get_region()) {
-        if (!is_neumann(ind.neighbour(Vector3i(-1, 0, 0))))
-            u[ind] += pressure[ind];
-        if (!is_neumann(ind.neighbour(Vector3i(1, 0, 0))))
-            u[ind + Vector3i(1, 0, 0)] -= pressure[ind];
-
-        if (!is_neumann(ind.neighbour(Vector3i(0, -1, 0))))
-            v[ind] += pressure[ind];
-        if (!is_neumann(ind.neighbour(Vector3i(0, 1, 0))))
-            v[ind + Vector3i(0, 1, 0)] -= pressure[ind];
-
-        if (!is_neumann(ind.neighbour(Vector3i(0, 0, -1))))
-            w[ind] += pressure[ind];
-        if (!is_neumann(ind.neighbour(Vector3i(0, 0, 1))))
-            w[ind + Vector3i(0, 0, 1)] -= pressure[ind];
-    }
+    });
+    sweep.for_each_row(Vector3i(res[0], res[1] + 1, res[2]), [&](int i, int j) {
+        real *face = v[i][j];
+        for (int k = 0; k < res[2]; k++) {
+            if (j < res[1] && !is_neumann(i, j - 1, k))
+                face[k] += pressure[i][j][k];
+            if (j > 0 && !is_neumann(i, j, k))
+                face[k] -= pressure[i][j - 1][k];
+        }
+    });
+    sweep.for_each_row(res, [&](int i, int j) {
+        real *face = w[i][j];
+        const real *p = pressure[i][j];
+        for (int k = 0; k <= res[2]; k++) {
+            if (k < res[2] && !is_neumann(i, j, k - 1))
+                face[k] += p[k];
+            if (k > 0 && !is_neumann(i, j, k))
+                face[k] -= p[k - 1];
+        }
+    });
     last_pressure = pressure;
 }
 
-void Smoke3D::initialize(const Config &config) {
+void Smoke3D::initialize_parameters(const Config &config) {
     Simulation3D::initialize(config);
     res = config.get_vec3i("resolution");
     smoke_alpha = config.get("smoke_alpha", 0.0f);
@@ -92,15 +92,16 @@ void Smoke3D::initialize(const Config &config) {
     tracker_generation = config.get("tracker_generation", 100.0f);
     num_threads = config.get_int("num_threads");
     super_sampling = config.get_int("super_sampling");
-    std::string padding;
     open_boundary = config.get_bool("open_boundary");
-    if (open_boundary) {
-        padding = "dirichlet";
-    } else {
-        padding = "neumann";
-    }
-
     perturbation = config.get("perturbation", 0.0f);
+    volume_bits = config.get("volume_bits", 8);
+    volume_threshold = config.get("volume_threshold", 1e-4f);
+    current_t = 0.0f;
+}
+
+void Smoke3D::initialize(const Config &config) {
+    initialize_parameters(config);
+    std::string padding = open_boundary ? "dirichlet" : "neumann";
     Config solver_config;
     solver_config.set("res", res).set("num_threads", num_threads).set("padding", padding).
             set("maximum_iterations", config.get_int("maximum_pressure_iterations"));
@@ -112,7 +113,12 @@ void Smoke3D::initialize(const Config &config) {
     pressure = Array(res[0], res[1], res[2], 0.0f);
     last_pressure = Array(res[0], res[1], res[2], 0.0f);
     t = Array(res[0], res[1], res[2], config.get("initial_t", 0.0f));
-    current_t = 0.0f;
+    divergence = Array(res[0], res[1], res[2], 0.0f);
+    advected_u = u.same_shape();
+    advected_v = v.same_shape();
+    advected_w = w.same_shape();
+    advected_rho = rho.same_shape();
+    advected_t = t.same_shape();
     boundary_condition = PoissonSolver3D::BCArray(res);
     for (auto &ind : boundary_condition.get_region()) {
         Vector3 d = ind.get_pos() - Vector3(res) * 0.5f;
@@ -167,6 +173,16 @@ std::vector<RenderParticle> Smoke3D::get_render_particles() const {
     return render_particles;
 }
 
+void Smoke3D::write_volumes(const std::string &prefix) const {
+    // Cell centers, where sampling returns the stored values
+    CompressedVolume::write(prefix + "_density.tcv", res, [&](int i, int j, int k) {
+        return sample_density(Vector3(i + 0.5f, j + 0.5f, k + 0.5f));
+    }, volume_bits, volume_threshold);
+    CompressedVolume::write(prefix + "_temperature.tcv", res, [&](int i, int j, int k) {
+        return sample_temperature(Vector3(i + 0.5f, j + 0.5f, k + 0.5f));
+    }, volume_bits, volume_threshold);
+}
+
 void Smoke3D::show(Array2D<Vector3> &buffer) {
     buffer.reset(Vector3(0));
     int half_width = buffer.get_width() / 2, half_height = buffer.get_height() / 2;
@@ -178,8 +194,8 @@ void Smoke3D::show(Array2D<Vector3> &buffer) {
                 real x = (i + 0.5f) / (real)half_width * res[0];
                 real y = (j + 0.5f) / (real)buffer.get_height() * res[1];
                 real z = k + 0.5f;
-                rho_sum += rho.sample(x, y, z);
-                t_sum += t.sample(x, y, z);
+                rho_sum += sample_density(Vector3(x, y, z));
+                t_sum += sample_temperature(Vector3(x, y, z));
             }
             rho_sum *= density_scaling;
             t_sum = std::min(1.0f, t_sum / res[2]);
@@ -195,8 +211,8 @@ void Smoke3D::show(Array2D<Vector3> &buffer) {
                 real x = (i + 0.5f) / (real)half_width * res[0];
                 real y = k + 0.5f;
                 real z = (j + 0.5f) / (real)half_height * res[2];
-                rho_sum += rho.sample(x, y, z);
-                t_sum += t.sample(x, y, z);
+                rho_sum += sample_density(Vector3(x, y, z));
+                t_sum += sample_temperature(Vector3(x, y, z));
             }
             rho_sum *= density_scaling;
             t_sum = std::min(1.0f, t_sum / res[2]);
@@ -207,15 +223,17 @@ void Smoke3D::show(Array2D<Vector3> &buffer) {
 }
 
 void Smoke3D::move_trackers(real delta_t) {
-    for (auto &tracker : trackers) {
+    ThreadedTaskManager::run((int)trackers.size(), num_threads, [&](int i) {
+        Tracker3D &tracker = trackers[i];
         auto velocity = sample_velocity(tracker.position);
         tracker.position += sample_velocity(tracker.position + 0.5f * delta_t * velocity) * delta_t;
-    }
+    });
 }
 
 void Smoke3D::step(real delta_t) {
+    Profiler _p("smoke_step");
     {
-        Time::Timer _("Seeding");
+        Profiler _("seeding");
         for (auto &ind : rho.get_region()) {
             for (int k = 0; k < super_sampling; k++) {
                 Vector3 pos = ind.get_pos() + Vector3(rand(), rand(), rand()) - ind.storage_offset;
@@ -241,24 +259,55 @@ void Smoke3D::step(real delta_t) {
                 }
             }
         }
-        for (auto &ind : v.get_region()) {
-            if (ind.j < res[1]) {
-                v[ind] += (-smoke_alpha * rho[ind] + smoke_beta * t[ind]) * delta_t;
+        const real t_decay = std::exp(-delta_t * temperature_decay);
+        StencilSweep(num_threads).for_each_row(res, [&](int i, int j) {
+            real *v_row = v[i][j], *t_row = t[i][j];
+            const real *rho_row = rho[i][j];
+            for (int k = 0; k < res[2]; k++) {
+                v_row[k] += (-smoke_alpha * rho_row[k] + smoke_beta * t_row[k]) * delta_t;
+                t_row[k] *= t_decay;
             }
-        }
-        real t_decay = std::exp(-delta_t * temperature_decay);
-        for (auto &ind : t.get_region()) {
-            t[ind] *= t_decay;
-        }
+        });
     }
-    apply_boundary_condition();
-    TIME(project());
-    apply_boundary_condition();
-    TIME(move_trackers(delta_t));
-    TIME(remove_outside_trackers());
-    TIME(advect(delta_t));
-    apply_boundary_condition();
+    TC_PROFILE("boundary_condition", apply_boundary_condition());
+    TC_PROFILE("project", project());
+    TC_PROFILE("boundary_condition", apply_boundary_condition());
+    TC_PROFILE("move_trackers", move_trackers(delta_t));
+    TC_PROFILE("remove_outside_trackers", remove_outside_trackers());
+    TC_PROFILE("advect", advect(delta_t));
+    TC_PROFILE("boundary_condition", apply_boundary_condition());
     current_t += delta_t;
+    if (telemetry.should_sample()) {
+        TelemetryRecord record;
+        record.t = current_t;
+        record.dt = delta_t;
+        record.active_particles = (int64)trackers.size();
+        record.max_velocity = get_max_face_speed();
+        telemetry.write(record);
+    }
+}
+
+real Smoke3D::get_max_face_speed() const {
+    StencilSweep sweep(num_threads);
+    real max_speed = 0.0f;
+    for (int axis = 0; axis < 3; axis++) {
+        const Array &face = axis == 0 ? u : (axis == 1 ? v : w);
+        Vector3i face_res(face.get_width(), face.get_height(), face.get_depth());
+        // One partial maximum per row, reduced serially afterwards
+        std::vector<real> row_max(face_res[0] * face_res[1], 0.0f);
+        sweep.for_each_row(face_res, [&](int i, int j) {
+            const real *row = face[i][j];
+            real m = 0.0f;
+            for (int k = 0; k < face_res[2]; k++) {
+                m = std::max(m, std::abs(row[k]));
+            }
+            row_max[i * face_res[1] + j] = m;
+        });
+        for (auto m : row_max) {
+            max_speed = std::max(max_speed, m);
+        }
+    }
+    return max_speed;
 }
 
 void Smoke3D::remove_outside_trackers() {
@@ -280,26 +329,41 @@ Vector3 Smoke3D::sample_velocity(const Vector3 &pos) const {
     return sample_velocity(u, v, w, pos);
 }
 
-void Smoke3D::advect(Array &attr, real delta_t) {
-    auto new_attr = attr.same_shape(0);
-    for (auto &ind : new_attr.get_region()) {
-        auto old_position = ind.get_pos() - delta_t * sample_velocity(ind.get_pos());
-        new_attr[ind] = attr.sample(old_position);
-    }
-    attr = new_attr;
+real Smoke3D::sample_density(const Vector3 &pos) const {
+    return rho.sample(pos);
+}
+
+real Smoke3D::sample_temperature(const Vector3 &pos) const {
+    return t.sample(pos);
 }
 
 void Smoke3D::apply_boundary_condition() {
-    for (auto &ind : boundary_condition.get_region()) {
-        if (boundary_condition[ind] == PoissonSolver3D::NEUMANN) {
-            u[ind] = 0;
-            u[ind + Vector3(1, 0, 0)] = 0;
-            v[ind] = 0;
-            v[ind + Vector3(0, 1, 0)] = 0;
-            w[ind] = 0;
-            w[ind + Vector3(0, 0, 1)] = 0;
+    // Faces next to a Neumann cell are closed
+    auto is_solid = [&](int i, int j, int k) -> bool {
+        return boundary_condition.inside(i, j, k) && boundary_condition[i][j][k] == PoissonSolver3D::NEUMANN;
+    };
+    StencilSweep sweep(num_threads);
+    sweep.for_each_row(Vector3i(res[0] + 1, res[1], res[2]), [&](int i, int j) {
+        real *face = u[i][j];
+        for (int k = 0; k < res[2]; k++) {
+            if (is_solid(i - 1, j, k) || is_solid(i, j, k))
+                face[k] = 0;
         }
-    }
+    });
+    sweep.for_each_row(Vector3i(res[0], res[1] + 1, res[2]), [&](int i, int j) {
+        real *face = v[i][j];
+        for (int k = 0; k < res[2]; k++) {
+            if (is_solid(i, j - 1, k) || is_solid(i, j, k))
+                face[k] = 0;
+        }
+    });
+    sweep.for_each_row(res, [&](int i, int j) {
+        real *face = w[i][j];
+        for (int k = 0; k <= res[2]; k++) {
+            if (is_solid(i, j, k - 1) || is_solid(i, j, k))
+                face[k] = 0;
+        }
+    });
     if (!open_boundary) {
         for (int i = 0; i < res[0]; i++) {
             for (int j = 0; j < res[1]; j++) {
@@ -319,12 +383,34 @@ void Smoke3D::apply_boundary_condition() {
     }
 }
 
+// Semi-Lagrangian advection of all fields in a single traversal, with the
+// velocity field of the beginning of the step. rho and t share their back-traced positions.
 void Smoke3D::advect(real delta_t) {
-    advect(rho, delta_t);
-    advect(t, delta_t);
-    advect(u, delta_t);
-    advect(v, delta_t);
-    advect(w, delta_t);
+    auto trace = [&](const Vector3 &pos) -> Vector3 {
+        return pos - delta_t * sample_velocity(pos);
+    };
+    StencilSweep(num_threads).for_each_row(Vector3i(res[0] + 1, res[1] + 1, res[2] + 1), [&](int i, int j) {
+        const bool cell_x = i < res[0], cell_y = j < res[1];
+        for (int k = 0; k <= res[2]; k++) {
+            const bool cell_z = k < res[2];
+            if (cell_x && cell_y && cell_z) {
+                Vector3 p = trace(Vector3(i + 0.5f, j + 0.5f, k + 0.5f));
+                advected_rho[i][j][k] = rho.sample(p);
+                advected_t[i][j][k] = t.sample(p);
+            }
+            if (cell_y && cell_z)
+                advected_u[i][j][k] = u.sample(trace(Vector3((real)i, j + 0.5f, k + 0.5f)));
+            if (cell_x && cell_z)
+                advected_v[i][j][k] = v.sample(trace(Vector3(i + 0.5f, (real)j, k + 0.5f)));
+            if (cell_x && cell_y)
+                advected_w[i][j][k] = w.sample(trace(Vector3(i + 0.5f, j + 0.5f, (real)k)));
+        }
+    });
+    std::swap(u.get_data(), advected_u.get_data());
+    std::swap(v.get_data(), advected_v.get_data());
+    std::swap(w.get_data(), advected_w.get_data());
+    std::swap(rho.get_data(), advected_rho.get_data());
+    std::swap(t.get_data(), advected_t.get_data());
 }
 
 void Smoke3D::confine_vorticity(real delta_t) {
@@ -34,6 +34,8 @@ class Smoke3D : public Simulation3D {
     typedef Array3D<real> Array;
 public:
     Array u, v, w, rho, t, pressure, last_pressure;
+    // Scratch buffers, kept between steps
+    Array divergence, advected_u, advected_v, advected_w, advected_rho, advected_t;
     Vector3i res;
     real smoke_alpha, smoke_beta;
     real temperature_decay;
@@ -42,6 +44,8 @@ public:
     real tracker_generation;
     real perturbation;
     int super_sampling;
+    int volume_bits;
+    real volume_threshold;
     std::shared_ptr<Texture> generation_tex;
     std::shared_ptr<Texture> initial_velocity_tex;
     std::shared_ptr<Texture> color_tex;
@@ -58,6 +62,9 @@ public:
 
     void initialize(const Config &config) override;
 
+    // Everything but the grids and the pressure solver
+    void initialize_parameters(const Config &config);
+
     void project();
 
     void confine_vorticity(real delta_t);
@@ -70,16 +77,25 @@ public:
 
     virtual void show(Array2D<Vector3> &buffer);
 
-    void advect(Array &attr, real delta_t);
-
     void apply_boundary_condition();
 
+    // Largest face velocity component magnitude over u, v and w
+    real get_max_face_speed() const;
+
+    bool is_neumann(int i, int j, int k) const;
+
     static Vector3 sample_velocity(const Array &u, const Array &v, const Array &w, const Vector3 &pos);
 
     Vector3 sample_velocity(const Vector3 &pos) const;
 
+    virtual real sample_density(const Vector3 &pos) const;
+
+    virtual real sample_temperature(const Vector3 &pos) const;
+
     std::vector<RenderParticle> get_render_particles() const override;
 
+    void write_volumes(const std::string &prefix) const override;
+
     void update(const Config &config) override;
 };
 
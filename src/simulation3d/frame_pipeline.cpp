@@ -0,0 +1,172 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/dynamics/frame_pipeline.h>
+#include <taichi/system/timer.h>
+#include <taichi/io/io.h>
+
+TC_NAMESPACE_BEGIN
+
+void FramePipeline::initialize(const Config &config) {
+    assert_info(workers.empty(), "FramePipeline can only be initialized once.");
+    output_directory = config.get("output_directory", std::string(""));
+    dump_particles = config.get("dump_particles", !output_directory.empty());
+    keep_images = config.get("keep_images", true);
+    width = config.get("width", 0);
+    height = config.get("height", 0);
+    int num_buffers = config.get("num_buffers", 2);
+    assert_info(num_buffers >= 1, "num_buffers must be positive.");
+    max_kept_images = config.get("max_kept_images", num_buffers + 1);
+    assert_info(max_kept_images >= 1, "max_kept_images must be positive.");
+    slots.resize((size_t)num_buffers);
+    for (int i = 0; i < NUM_STAGES; i++) {
+        num_processed[i] = 0;
+        workers.push_back(std::thread([this, i]() { worker(Stage(i)); }));
+    }
+}
+
+void FramePipeline::push(const Simulation3D &sim, int frame_id, std::shared_ptr<Camera> camera) {
+    push(sim.get_render_particles(), sim.get_current_time(), frame_id, camera);
+}
+
+void FramePipeline::push(std::vector<RenderParticle> &&particles, real t, int frame_id,
+                         std::shared_ptr<Camera> camera) {
+    assert_info(!workers.empty(), "FramePipeline not initialized.");
+    std::unique_lock<std::mutex> lock(mut);
+    rethrow_stage_exception();
+    Slot &slot = slots[num_pushed % slots.size()];
+    if (slot.pending_stages != 0) {
+        // Backpressure: the writer is a full buffer behind
+        double start_time = Time::get_time();
+        cv.wait(lock, [&slot]() { return slot.pending_stages == 0; });
+        stall_time += Time::get_time() - start_time;
+        rethrow_stage_exception();
+    }
+    slot.frame.id = frame_id;
+    slot.frame.t = t;
+    slot.frame.particles = std::move(particles);
+    slot.frame.camera = camera;
+    slot.pending_stages = NUM_STAGES;
+    num_pushed++;
+    cv.notify_all();
+}
+
+void FramePipeline::worker(Stage stage) {
+    while (true) {
+        Slot *slot;
+        {
+            std::unique_lock<std::mutex> lock(mut);
+            cv.wait(lock, [&]() { return stopping || num_processed[stage] < num_pushed; });
+            if (num_processed[stage] == num_pushed) {
+                // Stopping, and nothing left to do
+                return;
+            }
+            slot = &slots[num_processed[stage] % slots.size()];
+        }
+        // The slot can not be recycled before all stages release it,
+        // so it is safe to read it without holding the lock.
+        bool succeeded = true;
+        try {
+            process(stage, slot->frame);
+        } catch (...) {
+            std::unique_lock<std::mutex> lock(mut);
+            if (!stage_exception) {
+                stage_exception = std::current_exception();
+            }
+            succeeded = false;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mut);
+            if (succeeded && stage == RENDER && keep_images && particle_renderer) {
+                // Wait for the consumer to take some images; the slot stays in flight meanwhile
+                cv.wait(lock, [&]() { return stopping || (int)rendered_images.size() < max_kept_images; });
+                rendered_images[slot->frame.id] = slot->frame.image;
+            }
+            slot->pending_stages--;
+            num_processed[stage]++;
+            cv.notify_all();
+        }
+    }
+}
+
+void FramePipeline::process(Stage stage, Frame &frame) {
+    if (stage == DUMP) {
+        if (dump_particles) {
+            char fn[1024];
+            sprintf(fn, "%s/particles%05d.bin", output_directory.c_str(), frame.id);
+            write_vector_to_disk(&frame.particles, fn);
+        }
+    } else {
+        if (particle_renderer) {
+            if (frame.image.get_width() != width || frame.image.get_height() != height) {
+                frame.image.initialize(width, height);
+            }
+            frame.image.reset(Vector3(0.0f));
+            if (frame.camera) {
+                particle_renderer->set_camera(frame.camera);
+            }
+            particle_renderer->render(frame.image, frame.particles);
+        }
+        for (auto &hook : output_hooks) {
+            hook(frame);
+        }
+    }
+}
+
+Array2D<Vector3> FramePipeline::get_image(int frame_id) {
+    assert_info(keep_images && particle_renderer, "FramePipeline does not keep rendered images.");
+    std::unique_lock<std::mutex> lock(mut);
+    cv.wait(lock, [&]() {
+        return rendered_images.find(frame_id) != rendered_images.end() || num_processed[RENDER] == num_pushed ||
+               stage_exception;
+    });
+    auto it = rendered_images.find(frame_id);
+    if (it == rendered_images.end()) {
+        rethrow_stage_exception();
+    }
+    assert_info(it != rendered_images.end(), "Frame " + std::to_string(frame_id) + " was never pushed.");
+    Array2D<Vector3> image = it->second;
+    rendered_images.erase(it);
+    cv.notify_all();
+    return image;
+}
+
+void FramePipeline::flush() {
+    std::unique_lock<std::mutex> lock(mut);
+    cv.wait(lock, [&]() {
+        for (int i = 0; i < NUM_STAGES; i++) {
+            if (num_processed[i] < num_pushed) {
+                return false;
+            }
+        }
+        return true;
+    });
+    rethrow_stage_exception();
+}
+
+void FramePipeline::rethrow_stage_exception() {
+    if (stage_exception) {
+        std::exception_ptr e = stage_exception;
+        stage_exception = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+FramePipeline::~FramePipeline() {
+    {
+        std::unique_lock<std::mutex> lock(mut);
+        stopping = true;
+        cv.notify_all();
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+}
+
+TC_NAMESPACE_END
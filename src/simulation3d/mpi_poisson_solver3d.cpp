@@ -0,0 +1,516 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#ifdef TC_USE_MPI
+
+#include <mpi.h>
+
+#endif
+
+#include <taichi/dynamics/poisson_solver3d.h>
+#include "red_black_smoother.h"
+
+TC_NAMESPACE_BEGIN
+
+#ifdef TC_USE_MPI
+
+#define TC_MG_TAG_GHOST 11
+#define TC_MG_TAG_RESTRICT 12
+#define TC_MG_TAG_PROLONGATE 13
+
+// Domain-decomposed MGPCG ("mgpcg_mpi"), solving the same system as "mgpcg":
+// cell types come from set_boundary_condition (all interior by default), and
+// `padding` is the type of the cells outside the box.
+//
+// Every level is split into slabs of `width` x planes, one per rank of a group
+// [0, group_size). Slabs are stored with one ghost plane on each side, which
+// is refreshed from the neighbouring ranks before every smoothing pass and after
+// every red-black half-sweep, so results match the shared-memory solver up to
+// the order of the reductions.
+// Restriction and prolongation are local to a slab. When slabs get thinner than
+// `agglomeration_width` planes, the next level is gathered onto fewer ranks,
+// down to a single rank for the coarsest levels.
+//
+// run() takes the full arrays on every rank (e.g. a Smoke3D replicated on all
+// ranks) and returns the full solution on every rank. run_subdomain() works
+// on the slab of this rank only, for domains that do not fit on one node.
+class DistributedMultigridPCGPoissonSolver3D : public PoissonSolver3D {
+protected:
+    struct Level {
+        Vector3i res;
+        int group_size;
+        int width, x_begin;
+        bool active;
+        // (width + 2) x res[1] x res[2]; planes 0 and width + 1 are ghosts
+        Array pressure, residual, tmp_residual;
+        // Restricted residual (or received correction) of this slab, for the next level
+        std::vector<real> chunk;
+        // Cell types, with the same layout and ghosts as the arrays above
+        BCArray boundary;
+        RedBlackSmoother smoother;
+    };
+
+    const int size_threshold = 64;
+    Vector3i res;
+    CellType padding;
+    int num_threads;
+    int agglomeration_width;
+    bool has_null_space;
+    MPI_Comm comm;
+    int rank, world_size;
+    std::vector<Level> levels;
+
+    int64 get_plane_size(const Level &level) const {
+        return (int64)level.res[1] * level.res[2];
+    }
+
+    int get_level_threads(const Level &level) const {
+        int max_side = std::max(std::max(level.width, level.res[1]), level.res[2]);
+        return max_side >= 128 ? num_threads : 1;
+    }
+
+    // get_plane(plane) points to `count` values of plane [0, width + 2) of this slab
+    template <typename F>
+    void exchange_planes(const Level &level, const F &get_plane, int64 count) {
+        if (level.group_size == 1) {
+            return;
+        }
+        int lower = rank > 0 ? rank - 1 : MPI_PROC_NULL;
+        int upper = rank + 1 < level.group_size ? rank + 1 : MPI_PROC_NULL;
+        int bytes = (int)(count * sizeof(*get_plane(0)));
+        MPI_Sendrecv(get_plane(level.width), bytes, MPI_CHAR, upper, TC_MG_TAG_GHOST,
+                     get_plane(0), bytes, MPI_CHAR, lower, TC_MG_TAG_GHOST, comm, MPI_STATUS_IGNORE);
+        MPI_Sendrecv(get_plane(1), bytes, MPI_CHAR, lower, TC_MG_TAG_GHOST,
+                     get_plane(level.width + 1), bytes, MPI_CHAR, upper, TC_MG_TAG_GHOST, comm, MPI_STATUS_IGNORE);
+    }
+
+    void exchange_ghosts(const Level &level, Array &arr) {
+        exchange_planes(level, [&](int plane) { return &arr[plane][0][0]; }, get_plane_size(level));
+    }
+
+    void smooth(Level &level, int rounds, Array *residual = nullptr) {
+        exchange_ghosts(level, level.pressure);
+        RedBlackSmoother::HalfSweepCallback exchange = nullptr;
+        if (level.group_size > 1) {
+            exchange = [&](int color) {
+                exchange_planes(level, [&](int plane) { return level.smoother.get_compact_plane(color, plane); },
+                                level.smoother.get_compact_plane_size());
+            };
+        }
+        level.smoother.run(&level.residual[0][0][0], &level.pressure[0][0][0], rounds, get_level_threads(level),
+                           1.0f, residual ? &(*residual)[0][0][0] : nullptr, exchange);
+    }
+
+    void apply_L(Level &level, Array &x, Array &y) {
+        exchange_ghosts(level, x);
+        level.smoother.apply(&x[0][0][0], &y[0][0][0], get_level_threads(level));
+    }
+
+    // Fine ranks of level l send their chunk to rank / ratio, at plane offset (rank % ratio) * chunk planes
+    int get_ratio(int l) const {
+        return levels[l].group_size / levels[l + 1].group_size;
+    }
+
+    // Restriction of tmp_residual from level l to the residual of level l + 1
+    void restrict_residual(int l) {
+        Level &fine = levels[l], &coarse = levels[l + 1];
+        const int chunk_planes = fine.width / 2;
+        const int64 chunk_size = chunk_planes * get_plane_size(coarse);
+        const int height = coarse.res[1], depth = coarse.res[2];
+        const Array &x = fine.tmp_residual;
+        for (int i = 0; i < chunk_planes; i++) {
+            for (int j = 0; j < height; j++) {
+                const real *x00 = x[i * 2 + 1][j * 2 + 0], *x01 = x[i * 2 + 1][j * 2 + 1];
+                const real *x10 = x[i * 2 + 2][j * 2 + 0], *x11 = x[i * 2 + 2][j * 2 + 1];
+                real *out = &fine.chunk[(i * height + j) * depth];
+                for (int k = 0; k < depth; k++) {
+                    out[k] = x00[k * 2] + x00[k * 2 + 1] + x01[k * 2] + x01[k * 2 + 1] +
+                             x10[k * 2] + x10[k * 2 + 1] + x11[k * 2] + x11[k * 2 + 1];
+                }
+            }
+        }
+        const int ratio = get_ratio(l), owner = rank / ratio;
+        MPI_Request request = MPI_REQUEST_NULL;
+        if (owner == rank) {
+            std::copy(fine.chunk.begin(), fine.chunk.begin() + chunk_size, &coarse.residual[1][0][0]);
+        } else {
+            MPI_Isend(&fine.chunk[0], (int)(chunk_size * sizeof(real)), MPI_CHAR, owner, TC_MG_TAG_RESTRICT, comm,
+                      &request);
+        }
+        if (coarse.active) {
+            for (int source = rank * ratio; source < rank * ratio + ratio; source++) {
+                if (source != rank) {
+                    MPI_Recv(&coarse.residual[1 + (source % ratio) * chunk_planes][0][0],
+                             (int)(chunk_size * sizeof(real)), MPI_CHAR, source, TC_MG_TAG_RESTRICT, comm,
+                             MPI_STATUS_IGNORE);
+                }
+            }
+        }
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+    }
+
+    // Prolongation of the pressure of level l + 1 to the pressure of level l
+    void prolongate_correction(int l) {
+        Level &fine = levels[l], &coarse = levels[l + 1];
+        const int chunk_planes = fine.width / 2;
+        const int64 chunk_size = chunk_planes * get_plane_size(coarse);
+        const int ratio = get_ratio(l), owner = rank / ratio;
+        std::vector<MPI_Request> requests;
+        if (coarse.active) {
+            for (int target = rank * ratio; target < rank * ratio + ratio; target++) {
+                if (target != rank) {
+                    requests.push_back(MPI_REQUEST_NULL);
+                    MPI_Isend(&coarse.pressure[1 + (target % ratio) * chunk_planes][0][0],
+                              (int)(chunk_size * sizeof(real)), MPI_CHAR, target, TC_MG_TAG_PROLONGATE, comm,
+                              &requests.back());
+                }
+            }
+        }
+        if (owner == rank) {
+            const real *begin = &coarse.pressure[1][0][0];
+            std::copy(begin, begin + chunk_size, fine.chunk.begin());
+        } else {
+            MPI_Recv(&fine.chunk[0], (int)(chunk_size * sizeof(real)), MPI_CHAR, owner, TC_MG_TAG_PROLONGATE, comm,
+                     MPI_STATUS_IGNORE);
+        }
+        const int height = fine.res[1], depth = fine.res[2];
+        const int coarse_height = coarse.res[1], coarse_depth = coarse.res[2];
+        for (int i = 1; i <= fine.width; i++) {
+            for (int j = 0; j < height; j++) {
+                const real *delta = &fine.chunk[((i - 1) / 2 * coarse_height + j / 2) * coarse_depth];
+                real *out = fine.pressure[i][j];
+                for (int k = 0; k < depth; k++) {
+                    out[k] += delta[k / 2] * 0.5f;
+                }
+            }
+        }
+        if (!requests.empty()) {
+            MPI_Waitall((int)requests.size(), &requests[0], MPI_STATUSES_IGNORE);
+        }
+    }
+
+    // One V-cycle on level l, for the ranks active on it
+    void run(int l) {
+        Level &level = levels[l];
+        level.pressure.reset(0.0f);
+        if (level.res[0] * level.res[1] * level.res[2] <= size_threshold) {
+            smooth(level, 100);
+        } else {
+            smooth(level, 4, &level.tmp_residual);
+            restrict_residual(l);
+            if (levels[l + 1].active) {
+                run(l + 1);
+            }
+            prolongate_correction(l);
+            smooth(level, 4);
+        }
+    }
+
+    // Reductions over the owned planes of level 0
+    template <typename F>
+    double reduce(const F &f, MPI_Op op) const {
+        const Level &level = levels[0];
+        const int64 begin = get_plane_size(level), end = begin * (level.width + 1);
+        double local = 0;
+        for (int64 i = begin; i < end; i++) {
+            local = op == MPI_MAX ? std::max(local, f(i)) : local + f(i);
+        }
+        double global;
+        MPI_Allreduce(&local, &global, 1, MPI_DOUBLE, op, comm);
+        return global;
+    }
+
+    double dot(const Array &a, const Array &b) const {
+        return reduce([&](int64 i) { return (double)a.get_data()[i] * b.get_data()[i]; }, MPI_SUM);
+    }
+
+    double abs_max(const Array &a) const {
+        return reduce([&](int64 i) { return (double)std::abs(a.get_data()[i]); }, MPI_MAX);
+    }
+
+    void remove_average(Array &a) const {
+        double average = reduce([&](int64 i) { return (double)a.get_data()[i]; }, MPI_SUM) /
+                         ((double)res[0] * res[1] * res[2]);
+        for (auto &v : a.get_data()) {
+            v -= (real)average;
+        }
+    }
+
+    Array &apply_preconditioner(const Array &r) {
+        levels[0].residual = r;
+        run(0);
+        return levels[0].pressure;
+    }
+
+    // PCG on the slabs of level 0, same iteration as MultigridPCGPoissonSolver3D
+    void solve(const Array &b, Array &x, real tolerance) {
+        x = 0;
+        Array r = b;
+        if (has_null_space) {
+            remove_average(r);
+        }
+        double nu = abs_max(r);
+        if (nu < tolerance)
+            return;
+        Array p = apply_preconditioner(r);
+        double rho = dot(p, r);
+        Array z(p.get_width(), p.get_height(), p.get_depth());
+        for (int count = 0; count <= maximum_iterations; count++) {
+            apply_L(levels[0], p, z);
+            double sigma = dot(p, z);
+            double alpha = rho / max(1e-20, sigma);
+            r.add_in_place(-(real)alpha, z);
+            if (has_null_space) {
+                remove_average(r);
+            }
+            nu = abs_max(r);
+            if (rank == 0) {
+                printf(" MGPCG (MPI) iteration #%02d, nu=%f\n", count, nu);
+            }
+            if (nu < tolerance || count == maximum_iterations) {
+                x.add_in_place((real)alpha, p);
+                return;
+            }
+            z = apply_preconditioner(r);
+            double rho_new = dot(z, r);
+            double beta = rho_new / rho;
+            rho = rho_new;
+            x.add_in_place((real)alpha, p);
+            p = z.add((real)beta, p);
+        }
+    }
+
+    Array make_slab_array(const Level &level) const {
+        return Array(level.width + 2, level.res[1], level.res[2]);
+    }
+
+    // Cell types of level l + 1 from those of level l, as in MultigridPoissonSolver3D: a coarse cell
+    // is Dirichlet if any of its 8 children is, Neumann if all of them are, and interior otherwise.
+    // Chunks go to the ranks of the coarse level like in restrict_residual.
+    void restrict_boundary(int l) {
+        Level &fine = levels[l], &coarse = levels[l + 1];
+        const int chunk_planes = fine.width / 2;
+        const int64 chunk_size = chunk_planes * get_plane_size(coarse);
+        const int height = coarse.res[1], depth = coarse.res[2];
+        std::vector<CellType> chunk((size_t)chunk_size);
+        for (int i = 0; i < chunk_planes; i++) {
+            for (int j = 0; j < height; j++) {
+                for (int k = 0; k < depth; k++) {
+                    bool has_dirichlet = false, all_neumann = true;
+                    for (int di = 0; di < 2; di++) {
+                        for (int dj = 0; dj < 2; dj++) {
+                            for (int dk = 0; dk < 2; dk++) {
+                                CellType bc = fine.boundary[i * 2 + 1 + di][j * 2 + dj][k * 2 + dk];
+                                has_dirichlet = has_dirichlet || bc == DIRICHLET;
+                                all_neumann = all_neumann && bc == NEUMANN;
+                            }
+                        }
+                    }
+                    chunk[(i * height + j) * depth + k] = has_dirichlet ? DIRICHLET : (all_neumann ? NEUMANN
+                                                                                                    : INTERIOR);
+                }
+            }
+        }
+        const int ratio = get_ratio(l), owner = rank / ratio;
+        MPI_Request request = MPI_REQUEST_NULL;
+        if (owner == rank) {
+            std::copy(chunk.begin(), chunk.end(), &coarse.boundary[1][0][0]);
+        } else {
+            MPI_Isend(&chunk[0], (int)(chunk_size * sizeof(CellType)), MPI_CHAR, owner, TC_MG_TAG_RESTRICT, comm,
+                      &request);
+        }
+        if (coarse.active) {
+            for (int source = rank * ratio; source < rank * ratio + ratio; source++) {
+                if (source != rank) {
+                    MPI_Recv(&coarse.boundary[1 + (source % ratio) * chunk_planes][0][0],
+                             (int)(chunk_size * sizeof(CellType)), MPI_CHAR, source, TC_MG_TAG_RESTRICT, comm,
+                             MPI_STATUS_IGNORE);
+                }
+            }
+        }
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+    }
+
+    // Needs the owned planes of level.boundary. Fills its ghosts, and rebuilds the smoother from it.
+    void build_smoother(Level &level) {
+        const Vector3i &res = level.res;
+        for (int j = 0; j < res[1]; j++) {
+            for (int k = 0; k < res[2]; k++) {
+                level.boundary[0][j][k] = padding;
+                level.boundary[level.width + 1][j][k] = padding;
+            }
+        }
+        // Ghosts inside the domain are overwritten by the neighbouring slabs
+        exchange_planes(level, [&](int plane) { return &level.boundary[plane][0][0]; }, get_plane_size(level));
+        // i is a plane of the slab, including ghosts
+        auto neighbour_type = [&](int i, int j, int k, int d) -> CellType {
+            Vector3i n(i, j, k);
+            n[d / 2] += d % 2 == 0 ? 1 : -1;
+            if (n[1] < 0 || n[1] >= res[1] || n[2] < 0 || n[2] >= res[2]) {
+                return padding;
+            }
+            return level.boundary[n[0]][n[1]][n[2]];
+        };
+        // Smoother neighbour bits are x+, x-, y+, y-, z+, z-
+        level.smoother.initialize(Vector3i(level.width + 2, res[1], res[2]), [&](int i, int j, int k) {
+            if (i == 0 || i == level.width + 1 || level.boundary[i][j][k] != INTERIOR) {
+                return 0.0f;
+            }
+            int diag = 0;
+            for (int d = 0; d < 6; d++) {
+                diag += neighbour_type(i, j, k, d) != NEUMANN;
+            }
+            return 1.0f / diag;
+        }, [&](int i, int j, int k, int d) {
+            return neighbour_type(i, j, k, d) == INTERIOR;
+        }, (level.x_begin + 1) % 2);
+    }
+
+public:
+    void initialize(const Config &config) override {
+        PoissonSolver3D::initialize(config);
+        res = config.get_vec3i("res");
+        num_threads = config.get_int("num_threads");
+        agglomeration_width = config.get("agglomeration_width", 4);
+        auto padding_name = config.get_string("padding");
+        assert_info(padding_name == "dirichlet" || padding_name == "neumann",
+                    "'padding' has to be 'dirichlet' or 'neumann' instead of " + std::string(padding_name));
+        padding = padding_name == "dirichlet" ? DIRICHLET : NEUMANN;
+
+        int initialized;
+        MPI_Initialized(&initialized);
+        if (!initialized) {
+            MPI_Init(nullptr, nullptr);
+        }
+        comm = MPI_COMM_WORLD;
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &world_size);
+        assert_info(res[0] % world_size == 0, "The width has to be a multiple of the number of ranks.");
+        assert_info(world_size == 1 || res[0] / world_size % 2 == 0,
+                    "Every rank has to own an even number of x planes.");
+
+        levels.clear();
+        auto level_res = res;
+        int group_size = world_size;
+        do {
+            assert_info(level_res[0] % 2 == 0, "odd width");
+            assert_info(level_res[1] % 2 == 0, "odd height");
+            assert_info(level_res[2] % 2 == 0, "odd depth");
+            if (!levels.empty()) {
+                // Agglomerate onto a divisor of the previous group, keeping slabs even and thick enough
+                for (int g = group_size; g >= 1; g--) {
+                    if (group_size % g == 0 && (g == 1 || (level_res[0] % g == 0 && level_res[0] / g % 2 == 0 &&
+                                                           level_res[0] / g >= agglomeration_width))) {
+                        group_size = g;
+                        break;
+                    }
+                }
+            }
+            Level level;
+            level.res = level_res;
+            level.group_size = group_size;
+            level.width = level_res[0] / group_size;
+            level.x_begin = rank * level.width;
+            level.active = rank < group_size;
+            if (level.active) {
+                level.pressure = make_slab_array(level);
+                level.residual = make_slab_array(level);
+                level.tmp_residual = make_slab_array(level);
+                level.boundary = BCArray(Vector3i(level.width + 2, level_res[1], level_res[2]));
+            }
+            levels.push_back(level);
+            level_res /= 2;
+        } while (level_res[0] * level_res[1] * level_res[2] * 8 >= size_threshold);
+        for (int l = 0; l + 1 < (int)levels.size(); l++) {
+            if (levels[l].active) {
+                levels[l].chunk.resize((size_t)(levels[l].width / 2 * get_plane_size(levels[l + 1])));
+            }
+        }
+        set_boundary_condition(BCArray(Vector3i(levels[0].width, res[1], res[2]), INTERIOR));
+    }
+
+    // Same cell types as for MultigridPoissonSolver3D. `boundary` can be the full domain or the
+    // slab of this rank.
+    void set_boundary_condition(const BCArray &boundary) override {
+        Level &level = levels[0];
+        int offset;
+        if (boundary.get_width() == res[0]) {
+            offset = level.x_begin;
+        } else {
+            assert_info(boundary.get_width() == level.width, "Neither the domain nor the slab of this rank.");
+            offset = 0;
+        }
+        assert_info(boundary.get_height() == res[1] && boundary.get_depth() == res[2], "Wrong boundary size.");
+        int local_dirichlet = 0, has_dirichlet;
+        for (int i = 0; i < level.width; i++) {
+            for (int j = 0; j < res[1]; j++) {
+                for (int k = 0; k < res[2]; k++) {
+                    CellType bc = boundary[offset + i][j][k];
+                    level.boundary[i + 1][j][k] = bc;
+                    local_dirichlet |= int(bc == DIRICHLET);
+                }
+            }
+        }
+        MPI_Allreduce(&local_dirichlet, &has_dirichlet, 1, MPI_INT, MPI_LOR, comm);
+        has_null_space = padding == NEUMANN && !has_dirichlet;
+        for (int l = 0; l < (int)levels.size(); l++) {
+            if (!levels[l].active) {
+                break;
+            }
+            build_smoother(levels[l]);
+            if (l + 1 < (int)levels.size()) {
+                restrict_boundary(l);
+            }
+        }
+    }
+
+    int get_subdomain_begin() const {
+        return levels[0].x_begin;
+    }
+
+    int get_subdomain_width() const {
+        return levels[0].width;
+    }
+
+    // b and x are the planes [get_subdomain_begin(), get_subdomain_begin() + get_subdomain_width()) of the domain
+    void run_subdomain(const Array &b, Array &x, real tolerance) {
+        const Level &level = levels[0];
+        const int64 slab_size = level.width * get_plane_size(level);
+        assert_info(b.get_width() == level.width && x.get_width() == level.width, "Not a subdomain of this rank.");
+        Array local_b = make_slab_array(level), local_x = make_slab_array(level);
+        std::copy(&b[0][0][0], &b[0][0][0] + slab_size, &local_b[1][0][0]);
+        solve(local_b, local_x, tolerance);
+        std::copy(&local_x[1][0][0], &local_x[1][0][0] + slab_size, &x[0][0][0]);
+    }
+
+    virtual void run(const Array &b, Array &x, real tolerance) override {
+        const Level &level = levels[0];
+        const int64 slab_size = level.width * get_plane_size(level);
+        Array local_b = make_slab_array(level), local_x = make_slab_array(level);
+        std::copy(&b[level.x_begin][0][0], &b[level.x_begin][0][0] + slab_size, &local_b[1][0][0]);
+        solve(local_b, local_x, tolerance);
+        MPI_Allgather(&local_x[1][0][0], (int)(slab_size * sizeof(real)), MPI_CHAR,
+                      &x[0][0][0], (int)(slab_size * sizeof(real)), MPI_CHAR, comm);
+    }
+};
+
+#else
+
+class DistributedMultigridPCGPoissonSolver3D : public PoissonSolver3D {
+public:
+    void initialize(const Config &config) override {
+        error("Not compiled with MPI. Please recompile with cmake -DTC_USE_MPI=True");
+    }
+};
+
+#endif
+
+TC_IMPLEMENTATION(PoissonSolver3D, DistributedMultigridPCGPoissonSolver3D, "mgpcg_mpi");
+
+TC_NAMESPACE_END
@@ -449,6 +449,39 @@ void MPM3D::substep() {
             scheduler.enforce_smoothness(original_t_int_increment);
         }
     }
+    // Every rank has to get here, even with no particles: write_telemetry reduces over all of them
+    if (telemetry.should_sample()) {
+        write_telemetry();
+    }
+}
+
+void MPM3D::write_telemetry() {
+    TelemetryRecord record;
+    record.t = current_t;
+    record.dt = t_int_increment * base_delta_t;
+    real max_speed2 = 0.0f;
+    // With no particles, the scheduler was not updated in this substep, and this rank reports zeros
+    if (!particles.empty()) {
+        record.active_particles = (int64)scheduler.get_active_particles().size();
+        record.active_blocks = scheduler.get_num_active_grids();
+        for (auto p : scheduler.get_active_particles()) {
+            max_speed2 = std::max(max_speed2, dot(p->v, p->v));
+        }
+    }
+    record.max_velocity = std::sqrt(max_speed2);
+#ifdef TC_USE_MPI
+    if (use_mpi) {
+        int64 local_particles = record.active_particles, max_particles, total_particles;
+        MPI_Allreduce(&local_particles, &max_particles, 1, MPI_LONG_LONG, MPI_MAX, MPI_COMM_WORLD);
+        MPI_Allreduce(&local_particles, &total_particles, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+        if (total_particles > 0) {
+            record.mpi_imbalance = (real)max_particles * mpi_world_size / total_particles;
+        }
+    }
+#endif
+    if (mpi_world_rank == 0) {
+        telemetry.write(record);
+    }
 }
 
 #define TC_MPM_TAG_BELONGING 1
@@ -113,6 +113,8 @@ public:
 
     void substep();
 
+    void write_telemetry();
+
     template <typename T>
     void parallel_for_each_particle(const T &target) {
         ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
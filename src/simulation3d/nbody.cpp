@@ -10,9 +10,106 @@
 #include <taichi/dynamics/simulation3d.h>
 #include <taichi/visualization/particle_visualization.h>
 #include <taichi/visual/texture.h>
+#include <taichi/system/profiler.h>
+#include <taichi/math/fmm.h>
+#include <immintrin.h>
 
 TC_NAMESPACE_BEGIN
 
+// Interaction lists in SoA layout, padded to a multiple of 16 with massless far away entries
+struct InteractionList {
+    std::vector<float> x, y, z, mass;
+
+    void clear() {
+        x.clear();
+        y.clear();
+        z.clear();
+        mass.clear();
+    }
+
+    void push_back(const Vector3 &position, real m) {
+        x.push_back(position.x);
+        y.push_back(position.y);
+        z.push_back(position.z);
+        mass.push_back(m);
+    }
+
+    void pad() {
+        while (x.size() % 16 != 0) {
+            push_back(Vector3(1e18f), 0.0f);
+        }
+    }
+
+    int size() const {
+        return (int)x.size();
+    }
+};
+
+// sum_j m_j (p - x_j) / (|p - x_j|^2 + softening)^(3/2) over a padded list, with
+// rsqrt and a Newton step where AVX is available
+static Vector3 sum_field(const InteractionList &list, const Vector3 &p, real softening) {
+    const int n = list.size();
+    const float *xs = &list.x[0], *ys = &list.y[0], *zs = &list.z[0], *ms = &list.mass[0];
+#if defined(__AVX512F__)
+    __m512 fx = _mm512_setzero_ps(), fy = _mm512_setzero_ps(), fz = _mm512_setzero_ps();
+    const __m512 px = _mm512_set1_ps(p.x), py = _mm512_set1_ps(p.y), pz = _mm512_set1_ps(p.z);
+    const __m512 eps = _mm512_set1_ps(softening), half = _mm512_set1_ps(0.5f), three_halves = _mm512_set1_ps(1.5f);
+    for (int j = 0; j < n; j += 16) {
+        const __m512 dx = _mm512_sub_ps(px, _mm512_loadu_ps(xs + j));
+        const __m512 dy = _mm512_sub_ps(py, _mm512_loadu_ps(ys + j));
+        const __m512 dz = _mm512_sub_ps(pz, _mm512_loadu_ps(zs + j));
+        const __m512 r2 = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_fmadd_ps(dz, dz, eps)));
+        __m512 inv_r = _mm512_rsqrt14_ps(r2);
+        inv_r = _mm512_mul_ps(inv_r, _mm512_fnmadd_ps(_mm512_mul_ps(half, r2), _mm512_mul_ps(inv_r, inv_r),
+                                                      three_halves));
+        const __m512 s = _mm512_mul_ps(_mm512_loadu_ps(ms + j), _mm512_mul_ps(inv_r, _mm512_mul_ps(inv_r, inv_r)));
+        fx = _mm512_fmadd_ps(s, dx, fx);
+        fy = _mm512_fmadd_ps(s, dy, fy);
+        fz = _mm512_fmadd_ps(s, dz, fz);
+    }
+    return Vector3(_mm512_reduce_add_ps(fx), _mm512_reduce_add_ps(fy), _mm512_reduce_add_ps(fz));
+#elif defined(__AVX__)
+    __m256 fx = _mm256_setzero_ps(), fy = _mm256_setzero_ps(), fz = _mm256_setzero_ps();
+    const __m256 px = _mm256_set1_ps(p.x), py = _mm256_set1_ps(p.y), pz = _mm256_set1_ps(p.z);
+    const __m256 eps = _mm256_set1_ps(softening), half = _mm256_set1_ps(0.5f), three_halves = _mm256_set1_ps(1.5f);
+    for (int j = 0; j < n; j += 8) {
+        const __m256 dx = _mm256_sub_ps(px, _mm256_loadu_ps(xs + j));
+        const __m256 dy = _mm256_sub_ps(py, _mm256_loadu_ps(ys + j));
+        const __m256 dz = _mm256_sub_ps(pz, _mm256_loadu_ps(zs + j));
+        const __m256 r2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+                                        _mm256_add_ps(_mm256_mul_ps(dz, dz), eps));
+        __m256 inv_r = _mm256_rsqrt_ps(r2);
+        inv_r = _mm256_mul_ps(inv_r, _mm256_sub_ps(three_halves, _mm256_mul_ps(_mm256_mul_ps(half, r2),
+                                                                               _mm256_mul_ps(inv_r, inv_r))));
+        const __m256 s = _mm256_mul_ps(_mm256_loadu_ps(ms + j), _mm256_mul_ps(inv_r, _mm256_mul_ps(inv_r, inv_r)));
+        fx = _mm256_add_ps(fx, _mm256_mul_ps(s, dx));
+        fy = _mm256_add_ps(fy, _mm256_mul_ps(s, dy));
+        fz = _mm256_add_ps(fz, _mm256_mul_ps(s, dz));
+    }
+    float sums[3][8];
+    _mm256_storeu_ps(sums[0], fx);
+    _mm256_storeu_ps(sums[1], fy);
+    _mm256_storeu_ps(sums[2], fz);
+    Vector3 ret(0.0f);
+    for (int i = 0; i < 8; i++) {
+        ret += Vector3(sums[0][i], sums[1][i], sums[2][i]);
+    }
+    return ret;
+#else
+    Vector3 ret(0.0f);
+    for (int j = 0; j < n; j++) {
+        const Vector3 d = p - Vector3(xs[j], ys[j], zs[j]);
+        const real r2 = dot(d, d) + softening;
+        ret += d * (ms[j] / (r2 * std::sqrt(r2)));
+    }
+    return ret;
+#endif
+}
+
+// Barnes-Hut octree over particles, built as a compressed linear octree:
+// particles are sorted by the Morton code of their cell, particles sharing a finest
+// cell are merged, and every node covers a contiguous range of the sorted cells.
+// Nodes only exist where the range splits, and the children of a node are contiguous.
 class BarnesHutSummation {
 public:
     struct Particle {
@@ -39,33 +136,49 @@ public:
 protected:
     struct Node {
         Particle p;
-        int children[8]; // We do not use pointer here to save memory bandwidth(64 bit v.s. 32 bit)
-        // There are so many ways to optimize and I'll consider them later...
-        Vector3i bounds[2]; // TODO: this is quite brute-force...
+        Vector3i bounds[2];
+        // Children are nodes[child_begin .. child_begin + num_children)
+        int child_begin, num_children;
+        // Leaves (occupied cells) covered, in Morton order
+        int begin, end;
+
         Node() {
-            memset(children, 0, sizeof(children));
             p = Particle();
+            child_begin = 0;
+            num_children = 0;
+            begin = end = 0;
         }
 
-        bool is_leaf() {
-            for (int i = 0; i < 8; i++) {
-                if (children[i] != 0) {
-                    return false;
-                }
-            }
-            return p.mass > 0;
+        bool is_leaf() const {
+            return num_children == 0;
         }
     };
 
+    // A subtree left by the serial top of the build, for a worker thread
+    struct Task {
+        int node;
+        int begin, end;
+    };
+
+    // Morton codes take 3 bits per level
+    static const int max_levels = 21;
+
+    int num_threads = 1;
     real resolution, inv_resolution;
     int total_levels;
     int margin;
 
     std::vector<Node> nodes;
-    int node_end;
     Vector3 lower_corner;
 
-    Vector3i get_coord(const Vector3 &position) {
+    // Merged particles of the occupied finest cells, by increasing Morton code
+    std::vector<uint64> codes;
+    std::vector<Particle> leaves;
+    // Particles of leaf l are leaf_particles[leaf_offsets[l] .. leaf_offsets[l + 1])
+    std::vector<int> leaf_offsets;
+    std::vector<int> leaf_particles;
+
+    Vector3i get_coord(const Vector3 &position) const {
         Vector3i u;
         Vector3 t = (position - lower_corner) * inv_resolution;
         for (int i = 0; i < 3; i++) {
@@ -74,75 +187,179 @@ protected:
         return u;
     }
 
-    int get_child_index(const Vector3i &u, int level) {
-        int ret = 0;
+    uint64 get_code(const Vector3 &position) const {
+        Vector3i u = get_coord(position);
+        uint64 code = 0;
         for (int i = 0; i < 3; i++) {
-            ret += ((u[i] >> (total_levels - level - 1)) & 1) << i;
+            uint64 x = (uint64)clamp(u[i], 0, (1 << total_levels) - 1);
+            for (int b = 0; b < total_levels; b++) {
+                code |= ((x >> b) & 1) << (3 * b + i);
+            }
         }
-        return ret;
+        return code;
     }
 
-    void summarize(int t) {
-        Node &node = nodes[t];
-        if (node.is_leaf()) {
-            Vector3i u = get_coord(node.p.position);
-            node.bounds[0] = u - Vector3i(margin);
-            node.bounds[1] = u + Vector3i(margin);
-            return;
+    int get_num_chunks(int n) const {
+        return std::max(1, std::min(num_threads, n / 4096));
+    }
+
+    // LSD radix sort of codes (with their particle indices), 8 bits per pass, using
+    // per-chunk histograms so that every pass runs in parallel and stays stable
+    void sort_by_code(std::vector<uint64> &keys, std::vector<int> &indices) const {
+        const int n = (int)keys.size();
+        const int num_chunks = get_num_chunks(n);
+        std::vector<uint64> keys_buffer((size_t)n);
+        std::vector<int> indices_buffer((size_t)n);
+        std::vector<std::vector<int>> offsets((size_t)num_chunks, std::vector<int>(256));
+        auto chunk_begin = [&](int c) { return (int)((int64)n * c / num_chunks); };
+        for (int shift = 0; shift < 3 * total_levels; shift += 8) {
+            ThreadedTaskManager::run(num_chunks, num_threads, [&](int c) {
+                std::fill(offsets[c].begin(), offsets[c].end(), 0);
+                for (int i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+                    offsets[c][(keys[i] >> shift) & 255]++;
+                }
+            });
+            int sum = 0;
+            for (int digit = 0; digit < 256; digit++) {
+                for (int c = 0; c < num_chunks; c++) {
+                    int count = offsets[c][digit];
+                    offsets[c][digit] = sum;
+                    sum += count;
+                }
+            }
+            ThreadedTaskManager::run(num_chunks, num_threads, [&](int c) {
+                for (int i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+                    int slot = offsets[c][(keys[i] >> shift) & 255]++;
+                    keys_buffer[slot] = keys[i];
+                    indices_buffer[slot] = indices[i];
+                }
+            });
+            std::swap(keys, keys_buffer);
+            std::swap(indices, indices_buffer);
+        }
+    }
+
+    // Merges runs of equal codes into `codes` and `leaves`
+    void merge_cells(const std::vector<uint64> &sorted_codes, const std::vector<int> &sorted_indices,
+                     const std::vector<Particle> &particles) {
+        const int n = (int)sorted_codes.size();
+        const int num_chunks = get_num_chunks(n);
+        auto chunk_begin = [&](int c) { return (int)((int64)n * c / num_chunks); };
+        auto is_head = [&](int i) { return i == 0 || sorted_codes[i] != sorted_codes[i - 1]; };
+        std::vector<int> first_leaf((size_t)num_chunks + 1, 0);
+        ThreadedTaskManager::run(num_chunks, num_threads, [&](int c) {
+            for (int i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+                first_leaf[c + 1] += is_head(i);
+            }
+        });
+        for (int c = 0; c < num_chunks; c++) {
+            first_leaf[c + 1] += first_leaf[c];
+        }
+        codes.resize((size_t)first_leaf[num_chunks]);
+        leaves.resize((size_t)first_leaf[num_chunks]);
+        leaf_offsets.resize((size_t)first_leaf[num_chunks] + 1);
+        leaf_offsets[first_leaf[num_chunks]] = n;
+        ThreadedTaskManager::run(num_chunks, num_threads, [&](int c) {
+            int leaf = first_leaf[c];
+            for (int i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+                if (!is_head(i)) {
+                    continue;
+                }
+                real mass = 0.0f;
+                Vector3 total_position(0.0f);
+                for (int j = i; j < n && sorted_codes[j] == sorted_codes[i]; j++) {
+                    const Particle &p = particles[sorted_indices[j]];
+                    mass += p.mass;
+                    total_position += p.mass * p.position;
+                }
+                codes[leaf] = sorted_codes[i];
+                leaves[leaf] = Particle(total_position * (1.0f / mass), mass);
+                leaf_offsets[leaf] = i;
+                leaf++;
+            }
+        });
+    }
+
+    static int highest_bit(uint64 x) {
+        int ret = -1;
+        while (x) {
+            x >>= 1;
+            ret++;
         }
+        return ret;
+    }
+
+    // Center of mass and bounds of an internal node from its children
+    void summarize(std::vector<Node> &storage, int t) const {
+        Node &node = storage[t];
         real mass = 0.0f;
         Vector3 total_position(0.0f);
         node.bounds[0] = Vector3i(std::numeric_limits<int>::max());
         node.bounds[1] = Vector3i(std::numeric_limits<int>::min());
-        for (int c = 0; c < 8; c++) {
-            if (node.children[c]) {
-                summarize(nodes[t].children[c]);
-                const Node &ch = nodes[node.children[c]];
-                mass += ch.p.mass;
-                total_position += ch.p.mass * ch.p.position;
-                for (int i = 0; i < 3; i++) {
-                    node.bounds[0][i] = std::min(node.bounds[0][i], ch.bounds[0][i]);
-                    node.bounds[1][i] = std::max(node.bounds[1][i], ch.bounds[1][i]);
-                }
+        for (int c = node.child_begin; c < node.child_begin + node.num_children; c++) {
+            const Node &ch = storage[c];
+            mass += ch.p.mass;
+            total_position += ch.p.mass * ch.p.position;
+            for (int i = 0; i < 3; i++) {
+                node.bounds[0][i] = std::min(node.bounds[0][i], ch.bounds[0][i]);
+                node.bounds[1][i] = std::max(node.bounds[1][i], ch.bounds[1][i]);
             }
         }
         total_position *= 1.0f / mass;
-        if (abnormal(total_position)) {
-            P(mass);
-            for (int i = 0; i < 8; i++) {
-                P(i);
-                P(node.children[i]);
-                P(nodes[node.children[i]].p.position);
-                P(nodes[node.children[i]].p.mass);
-            }
-        }
         CV(total_position);
         node.p = Particle(total_position, mass);
     }
 
-    int create_child(int t, int child_index) {
-        return create_child(t, child_index, Particle(Vector3(0.0f), 0.0f));
-    }
-
-    int create_child(int t, int child_index, const Particle &p) {
-        int nt = get_new_node();
-        nodes[t].children[child_index] = nt;
-        nodes[nt].p = p;
-        return nt;
-    }
-
-    int get_new_node() {
-        nodes[node_end] = Node();
-        return node_end++;
+    // Builds node t of `storage` over leaves [begin, end). With `tasks`, ranges of at most
+    // task_size leaves are left to build later, and nodes are not summarized.
+    void build(std::vector<Node> &storage, int t, int begin, int end, int task_size, std::vector<Task> *tasks) {
+        storage[t].begin = begin;
+        storage[t].end = end;
+        if (end - begin <= 1) {
+            Node &node = storage[t];
+            node.num_children = 0;
+            node.p = begin < end ? leaves[begin] : Particle();
+            Vector3i u = get_coord(node.p.position);
+            node.bounds[0] = u - Vector3i(margin);
+            node.bounds[1] = u + Vector3i(margin);
+            return;
+        }
+        if (tasks && end - begin <= task_size) {
+            tasks->push_back(Task{t, begin, end});
+            return;
+        }
+        // Split at the highest octree level where the codes in the range differ
+        const int shift = highest_bit(codes[begin] ^ codes[end - 1]) / 3 * 3;
+        int boundaries[9];
+        int num_children = 0;
+        boundaries[0] = begin;
+        while (boundaries[num_children] < end) {
+            const uint64 prefix = codes[boundaries[num_children]] >> shift;
+            boundaries[num_children + 1] = (int)(std::upper_bound(codes.begin() + boundaries[num_children],
+                                                                  codes.begin() + end, prefix,
+                                                                  [shift](uint64 p, uint64 code) {
+                                                                      return p < (code >> shift);
+                                                                  }) - codes.begin());
+            num_children++;
+        }
+        const int child_begin = (int)storage.size();
+        storage.resize(storage.size() + num_children);
+        storage[t].child_begin = child_begin;
+        storage[t].num_children = num_children;
+        for (int c = 0; c < num_children; c++) {
+            build(storage, child_begin + c, boundaries[c], boundaries[c + 1], task_size, tasks);
+        }
+        if (!tasks) {
+            summarize(storage, t);
+        }
     }
 
 public:
     // We do not evaluate the weighted average of position and mass on the fly
     // for efficiency and accuracy
-    void initialize(real resolution, real margin_real, const std::vector<Particle> &particles) {
-        this->resolution = resolution;
-        this->inv_resolution = 1.0f / resolution;
-        this->margin = (int)std::ceil(margin_real * inv_resolution);
+    void initialize(real resolution, real margin_real, const std::vector<Particle> &particles,
+                    int num_threads = 1) {
+        this->num_threads = num_threads;
         assert(particles.size() != 0);
         Vector3 lower(1e30f);
         Vector3 upper(-1e30f);
@@ -151,119 +368,164 @@ public:
                 lower[k] = std::min(lower[k], p.position[k]);
                 upper[k] = std::max(upper[k], p.position[k]);
             }
-            //P(p.position);
         }
         lower_corner = lower;
+        // Coarsen the finest cells if the codes would not fit in 64 bits
+        resolution = std::max(resolution, max_component(upper - lower) / (real)(1 << max_levels) * 1.0001f);
+        this->resolution = resolution;
+        this->inv_resolution = 1.0f / resolution;
+        this->margin = (int)std::ceil(margin_real * inv_resolution);
         int intervals = (int)std::ceil(max_component(upper - lower) / resolution);
         total_levels = 0;
         for (int i = 1; i < intervals; i *= 2, total_levels++);
-        // We do not use the 0th node...
-        node_end = 1;
-        nodes.clear();
-        nodes.resize(particles.size() * 2);
-        int root = get_new_node();
-        // Make sure that one leaf node contains only one particle.
-        // Unless particles are too close and thereby merged.
-        for (auto &p : particles) {
-            if (p.mass == 0) {
-                continue;
-            }
-            Vector3i u = get_coord(p.position);
-            int t = root;
-            if (nodes[t].is_leaf()) {
-                // First node
-                nodes[t].p = p;
-                continue;
-            }
-            // Traverse down until there's no way...
-            int k = 0;
-            int cp;
-            for (; k < total_levels; k++) {
-                cp = get_child_index(u, k);
-                if (nodes[t].children[cp] != 0) {
-                    t = nodes[t].children[cp];
-                } else {
-                    break;
+
+        {
+            Profiler _("sort");
+            std::vector<uint64> sorted_codes;
+            std::vector<int> sorted_indices;
+            for (int i = 0; i < (int)particles.size(); i++) {
+                if (particles[i].mass != 0) {
+                    sorted_indices.push_back(i);
                 }
             }
-            if (nodes[t].is_leaf()) {
-                // Leaf node, containing one particle q
-                // Split the node until p and q belong to different children.
-                Particle q = nodes[t].p;
-                nodes[t].p = Particle();
-                Vector3i v = get_coord(q.position);
-                int cq = get_child_index(v, k);
-                while (cp == cq && k < total_levels) {
-                    t = create_child(t, cp);
-                    k++;
-                    cp = get_child_index(u, k);
-                    cq = get_child_index(v, k);
+            sorted_codes.resize(sorted_indices.size());
+            ThreadedTaskManager::run(get_num_chunks((int)sorted_indices.size()), num_threads, [&](int c) {
+                const int n = (int)sorted_indices.size(), num_chunks = get_num_chunks(n);
+                for (int i = (int)((int64)n * c / num_chunks); i < (int)((int64)n * (c + 1) / num_chunks); i++) {
+                    sorted_codes[i] = get_code(particles[sorted_indices[i]].position);
                 }
-                if (k == total_levels) {
-                    // We have to merge two particles since they are too close...
-                    q = p + q;
-                    create_child(t, cp, q);
-                } else {
-                    nodes[t].p = Particle();
-                    create_child(t, cp, p);
-                    create_child(t, cq, q);
+            });
+            sort_by_code(sorted_codes, sorted_indices);
+            merge_cells(sorted_codes, sorted_indices, particles);
+            leaf_particles.swap(sorted_indices);
+        }
+
+        Profiler _("build");
+        // The top of the tree is built serially, until ranges are small enough to be
+        // worth a task. We do not use the 0th node, and the root is node 1.
+        const int num_leaves = (int)leaves.size();
+        const int task_size = num_threads > 1 ? std::max(1024, num_leaves / (num_threads * 8)) : num_leaves;
+        nodes.clear();
+        nodes.reserve((size_t)num_leaves * 2 + 2);
+        nodes.resize(2);
+        std::vector<Task> tasks;
+        build(nodes, 1, 0, num_leaves, task_size, &tasks);
+        const int num_top_nodes = (int)nodes.size();
+
+        // Subtrees are built (and summarized) into their own buffers, with the task root first
+        std::vector<std::vector<Node>> subtrees(tasks.size());
+        ThreadedTaskManager::run((int)tasks.size(), num_threads, [&](int i) {
+            subtrees[i].reserve((size_t)(tasks[i].end - tasks[i].begin) * 2);
+            subtrees[i].resize(1);
+            build(subtrees[i], 0, tasks[i].begin, tasks[i].end, 0, nullptr);
+        });
+        std::vector<int> subtree_offsets(tasks.size() + 1, num_top_nodes);
+        for (int i = 0; i < (int)tasks.size(); i++) {
+            subtree_offsets[i + 1] = subtree_offsets[i] + (int)subtrees[i].size() - 1;
+        }
+        nodes.resize((size_t)subtree_offsets[tasks.size()]);
+        ThreadedTaskManager::run((int)tasks.size(), num_threads, [&](int i) {
+            // Local node l > 0 goes to subtree_offsets[i] + l - 1
+            const int relocation = subtree_offsets[i] - 1;
+            for (int l = 0; l < (int)subtrees[i].size(); l++) {
+                Node node = subtrees[i][l];
+                if (!node.is_leaf()) {
+                    node.child_begin += relocation;
                 }
-            } else {
-                // Non-leaf node, simply create a child.
-                create_child(t, cp, p);
+                nodes[l == 0 ? tasks[i].node : relocation + l] = node;
+            }
+            std::vector<Node>().swap(subtrees[i]);
+        });
+
+        // Children of top nodes come after them
+        std::vector<char> is_task_root((size_t)num_top_nodes, 0);
+        for (auto &task : tasks) {
+            is_task_root[task.node] = 1;
+        }
+        for (int t = num_top_nodes - 1; t >= 1; t--) {
+            if (!is_task_root[t] && !nodes[t].is_leaf()) {
+                summarize(nodes, t);
             }
         }
-        P(node_end);
-        summarize(root);
     }
 
-    /*
-    template<typename T>
-    Vector3 summation(const Particle &p, const T &func) {
-        // TODO: fine level
-        // TODO: only one particle?
-        int t = 1;
-        Vector3 ret(0.0f);
-        Vector3 u = get_coord(p.position);
-        for (int k = 0; k < total_levels; k++) {
-            int cp = get_child_index(u, k);
-            for (int c = 0; c < 8; c++) {
-                if (c != cp && nodes[t].children[c]) {
-                    const Node &n = nodes[nodes[t].children[c]];
-                    auto tmp = func(p, n.p);
-                    ret += tmp;
-                }
+    // Field of all other particles at every particle passed to initialize (zero for massless
+    // ones), sum_q m_q (x - x_q) / (|x - x_q|^2 + softening)^(3/2).
+    // Subtrees of at most group_size cells walk the tree together: a node is opened if it
+    // is not a leaf and its bounds overlap the cells of the group, which is the opening
+    // criterion of summation() for every particle of the group at once. The interaction
+    // list of the group is then summed for each of its particles.
+    void evaluate_grouped(const std::vector<Particle> &particles, real softening, std::vector<Vector3> &field,
+                          int group_size = 32) {
+        field.assign(particles.size(), Vector3(0.0f));
+        std::vector<int> groups;
+        std::vector<int> stack(1, 1);
+        while (!stack.empty()) {
+            const int t = stack.back();
+            stack.pop_back();
+            if (nodes[t].is_leaf() || nodes[t].end - nodes[t].begin <= group_size) {
+                groups.push_back(t);
+                continue;
             }
-            t = nodes[t].children[cp];
-            if (t == 0) {
-                break;
+            for (int c = nodes[t].child_begin; c < nodes[t].child_begin + nodes[t].num_children; c++) {
+                stack.push_back(c);
             }
         }
-        return ret;
+        ThreadedTaskManager::run((int)groups.size(), num_threads, [&](int g) {
+            const Node &group = nodes[groups[g]];
+            // Cells of the group, without the margin
+            const Vector3i lower = group.bounds[0] + Vector3i(margin), upper = group.bounds[1] - Vector3i(margin);
+            thread_local InteractionList list;
+            thread_local std::vector<int> walk;
+            list.clear();
+            walk.assign(1, 1);
+            if (nodes[1].is_leaf()) {
+                list.push_back(nodes[1].p.position, nodes[1].p.mass);
+                walk.clear();
+            }
+            while (!walk.empty()) {
+                const Node &node = nodes[walk.back()];
+                walk.pop_back();
+                for (int c = node.child_begin; c < node.child_begin + node.num_children; c++) {
+                    const Node &ch = nodes[c];
+                    bool overlap = true;
+                    for (int i = 0; i < 3; i++) {
+                        overlap = overlap && ch.bounds[0][i] <= upper[i] && lower[i] <= ch.bounds[1][i];
+                    }
+                    if (overlap && !ch.is_leaf()) {
+                        walk.push_back(c);
+                    } else {
+                        list.push_back(ch.p.position, ch.p.mass);
+                    }
+                }
+            }
+            list.pad();
+            for (int j = leaf_offsets[group.begin]; j < leaf_offsets[group.end]; j++) {
+                const int i = leaf_particles[j];
+                field[i] = sum_field(list, particles[i].position, softening);
+            }
+        });
     }
-    */
 
     template <typename T>
     Vector3 summation(int t, const Particle &p, const T &func) {
         const Node &node = nodes[t];
-        if (nodes[t].is_leaf()) {
+        if (node.is_leaf()) {
             return func(p, node.p);
         }
         Vector3 ret(0.0f);
         Vector3i u = get_coord(p.position);
-        for (int c = 0; c < 8; c++) {
-            if (node.children[c]) {
-                const Node &ch = nodes[node.children[c]];
-                if (
-                        ch.bounds[0][0] <= u[0] && u[0] <= ch.bounds[1][0] &&
-                        ch.bounds[0][1] <= u[1] && u[1] <= ch.bounds[1][1] &&
-                        ch.bounds[0][2] <= u[2] && u[2] <= ch.bounds[1][2]
-                        ) {
-                    ret += summation(node.children[c], p, func);
-                } else {
-                    // Coarse summation 
-                    ret += func(p, ch.p);
-                }
+        for (int c = node.child_begin; c < node.child_begin + node.num_children; c++) {
+            const Node &ch = nodes[c];
+            if (
+                    ch.bounds[0][0] <= u[0] && u[0] <= ch.bounds[1][0] &&
+                    ch.bounds[0][1] <= u[1] && u[1] <= ch.bounds[1][1] &&
+                    ch.bounds[0][2] <= u[2] && u[2] <= ch.bounds[1][2]
+                    ) {
+                ret += summation(c, p, func);
+            } else {
+                // Coarse summation
+                ret += func(p, ch.p);
             }
         }
         return ret;
@@ -278,10 +540,8 @@ public:
         printf("(%d, %d, %d) (%d, %d, %d)\n",
                nodes[t].bounds[0][0], nodes[t].bounds[0][1], nodes[t].bounds[0][2],
                nodes[t].bounds[1][0], nodes[t].bounds[1][1], nodes[t].bounds[1][2]);
-        for (int c = 0; c < 8; c++) {
-            if (nodes[t].children[c] != 0) {
-                print_tree(nodes[t].children[c], level + 1);
-            }
+        for (int c = nodes[t].child_begin; c < nodes[t].child_begin + nodes[t].num_children; c++) {
+            print_tree(c, level + 1);
         }
     }
 };
@@ -300,6 +560,9 @@ protected:
     std::shared_ptr<Texture> velocity_field;
     std::vector<Particle> particles;
     BarnesHutSummation bhs;
+    // "barnes_hut" or "fmm"
+    std::string gravity_solver;
+    std::shared_ptr<FastMultipoleSummation> fmm;
     real delta_t;
 public:
     virtual void initialize(const Config &config) override {
@@ -308,6 +571,13 @@ public:
         particles.reserve(num_particles);
         gravitation = config.get_real("gravitation");
         delta_t = config.get_real("delta_t");
+        gravity_solver = config.get("gravity_solver", std::string("barnes_hut"));
+        assert_info(gravity_solver == "barnes_hut" || gravity_solver == "fmm",
+                    "Unknown gravity solver: " + gravity_solver);
+        if (gravity_solver == "fmm") {
+            fmm = std::make_shared<FastMultipoleSummation>(config.get("fmm_order", 4), config.get("fmm_theta", 0.5f),
+                                                           config.get("fmm_leaf_size", 32), 1e-4f, num_threads);
+        }
         real vel_scale = config.get_real("vel_scale");
         for (int i = 0; i < num_particles; i++) {
             Vector3 p(rand(), rand(), rand());
@@ -327,61 +597,79 @@ public:
         return render_particles;
     }
 
-    void substep(real dt) {
+    void substep_barnes_hut(real dt) {
         using BHP = BarnesHutSummation::Particle;
-        std::vector<BHP> bhps;
-        bhps.reserve(particles.size());
-        for (auto &p : particles) {
-            bhps.push_back(BHP(p.position, 1.0f));
-        }
+        std::vector<BHP> bhps(particles.size());
+        ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
+            bhps[i] = BHP(particles[i].position, 1.0f);
+        });
 
-        bhs.initialize(1e-4f, 1e-3f, bhps);
+        TC_PROFILE("build_tree", bhs.initialize(1e-4f, 1e-3f, bhps, num_threads));
         // bhs.print_tree(1, 0);
 
-        auto f = [](const BHP &p, const BHP &q) {
-            CV(p.position);
-            CV(q.position);
-            Vector3 d = p.position - q.position;
-            real dist2 = dot(d, d);
-            dist2 += 1e-4f;
-            CV(d);
-            d *= p.mass * q.mass / (dist2 * sqrt(dist2));
-            CV(p.mass);
-            CV(q.mass);
-            CV(dist2);
-            CV(d);
-            return d;
-        };
         if (gravitation != 0) {
-            real max_err = -1;
+            Profiler _("summation");
+            std::vector<Vector3> field;
+            bhs.evaluate_grouped(bhps, 1e-4f, field);
             ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
-                auto &p = particles[i];
-                /*
-                Vector3 total_f(0.0f);
-                for (int j = 0; j < (int)particles.size(); j++) {
-                    auto &q = particles[j];
-                    total_f += f(BHP(p.position, 1.0f), BHP(q.position, 1.0f));
-                }
-
-                auto err = length(total_f_bhs - total_f) / length(total_f);
-                max_err = std::max(err, max_err);
-                
-                P(total_f);
-                P(total_f_bhs);
-                P(err);
-                */
-                Vector3 total_f_bhs = bhs.summation(1, BHP(p.position, 1.0f), f);
-                CV(total_f_bhs);
-                particles[i].velocity += total_f_bhs * gravitation * dt;
+                particles[i].velocity += field[i] * gravitation * dt;
                 CV(particles[i].velocity);
-                CV(total_f_bhs);
             });
-            //P(max_err);
         }
-        for (auto &p : particles) {
-            p.position += dt * p.velocity;
+    }
+
+    void substep_fmm(real dt) {
+        std::vector<Vector3> positions(particles.size());
+        std::vector<real> masses(particles.size(), 1.0f);
+        ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
+            positions[i] = particles[i].position;
+        });
+        std::vector<Vector3> field;
+        TC_PROFILE("fmm", fmm->evaluate(positions, masses, field));
+        ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
+            particles[i].velocity += field[i] * gravitation * dt;
+        });
+    }
+
+    void substep(real dt) {
+        Profiler _p("nbody_substep");
+        if (gravity_solver == "fmm") {
+            if (gravitation != 0) {
+                substep_fmm(dt);
+            }
+        } else {
+            substep_barnes_hut(dt);
+        }
+        {
+            Profiler _("advance");
+            ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
+                particles[i].position += dt * particles[i].velocity;
+            });
         }
         current_t += dt;
+        if (telemetry.should_sample()) {
+            TelemetryRecord record;
+            record.t = current_t;
+            record.dt = dt;
+            record.active_particles = (int64)particles.size();
+            // Per-chunk partial maxima, reduced serially afterwards
+            const int n = (int)particles.size();
+            const int num_chunks = std::max(1, std::min(num_threads, n / 4096));
+            std::vector<real> chunk_max((size_t)num_chunks, 0.0f);
+            ThreadedTaskManager::run(num_chunks, num_threads, [&](int c) {
+                real m = 0.0f;
+                for (int i = (int)((int64)n * c / num_chunks); i < (int)((int64)n * (c + 1) / num_chunks); i++) {
+                    m = std::max(m, dot(particles[i].velocity, particles[i].velocity));
+                }
+                chunk_max[c] = m;
+            });
+            real max_speed2 = 0.0f;
+            for (auto m : chunk_max) {
+                max_speed2 = std::max(max_speed2, m);
+            }
+            record.max_velocity = std::sqrt(max_speed2);
+            telemetry.write(record);
+        }
     }
 
     virtual void step(real dt) override {
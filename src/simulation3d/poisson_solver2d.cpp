@@ -10,9 +10,169 @@
 #include <taichi/system/threading.h>
 #include <taichi/dynamics/poisson_solver2d.h>
 #include <taichi/math/stencils.h>
+#include <taichi/math/stencil_sweep.h>
+#include "red_black_smoother.h"
 
 TC_NAMESPACE_BEGIN
 
+// Parallel reductions over columns. Partial sums are accumulated per column
+// and then summed in order, so results do not depend on the number of threads.
+static double parallel_dot(const Array2D<real> &a, const Array2D<real> &b, int num_threads) {
+    std::vector<double> partial((size_t)a.get_width(), 0.0);
+    ThreadedTaskManager::run(a.get_width(), num_threads, [&](int i) {
+        const real *col_a = a[i], *col_b = b[i];
+        double sum = 0;
+        for (int j = 0; j < a.get_height(); j++) {
+            sum += col_a[j] * col_b[j];
+        }
+        partial[i] = sum;
+    });
+    double sum = 0;
+    for (auto p : partial) {
+        sum += p;
+    }
+    return sum;
+}
+
+static real parallel_abs_max(const Array2D<real> &a, int num_threads) {
+    std::vector<real> partial((size_t)a.get_width(), 0.0f);
+    ThreadedTaskManager::run(a.get_width(), num_threads, [&](int i) {
+        const real *col = a[i];
+        real ret = 0;
+        for (int j = 0; j < a.get_height(); j++) {
+            ret = std::max(ret, std::abs(col[j]));
+        }
+        partial[i] = ret;
+    });
+    real ret = 0;
+    for (auto p : partial) {
+        ret = std::max(ret, p);
+    }
+    return ret;
+}
+
+// Variable-coefficient 5-point operator, see PoissonSolver2D::set_system
+struct CoefficientSystem2D {
+    typedef Array2D<real> Array;
+    Array Ad, Ax, Ay, inv_Ad;
+
+    void initialize(const Array &Ad, const Array &Ax, const Array &Ay) {
+        this->Ad = Ad;
+        this->Ax = Ax;
+        this->Ay = Ay;
+        inv_Ad = Ad.same_shape(0.0f);
+        for (auto &ind : Ad.get_region()) {
+            if (Ad[ind] > 0) {
+                inv_Ad[ind] = 1.0f / Ad[ind];
+            }
+        }
+    }
+
+    // Constant coefficients derived from cell types, matching MultigridPoissonSolver2D::apply_L
+    void initialize(const PoissonSolver2D::BCArray &boundary, PoissonSolver2D::CellType padding) {
+        const int width = boundary.get_width(), height = boundary.get_height();
+        Array Ad(width, height, 0.0f), Ax(width, height, 0.0f), Ay(width, height, 0.0f);
+        auto cell_type = [&](const Index2D &ind) {
+            return boundary.inside(ind) ? boundary[ind] : padding;
+        };
+        for (auto &ind : boundary.get_region()) {
+            if (boundary[ind] != PoissonSolver2D::INTERIOR) {
+                continue;
+            }
+            for (int k = 0; k < 4; k++) {
+                auto cell = cell_type(ind + neighbour4_2d[k]);
+                if (cell != PoissonSolver2D::NEUMANN) {
+                    Ad[ind] += 1.0f;
+                }
+            }
+            if (cell_type(ind.neighbour(1, 0)) == PoissonSolver2D::INTERIOR) {
+                Ax[ind] = -1.0f;
+            }
+            if (cell_type(ind.neighbour(0, 1)) == PoissonSolver2D::INTERIOR) {
+                Ay[ind] = -1.0f;
+            }
+        }
+        initialize(Ad, Ax, Ay);
+    }
+
+    bool is_dof(int i, int j) const {
+        return inv_Ad[i][j] > 0;
+    }
+
+    // Off-diagonal part of row (i, j), applied to x
+    real off_diagonal(const Array &x, int i, int j) const {
+        const int width = x.get_width(), height = x.get_height();
+        real t = 0;
+        if (0 < i)
+            t += Ax[i - 1][j] * x[i - 1][j];
+        if (i < width - 1)
+            t += Ax[i][j] * x[i + 1][j];
+        if (0 < j)
+            t += Ay[i][j - 1] * x[i][j - 1];
+        if (j < height - 1)
+            t += Ay[i][j] * x[i][j + 1];
+        return t;
+    }
+
+    void apply(const Array &x, Array &y, int num_threads) const {
+        ThreadedTaskManager::run(x.get_width(), num_threads, [&](int i) {
+            for (int j = 0; j < x.get_height(); j++) {
+                if (is_dof(i, j)) {
+                    y[i][j] = Ad[i][j] * x[i][j] + off_diagonal(x, i, j);
+                } else {
+                    y[i][j] = 0.0f;
+                }
+            }
+        });
+    }
+
+    // One Gauss-Seidel pass over the cells with (i + j) % 2 == color
+    void relax(const Array &b, Array &x, int color, int num_threads) const {
+        ThreadedTaskManager::run(x.get_width(), num_threads, [&](int i) {
+            for (int j = (i + color) % 2; j < x.get_height(); j += 2) {
+                if (is_dof(i, j)) {
+                    x[i][j] = (b[i][j] - off_diagonal(x, i, j)) * inv_Ad[i][j];
+                }
+            }
+        });
+    }
+
+    // Singular iff every row sums to zero, i.e. no Dirichlet cell (or cut cell) is coupled
+    bool has_null_space() const {
+        for (auto &ind : Ad.get_region()) {
+            if (Ad[ind] <= 0) {
+                continue;
+            }
+            real row_sum = Ad[ind] + Ax[ind] + Ay[ind];
+            if (ind.i > 0)
+                row_sum += Ax[ind.neighbour(-1, 0)];
+            if (ind.j > 0)
+                row_sum += Ay[ind.neighbour(0, -1)];
+            if (std::abs(row_sum) > 1e-6f * Ad[ind]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Remove the constant mode (over degrees of freedom) from r
+    void project_out_null_space(Array &r) const {
+        double sum = 0;
+        int count = 0;
+        for (auto &ind : r.get_region()) {
+            if (Ad[ind] > 0) {
+                sum += r[ind];
+                count++;
+            }
+        }
+        real mean = real(sum / std::max(count, 1));
+        for (auto &ind : r.get_region()) {
+            if (Ad[ind] > 0) {
+                r[ind] -= mean;
+            }
+        }
+    }
+};
 
 // Maybe we are going to need Algebraic Multigrid in the future,
 // but let's have a GMG with different boundary conditions support first...
@@ -79,11 +239,14 @@ public:
     }
 
     std::vector<System> systems;
+    std::vector<RedBlackSmoother> smoothers;
 
     void set_boundary_condition(const BCArray &boundary) override {
         Vector2i res = this->res;
+        assert_info(boundary.get_width() == res[0] && boundary.get_height() == res[1],
+                    "boundary condition does not match the solver resolution");
         boundaries.clear();
-        boundaries.push_back(BCArray(res));
+        boundaries.push_back(boundary);
         // Iff we pad with Neumann and there's no dirichlet...
         has_null_space = padding == NEUMANN;
 
@@ -125,6 +288,7 @@ public:
         }
 
         systems.clear();
+        smoothers.clear();
         res = this->res;
         // Step 2: build the compressed systems
         for (int l = 0; l < max_level; l++) {
@@ -149,6 +313,15 @@ public:
                     system[ind].inv_numerator = 1.0f / system[ind].inv_numerator;
             }
             systems.push_back(system);
+            // The smoother sees the grid as (i, 0, j); its bits are x+, x-, y+, y-, z+, z-
+            static const int smoother_to_stencil[6] = {0, 1, -1, -1, 2, 3};
+            smoothers.push_back(RedBlackSmoother());
+            smoothers.back().initialize(Vector3i(res[0], 1, res[1]), [&](int i, int, int j) {
+                return system[i][j].inv_numerator;
+            }, [&](int i, int, int j, int d) {
+                return smoother_to_stencil[d] >= 0 &&
+                       system[i][j].get_neighbour_cell_type(smoother_to_stencil[d]) == INTERIOR;
+            });
             res /= 2;
         }
     }
@@ -177,128 +350,77 @@ public:
         } while (res[0] * res[1] * 8 >= size_threshold);
     }
 
-    void parallel_for_each_cell(Array &arr, int threshold, const std::function<void(const Index2D &index)> &func) {
-        int max_side = std::max(std::max(arr.get_width(), arr.get_height()), 0);
-        int num_threads;
-        if (max_side >= threshold) {
-            num_threads = this->num_threads;
-        } else {
-            num_threads = 1;
-        }
-        ThreadedTaskManager::run(arr.get_width(), num_threads, [&](int x) {
-            const int height = arr.get_height();
-            for (int y = 0; y < height; y++) {
-                func(Index2D(x, y));
-            }
-        });
-    }
-
     bool get_has_null_space() {
         return has_null_space;
     }
 
-    void gauss_seidel(const System &system, const Array &residual, Array &pressure, int rounds) {
-        for (int i = 0; i < rounds; i++) {
-            for (int c = 0; c < 2; c++) {
-                parallel_for_each_cell(pressure, 64, [&](const Index2D &ind) {
-                    int sum = ind.i + ind.j;
-                    if ((sum) % 2 == c) {
-                        if (system[ind].inv_numerator > 0) {
-                            real res = residual[ind];
-                            for (int k = 0; k < 4; k++) {
-                                Vector2i offset = neighbour4_2d[k];
-                                if (system[ind].get_neighbour_cell_type(k) == INTERIOR) {
-                                    res += pressure[ind + offset];
-                                }
-                            }
-                            pressure[ind] = res * system[ind].inv_numerator;
-                        } else {
-                            pressure[ind] = 0.0f;
-                        }
-                    }
-                });
-            }
-        }
+    // Small levels are not worth spawning threads for
+    int get_level_threads(int level) const {
+        const Array &arr = pressures[level];
+        int max_side = std::max(arr.get_width(), arr.get_height());
+        return max_side >= 64 ? num_threads : 1;
     }
 
-    void apply_L(const System &system, const Array &pressure, Array &output) {
-        for (auto &ind : pressure.get_region()) {
-            if (system[ind].inv_numerator == 0.0f) {
-                output[ind] = 0.0f;
-                continue;
-            }
-            real pressure_center = pressure[ind];
-            real res = 0.0f;
-            for (int k = 0; k < 4; k++) {
-                Vector2i offset = neighbour4_2d[k];
-                CellType type = system[ind].get_neighbour_cell_type(k);
-                if (type == INTERIOR) {
-                    res += pressure_center - pressure[ind + offset];
-                } else if (type == DIRICHLET) {
-                    res += pressure_center;
-                }
-            }
-            output[ind] = res;
-        }
+    // If `residual` is given, the residual after smoothing is written to it as well.
+    void gauss_seidel(int level, int rounds, Array *residual = nullptr) {
+        smoothers[level].run(&residuals[level][0][0], &pressures[level][0][0], rounds,
+                             get_level_threads(level), 1.0f, residual ? &(*residual)[0][0] : nullptr);
     }
 
-    void compute_residual(const System &system, const Array &pressure, const Array &div, Array &residual) {
-        parallel_for_each_cell(residual, 128, [&](const Index2D &ind) {
-            if (system[ind].inv_numerator == 0) {
-                residual[ind] = 0.0f;
-                return;
-            }
-            real pressure_center = pressure[ind];
-            real res = 0.0f;
-            for (int k = 0; k < 4; k++) {
-                Vector2i offset = neighbour4_2d[k];
-                CellType type = system[ind].get_neighbour_cell_type(k);
-                if (type == INTERIOR) {
-                    res += pressure_center - pressure[ind + offset];
-                } else if (type == DIRICHLET) {
-                    res += pressure_center;
-                }
-            }
-            residual[ind] = div[ind] - res;
-        });
+    void apply_L(int level, const Array &pressure, Array &output) {
+        smoothers[level].apply(&pressure[0][0], &output[0][0], get_level_threads(level));
+    }
+
+    void compute_residual(int level, const Array &pressure, const Array &div, Array &residual) {
+        smoothers[level].compute_residual(&div[0][0], &pressure[0][0], &residual[0][0],
+                                          get_level_threads(level));
     }
 
-    void downsample(const System &system, const Array &x, Array &x_downsampled) { // Restriction
-        for (auto &ind : x_downsampled.get_region()) {
-            if (system[ind].inv_numerator > 0) {
-                x_downsampled[ind] =
-                        x[ind.i * 2 + 0][ind.j * 2 + 0] +
-                        x[ind.i * 2 + 0][ind.j * 2 + 1] +
-                        x[ind.i * 2 + 1][ind.j * 2 + 0] +
-                        x[ind.i * 2 + 1][ind.j * 2 + 1];
-            } else {
-                x_downsampled[ind] = 0.0f;
+    // Restriction from `level` - 1 to `level`
+    void downsample(int level, const Array &x, Array &x_downsampled) {
+        const System &system = systems[level];
+        const int height = x_downsampled.get_height();
+        StencilSweep(get_level_threads(level - 1)).for_each_row(Vector3i(system.get_width(), 1, height),
+                                                                [&](int i, int) {
+            const real *x0 = x[i * 2 + 0], *x1 = x[i * 2 + 1];
+            const SystemRow *column = system[i];
+            real *out = x_downsampled[i];
+            for (int j = 0; j < height; j++) {
+                out[j] = real(column[j].inv_numerator > 0) *
+                         (x0[j * 2] + x0[j * 2 + 1] + x1[j * 2] + x1[j * 2 + 1]);
             }
-        }
+        });
     }
 
-    void prolongate(const System &system, Array &x, const Array &x_delta) const {
-        for (auto &ind : x.get_region()) {
-            // Do not prolongate to cells without a degree of freedom
-            if (system[ind].inv_numerator > 0) {
-                x[ind] += x_delta[ind.i / 2][ind.j / 2]; // Note: In 2D, there's no 0.5 factor here
+    // Prolongation from `level` + 1 to `level`
+    void prolongate(int level, Array &x, const Array &x_delta) const {
+        const System &system = systems[level];
+        const int height = x.get_height();
+        StencilSweep(get_level_threads(level)).for_each_row(Vector3i(system.get_width(), 1, height),
+                                                            [&](int i, int) {
+            const real *delta = x_delta[i / 2];
+            const SystemRow *column = system[i];
+            real *out = x[i];
+            for (int j = 0; j < height; j++) {
+                // Do not prolongate to cells without a degree of freedom.
+                // Note: In 2D, there's no 0.5 factor here
+                out[j] += real(column[j].inv_numerator > 0) * delta[j / 2];
             }
-        }
+        });
     }
 
     void run(int level) {
         pressures[level].reset(0.0f);
         if (residuals[level].get_size() <= size_threshold) { // 4 * 4 * 4
-            gauss_seidel(systems[level], residuals[level], pressures[level], 100);
+            gauss_seidel(level, 100);
         } else {
-            gauss_seidel(systems[level], residuals[level], pressures[level], 4);
+            gauss_seidel(level, 4, &tmp_residuals[level]);
             {
-                compute_residual(systems[level], pressures[level], residuals[level], tmp_residuals[level]);
-                downsample(systems[level + 1], tmp_residuals[level], residuals[level + 1]);
+                downsample(level + 1, tmp_residuals[level], residuals[level + 1]);
                 run(level + 1);
-                prolongate(systems[level], pressures[level], pressures[level + 1]);
+                prolongate(level, pressures[level], pressures[level + 1]);
             }
-            gauss_seidel(systems[level], residuals[level], pressures[level], 4);
+            gauss_seidel(level, 4);
         }
     }
 
@@ -309,7 +431,7 @@ public:
         do {
             iterations++;
             run(0);
-            compute_residual(systems[0], pressures[0], residuals[0], tmp_residuals[0]);
+            compute_residual(0, pressures[0], residuals[0], tmp_residuals[0]);
             P(iterations);
             P(tmp_residuals[0].abs_max());
         } while (tmp_residuals[0].abs_max() > pressure_tolerance);
@@ -319,46 +441,111 @@ public:
 
 class MultigridPCGPoissonSolver2D : public MultigridPoissonSolver2D {
 public:
+    int maximum_iterations;
+    // If set, the outer CG solves this (e.g. cut-cell) system,
+    // while the multigrid preconditioner stays on the cell types.
+    bool use_coefficient_system = false;
+    CoefficientSystem2D coefficient_system;
+
     void initialize(const Config &config) {
         MultigridPoissonSolver2D::initialize(config);
+        maximum_iterations = config.get("maximum_iterations", 20);
+    }
+
+    void set_boundary_condition(const BCArray &boundary) override {
+        MultigridPoissonSolver2D::set_boundary_condition(boundary);
+        use_coefficient_system = false;
+    }
+
+    void set_system(const Array &Ad, const Array &Ax, const Array &Ay) override {
+        coefficient_system.initialize(Ad, Ax, Ay);
+        has_null_space = coefficient_system.has_null_space();
+        use_coefficient_system = true;
+    }
+
+    void apply_system(const Array &x, Array &y) {
+        if (use_coefficient_system) {
+            coefficient_system.apply(x, y, num_threads);
+        } else {
+            apply_L(0, x, y);
+        }
+    }
+
+    bool is_unknown(int i, int j) const {
+        if (use_coefficient_system) {
+            return coefficient_system.is_dof(i, j);
+        } else {
+            return systems[0][i][j].inv_numerator > 0;
+        }
+    }
+
+    // Zeros x on cells without a degree of freedom
+    void mask_unknowns(Array &x) const {
+        ThreadedTaskManager::run(x.get_width(), num_threads, [&](int i) {
+            for (int j = 0; j < x.get_height(); j++) {
+                if (!is_unknown(i, j)) {
+                    x[i][j] = 0.0f;
+                }
+            }
+        });
+    }
+
+    // Remove the constant mode (over unknowns) from r
+    void project_out_null_space(Array &r) const {
+        if (!has_null_space) {
+            return;
+        }
+        double sum = 0;
+        int count = 0;
+        for (auto &ind : r.get_region()) {
+            if (is_unknown(ind.i, ind.j)) {
+                sum += r[ind];
+                count++;
+            }
+        }
+        real mean = real(sum / std::max(count, 1));
+        for (auto &ind : r.get_region()) {
+            if (is_unknown(ind.i, ind.j)) {
+                r[ind] -= mean;
+            }
+        }
     }
 
     Array apply_preconditioner(Array &r) {
         pressures[0] = 0;
         residuals[0] = r;
         MultigridPoissonSolver2D::run(0);
+        mask_unknowns(pressures[0]);
         return pressures[0];
     }
 
     virtual void run(const Array &residual, Array &pressure, real pressure_tolerance) {
         pressure = 0;
-        Array r(res), mu(res), tmp(res);
-        mu = has_null_space ? r.get_average() : 0;
-        r = residual; //TODO: r = r - Lx
-        double nu = (r - mu).abs_max();
+        Array r = residual; //TODO: r = r - Lx
+        // Cells without a degree of freedom stay zero in r, p and z throughout
+        mask_unknowns(r);
+        project_out_null_space(r);
+        double nu = parallel_abs_max(r, num_threads);
         if (nu < pressure_tolerance)
             return;
-        r -= mu;
         Array p = apply_preconditioner(r);
-        double rho = p.dot_double(r);
-        int maximum_iterations = 20;
+        double rho = parallel_dot(p, r, num_threads);
         Array z(res);
         for (int count = 0; count <= maximum_iterations; count++) {
-            apply_L(systems[0], p, z);
-            double sigma = p.dot_double(z);
+            apply_system(p, z);
+            double sigma = parallel_dot(p, z, num_threads);
             double alpha = rho / max(1e-20, sigma);
             r.add_in_place(-(real)alpha, z);
-            mu = has_null_space ? r.get_average() : 0;
-            nu = (r - mu).abs_max();
-            (r - mu).print_abs_max_pos();
+            project_out_null_space(r);
+            nu = parallel_abs_max(r, num_threads);
+            r.print_abs_max_pos();
             printf(" MGPCG iteration #%02d, nu=%f\n", count, nu);
             if (nu < pressure_tolerance || count == maximum_iterations) {
                 pressure.add_in_place((real)alpha, p);
                 return;
             }
-            r -= mu;
             z = apply_preconditioner(r);
-            double rho_new = z.dot_double(r);
+            double rho_new = parallel_dot(z, r, num_threads);
             double beta = rho_new / rho;
             rho = rho_new;
             pressure.add_in_place((real)alpha, p);
@@ -367,8 +554,82 @@ public:
     }
 };
 
+// Conjugate gradients on a (possibly variable-coefficient) 5-point system,
+// preconditioned with a symmetric red-black Gauss-Seidel sweep (red, black, red),
+// which keeps the preconditioner SPD. All passes are parallel over columns, and
+// unlike the multigrid solvers, any resolution is supported.
+class RedBlackPCGPoissonSolver2D : public PoissonSolver2D {
+public:
+    Vector2i res;
+    int num_threads;
+    int maximum_iterations;
+    CellType padding;
+    bool has_null_space;
+    CoefficientSystem2D system;
+
+    void initialize(const Config &config) override {
+        res = config.get_vec2i("res");
+        num_threads = config.get_int("num_threads");
+        maximum_iterations = config.get("maximum_iterations", 300);
+        auto padding_name = config.get_string("padding");
+        assert_info(padding_name == "dirichlet" || padding_name == "neumann",
+                    "'padding' has to be 'dirichlet' or 'neumann' instead of " + std::string(padding_name));
+        padding = padding_name == "dirichlet" ? DIRICHLET : NEUMANN;
+    }
+
+    void set_boundary_condition(const BCArray &boundary) override {
+        system.initialize(boundary, padding);
+        has_null_space = system.has_null_space();
+    }
+
+    void set_system(const Array &Ad, const Array &Ax, const Array &Ay) override {
+        system.initialize(Ad, Ax, Ay);
+        has_null_space = system.has_null_space();
+    }
+
+    void apply_preconditioner(const Array &r, Array &z) {
+        z = 0;
+        system.relax(r, z, 0, num_threads);
+        system.relax(r, z, 1, num_threads);
+        system.relax(r, z, 0, num_threads);
+    }
+
+    virtual void run(const Array &residual, Array &pressure, real pressure_tolerance) override {
+        pressure = 0;
+        Array r = residual, z(res), s(res);
+        if (has_null_space) {
+            system.project_out_null_space(r);
+        }
+        if (parallel_abs_max(r, num_threads) < pressure_tolerance)
+            return;
+        apply_preconditioner(r, z);
+        s = z;
+        double rho = parallel_dot(z, r, num_threads);
+        int count;
+        for (count = 0; count < maximum_iterations; count++) {
+            system.apply(s, z, num_threads);
+            double alpha = rho / max(1e-20, parallel_dot(s, z, num_threads));
+            pressure.add_in_place((real)alpha, s);
+            r.add_in_place(-(real)alpha, z);
+            if (has_null_space) {
+                system.project_out_null_space(r);
+            }
+            if (parallel_abs_max(r, num_threads) < pressure_tolerance)
+                break;
+            apply_preconditioner(r, z);
+            double rho_new = parallel_dot(z, r, num_threads);
+            double beta = rho_new / rho;
+            rho = rho_new;
+            s = z.add((real)beta, s);
+        }
+        printf(" RBPCG iterated %d times, nu=%f\n", count, parallel_abs_max(r, num_threads));
+    }
+};
+
 TC_IMPLEMENTATION(PoissonSolver2D, MultigridPoissonSolver2D, "mg");
 
 TC_IMPLEMENTATION(PoissonSolver2D, MultigridPCGPoissonSolver2D, "mgpcg");
 
+TC_IMPLEMENTATION(PoissonSolver2D, RedBlackPCGPoissonSolver2D, "rbpcg");
+
 TC_NAMESPACE_END
@@ -10,6 +10,8 @@
 #include <taichi/system/threading.h>
 #include <taichi/dynamics/poisson_solver3d.h>
 #include <taichi/math/stencils.h>
+#include <taichi/math/stencil_sweep.h>
+#include "red_black_smoother.h"
 
 TC_NAMESPACE_BEGIN
 
@@ -83,11 +85,12 @@ public:
     }
 
     std::vector<System> systems;
+    std::vector<RedBlackSmoother> smoothers;
 
     void set_boundary_condition(const BCArray &boundary) override {
         Vector3i res = this->res;
         boundaries.clear();
-        boundaries.push_back(BCArray(res));
+        boundaries.push_back(boundary);
         // Iff we pad with Neumann and there's no dirichlet...
         has_null_space = padding == NEUMANN;
 
@@ -131,6 +134,7 @@ public:
         }
 
         systems.clear();
+        smoothers.clear();
         res = this->res;
         // Step 2: build the compressed systems
         for (int l = 0; l < max_level; l++) {
@@ -156,6 +160,14 @@ public:
                 }
             }
             systems.push_back(system);
+            // Smoother bits are x+, x-, y+, y-, z+, z-
+            static const int smoother_to_stencil[6] = {4, 5, 2, 3, 0, 1};
+            smoothers.push_back(RedBlackSmoother());
+            smoothers.back().initialize(res, [&](int i, int j, int k) {
+                return system[i][j][k].inv_numerator;
+            }, [&](int i, int j, int k, int d) {
+                return system[i][j][k].get_neighbour_cell_type(smoother_to_stencil[d]) == INTERIOR;
+            });
             res /= 2;
         }
     }
@@ -187,161 +199,84 @@ public:
         } while (res[0] * res[1] * res[2] * 8 >= size_threshold);
     }
 
-    void parallel_for_each_cell(Array &arr, int threshold, const std::function<void(const Index3D &index)> &func) {
-        int max_side = std::max(std::max(arr.get_width(), arr.get_height()), arr.get_depth());
-        int num_threads;
-        if (max_side >= threshold) {
-            num_threads = this->num_threads;
-        } else {
-            num_threads = 1;
-        }
-        ThreadedTaskManager::run(arr.get_width(), num_threads, [&](int x) {
-            const int height = arr.get_height();
-            const int depth = arr.get_depth();
-            for (int y = 0; y < height; y++) {
-                for (int z = 0; z < depth; z++) {
-                    func(Index3D(x, y, z));
-                }
-            }
-        });
-    }
-
     bool get_has_null_space() {
         return has_null_space;
     }
 
-    void gauss_seidel(const System &system, const Array &residual, Array &pressure, int rounds) {
-        for (int i = 0; i < rounds; i++) {
-            for (int c = 0; c < 2; c++) {
-                parallel_for_each_cell(pressure, 128, [&](const Index3D &ind) {
-                    int sum = ind.i + ind.j + ind.k;
-                    if ((sum) % 2 == c) {
-                        if (system[ind].inv_numerator > 0) {
-                            real res = residual[ind];
-                            for (int k = 0; k < 6; k++) {
-                                Vector3i offset = neighbour6_3d[k];
-                                if (system[ind].get_neighbour_cell_type(k) == INTERIOR) {
-                                    res += pressure[ind + offset];
-                                }
-                            }
-                            pressure[ind] = res * system[ind].inv_numerator;
-                        } else {
-                            pressure[ind] = 0.0f;
-                        }
-                    }
-                });
-            }
-        }
+    // Small levels are not worth spawning threads for
+    int get_level_threads(int level) const {
+        const Array &arr = pressures[level];
+        int max_side = std::max(std::max(arr.get_width(), arr.get_height()), arr.get_depth());
+        return max_side >= 128 ? num_threads : 1;
     }
 
-    void damped_jacobi(const System &system, const Array &residual, Array &pressure, int rounds) {
-        for (int i = 0; i < rounds; i++) {
-            for (int c = 0; c < 2; c++) {
-                parallel_for_each_cell(pressure, 128, [&](const Index3D &ind) {
-                    int sum = ind.i + ind.j + ind.k;
-                    if ((sum) % 2 == c) {
-                        if (system[ind].inv_numerator > 0) {
-                            real res = residual[ind];
-                            for (int k = 0; k < 6; k++) {
-                                Vector3i offset = neighbour6_3d[k];
-                                if (system[ind].get_neighbour_cell_type(k) == INTERIOR) {
-                                    res += pressure[ind + offset];
-                                }
-                            }
-                            real delta = res * system[ind].inv_numerator - pressure[ind];
-                            pressure[ind] += delta * 0.666666666667f;
-                        } else {
-                            pressure[ind] = 0.0f;
-                        }
-                    }
-                });
-            }
-        }
+    // If `residual` is given, the residual after smoothing is written to it as well.
+    void gauss_seidel(int level, int rounds, Array *residual = nullptr) {
+        smoothers[level].run(&residuals[level][0][0][0], &pressures[level][0][0][0], rounds,
+                             get_level_threads(level), 1.0f, residual ? &(*residual)[0][0][0] : nullptr);
     }
 
-    void apply_L(const System &system, const Array &pressure, Array &output) {
-        for (auto &ind : pressure.get_region()) {
-            if (system[ind].inv_numerator == 0.0f) {
-                output[ind] = 0.0f;
-                continue;
-            }
-            real pressure_center = pressure[ind];
-            real res = 0.0f;
-            for (int k = 0; k < 6; k++) {
-                Vector3i offset = neighbour6_3d[k];
-                CellType type = system[ind].get_neighbour_cell_type(k);
-                if (type == INTERIOR) {
-                    res += pressure_center - pressure[ind + offset];
-                } else if (type == DIRICHLET) {
-                    res += pressure_center;
-                }
-            }
-            output[ind] = res;
-        }
+    void damped_jacobi(int level, int rounds) {
+        smoothers[level].run(&residuals[level][0][0][0], &pressures[level][0][0][0], rounds,
+                             get_level_threads(level), 0.666666666667f);
     }
 
-    void compute_residual(const System &system, const Array &pressure, const Array &div, Array &residual) {
-        parallel_for_each_cell(residual, 128, [&](const Index3D &ind) {
-            if (system[ind].inv_numerator == 0) {
-                residual[ind] = 0.0f;
-                return;
-            }
-            real pressure_center = pressure[ind];
-            real res = 0.0f;
-            for (int k = 0; k < 6; k++) {
-                Vector3i offset = neighbour6_3d[k];
-                CellType type = system[ind].get_neighbour_cell_type(k);
-                if (type == INTERIOR) {
-                    res += pressure_center - pressure[ind + offset];
-                } else if (type == DIRICHLET) {
-                    res += pressure_center;
-                }
-            }
-            residual[ind] = div[ind] - res;
-        });
+    void apply_L(int level, const Array &pressure, Array &output) {
+        smoothers[level].apply(&pressure[0][0][0], &output[0][0][0], get_level_threads(level));
+    }
+
+    void compute_residual(int level, const Array &pressure, const Array &div, Array &residual) {
+        smoothers[level].compute_residual(&div[0][0][0], &pressure[0][0][0], &residual[0][0][0],
+                                          get_level_threads(level));
     }
 
-    void downsample(const System &system, const Array &x, Array &x_downsampled) { // Restriction
-        for (auto &ind : x_downsampled.get_region()) {
-            if (system[ind].inv_numerator > 0) {
-                x_downsampled[ind] =
-                        x[ind.i * 2 + 0][ind.j * 2 + 0][ind.k * 2 + 0] +
-                        x[ind.i * 2 + 0][ind.j * 2 + 0][ind.k * 2 + 1] +
-                        x[ind.i * 2 + 0][ind.j * 2 + 1][ind.k * 2 + 0] +
-                        x[ind.i * 2 + 0][ind.j * 2 + 1][ind.k * 2 + 1] +
-                        x[ind.i * 2 + 1][ind.j * 2 + 0][ind.k * 2 + 0] +
-                        x[ind.i * 2 + 1][ind.j * 2 + 0][ind.k * 2 + 1] +
-                        x[ind.i * 2 + 1][ind.j * 2 + 1][ind.k * 2 + 0] +
-                        x[ind.i * 2 + 1][ind.j * 2 + 1][ind.k * 2 + 1];
-            } else {
-                x_downsampled[ind] = 0.0f;
+    // Restriction from `level` - 1 to `level`
+    void downsample(int level, const Array &x, Array &x_downsampled) {
+        const System &system = systems[level];
+        const int depth = x_downsampled.get_depth();
+        const Vector3i level_res(system.get_width(), system.get_height(), system.get_depth());
+        StencilSweep(get_level_threads(level - 1)).for_each_row(level_res, [&](int i, int j) {
+            const real *x00 = x[i * 2 + 0][j * 2 + 0], *x01 = x[i * 2 + 0][j * 2 + 1];
+            const real *x10 = x[i * 2 + 1][j * 2 + 0], *x11 = x[i * 2 + 1][j * 2 + 1];
+            const SystemRow *row = system[i][j];
+            real *out = x_downsampled[i][j];
+            for (int k = 0; k < depth; k++) {
+                out[k] = real(row[k].inv_numerator > 0) *
+                         (x00[k * 2] + x00[k * 2 + 1] + x01[k * 2] + x01[k * 2 + 1] +
+                          x10[k * 2] + x10[k * 2 + 1] + x11[k * 2] + x11[k * 2 + 1]);
             }
-        }
+        });
     }
 
-    void prolongate(const System &system, Array &x, const Array &x_delta) const {
-        for (auto &ind : x.get_region()) {
-            // Do not prolongate to cells without a degree of freedom
-            if (system[ind].inv_numerator > 0) {
-                x[ind] += x_delta[ind.i / 2][ind.j / 2][ind.k / 2] * 0.5f;
+    // Prolongation from `level` + 1 to `level`
+    void prolongate(int level, Array &x, const Array &x_delta) const {
+        const System &system = systems[level];
+        const int depth = x.get_depth();
+        const Vector3i level_res(system.get_width(), system.get_height(), system.get_depth());
+        StencilSweep(get_level_threads(level)).for_each_row(level_res, [&](int i, int j) {
+            const real *delta = x_delta[i / 2][j / 2];
+            const SystemRow *row = system[i][j];
+            real *out = x[i][j];
+            for (int k = 0; k < depth; k++) {
+                // Do not prolongate to cells without a degree of freedom
+                out[k] += real(row[k].inv_numerator > 0) * delta[k / 2] * 0.5f;
             }
-        }
+        });
     }
 
     void run(int level) {
         if (use_as_preconditioner)
             pressures[level].reset(0.0f);
         if (residuals[level].get_size() <= size_threshold) { // 4 * 4 * 4
-            gauss_seidel(systems[level], residuals[level], pressures[level], 100);
+            gauss_seidel(level, 100);
         } else {
-            gauss_seidel(systems[level], residuals[level], pressures[level], 4);
+            gauss_seidel(level, 4, &tmp_residuals[level]);
             {
-                compute_residual(systems[level], pressures[level], residuals[level], tmp_residuals[level]);
-                downsample(systems[level + 1], tmp_residuals[level], residuals[level + 1]);
+                downsample(level + 1, tmp_residuals[level], residuals[level + 1]);
                 run(level + 1);
-                prolongate(systems[level], pressures[level], pressures[level + 1]);
+                prolongate(level, pressures[level], pressures[level + 1]);
             }
-            gauss_seidel(systems[level], residuals[level], pressures[level], 4);
+            gauss_seidel(level, 4);
         }
     }
 
@@ -352,7 +287,7 @@ public:
         do {
             iterations++;
             run(0);
-            compute_residual(systems[0], pressures[0], residuals[0], tmp_residuals[0]);
+            compute_residual(0, pressures[0], residuals[0], tmp_residuals[0]);
             P(iterations);
             P(tmp_residuals[0].abs_max());
         } while (tmp_residuals[0].abs_max() > pressure_tolerance);
@@ -382,7 +317,7 @@ public:
         double rho = p.dot_double(r);
         Array z(res);
         for (int count = 0; count <= maximum_iterations; count++) {
-            apply_L(systems[0], p, z);
+            apply_L(0, p, z);
             double sigma = p.dot_double(z);
             double alpha = rho / max(1e-20, sigma);
             r.add_in_place(-(real)alpha, z);
@@ -432,7 +367,7 @@ public:
         double rho = p.dot_double(r);
         Array z(res);
         for (int count = 0; count <= maximum_iterations; count++) {
-            apply_L(systems[0], p, z);
+            apply_L(0, p, z);
             double sigma = p.dot_double(z);
             double alpha = rho / max(1e-20, sigma);
             r.add_in_place(-(real)alpha, z);
@@ -0,0 +1,279 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/math/stencil_sweep.h>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+TC_NAMESPACE_BEGIN
+
+// Red-black Gauss-Seidel smoother for the (unit coefficient) Poisson systems
+// used by the geometric multigrid solvers.
+//
+// The grid is treated as rows of `depth` cells, one row per (x, y); 2D grids
+// use y = 0. Cells of the same color are packed into compact rows of
+// `depth / 2` values, padded with one zero on each side, so that a color pass
+// touches only the cells it updates and all neighbour accesses are unit-stride:
+//   - the x/y neighbours of compact cell m are compact cell m of the adjacent rows
+//     (of the other color);
+//   - the z neighbours are compact cells m + s - 1 and m + s of the other color
+//     in the same row, where s = (color + x + y + parity) % 2 is the row shift.
+// Neighbour coupling is stored as a per-cell bit mask, so the inner loops are
+// branch-free and get auto-vectorized.
+//
+// Single-threaded runs are temporally tiled (see StencilSweep::wavefront): all
+// half-sweeps are done in one pass over the grid. Multi-threaded runs sweep
+// color by color over spatially blocked rows.
+class RedBlackSmoother {
+public:
+    // Neighbour bits: x+, x-, y+, y-, z+, z-; DOF_BIT marks cells with a degree of freedom.
+    enum {
+        DOF_BIT = 6
+    };
+
+    // Called with the color just updated, after every half-sweep
+    typedef std::function<void(int color)> HalfSweepCallback;
+
+protected:
+    enum Mode {
+        GAUSS_SEIDEL, DAMPED, RESIDUAL, APPLY
+    };
+
+    int width = 0, height = 0, depth = 0;
+    int half = 0, row_stride = 0;
+    int parity = 0;
+    std::vector<real> x_compact[2], b_compact[2], inv_diag[2], diag[2];
+    std::vector<uint8_t> masks[2];
+    std::vector<real> zero_row;
+
+    Vector3i get_res() const {
+        return Vector3i(width, height, depth);
+    }
+
+    int row_id(int x, int y) const {
+        return x * height + y;
+    }
+
+    int row_shift(int color, int x, int y) const {
+        return (color + x + y + parity) % 2;
+    }
+
+    const real *neighbour_row(const std::vector<real> &compact, int x, int y) const {
+        if (x < 0 || x >= width || y < 0 || y >= height) {
+            return &zero_row[1];
+        }
+        return &compact[row_id(x, y) * row_stride + 1];
+    }
+
+    // GAUSS_SEIDEL/DAMPED: update the compact row in place.
+    // RESIDUAL/APPLY: write b - Ax/Ax of the row's cells of this color into the dense row `out`.
+    template <Mode mode>
+    void process_row(int color, int x, int y, real omega, real *out = nullptr) {
+        const int r = row_id(x, y);
+        const int s = row_shift(color, x, y);
+        const std::vector<real> &other = x_compact[1 - color];
+        const real *__restrict xp = neighbour_row(other, x + 1, y);
+        const real *__restrict xm = neighbour_row(other, x - 1, y);
+        const real *__restrict yp = neighbour_row(other, x, y + 1);
+        const real *__restrict ym = neighbour_row(other, x, y - 1);
+        const real *__restrict zn = &other[r * row_stride + s];
+        const real *__restrict b = &b_compact[color][r * row_stride + 1];
+        const real *__restrict inv = &inv_diag[color][r * row_stride + 1];
+        const real *__restrict d = &diag[color][r * row_stride + 1];
+        const uint8_t *__restrict mask = &masks[color][r * half];
+        real *__restrict xc = &x_compact[color][r * row_stride + 1];
+        const real keep = 1.0f - omega;
+        for (int m = 0; m < half; m++) {
+            const int bits = mask[m];
+            real sum = b[m]
+                       + real((bits >> 0) & 1) * xp[m]
+                       + real((bits >> 1) & 1) * xm[m]
+                       + real((bits >> 2) & 1) * yp[m]
+                       + real((bits >> 3) & 1) * ym[m]
+                       + real((bits >> 4) & 1) * zn[m + 1]
+                       + real((bits >> 5) & 1) * zn[m];
+            if (mode == GAUSS_SEIDEL) {
+                xc[m] = sum * inv[m];
+            } else if (mode == DAMPED) {
+                xc[m] = real((bits >> DOF_BIT) & 1) * keep * xc[m] + omega * sum * inv[m];
+            } else if (mode == RESIDUAL) {
+                out[2 * m + s] = real((bits >> DOF_BIT) & 1) * (sum - d[m] * xc[m]);
+            } else {
+                out[2 * m + s] = real((bits >> DOF_BIT) & 1) * (d[m] * xc[m] - sum);
+            }
+        }
+    }
+
+    // b = nullptr gathers a zero right hand side
+    void gather(const real *b, const real *x, const StencilSweep &sweep) {
+        sweep.for_each_row(get_res(), [&](int i, int j) {
+            const int r = row_id(i, j);
+            const real *x_row = x + r * depth;
+            const real *b_row = b ? b + r * depth : nullptr;
+            for (int c = 0; c < 2; c++) {
+                const int s = row_shift(c, i, j);
+                real *__restrict xc = &x_compact[c][r * row_stride + 1];
+                real *__restrict bc = &b_compact[c][r * row_stride + 1];
+                for (int m = 0; m < half; m++) {
+                    xc[m] = x_row[2 * m + s];
+                }
+                for (int m = 0; m < half; m++) {
+                    bc[m] = b_row ? b_row[2 * m + s] : 0.0f;
+                }
+            }
+        });
+    }
+
+    // Writes back x, and optionally the residual b - Ax, computed from the compact rows.
+    void scatter(real *x, real *residual, const StencilSweep &sweep) {
+        sweep.for_each_row(get_res(), [&](int i, int j) {
+            const int r = row_id(i, j);
+            real *x_row = x + r * depth;
+            for (int c = 0; c < 2; c++) {
+                const int s = row_shift(c, i, j);
+                const real *xc = &x_compact[c][r * row_stride + 1];
+                for (int m = 0; m < half; m++) {
+                    x_row[2 * m + s] = xc[m];
+                }
+                if (residual) {
+                    process_row<RESIDUAL>(c, i, j, 1.0f, residual + r * depth);
+                }
+            }
+        });
+    }
+
+    template <Mode mode>
+    void smooth(int rounds, real omega, const StencilSweep &sweep, const HalfSweepCallback &after_half_sweep) {
+        if (sweep.num_threads == 1 && !after_half_sweep) {
+            // Stage 2 * round + color of plane x needs the previous stage on planes x - 1 .. x + 1
+            sweep.wavefront(width, rounds * 2, 1, [&](int stage, int i) {
+                for (int j = 0; j < height; j++) {
+                    process_row<mode>(stage % 2, i, j, omega);
+                }
+            });
+        } else {
+            for (int round = 0; round < rounds; round++) {
+                for (int c = 0; c < 2; c++) {
+                    sweep.for_each_row(get_res(), [&](int i, int j) {
+                        process_row<mode>(c, i, j, omega);
+                    });
+                    if (after_half_sweep) {
+                        after_half_sweep(c);
+                    }
+                }
+            }
+        }
+    }
+
+public:
+    RedBlackSmoother() {}
+
+    // inv_diag(x, y, z): inverse diagonal, 0 for cells without a degree of freedom.
+    // couples(x, y, z, k): whether the cell reads its neighbour in direction k (bit order above).
+    // Red cells (color 0) have an even x + y + z + parity; subgrids pass the parity of their x offset.
+    template <typename InvDiag, typename Couples>
+    void initialize(const Vector3i &res, const InvDiag &get_inv_diag, const Couples &couples, int parity = 0) {
+        width = res[0];
+        height = res[1];
+        depth = res[2];
+        this->parity = parity;
+        assert_info(depth % 2 == 0, "RedBlackSmoother: odd depth");
+        half = depth / 2;
+        row_stride = half + 2;
+        zero_row.assign((size_t)row_stride, 0.0f);
+        const int num_rows = width * height;
+        for (int c = 0; c < 2; c++) {
+            x_compact[c].assign((size_t)num_rows * row_stride, 0.0f);
+            b_compact[c].assign((size_t)num_rows * row_stride, 0.0f);
+            inv_diag[c].assign((size_t)num_rows * row_stride, 0.0f);
+            diag[c].assign((size_t)num_rows * row_stride, 0.0f);
+            masks[c].assign((size_t)num_rows * half, 0);
+            for (int i = 0; i < width; i++) {
+                for (int j = 0; j < height; j++) {
+                    const int r = row_id(i, j);
+                    const int s = row_shift(c, i, j);
+                    for (int m = 0; m < half; m++) {
+                        const int k = 2 * m + s;
+                        real inv = get_inv_diag(i, j, k);
+                        int bits = 0;
+                        if (inv > 0) {
+                            bits |= 1 << DOF_BIT;
+                            for (int d = 0; d < 6; d++) {
+                                if (couples(i, j, k, d)) {
+                                    bits |= 1 << d;
+                                }
+                            }
+                            diag[c][r * row_stride + 1 + m] = 1.0f / inv;
+                        }
+                        inv_diag[c][r * row_stride + 1 + m] = inv;
+                        masks[c][r * half + m] = (uint8_t)bits;
+                    }
+                }
+            }
+        }
+    }
+
+    // Runs `rounds` red-black sweeps on x, with b as the right hand side.
+    // b and x are dense arrays in (x, y, z) row-major order.
+    // With omega < 1, each half-sweep is damped: x <- (1 - omega) x + omega x_GS.
+    // Cells without a degree of freedom are set to zero.
+    // If `residual` is given, b - Ax (after smoothing) is written to it as well.
+    // `after_half_sweep` can refresh cells of the updated color through get_compact_plane()
+    // (e.g. ghost planes of a subdomain); it disables temporal tiling.
+    void run(const real *b, real *x, int rounds, int num_threads, real omega = 1.0f, real *residual = nullptr,
+             const HalfSweepCallback &after_half_sweep = nullptr) {
+        StencilSweep sweep(num_threads);
+        gather(b, x, sweep);
+        if (omega == 1.0f) {
+            smooth<GAUSS_SEIDEL>(rounds, omega, sweep, after_half_sweep);
+        } else {
+            smooth<DAMPED>(rounds, omega, sweep, after_half_sweep);
+        }
+        scatter(x, residual, sweep);
+    }
+
+    // residual = b - Ax, with zeros on cells without a degree of freedom.
+    void compute_residual(const real *b, const real *x, real *residual, int num_threads) {
+        StencilSweep sweep(num_threads);
+        gather(b, x, sweep);
+        sweep.for_each_row(get_res(), [&](int i, int j) {
+            for (int c = 0; c < 2; c++) {
+                process_row<RESIDUAL>(c, i, j, 1.0f, residual + row_id(i, j) * depth);
+            }
+        });
+    }
+
+    // Compact values of one color on plane x during run(), padding included.
+    // The layout only depends on the parity of x, so planes can be copied
+    // between grids with the same height and depth.
+    real *get_compact_plane(int color, int x) {
+        return &x_compact[color][row_id(x, 0) * row_stride];
+    }
+
+    int get_compact_plane_size() const {
+        return height * row_stride;
+    }
+
+    // y = Ax, with zeros on cells without a degree of freedom.
+    void apply(const real *x, real *y, int num_threads) {
+        StencilSweep sweep(num_threads);
+        gather(nullptr, x, sweep);
+        sweep.for_each_row(get_res(), [&](int i, int j) {
+            for (int c = 0; c < 2; c++) {
+                process_row<APPLY>(c, i, j, 1.0f, y + row_id(i, j) * depth);
+            }
+        });
+    }
+};
+
+TC_NAMESPACE_END
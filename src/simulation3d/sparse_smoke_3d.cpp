@@ -0,0 +1,506 @@
+/*******************************************************************************
+    Taichi - Physically based Computer Graphics Library
+
+    Copyright (c) 2017 Yuanming Hu <yuanmhu@gmail.com>
+
+    All rights reserved. Use of this source code is governed by
+    the MIT license as written in the LICENSE file.
+*******************************************************************************/
+
+#include "fluid_3d.h"
+#include <taichi/math/sparse_grid_3d.h>
+#include <taichi/io/compressed_volume.h>
+#include <taichi/system/threading.h>
+#include <taichi/system/profiler.h>
+
+TC_NAMESPACE_BEGIN
+
+// Smoke3D on a tiled sparse domain ("sparse_smoke").
+//
+// All fields are SparseGrid3D's sharing one set of active tiles: tiles where
+// density, temperature or velocity exceed `activity_threshold`, tiles that
+// contain a source, and a halo of `halo` tiles around them. The set is updated
+// at the beginning of every step. Seeding, buoyancy, projection, advection and
+// boundary handling only visit active tiles, so time and memory follow the plume.
+//
+// Cells outside the active tiles are air at rest: they read as zero and are
+// Dirichlet (p = 0) cells for the pressure solve, which is a PCG with a
+// symmetric red-black Gauss-Seidel preconditioner on the active cells.
+// Sources are found by probing the generation texture on a 3^3 lattice per
+// tile in update(), so sources thinner than half a tile may be missed.
+// Solid cells (`boundary_condition`) are not supported in this mode.
+// When res is not a multiple of the tile size, the cells of partial tiles beyond res
+// are never written and stay zero, so reductions can run over whole tiles.
+class SparseSmoke3D : public Smoke3D {
+protected:
+    typedef SparseGrid3D<real> Grid;
+    static const int tile_size = Grid::tile_size;
+
+    Grid sparse_u, sparse_v, sparse_w, sparse_rho, sparse_t, sparse_pressure;
+    Grid next_u, next_v, next_w, next_rho, next_t;
+    // PCG buffers
+    Grid divergence_grid, residual, preconditioned, search, product;
+    Vector3i tile_res;
+    // Per cell tile: active and source tiles
+    std::vector<char> active_mask, source_mask;
+    // Per face tile of the u, v and w grids
+    std::vector<char> face_masks[3];
+    real activity_threshold;
+    int halo;
+    int maximum_iterations;
+
+    int get_num_tiles() const {
+        return tile_res[0] * tile_res[1] * tile_res[2];
+    }
+
+    Grid &get_face_grid(int axis) {
+        return axis == 0 ? sparse_u : (axis == 1 ? sparse_v : sparse_w);
+    }
+
+    // f(tile, base) for every active tile of `grid`, in parallel
+    template <typename F>
+    void for_each_tile(const Grid &grid, const F &f) {
+        const std::vector<int> &tiles = grid.get_active_tiles();
+        ThreadedTaskManager::run((int)tiles.size(), num_threads, [&](int t) {
+            f(tiles[t], grid.get_tile_coord(tiles[t]) * tile_size);
+        });
+    }
+
+    // f(i, j, k, cell) for every cell of the grid in active tiles, in parallel
+    template <typename F>
+    void for_each_cell(Grid &grid, const F &f) {
+        const Vector3i res = grid.get_res();
+        for_each_tile(grid, [&](int tile, const Vector3i &base) {
+            real *data = grid.get_tile(tile);
+            for (int x = 0; x < tile_size && base[0] + x < res[0]; x++) {
+                for (int y = 0; y < tile_size && base[1] + y < res[1]; y++) {
+                    for (int z = 0; z < tile_size && base[2] + z < res[2]; z++) {
+                        f(base[0] + x, base[1] + y, base[2] + z, data[Grid::get_cell_id(x, y, z)]);
+                    }
+                }
+            }
+        });
+    }
+
+    void set_active_tiles(const std::vector<char> &mask) {
+        active_mask = mask;
+        for (auto grid : {&sparse_rho, &sparse_t, &sparse_pressure, &divergence_grid, &residual, &preconditioned,
+                          &search, &product}) {
+            grid->set_active_tiles(mask);
+        }
+        // A face tile is active if one of the cell tiles it touches is
+        for (int axis = 0; axis < 3; axis++) {
+            Grid &grid = get_face_grid(axis);
+            std::vector<char> &face_mask = face_masks[axis];
+            face_mask.assign((size_t)grid.get_num_tiles(), 0);
+            for (int tile = 0; tile < grid.get_num_tiles(); tile++) {
+                Vector3i coord = grid.get_tile_coord(tile);
+                for (int offset = 0; offset < 2; offset++) {
+                    Vector3i c = coord;
+                    c[axis] -= offset;
+                    if (c[axis] >= 0 && c[axis] < tile_res[axis]) {
+                        face_mask[tile] |= mask[(c[0] * tile_res[1] + c[1]) * tile_res[2] + c[2]];
+                    }
+                }
+            }
+            grid.set_active_tiles(face_mask);
+        }
+    }
+
+    // Tiles with content or sources, dilated by `halo` tiles
+    void update_active_tiles() {
+        std::vector<char> content = source_mask;
+        for_each_tile(sparse_rho, [&](int tile, const Vector3i &base) {
+            bool has_content = false;
+            for (int x = 0; x < tile_size && !has_content; x++) {
+                for (int y = 0; y < tile_size; y++) {
+                    for (int z = 0; z < tile_size; z++) {
+                        int i = base[0] + x, j = base[1] + y, k = base[2] + z;
+                        real magnitude = std::max(std::max(std::abs(sparse_rho.get(i, j, k)),
+                                                           std::abs(sparse_t.get(i, j, k))),
+                                                  std::max(std::max(std::abs(sparse_u.get(i, j, k)),
+                                                                    std::abs(sparse_v.get(i, j, k))),
+                                                           std::abs(sparse_w.get(i, j, k))));
+                        has_content = has_content || magnitude > activity_threshold;
+                    }
+                }
+            }
+            if (has_content) {
+                content[tile] = 1;
+            }
+        });
+        std::vector<char> mask((size_t)get_num_tiles(), 0);
+        for (int tile = 0; tile < get_num_tiles(); tile++) {
+            if (!content[tile]) {
+                continue;
+            }
+            Vector3i coord = sparse_rho.get_tile_coord(tile);
+            for (int x = std::max(coord[0] - halo, 0); x <= std::min(coord[0] + halo, tile_res[0] - 1); x++) {
+                for (int y = std::max(coord[1] - halo, 0); y <= std::min(coord[1] + halo, tile_res[1] - 1); y++) {
+                    for (int z = std::max(coord[2] - halo, 0); z <= std::min(coord[2] + halo, tile_res[2] - 1); z++) {
+                        mask[(x * tile_res[1] + y) * tile_res[2] + z] = 1;
+                    }
+                }
+            }
+        }
+        set_active_tiles(mask);
+    }
+
+    void find_source_tiles() {
+        source_mask.assign((size_t)get_num_tiles(), 0);
+        ThreadedTaskManager::run(get_num_tiles(), num_threads, [&](int tile) {
+            Vector3i base = sparse_rho.get_tile_coord(tile) * tile_size;
+            for (int a = 0; a < 27; a++) {
+                Vector3 pos = Vector3(base) + Vector3(real(a / 9), real(a / 3 % 3), real(a % 3)) * (tile_size * 0.5f);
+                pos = Vector3(std::min(pos.x, res[0] - 0.5f), std::min(pos.y, res[1] - 0.5f),
+                              std::min(pos.z, res[2] - 0.5f));
+                if (generation_tex->sample(pos / Vector3(res)).x != 0) {
+                    source_mask[tile] = 1;
+                    break;
+                }
+            }
+        });
+    }
+
+    void seed(real delta_t) {
+        for (int tile = 0; tile < get_num_tiles(); tile++) {
+            if (!source_mask[tile]) {
+                continue;
+            }
+            Vector3i base = sparse_rho.get_tile_coord(tile) * tile_size;
+            for (int c = 0; c < Grid::tile_cells; c++) {
+                int i = base[0] + c / (tile_size * tile_size), j = base[1] + c / tile_size % tile_size,
+                        k = base[2] + c % tile_size;
+                if (i >= res[0] || j >= res[1] || k >= res[2]) {
+                    continue;
+                }
+                for (int s = 0; s < super_sampling; s++) {
+                    Vector3 pos = Vector3(real(i), real(j), real(k)) + Vector3(rand(), rand(), rand());
+                    Vector3 relative_pos = pos / Vector3(res);
+                    real seed = generation_tex->sample(relative_pos).x / super_sampling;
+                    if (seed == 0) {
+                        continue;
+                    }
+                    Vector3 initial_speed = initial_velocity_tex->sample3(relative_pos);
+                    Vector3 color = color_tex->sample3(relative_pos);
+                    sparse_t.get_ref(i, j, k) = temperature_tex->sample3(relative_pos).x;
+                    sparse_rho.get_ref(i, j, k) += seed;
+
+                    sparse_u.get_ref(i, j, k) = initial_speed.x;
+                    sparse_v.get_ref(i, j, k) = initial_speed.y;
+                    sparse_w.get_ref(i, j, k) = initial_speed.z;
+
+                    real gen = delta_t * seed;
+                    int gen_int = (int)std::floor(gen) + int(rand() < gen - std::floor(gen));
+
+                    for (int g = 0; g < gen_int; g++) {
+                        trackers.push_back(Tracker3D(pos, color));
+                    }
+                }
+            }
+        }
+    }
+
+    void apply_forces(real delta_t) {
+        const real t_decay = std::exp(-delta_t * temperature_decay);
+        for_each_cell(sparse_t, [&](int i, int j, int k, real &temperature) {
+            sparse_v.get_ref(i, j, k) += (-smoke_alpha * sparse_rho.get(i, j, k) + smoke_beta * temperature) * delta_t;
+            temperature *= t_decay;
+        });
+    }
+
+    // Closed boxes have no-through-flow walls
+    void apply_boundary_condition() {
+        if (open_boundary) {
+            return;
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            for_each_cell(get_face_grid(axis), [&](int i, int j, int k, real &face) {
+                int coord = axis == 0 ? i : (axis == 1 ? j : k);
+                if (coord == 0 || coord == res[axis]) {
+                    face = 0;
+                }
+            });
+        }
+    }
+
+    // Cells outside the box are Neumann for closed boxes, cells of inactive tiles are Dirichlet
+    int get_diagonal(int i, int j, int k) const {
+        if (open_boundary) {
+            return 6;
+        }
+        return 6 - (i == 0) - (i == res[0] - 1) - (j == 0) - (j == res[1] - 1) - (k == 0) - (k == res[2] - 1);
+    }
+
+    // f(i, j, k, out cell, in cell, sum of the six neighbours in `in`) for every active cell
+    template <typename F>
+    void for_each_stencil(Grid &out, const Grid &in, const F &f) {
+        for_each_tile(out, [&](int tile, const Vector3i &base) {
+            real *out_tile = out.get_tile(tile);
+            const real *in_tile = in.get_tile(tile);
+            const real *neighbours[6];
+            in.get_neighbour_tiles(tile, neighbours);
+            for (int x = 0; x < tile_size && base[0] + x < res[0]; x++) {
+                for (int y = 0; y < tile_size && base[1] + y < res[1]; y++) {
+                    for (int z = 0; z < tile_size && base[2] + z < res[2]; z++) {
+                        const int c = Grid::get_cell_id(x, y, z);
+                        f(base[0] + x, base[1] + y, base[2] + z, out_tile[c], in_tile[c],
+                          Grid::get_neighbour_sum(in_tile, neighbours, x, y, z));
+                    }
+                }
+            }
+        });
+    }
+
+    // Symmetric red-black Gauss-Seidel: z = M^-1 r, with M symmetric positive definite
+    void precondition(const Grid &r, Grid &z) {
+        z.reset(0.0f);
+        for (int color : {0, 1, 1, 0}) {
+            for_each_tile(z, [&](int tile, const Vector3i &base) {
+                real *z_tile = z.get_tile(tile);
+                const real *r_tile = r.get_tile(tile);
+                const real *neighbours[6];
+                z.get_neighbour_tiles(tile, neighbours);
+                for (int x = 0; x < tile_size && base[0] + x < res[0]; x++) {
+                    for (int y = 0; y < tile_size && base[1] + y < res[1]; y++) {
+                        for (int k = (base[0] + x + base[1] + y + base[2] + color) % 2;
+                             k < tile_size && base[2] + k < res[2]; k += 2) {
+                            const int c = Grid::get_cell_id(x, y, k);
+                            z_tile[c] = (r_tile[c] + Grid::get_neighbour_sum(z_tile, neighbours, x, y, k)) /
+                                        get_diagonal(base[0] + x, base[1] + y, base[2] + k);
+                        }
+                    }
+                }
+            });
+        }
+    }
+
+    double dot(Grid &a, const Grid &b) {
+        std::vector<double> partial(a.get_active_tiles().size(), 0.0);
+        const std::vector<int> &tiles = a.get_active_tiles();
+        ThreadedTaskManager::run((int)tiles.size(), num_threads, [&](int t) {
+            const real *x = a.get_tile(tiles[t]), *y = b.get_tile(tiles[t]);
+            double sum = 0;
+            for (int c = 0; c < Grid::tile_cells; c++) {
+                sum += x[c] * y[c];
+            }
+            partial[t] = sum;
+        });
+        double sum = 0;
+        for (double p : partial) {
+            sum += p;
+        }
+        return sum;
+    }
+
+    real abs_max(const Grid &a) {
+        real ret = 0;
+        for (int tile : a.get_active_tiles()) {
+            const real *x = a.get_tile(tile);
+            for (int c = 0; c < Grid::tile_cells; c++) {
+                ret = std::max(ret, std::abs(x[c]));
+            }
+        }
+        return ret;
+    }
+
+    // y = a * x + y on all active cells
+    void add_in_place(Grid &y, real a, const Grid &x) {
+        const std::vector<int> &tiles = y.get_active_tiles();
+        ThreadedTaskManager::run((int)tiles.size(), num_threads, [&](int t) {
+            real *__restrict y_tile = y.get_tile(tiles[t]);
+            const real *__restrict x_tile = x.get_tile(tiles[t]);
+            for (int c = 0; c < Grid::tile_cells; c++) {
+                y_tile[c] += a * x_tile[c];
+            }
+        });
+    }
+
+    void project() {
+        for_each_cell(divergence_grid, [&](int i, int j, int k, real &div) {
+            div = sparse_u.get(i + 1, j, k) - sparse_u.get(i, j, k) + sparse_v.get(i, j + 1, k) -
+                  sparse_v.get(i, j, k) + sparse_w.get(i, j, k + 1) - sparse_w.get(i, j, k);
+        });
+        // Partial domains have Dirichlet cells; only a closed, fully active box has a null space
+        if (!open_boundary && (int)divergence_grid.get_active_tiles().size() == get_num_tiles()) {
+            double sum = 0;
+            for (int tile : divergence_grid.get_active_tiles()) {
+                const real *x = divergence_grid.get_tile(tile);
+                for (int c = 0; c < Grid::tile_cells; c++) {
+                    sum += x[c];
+                }
+            }
+            const real average = (real)(sum / ((double)res[0] * res[1] * res[2]));
+            for_each_cell(divergence_grid, [&](int i, int j, int k, real &div) {
+                div -= average;
+            });
+        }
+        sparse_pressure.reset(0.0f);
+        // PCG on the active cells, r = b - Ax with x = 0
+        for_each_cell(residual, [&](int i, int j, int k, real &r) {
+            r = divergence_grid.get(i, j, k);
+        });
+        if (abs_max(residual) > pressure_tolerance) {
+            precondition(residual, preconditioned);
+            for_each_cell(search, [&](int i, int j, int k, real &p) {
+                p = preconditioned.get(i, j, k);
+            });
+            double rho = dot(preconditioned, residual);
+            for (int iteration = 0; iteration < maximum_iterations; iteration++) {
+                for_each_stencil(product, search, [&](int i, int j, int k, real &ap, real p, real neighbour_sum) {
+                    ap = get_diagonal(i, j, k) * p - neighbour_sum;
+                });
+                double alpha = rho / std::max(1e-20, dot(search, product));
+                add_in_place(sparse_pressure, (real)alpha, search);
+                add_in_place(residual, -(real)alpha, product);
+                if (abs_max(residual) < pressure_tolerance) {
+                    break;
+                }
+                precondition(residual, preconditioned);
+                double rho_new = dot(preconditioned, residual);
+                double beta = rho_new / rho;
+                rho = rho_new;
+                for_each_cell(search, [&](int i, int j, int k, real &p) {
+                    p = preconditioned.get(i, j, k) + (real)beta * p;
+                });
+            }
+        }
+        // Faces gather the pressure of the cells on both sides; walls of closed boxes are Neumann
+        for (int axis = 0; axis < 3; axis++) {
+            for_each_cell(get_face_grid(axis), [&](int i, int j, int k, real &face) {
+                Vector3i cell(i, j, k), left(i, j, k);
+                left[axis] -= 1;
+                bool wall = !open_boundary && (cell[axis] == 0 || cell[axis] == res[axis]);
+                if (!wall) {
+                    face += sparse_pressure.get(cell[0], cell[1], cell[2]) -
+                            sparse_pressure.get(left[0], left[1], left[2]);
+                }
+            });
+        }
+    }
+
+    Vector3 sample_sparse_velocity(const Vector3 &pos) const {
+        return Vector3(sparse_u.sample(pos), sparse_v.sample(pos), sparse_w.sample(pos));
+    }
+
+    void move_trackers(real delta_t) {
+        ThreadedTaskManager::run((int)trackers.size(), num_threads, [&](int i) {
+            Tracker3D &tracker = trackers[i];
+            auto velocity = sample_sparse_velocity(tracker.position);
+            tracker.position += sample_sparse_velocity(tracker.position + 0.5f * delta_t * velocity) * delta_t;
+        });
+    }
+
+    // Semi-Lagrangian advection with the velocity of the beginning of the step, see Smoke3D::advect
+    void advect(real delta_t) {
+        auto trace = [&](const Vector3 &pos) -> Vector3 {
+            return pos - delta_t * sample_sparse_velocity(pos);
+        };
+        next_rho.set_active_tiles(active_mask);
+        next_t.set_active_tiles(active_mask);
+        for_each_cell(next_rho, [&](int i, int j, int k, real &rho) {
+            Vector3 p = trace(Vector3(i + 0.5f, j + 0.5f, k + 0.5f));
+            rho = sparse_rho.sample(p);
+            next_t.get_ref(i, j, k) = sparse_t.sample(p);
+        });
+        Grid *next[3] = {&next_u, &next_v, &next_w};
+        for (int axis = 0; axis < 3; axis++) {
+            const Grid &grid = get_face_grid(axis);
+            next[axis]->set_active_tiles(face_masks[axis]);
+            for_each_cell(*next[axis], [&](int i, int j, int k, real &value) {
+                Vector3 pos(i + 0.5f, j + 0.5f, k + 0.5f);
+                pos[axis] -= 0.5f;
+                value = grid.sample(trace(pos));
+            });
+        }
+        std::swap(sparse_rho, next_rho);
+        std::swap(sparse_t, next_t);
+        std::swap(sparse_u, next_u);
+        std::swap(sparse_v, next_v);
+        std::swap(sparse_w, next_w);
+    }
+
+public:
+    void initialize(const Config &config) override {
+        initialize_parameters(config);
+        activity_threshold = config.get("activity_threshold", 1e-3f);
+        halo = config.get("halo", 1);
+        maximum_iterations = config.get_int("maximum_pressure_iterations");
+        assert_info(config.get("initial_t", 0.0f) == 0.0f, "Sparse smoke needs zero initial temperature");
+        sparse_u.initialize(Vector3i(res[0] + 1, res[1], res[2]), Vector3(0.0f, 0.5f, 0.5f));
+        sparse_v.initialize(Vector3i(res[0], res[1] + 1, res[2]), Vector3(0.5f, 0.0f, 0.5f));
+        sparse_w.initialize(Vector3i(res[0], res[1], res[2] + 1), Vector3(0.5f, 0.5f, 0.0f));
+        for (int axis = 0; axis < 3; axis++) {
+            Grid &grid = get_face_grid(axis);
+            (axis == 0 ? next_u : (axis == 1 ? next_v : next_w)).initialize(grid.get_res(), Vector3(
+                    axis == 0 ? 0.0f : 0.5f, axis == 1 ? 0.0f : 0.5f, axis == 2 ? 0.0f : 0.5f));
+        }
+        for (auto grid : {&sparse_rho, &sparse_t, &sparse_pressure, &next_rho, &next_t, &divergence_grid, &residual,
+                          &preconditioned, &search, &product}) {
+            grid->initialize(res);
+        }
+        tile_res = sparse_rho.get_tile_res();
+        source_mask.assign((size_t)get_num_tiles(), 0);
+        set_active_tiles(source_mask);
+    }
+
+    void update(const Config &config) override {
+        Smoke3D::update(config);
+        find_source_tiles();
+    }
+
+    void step(real delta_t) override {
+        Profiler _p("sparse_smoke_step");
+        TC_PROFILE("activity", update_active_tiles());
+        TC_PROFILE("seeding", seed(delta_t));
+        TC_PROFILE("forces", apply_forces(delta_t));
+        TC_PROFILE("boundary_condition", apply_boundary_condition());
+        TC_PROFILE("project", project());
+        TC_PROFILE("boundary_condition", apply_boundary_condition());
+        TC_PROFILE("move_trackers", move_trackers(delta_t));
+        TC_PROFILE("remove_outside_trackers", remove_outside_trackers());
+        TC_PROFILE("advect", advect(delta_t));
+        TC_PROFILE("boundary_condition", apply_boundary_condition());
+        current_t += delta_t;
+        if (telemetry.should_sample()) {
+            TelemetryRecord record;
+            record.t = current_t;
+            record.dt = delta_t;
+            record.active_particles = (int64)trackers.size();
+            record.active_blocks = (int64)sparse_rho.get_active_tiles().size();
+            real max_speed = 0.0f;
+            for (int axis = 0; axis < 3; axis++) {
+                max_speed = std::max(max_speed, abs_max(get_face_grid(axis)));
+            }
+            record.max_velocity = max_speed;
+            telemetry.write(record);
+        }
+    }
+
+    // Volume bricks coincide with tiles, so only active tiles are visited;
+    // inactive ones read as zero, as in the grid.
+    void write_volumes(const std::string &prefix) const override {
+        static_assert(CompressedVolume::brick_size == tile_size, "volume bricks have to match the tiles");
+        auto write = [&](const std::string &fn, const Grid &grid) {
+            CompressedVolume::write(fn, res, [&](int i, int j, int k) {
+                return grid.get(i, j, k);
+            }, volume_bits, volume_threshold, [&](const Vector3i &brick) {
+                return grid.is_active(grid.get_tile_id(brick[0], brick[1], brick[2]));
+            });
+        };
+        write(prefix + "_density.tcv", sparse_rho);
+        write(prefix + "_temperature.tcv", sparse_t);
+    }
+
+    real sample_density(const Vector3 &pos) const override {
+        return sparse_rho.sample(pos);
+    }
+
+    real sample_temperature(const Vector3 &pos) const override {
+        return sparse_t.sample(pos);
+    }
+};
+
+TC_IMPLEMENTATION(Simulation3D, SparseSmoke3D, "sparse_smoke");
+
+TC_NAMESPACE_END
@@ -28,6 +28,11 @@ public:
         return nested->is_index_matched();
     }
 
+    // Rays pass through where the mask is set
+    virtual bool may_be_index_matched() const override {
+        return true;
+    }
+
     virtual void sample(const Vector3 &in_dir, real u, real v, Vector3 &out_dir, Vector3 &f, real &pdf,
                         SurfaceEvent &event, const Vector2 &uv) const override {
         real alpha = mask->sample(uv).x;
@@ -322,33 +322,51 @@ public:
             delta_x = std::max(delta_x, (bb.upper_boundary[i] - bb.lower_boundary[i]) / resolution[i]);
         for (int i = 0; i < 3; ++i)
             offset[i] = int(resolution[i] - (bb.upper_boundary[i] - bb.lower_boundary[i]) / delta_x) / 2;
-        // cast ray for each i, j
-        for (int i = 0; i < resolution.x; ++i)
+        // cast rays along z for each i, j; the columns of a slice advance together in one batch
+        real start_z = (0 - offset.z) * delta_x + bb.lower_boundary.z;
+        real base_z = start_z - eps;
+        std::vector<real> z(resolution.y);
+        std::vector<int> k(resolution.y), active;
+        std::vector<char> inside(resolution.y);
+        std::vector<Ray> rays;
+        for (int i = 0; i < resolution.x; ++i) {
+            real x = (i - offset.x) * delta_x + bb.lower_boundary.x;
+            active.clear();
             for (int j = 0; j < resolution.y; ++j) {
-                real x = (i - offset.x) * delta_x + bb.lower_boundary.x;
-                real y = (j - offset.y) * delta_x + bb.lower_boundary.y;
-                real z = (0 - offset.z) * delta_x + bb.lower_boundary.z;
-                real base_z = z - eps;
-                int k = 0;
-                bool inside = false;
-                while (k < resolution.z) {
-                    int next_k;
-                    Ray ray(Vector3(x, y, z), Vector3(0, 0, 1));
-                    scene_geometry->query(ray);
-                    if (ray.dist == Ray::DIST_INFINITE) {
+                z[j] = start_z;
+                k[j] = 0;
+                inside[j] = false;
+                active.push_back(j);
+            }
+            while (!active.empty()) {
+                rays.clear();
+                for (int j : active) {
+                    real y = (j - offset.y) * delta_x + bb.lower_boundary.y;
+                    rays.push_back(Ray(Vector3(x, y, z[j]), Vector3(0, 0, 1)));
+                }
+                scene_geometry->query_batch(&rays[0], (int)rays.size());
+                int num_active = 0;
+                for (int r = 0; r < (int)active.size(); ++r) {
+                    int j = active[r], next_k;
+                    if (rays[r].dist == Ray::DIST_INFINITE) {
                         next_k = resolution.z;
-                        inside = false;
+                        inside[j] = false;
                     } else {
-                        z += ray.dist;
-                        next_k = std::min(int((z - base_z) / delta_x), resolution.z);
+                        z[j] += rays[r].dist;
+                        next_k = std::min(int((z[j] - base_z) / delta_x), resolution.z);
                     }
-                    while (k < next_k) {
-                        arr.set(i, j, k, char(inside));
-                        ++k;
+                    while (k[j] < next_k) {
+                        arr.set(i, j, k[j], inside[j]);
+                        ++k[j];
+                    }
+                    inside[j] = !inside[j];
+                    if (k[j] < resolution.z) {
+                        active[num_active++] = j;
                     }
-                    inside = !inside;
                 }
+                active.resize(num_active);
             }
+        }
     }
 
     bool inside(const Vector3 &coord) const {
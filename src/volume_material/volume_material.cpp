@@ -11,6 +11,7 @@
 #include <taichi/visual/texture.h>
 #include <taichi/math/array_3d.h>
 #include <taichi/math/stencils.h>
+#include <taichi/io/compressed_volume.h>
 #include <taichi/common/asset_manager.h>
 #include <queue>
 
@@ -51,14 +52,27 @@ class VoxelVolumeMaterial : public VolumeMaterial {
 protected:
     Array3D<real> voxels;
     std::shared_ptr<Texture> tex;
+    // Set if the density comes from a compressed volume file instead of a texture
+    std::shared_ptr<CompressedVolume> volume;
     Vector3i resolution;
     real maximum;
 
+    real sample_density(const Vector3 &pos) const {
+        return volume ? volume->sample_relative_coord(pos) : voxels.sample_relative_coord(pos);
+    }
+
 public:
     virtual void initialize(const Config &config) override {
         VolumeMaterial::initialize(config);
         this->volumetric_scattering = config.get_real("scattering");
         this->volumetric_absorption = config.get_real("absorption");
+        if (config.has_key("volume_file")) {
+            // Mapped, not loaded: only the bricks that rays pass through are decoded
+            volume = std::make_shared<CompressedVolume>(config.get_string("volume_file"));
+            resolution = volume->get_res();
+            maximum = volume->get_maximum();
+            return;
+        }
         this->resolution = config.get_vec3i("resolution");
         this->tex = AssetManager::get_asset<Texture>(config.get_int("tex"));
         voxels.initialize(resolution.x, resolution.y, resolution.z, 1.0f);
@@ -90,7 +104,7 @@ public:
                 dist = std::numeric_limits<real>::infinity();
                 break;
             }
-            kill = voxels.sample_relative_coord(pos);
+            kill = sample_density(pos);
         } while (maximum * rand() > kill && dist < ray.dist);
         return dist;
     }
@@ -159,6 +173,7 @@ protected:
 public:
     virtual void initialize(const Config &config) override {
         VoxelVolumeMaterial::initialize(config);
+        assert_info(volume == nullptr, "sdf_voxel needs a texture, not a volume file");
         sdf.initialize(resolution.x, resolution.y, resolution.z, 1e30f);
         calculate_sdf();
     }